@@ -0,0 +1,100 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "Disassembler.h"
+
+// Disassembles many ROM images at once, spread across every core
+int main(int argc, char **argv)
+{
+    unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::string out_dir;
+    uint16_t origin = 0;
+    std::vector<std::string> files;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            thread_count = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_dir = argv[++i];
+        else if(strcmp(argv[i], "--origin") == 0 && i + 1 < argc)
+            origin = (uint16_t)strtoul(argv[++i], nullptr, 0);
+        else
+            files.emplace_back(argv[i]);
+    }
+
+    if(files.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] [-o output dir] [--origin address] <rom files...>" << std::endl;
+        return 1;
+    }
+
+    // Each thread takes the next file until there are none left, so big files don't hold up the rest
+    std::atomic<size_t> next_file(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<uint64_t> total_bytes(0);
+    std::atomic<uint64_t> total_instructions(0);
+
+    auto worker = [&]()
+    {
+        std::vector<uint8_t> data;
+        std::vector<Disassembler::Instruction> instructions;
+        std::string listing;
+        size_t index;
+        while((index = next_file++) < files.size())
+        {
+            const std::string &path = files[index];
+            std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+            if(!input.is_open())
+            {
+                ++failed;
+                continue;
+            }
+            data.resize((size_t)input.tellg());
+            input.seekg(0);
+            input.read(reinterpret_cast<char *>(data.data()), data.size());
+
+            instructions.clear();
+            listing.clear();
+            Disassembler::disassemble(data.data(), data.size(), origin, instructions);
+            for(const Disassembler::Instruction &instr : instructions)
+                Disassembler::format(instr, listing);
+
+            // Write next to the input, or into the output directory if one was given
+            std::string out_path = path + ".asm";
+            if(!out_dir.empty())
+            {
+                size_t slash = path.find_last_of('/');
+                out_path = out_dir + "/" + (slash == std::string::npos ? path : path.substr(slash + 1)) + ".asm";
+            }
+            std::ofstream output(out_path, std::ios::out | std::ios::trunc);
+            output.write(listing.data(), listing.size());
+            if(!output)
+            {
+                ++failed;
+                continue;
+            }
+
+            total_bytes += data.size();
+            total_instructions += instructions.size();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned int i = 0; i < thread_count; ++i)
+        threads.emplace_back(worker);
+    for(std::thread &thread : threads)
+        thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << files.size() - failed << " files, " << total_bytes << " bytes, " << total_instructions
+              << " instructions in " << seconds << "s using " << thread_count << " threads" << std::endl;
+    if(failed)
+        std::cerr << failed << " files could not be read or written" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include "BatchRunner.h"
+
+bool read_file(const std::string &path, std::vector<uint8_t> &data)
+{
+    std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!input.is_open())
+        return false;
+    data.resize((size_t)input.tellg());
+    input.seekg(0);
+    input.read(reinterpret_cast<char *>(data.data()), data.size());
+    return (bool)input;
+}
+
+// Reads a manifest with a job per line: <binary> [input=<file>] [cycles=<n> | instructions=<n>] [load=<address>] [entry=<address>] [rom]
+// The binary's format is chosen by its extension, see ProgramImage. Jobs which load the same binary the same way share one image of it.
+// Blank lines and lines starting with # are skipped
+bool read_manifest(const std::string &path, uint64_t default_cycles, std::vector<BatchRunner::Job> &jobs)
+{
+    std::ifstream manifest(path);
+    if(!manifest.is_open())
+    {
+        std::cerr << "Couldn't open manifest " << path << std::endl;
+        return false;
+    }
+
+    std::map<std::string, std::shared_ptr<const ProgramImage>> images;
+    std::string line;
+    for(size_t line_no = 1; std::getline(manifest, line); ++line_no)
+    {
+        std::istringstream fields(line);
+        std::string binary, field;
+        if(!(fields >> binary) || binary[0] == '#')
+            continue;
+
+        BatchRunner::Job job;
+        job.name = binary;
+        job.budget = default_cycles;
+        ProgramImage::Options options;
+        while(fields >> field)
+        {
+            size_t equals = field.find('=');
+            std::string key = field.substr(0, equals);
+            std::string value = equals == std::string::npos ? "" : field.substr(equals + 1);
+            if(key == "input" && !value.empty())
+            {
+                if(!read_file(value, job.input))
+                {
+                    std::cerr << path << ":" << line_no << ": couldn't read " << value << std::endl;
+                    return false;
+                }
+            }
+            else if(key == "cycles" && !value.empty())
+            {
+                job.limit = BatchRunner::Limit::Cycles;
+                job.budget = strtoull(value.c_str(), nullptr, 0);
+            }
+            else if(key == "instructions" && !value.empty())
+            {
+                job.limit = BatchRunner::Limit::Instructions;
+                job.budget = strtoull(value.c_str(), nullptr, 0);
+            }
+            else if(key == "load" && !value.empty())
+            {
+                options.load_address = (uint16_t)strtoul(value.c_str(), nullptr, 0);
+            }
+            else if(key == "entry" && !value.empty())
+            {
+                options.entry = (uint32_t)strtoul(value.c_str(), nullptr, 0);
+            }
+            else if(key == "rom" && value.empty())
+            {
+                options.read_only = true;
+            }
+            else
+            {
+                std::cerr << path << ":" << line_no << ": unknown field " << field << std::endl;
+                return false;
+            }
+        }
+
+        std::shared_ptr<const ProgramImage> &image = images[binary + ' ' + std::to_string(options.load_address) + ' '
+                                                            + std::to_string(options.entry) + ' ' + std::to_string(options.read_only)];
+        if(!image)
+            image = ProgramImage::open(binary, options);
+        if(!image)
+        {
+            std::cerr << path << ":" << line_no << ": couldn't load " << binary << std::endl;
+            return false;
+        }
+        job.image = image;
+        jobs.emplace_back(std::move(job));
+    }
+    return true;
+}
+
+// Runs every program in a manifest across every core, and writes a report of how each one ended
+int main(int argc, char **argv)
+{
+    unsigned int thread_count = 0;
+    Emulator::Engine engine = Emulator::Engine::Portable;
+    uint64_t default_cycles = BatchRunner::Job().budget;
+    std::string report_path;
+    std::string manifest_path;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            thread_count = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if(name == "portable")
+                engine = Emulator::Engine::Portable;
+            else if(name == "threaded")
+                engine = Emulator::Engine::Threaded;
+            else if(name == "cached")
+                engine = Emulator::Engine::Cached;
+            else if(name == "native")
+                engine = Emulator::Engine::Native;
+            else
+            {
+                std::cerr << "Unknown engine " << name << std::endl;
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            default_cycles = strtoull(argv[++i], nullptr, 0);
+        else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            report_path = argv[++i];
+        else
+            manifest_path = argv[i];
+    }
+
+    if(manifest_path.empty())
+    {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] [-e portable|threaded|cached|native] [-c default cycle budget]"
+                  << " [-o report] <manifest>" << std::endl;
+        return 1;
+    }
+
+    std::vector<BatchRunner::Job> jobs;
+    if(!read_manifest(manifest_path, default_cycles, jobs))
+        return 1;
+
+    BatchRunner runner(thread_count, engine);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<BatchRunner::Result> results = runner.run(jobs);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if(report_path.empty())
+    {
+        BatchRunner::write_report(jobs, results, std::cout);
+    }
+    else
+    {
+        std::ofstream report(report_path, std::ios::out | std::ios::trunc);
+        BatchRunner::write_report(jobs, results, report);
+        if(!report)
+        {
+            std::cerr << "Couldn't write report " << report_path << std::endl;
+            return 1;
+        }
+    }
+
+    uint64_t total_cycles = 0;
+    size_t stopped = 0;
+    for(const BatchRunner::Result &result : results)
+    {
+        total_cycles += result.cycles;
+        stopped += result.status == BatchRunner::Status::Stopped;
+    }
+    std::cerr << jobs.size() << " jobs, " << total_cycles << " T-states in " << seconds << "s using "
+              << runner.get_thread_count() << " threads" << std::endl;
+    if(stopped)
+        std::cerr << stopped << " jobs were stopped by their budget before finishing" << std::endl;
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "Fuzzer.h"
+
+// Fuzzes the Z80 program named by Z80_FUZZ_PROGRAM, feeding it each input through port reads.
+// Z80_FUZZ_BUDGET sets the most instructions per run. A HALT with interrupts disabled
+// is the program's way of flagging a bug, and is reported as a crash.
+//
+// Coverage of the Z80 program is exported through libFuzzer's extra counters, so the
+// emulator itself doesn't need instrumenting.
+
+__attribute__((used, section("__libfuzzer_extra_counters"))) static uint8_t coverage[0x10000];
+
+static std::unique_ptr<Fuzzer> fuzzer;
+
+static bool read_file(const char *path, std::vector<uint8_t> &data)
+{
+    std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!input.is_open())
+        return false;
+    data.resize((size_t)input.tellg());
+    input.seekg(0);
+    input.read(reinterpret_cast<char *>(data.data()), data.size());
+    return (bool)input;
+}
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***)
+{
+    const char *path = getenv("Z80_FUZZ_PROGRAM");
+    std::vector<uint8_t> program;
+    if(!path || !read_file(path, program))
+    {
+        std::cerr << "Set Z80_FUZZ_PROGRAM to the program to fuzz" << std::endl;
+        exit(1);
+    }
+
+    const char *budget = getenv("Z80_FUZZ_BUDGET");
+    fuzzer.reset(new Fuzzer(program, budget ? strtoull(budget, nullptr, 0) : 1000000, Emulator::Engine::Threaded));
+    fuzzer->set_coverage_map(coverage, sizeof(coverage));
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(fuzzer->run(data, size) == Fuzzer::Status::Halted)
+    {
+        std::cerr << "HALT at " << std::hex << (uint16_t)(fuzzer->get_emulator().get_registers().PC - 1) << std::endl;
+        abort();
+    }
+    return 0;
+}
+
+#ifndef Z80_FUZZ_LIBFUZZER
+// Without libFuzzer, runs each input file given, -runs=N times, to reproduce crashes and measure executions per second
+int main(int argc, char **argv)
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    size_t runs = 1;
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            runs = std::max<size_t>(1, strtoull(argv[i] + 6, nullptr, 0));
+            continue;
+        }
+
+        std::vector<uint8_t> input;
+        if(!read_file(argv[i], input))
+        {
+            std::cerr << "Couldn't read " << argv[i] << std::endl;
+            return 1;
+        }
+        for(size_t run = 0; run < runs; ++run)
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        total += runs;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << total << " runs in " << seconds << "s, " << (size_t)(total / seconds) << " exec/s" << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,153 @@
+#ifndef Z80_DISASSEMBLER_BATCHRUNNER_H
+#define Z80_DISASSEMBLER_BATCHRUNNER_H
+
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Emulator.h"
+#include "ProgramImage.h"
+#include "Snapshot.h"
+
+/*!
+ * Runs many independent programs across every core. Each worker thread
+ * owns an emulator which is reset and reused from job to job, so nothing
+ * is allocated per job. Jobs are split evenly between the workers up
+ * front, and a worker which runs out steals from the back of another's
+ * queue, so a few long jobs don't leave the other cores idle.
+ *
+ * Jobs can start from a snapshot of a machine which has already booted.
+ * A worker which runs several jobs from the same snapshot only copies
+ * back the memory the previous job wrote.
+ */
+class BatchRunner
+{
+public:
+    enum Limit
+    {
+        Cycles = 0,       // The budget is in T-states
+        Instructions = 1, // The budget is in instructions
+    };
+
+    enum Status
+    {
+        Finished = 0, // Ran past the end of the program, or halted with interrupts disabled
+        Stopped = 1,  // Still running when the budget ran out, or halted waiting for an interrupt
+    };
+
+    struct Job
+    {
+        std::string name;
+        std::vector<uint8_t> program;
+        std::shared_ptr<const ProgramImage> image; // If set, loaded instead of program, and can be shared between jobs
+        std::shared_ptr<const Snapshot> start; // If set, the job resumes from here instead of loading program or image
+        std::vector<uint8_t> input;   // Returned by port reads in order, reads past the end get 0xFF
+        Limit limit = Limit::Cycles;
+        uint64_t budget = 100000000;  // The most the job may run for, in units of limit
+    };
+
+    struct Result
+    {
+        Status status;
+        Emulator::Registers registers; // Final state of the CPU
+        uint64_t cycles;               // T-states run
+        std::vector<uint8_t> output;   // Every byte written to a port, in order
+    };
+
+    /*!
+     * Constructor
+     *
+     * @param thread_count The number of worker threads, 0 for one per core
+     * @param engine The execution engine every worker's emulator uses
+     */
+    explicit BatchRunner(unsigned int thread_count = 0, Emulator::Engine engine = Emulator::Engine::Portable);
+
+    /*!
+     * Destructor
+     */
+    ~BatchRunner();
+
+    /*!
+     * Runs every job, returning once they've all finished. The workers'
+     * emulators are kept between calls.
+     *
+     * @param jobs The jobs to run
+     * @return A result for each job, in the same order as the jobs
+     */
+    std::vector<Result> run(const std::vector<Job> &jobs);
+
+    /*!
+     * Gets the number of worker threads
+     *
+     * @return The number of workers
+     */
+    size_t get_thread_count() const;
+
+    /*!
+     * Writes a tab separated report with a line for each job, giving its
+     * status, cycle count, final registers and port output in hex
+     *
+     * @param jobs The jobs which were run
+     * @param results The results returned by run()
+     * @param stream The stream to write to
+     */
+    static void write_report(const std::vector<Job> &jobs, const std::vector<Result> &results, std::ostream &stream);
+
+private:
+    // Cache line aligned, so workers taking from their own queues don't contend
+    struct alignas(64) WorkQueue
+    {
+        std::mutex lock;
+        std::deque<size_t> jobs; // Indices into the job list
+    };
+
+    // Port state for the job a worker is running
+    struct JobIO
+    {
+        const Job *job;
+        size_t input_pos;
+        std::vector<uint8_t> *output;
+    };
+
+    /*!
+     * Runs jobs on one thread until every queue is empty
+     *
+     * @param worker The index of the worker, which selects its emulator and queue
+     * @param jobs The jobs being run
+     * @param results Where to store the results
+     */
+    void work(size_t worker, const std::vector<Job> &jobs, std::vector<Result> &results);
+
+    /*!
+     * Takes the next job for a worker, from the front of its own queue,
+     * or failing that from the back of another worker's queue
+     *
+     * @param worker The index of the worker
+     * @param index Set to the index of the job taken
+     * @return False once there are no jobs left anywhere
+     */
+    bool take_job(size_t worker, size_t &index);
+
+    /*!
+     * Runs a single job on an emulator
+     *
+     * @param emulator The emulator to run it on, which is reset first, or restored from the job's snapshot
+     * @param job The job to run
+     * @param result Where to store the result
+     */
+    static void run_job(Emulator &emulator, const Job &job, Result &result);
+
+    /*!
+     * Port handler for every port of a worker's emulator
+     */
+    static void job_port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size);
+
+    std::vector<std::unique_ptr<Emulator>> emulators;
+    std::unique_ptr<WorkQueue[]> queues;
+};
+
+
+#endif //Z80_DISASSEMBLER_BATCHRUNNER_H
@@ -0,0 +1,129 @@
+#ifndef Z80_DISASSEMBLER_BLOCKCACHE_H
+#define Z80_DISASSEMBLER_BLOCKCACHE_H
+
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Emulator.h"
+
+struct JitBlock;
+
+/*!
+ * A cache of decoded basic blocks, keyed by the address of their first
+ * instruction. Blocks are tracked per 256 byte page of memory, so that a
+ * write to a page containing code can drop every block which overlaps it.
+ */
+class BlockCache
+{
+public:
+    static constexpr size_t page_size = 0x100;
+    static constexpr size_t page_count = 0x10000 / page_size;
+
+    /*!
+     * A straight run of instructions, ending at the first
+     * instruction which can change PC.
+     */
+    struct Block
+    {
+        uint16_t start; // Address of the first instruction
+        uint16_t size;  // Number of bytes covered by the block
+        std::vector<Emulator::Instruction> instructions;
+        uint32_t executions = 0;       // Times the block has been interpreted, used to find hot blocks
+        JitBlock *compiled = nullptr;  // Native code for the block, if it's been compiled
+    };
+    typedef std::function<void(Block &)> retire_hook_t;
+
+    /*!
+     * Constructor
+     */
+    BlockCache();
+
+    /*!
+     * Finds the block starting at a given address
+     *
+     * @param pc The address the block starts at
+     * @return The block, or nullptr if none is cached
+     */
+    inline Block *find(uint16_t pc)
+    {
+        return blocks[pc].get();
+    }
+
+    /*!
+     * Adds a block to the cache, replacing any existing block at the same address
+     *
+     * @param block The block to add
+     * @param watched_pages The bitmap of pages to check writes to, the block's pages are marked in it
+     * @return The block
+     */
+    Block *insert(std::unique_ptr<Block> block, std::array<bool, page_count> &watched_pages);
+
+    /*!
+     * Drops every block which overlaps a page. Blocks are only freed
+     * by the next call to release(), so the block being executed
+     * stays valid until it's finished with.
+     *
+     * @param page The page which was written to
+     * @return True if any blocks were dropped
+     */
+    bool invalidate_page(uint8_t page);
+
+    /*!
+     * Frees blocks which have been invalidated
+     */
+    inline void release()
+    {
+        retired.clear();
+    }
+
+    /*!
+     * Drops every block
+     */
+    void clear();
+
+    /*!
+     * Sets a functor to be called whenever a block is dropped, so
+     * anything derived from it can be dropped too.
+     *
+     * @param hook The functor to call
+     */
+    void set_retire_hook(retire_hook_t hook);
+    /*!
+     * Counts the entries in the per page lists, one for each page each cached block covers
+     *
+     * @return The number of entries
+     */
+    size_t page_entries() const;
+
+private:
+    /*!
+     * Removes a block from the lists of every page it covers
+     *
+     * @param block The block to remove
+     */
+    void unlink(const Block &block);
+
+    /*!
+     * Moves a block to the retired list
+     *
+     * @param block The block to retire
+     */
+    void retire(std::unique_ptr<Block> block);
+
+    // Called for each block as it's dropped
+    retire_hook_t retire_hook;
+
+    // Blocks indexed by start address
+    std::vector<std::unique_ptr<Block>> blocks;
+
+    // Start addresses of the blocks which overlap each page
+    std::array<std::vector<uint16_t>, page_count> page_blocks;
+
+    // Blocks which have been invalidated, but may still be executing
+    std::vector<std::unique_ptr<Block>> retired;
+};
+
+
+#endif //Z80_DISASSEMBLER_BLOCKCACHE_H
@@ -0,0 +1,66 @@
+#ifndef Z80_DISASSEMBLER_DISASSEMBLER_H
+#define Z80_DISASSEMBLER_DISASSEMBLER_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*!
+ * Decodes Z80 machine code into instructions without executing it.
+ * There's no state, so one Disassembler can be shared between threads.
+ *
+ * Covers the whole documented instruction set, plus the undocumented
+ * IXH/IXL/IYH/IYL forms, SLL, and the DDCB/FDCB forms which copy their
+ * result into a register.
+ */
+class Disassembler
+{
+public:
+    /*!
+     * A decoded instruction. Holds no pointers to the input, and
+     * doesn't allocate, so large numbers of them are cheap.
+     */
+    struct Instruction
+    {
+        uint16_t address;     // The address the instruction was decoded from
+        uint8_t length;       // Length in bytes, including prefixes and operands
+        uint8_t bytes[4];     // The instruction bytes
+        const char *mnemonic; // The mnemonic, such as "LD"
+        char operands[20];    // The operands, such as "A, (IX+0x05)". Empty if there are none.
+    };
+
+    /*!
+     * Decodes a single instruction. If the data ends part way through an
+     * instruction, a one byte DB pseudo instruction is returned instead.
+     *
+     * @param data The bytes to decode, starting at the instruction
+     * @param size The number of bytes available
+     * @param address The address of the first byte
+     * @return The instruction
+     */
+    static Instruction decode(const uint8_t *data, size_t size, uint16_t address);
+
+    /*!
+     * Decodes every instruction in a block of code, one after another
+     *
+     * @param data The bytes to decode
+     * @param size The number of bytes
+     * @param origin The address of the first byte
+     * @param instructions The vector to append the instructions to
+     */
+    static void disassemble(const uint8_t *data, size_t size, uint16_t origin, std::vector<Instruction> &instructions);
+
+    /*!
+     * Formats an instruction as a line of assembly listing,
+     * with its address and bytes, and appends it to a string
+     *
+     * @param instr The instruction to format
+     * @param out The string to append to
+     */
+    static void format(const Instruction &instr, std::string &out);
+};
+
+
+#endif //Z80_DISASSEMBLER_DISASSEMBLER_H
@@ -6,162 +6,1407 @@
 #define Z80_DISASSEMBLER_DECODER_H
 
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <vector>
 #include <functional>
+#include <map>
+#include <utility>
+#include "FlagTables.h"
+
+class BlockCache;
+class Jit;
+class Profiler;
+class ProgramImage;
+class Snapshot;
+class TraceWriter;
+struct TraceRecord;
 
 class Emulator
 {
 public:
     enum PortState
     {
-        Read = 0,
-        Write = 1,
-    };
-    typedef std::function<void(PortState, uint8_t *data, uint16_t)> port_handler_t;
+        Read = 0,
+        Write = 1,
+    };
+    typedef std::function<void(PortState, uint8_t *data, uint16_t)> port_handler_t;
+    typedef void (*port_callback_t)(void *context, PortState state, uint8_t *data, uint16_t size);
+    typedef std::function<void(uint16_t addr, uint8_t val)> memory_hook_t;
+    typedef void (*mmio_callback_t)(void *context, uint16_t addr, uint8_t val);
+
+    // The address space is mapped in pages of this size, see map_memory()
+    static constexpr size_t memory_page_size = 0x1000;
+    static constexpr size_t memory_page_count = 0x10000 / memory_page_size;
+
+    /*!
+     * Memory which can be mapped into the address space, covering whole pages
+     */
+    struct Bank
+    {
+        const uint8_t *read; // Where reads come from
+        uint8_t *write;      // Where writes go, nullptr if they're ignored, as for ROM
+    };
+
+    enum Prefix
+    {
+        None = 0,
+        CB = 1,
+        DD = 2,
+        ED = 3,
+        FD = 4,
+        DDCB = 5,
+        FDCB = 6,
+        PrefixCount = 7
+    };
+
+    enum Engine
+    {
+        Portable = 0, // Calls through the opcode tables, works with any compiler
+        Threaded = 1, // Direct threaded code, each handler jumps straight to the next one. Needs GCC/Clang.
+        Cached = 2,   // Executes from a cache of predecoded basic blocks
+        Native = 3,   // Like Cached, but hot blocks are compiled to x86-64 code. Falls back to Cached on other hosts.
+    };
+
+    enum TraceMode
+    {
+        NoTrace = 0,
+        TextTrace = 1,   // Formats every instruction into the log stream
+        BinaryTrace = 2, // Pushes a record per instruction to the trace writer, see set_trace_writer()
+    };
+
+    /*!
+     * Compile time options for the emulation loop. Anything which is
+     * turned off is compiled out of the loop entirely, rather than
+     * being checked for on every instruction.
+     *
+     * @tparam trace_ How to trace every instruction
+     * @tparam count_cycles_ Count cycles as instructions execute, see get_cycles()
+     * @tparam memory_hooks_ Call the memory hook on every write, see set_memory_hook()
+     * @tparam coverage_ Record edge coverage, see set_coverage_map()
+     * @tparam profile_ Record where time is spent, see set_profiler()
+     */
+    template<TraceMode trace_, bool count_cycles_ = false, bool memory_hooks_ = false, bool coverage_ = false, bool profile_ = false>
+    struct Policy
+    {
+        static constexpr TraceMode trace = trace_;
+        static constexpr bool count_cycles = count_cycles_;
+        static constexpr bool memory_hooks = memory_hooks_;
+        static constexpr bool coverage = coverage_;
+        static constexpr bool profile = profile_;
+        static constexpr bool stepped = false; // Set internally by run() and run_until(), see Stepped
+    };
+    typedef Policy<NoTrace> Fast;           // Nothing but the emulation itself
+    typedef Policy<TextTrace> Traced;       // Logs every instruction
+    typedef Policy<BinaryTrace> BinaryTraced; // Writes a binary trace
+    typedef Policy<NoTrace, true> Timed;    // Counts T-states, as needed by run_for_cycles()
+    typedef Policy<NoTrace, false, false, true> Covered; // Records edge coverage, for fuzzing
+    typedef Policy<NoTrace, true, false, false, true> Profiled; // Counts T-states and records them in the profiler
+
+    struct Instruction;
+    typedef void (Emulator::*handler_t)(const Instruction &);
+
+    /*!
+     * A decoded instruction. Handlers take all of their operands
+     * from here, so that a decoded instruction can be executed
+     * again without touching the instruction bytes in memory.
+     */
+    struct Instruction
+    {
+        handler_t handler; // The function which executes the instruction
+        uint16_t pc;       // The address the instruction was fetched from
+        uint16_t operand;  // Immediate n/nn, or the displacement d
+        uint8_t opcode;    // The opcode byte, after any prefixes
+        uint8_t length;    // Length in bytes, including prefixes and operands
+        Prefix prefix;     // The table the opcode was decoded from
+    };
+
+    // Registers. Pairs are laid out so that the first register is the high byte on a little endian host.
+    struct Registers
+    {
+        struct
+        {
+            union
+            {
+                struct
+                {
+                    uint8_t C;
+                    uint8_t B;
+                };
+                uint16_t BC;
+            };
+
+            union
+            {
+                struct
+                {
+                    uint8_t E;
+                    uint8_t D;
+                };
+                uint16_t DE;
+            };
+
+            union
+            {
+                struct
+                {
+                    uint8_t L;
+                    uint8_t H;
+                };
+                uint16_t HL;
+            };
+
+            union
+            {
+                struct
+                {
+                    union
+                    {
+                        struct
+                        {
+                            uint8_t C:1;  // Carry
+                            uint8_t N:1;  // Subtract
+                            uint8_t PV:1; // Parity/Overflow
+                            uint8_t X:1;  // Undocumented, copy of bit 3
+                            uint8_t H:1;  // Half Carry
+                            uint8_t Y:1;  // Undocumented, copy of bit 5
+                            uint8_t Z:1;  // Zero
+                            uint8_t S:1;  // Sign
+                        };
+                        uint8_t value; // All flags at once, as stored by the lookup tables
+                    } F;
+                    uint8_t A;
+                };
+                uint16_t AF;
+            } ;
+        } general, shadow;
+
+        // Index registers, used in place of HL by the DD and FD prefixed instructions
+        union
+        {
+            struct
+            {
+                uint8_t IXL;
+                uint8_t IXH;
+            };
+            uint16_t IX;
+        };
+
+        union
+        {
+            struct
+            {
+                uint8_t IYL;
+                uint8_t IYH;
+            };
+            uint16_t IY;
+        };
+
+        uint16_t SP;
+        uint16_t PC;
+
+        uint8_t I;  // High byte of the interrupt vector table, for IM 2
+        uint8_t IM; // Interrupt mode, 0, 1 or 2
+        bool IFF1;  // If maskable interrupts are accepted
+        bool IFF2;  // Holds IFF1 while an NMI is serviced
+    };
+
+    /*!
+     * Constructor
+     *
+     * @param engine The execution engine to use
+     */
+    explicit Emulator(Engine engine = Engine::Portable);
+
+    /*!
+     * Destructor
+     */
+    ~Emulator();
+
+    /*!
+     * Resets the state of the emulator, clearing memory.
+     * Port bindings, the memory map and the interrupt timer are kept.
+     */
+    void reset();
+
+    /*!
+     * Loads a program at address 0 and points PC at it, without running it.
+     * Emulation stops if PC runs past the end of the program.
+     *
+     * @param data The program to load
+     */
+    void load(const std::vector<uint8_t> &data);
+
+    /*!
+     * Loads a program image and points PC at its entry point, without
+     * running it. Snapshots also load the registers. Read only images
+     * have the segments which start on a page mapped as ROM, see
+     * map_memory(), anything else is copied into RAM.
+     * Emulation stops if PC reaches the image's end.
+     *
+     * The memory map is kept by reset() and later loads, so mapped pages
+     * keep reading from the image until something else is mapped over
+     * them. The emulator, and any snapshot of it, holds a reference to
+     * the image until then, so the caller needn't keep it.
+     *
+     * @param image The image to load
+     */
+    void load(const ProgramImage &image);
+
+    /*!
+     * Emulates instruction data, with the features given by a policy
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param data The data to emulate
+     * @param log_stream The data stream to log to, only used with TextTrace
+     */
+    template<typename ExecutionPolicy>
+    void emulate(const std::vector<uint8_t> &data, std::ostream *log_stream = nullptr);
+
+    /*!
+     * Emulates a program image, with the features given by a policy
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param image The image to load and emulate
+     * @param log_stream The data stream to log to, only used with TextTrace
+     */
+    template<typename ExecutionPolicy>
+    void emulate(const ProgramImage &image, std::ostream *log_stream = nullptr);
+
+    /*!
+     * Continues emulating the loaded program for a number of T-states.
+     *
+     * Emulation can only stop between instructions, so a call can run
+     * past its budget by part of an instruction. The overrun is taken
+     * off the next call's budget, so over many calls the total stays
+     * exactly in step with the sum of the budgets. This lets several
+     * emulators be interleaved deterministically on one thread.
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy, which must count cycles
+     * @param budget The number of T-states to run for
+     * @param log_stream The data stream to log to, only used with TextTrace
+     * @return The number of T-states actually run, less if the program ended or halted
+     */
+    template<typename ExecutionPolicy = Timed>
+    uint64_t run_for_cycles(uint64_t budget, std::ostream *log_stream = nullptr);
+
+    /*!
+     * Continues emulating the loaded program for a number of instructions.
+     * All state is kept between calls, so emulation can be paused to do
+     * other work and resumed where it left off. The run_for_cycles()
+     * deadline doesn't stop it, but the cycles it runs count towards it.
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param instructions The maximum number of instructions to execute
+     * @param log_stream The data stream to log to, only used with TextTrace
+     * @return The number of instructions executed, less if the program ended or halted
+     */
+    template<typename ExecutionPolicy = Fast>
+    size_t run(size_t instructions, std::ostream *log_stream = nullptr);
+
+    /*!
+     * Executes the next instruction of the loaded program
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param log_stream The data stream to log to, only used with TextTrace
+     * @return True if an instruction was executed, false if the program has ended or halted
+     */
+    template<typename ExecutionPolicy = Fast>
+    inline bool step(std::ostream *log_stream = nullptr)
+    {
+        return run<ExecutionPolicy>(1, log_stream) == 1;
+    }
+
+    /*!
+     * Continues emulating the loaded program until PC reaches a breakpoint.
+     * At least one instruction is executed, so calling this again from
+     * the breakpoint runs until it's next reached.
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param breakpoint The address to stop at
+     * @param max_instructions The maximum number of instructions to execute
+     * @param log_stream The data stream to log to, only used with TextTrace
+     * @return True if the breakpoint was reached
+     */
+    template<typename ExecutionPolicy = Fast>
+    bool run_until(uint16_t breakpoint, size_t max_instructions = SIZE_MAX, std::ostream *log_stream = nullptr);
+
+    /*!
+     * Continues emulating the loaded program until a predicate returns true.
+     * The predicate is checked before every instruction, which stops the
+     * engines from running more than one instruction at a time, so a
+     * breakpoint should be used instead where possible.
+     *
+     * @tparam ExecutionPolicy An instantiation of Policy
+     * @param predicate Called with the emulator before each instruction
+     * @param max_instructions The maximum number of instructions to execute
+     * @param log_stream The data stream to log to, only used with TextTrace
+     * @return True if the predicate returned true
+     */
+    template<typename ExecutionPolicy = Fast>
+    bool run_until(const std::function<bool(const Emulator &)> &predicate, size_t max_instructions = SIZE_MAX,
+                   std::ostream *log_stream = nullptr);
+
+    /*!
+     * Checks if the loaded program has finished, either by PC running past
+     * its end, or by executing a HALT with maskable interrupts disabled
+     *
+     * @return True if there's nothing left to run
+     */
+    bool is_finished() const;
+
+    /*!
+     * Checks if the CPU is halted, waiting for an interrupt
+     *
+     * @return True if a HALT was executed and no interrupt has been accepted since
+     */
+    bool is_halted() const;
+
+    /*!
+     * Gets the CPU registers
+     *
+     * @return The registers
+     */
+    const Registers &get_registers() const;
+
+    /*!
+     * Replaces the CPU registers, for resuming a machine whose state was captured elsewhere
+     *
+     * @param registers The new registers
+     */
+    void set_registers(const Registers &registers);
+
+    /*!
+     * Replaces the whole of memory, for resuming a machine whose state was
+     * captured elsewhere. Unlike load(), the registers are left alone.
+     *
+     * @param image The 64 KB memory image
+     * @param end Emulation stops if PC reaches this address
+     */
+    void load_memory(const uint8_t *image, size_t end);
+
+    /*!
+     * Gets the emulator's own 64 KB of RAM. Pages with something else
+     * mapped over them read from that instead, see map_memory().
+     *
+     * @return The 64 KB of memory
+     */
+    const uint8_t *get_memory() const;
+
+    /*!
+     * Maps memory into the address space, in place of the emulator's own
+     * RAM. The memory is the caller's, and must outlive emulation. ROM
+     * can be mapped into any number of emulators at once, as they only
+     * read it. Can be called from port handlers to switch banks while running.
+     * The map is kept by reset() and captured by snapshots, but the contents
+     * of mapped memory aren't.
+     *
+     * @param first_page The first page to map, the address divided by memory_page_size
+     * @param page_count The number of pages to map
+     * @param bank The memory to map, page_count * memory_page_size bytes
+     */
+    void map_memory(uint8_t first_page, uint8_t page_count, const Bank &bank);
+
+    /*!
+     * Maps memory mapped I/O into the address space. Reads come straight
+     * from the bank, which the device keeps up to date, so reading costs
+     * no more than RAM. Writes go to the bank as usual, then call the
+     * callback, which may change what was written.
+     *
+     * @param first_page The first page to map
+     * @param page_count The number of pages to map
+     * @param bank The device's registers, page_count * memory_page_size bytes
+     * @param callback Called with the address and value of every write
+     * @param context Passed to the callback as is
+     */
+    void map_mmio(uint8_t first_page, uint8_t page_count, const Bank &bank, mmio_callback_t callback, void *context);
+
+    /*!
+     * Maps the emulator's own RAM back into pages
+     *
+     * @param first_page The first page to unmap
+     * @param page_count The number of pages to unmap
+     */
+    void unmap_memory(uint8_t first_page, uint8_t page_count);
+
+    /*!
+     * Binds a port which switches banks. Writing n to it maps banks[n % banks.size()]
+     * at first_page. Reads from it return 0xFF.
+     *
+     * @param port_no The port which selects the bank
+     * @param first_page The first page banks are mapped at
+     * @param page_count The number of pages each bank covers
+     * @param banks The banks to choose from
+     */
+    void bind_bank_switch(uint16_t port_no, uint8_t first_page, uint8_t page_count, std::vector<Bank> banks);
+
+    /*!
+     * Captures the state of the machine: registers, memory, port bindings,
+     * cycle count and interrupt state. Pages which haven't been written since
+     * the last snapshot() or restore() are shared with that snapshot rather
+     * than copied. The engine, memory hook and trace writer aren't captured.
+     *
+     * @return The snapshot
+     */
+    std::shared_ptr<const Snapshot> snapshot();
+
+    /*!
+     * Puts back the state captured by snapshot(), on this or any other
+     * Emulator. Restoring the snapshot this emulator last took or restored
+     * only copies back the pages written since, otherwise every page which
+     * differs is copied. Port bindings are restored as they were captured,
+     * so they call the same handlers with the same contexts.
+     *
+     * @param snapshot The snapshot to restore
+     */
+    void restore(const std::shared_ptr<const Snapshot> &snapshot);
+
+    /*!
+     * Emulates instruction data, as fast as possible
+     *
+     * @param data The data to emulate
+     */
+    inline void emulate(const std::vector<uint8_t> &data)
+    {
+        emulate<Fast>(data);
+    }
+
+    /*!
+     * Emulates instruction data, logging each instruction
+     *
+     * @param data The data to emulate
+     * @param log_stream The data stream to log to
+     */
+    inline void emulate(const std::vector<uint8_t> &data, std::ostream &log_stream)
+    {
+        emulate<Traced>(data, &log_stream);
+    }
+
+    /*!
+     * Emulates a program image, as fast as possible
+     *
+     * @param image The image to emulate
+     */
+    inline void emulate(const ProgramImage &image)
+    {
+        emulate<Fast>(image);
+    }
+
+    /*!
+     * Emulates a program image, logging each instruction
+     *
+     * @param image The image to emulate
+     * @param log_stream The data stream to log to
+     */
+    inline void emulate(const ProgramImage &image, std::ostream &log_stream)
+    {
+        emulate<Traced>(image, &log_stream);
+    }
+
+    /*!
+     * Registers a port handler, this callback
+     * will be called whenever the CPU tries to read
+     * or write to a port. Block I/O instructions such as
+     * OTIR pass their whole transfer in one call.
+     * Ports are addressed by all 16 bits, A and n for the (n)
+     * forms, and BC for the block forms. Ports below 0x100
+     * only decode the low byte, as most hardware did, and
+     * ports from 0x100 up match the whole address.
+     *
+     * @param port_no The port number to install the handler into
+     * @param callback The function to call on read/write request, or nullptr to unbind the port
+     * @param context Passed to the callback as is
+     */
+    void bind_port(uint16_t port_no, port_callback_t callback, void *context);
+
+    /*!
+     * Registers a port handler, this functor
+     * will be called whenever the CPU tries to read
+     * or write to a port. Costs an extra call
+     * compared to binding a callback directly.
+     *
+     * @param port_no The port number to install the handler into
+     * @param handler The functor to call on read/write request
+     */
+    void bind_port(uint16_t port_no, port_handler_t handler);
+
+    /*!
+     * Sets the handler for ports which nothing is bound to. By default
+     * reads from them return 0xFF, and writes to them are ignored.
+     *
+     * @param callback The function to call on read/write request, or nullptr for the default
+     * @param context Passed to the callback as is
+     */
+    void set_default_port_handler(port_callback_t callback, void *context);
+
+    /*!
+     * Selects the execution engine used by emulate(). All engines
+     * produce the same results, they only differ in speed.
+     *
+     * @param engine The engine to use
+     */
+    void set_engine(Engine engine);
+
+    /*!
+     * Registers a functor to be called whenever an instruction writes
+     * to memory. Only called when emulating with a policy which has
+     * memory hooks enabled.
+     *
+     * @param hook The functor to call, with the address and the value written
+     */
+    void set_memory_hook(memory_hook_t hook);
+
+    /*!
+     * Gets the number of T-states counted since the last reset. Only
+     * counted when emulating with a policy which counts cycles.
+     *
+     * @return The number of T-states
+     */
+    uint64_t get_cycles() const;
+
+    /*!
+     * Raises the maskable interrupt line. It stays raised until the CPU
+     * accepts the interrupt or clear_interrupt() is called, so it can be
+     * raised while interrupts are disabled. Can be called from port handlers.
+     *
+     * @param data The byte the device puts on the data bus. In IM 0 this is an
+     *             RST instruction, in IM 2 the low byte of the vector address.
+     */
+    void interrupt(uint8_t data = 0xFF);
+
+    /*!
+     * Lowers the maskable interrupt line, if the interrupt hasn't been accepted yet
+     */
+    void clear_interrupt();
+
+    /*!
+     * Triggers a non maskable interrupt, accepted before the next instruction
+     */
+    void nmi();
+
+    /*!
+     * Raises the maskable interrupt line every period T-states, like a frame
+     * or timer interrupt. When the CPU is halted waiting for an interrupt,
+     * emulation skips straight to the next tick rather than running through
+     * the idle time. Ticks only land on the exact T-state when emulating
+     * with a policy which counts cycles.
+     *
+     * @param period The T-states between ticks, or 0 to stop the timer
+     * @param data The byte on the data bus, as for interrupt()
+     */
+    void set_interrupt_timer(uint64_t period, uint8_t data = 0xFF);
+
+    /*!
+     * Sets where binary traces are written, when emulating with
+     * a policy using BinaryTrace. The writer must outlive emulation.
+     *
+     * @param writer The trace writer, or nullptr to not write traces
+     */
+    void set_trace_writer(TraceWriter *writer);
+
+    /*!
+     * Sets where edge coverage is recorded, when emulating with a policy
+     * using coverage. Each instruction bumps the counter for the edge from
+     * the previous instruction, keyed as AFL does by (previous PC >> 1) ^ PC.
+     * Counters wrap rather than saturate. The map must outlive emulation.
+     *
+     * @param map The counters, or nullptr to not record coverage
+     * @param size The number of counters, a power of two
+     */
+    void set_coverage_map(uint8_t *map, size_t size);
+
+    /*!
+     * Sets the profiler, when emulating with a policy using profiling.
+     * The profiler must outlive emulation.
+     *
+     * @param profiler The profiler, or nullptr to not profile
+     */
+    void set_profiler(Profiler *profiler);
+
+    /*!
+     * Logs an instruction from a binary trace, in the same format as
+     * emulating with TextTrace. The record's bytes are decoded from
+     * this emulator's memory, so this overwrites memory at the record's PC.
+     *
+     * @param record The record to log
+     * @param log_stream The stream to log to
+     */
+    void log_trace_record(const TraceRecord &record, std::ostream &log_stream);
+private:
+    friend class Jit;
+    friend class Profiler;
+    friend class Snapshot;
+
+    /*!
+     * Runs the loaded program with the selected engine, until PC reaches
+     * the end of the program, a HALT is executed, or when counting cycles,
+     * the cycle deadline is reached.
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void run_engine(std::ostream *log_stream);
+
+    /*!
+     * Checks if emulation should carry on to the next instruction
+     *
+     * @tparam ExecutionPolicy The features compiled into the loop
+     * @param end The address to stop at
+     * @return True if another instruction should be executed
+     */
+    template<typename ExecutionPolicy>
+    inline bool running(size_t end) const
+    {
+        return reg.PC < end && !halted && !interrupt_pending && !limit_reached<ExecutionPolicy>();
+    }
+
+    /*!
+     * Checks if one of the limits set by run_for_cycles(), run() or run_until() has been reached
+     *
+     * @tparam ExecutionPolicy The features compiled into the loop
+     * @return True if emulation should stop
+     */
+    template<typename ExecutionPolicy>
+    inline bool limit_reached() const
+    {
+        if constexpr(ExecutionPolicy::count_cycles)
+        {
+            if(cycles >= cycle_limit)
+                return true;
+        }
+        if constexpr(ExecutionPolicy::stepped)
+        {
+            if(instructions_left == 0 || reg.PC == breakpoint)
+                return true;
+        }
+        return false;
+    }
+
+    /*!
+     * Recalculates interrupt_pending, after anything it depends on changes
+     */
+    inline void update_interrupt_pending()
+    {
+        interrupt_pending = nmi_requested || (irq_requested && reg.IFF1) || ei_delay;
+    }
+
+    /*!
+     * Accepts a pending interrupt, pushing PC and jumping to its handler.
+     * Straight after an EI, the instruction after it is executed instead,
+     * as interrupts aren't enabled until it's done, and any interrupt is
+     * left pending for the next call.
+     *
+     * @tparam ExecutionPolicy The features compiled into the loop
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void accept_interrupt(std::ostream *log_stream);
+
+    /*!
+     * Raises the interrupt line if a timer tick is due, and works out
+     * the cycle count the engines have to stop at
+     */
+    void update_timer();
+
+    /*!
+     * While halted, skips forward to the next timer tick or the cycle deadline,
+     * whichever is first, in the same steps of 4 T-states the CPU would take
+     *
+     * @return False if nothing can wake the CPU before emulation has to stop
+     */
+    bool skip_halt();
+
+    /*!
+     * A policy with the same features as another, which also stops after
+     * a number of instructions or at a breakpoint. Used by run() and
+     * run_until(), so the check is compiled out of emulate().
+     *
+     * @tparam ExecutionPolicy The policy to extend
+     */
+    template<typename ExecutionPolicy>
+    struct Stepped : ExecutionPolicy
+    {
+        static constexpr bool stepped = true;
+    };
+
+    /*!
+     * Runs the emulator by calling through the opcode tables,
+     * until PC reaches the end address or a HALT is executed.
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param end The address to stop at
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void run_portable(size_t end, std::ostream *log_stream);
+
+    /*!
+     * Runs the emulator using direct threaded code, until PC reaches the
+     * end address or a HALT is executed. Each unprefixed opcode has its
+     * own inlined handler ending in its own indirect jump, which gives the
+     * branch predictor one history per opcode rather than a single shared one.
+     *
+     * Falls back to run_portable() on compilers without labels as values.
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param end The address to stop at
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void run_threaded(size_t end, std::ostream *log_stream);
+
+    /*!
+     * Runs the emulator from the basic block cache, until PC reaches the
+     * end address or a HALT is executed. Blocks are decoded once and then
+     * replayed, writes to memory holding code drop the affected blocks.
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param end The address to stop at
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void run_cached(size_t end, std::ostream *log_stream);
+
+    /*!
+     * Runs the emulator from the basic block cache, compiling blocks to
+     * native code once they've been executed enough times. Compiled blocks
+     * which jump to each other are chained together, so tight loops run
+     * without coming back here.
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param end The address to stop at
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void run_native(size_t end, std::ostream *log_stream);
+
+    /*!
+     * Interprets a decoded block, stopping early if it modifies code or executes a HALT
+     *
+     * @tparam ExecutionPolicy The features to compile into the loop
+     * @param instructions The instructions in the block
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    void execute_block(const std::vector<Instruction> &instructions, std::ostream *log_stream);
+
+    /*!
+     * Does the per instruction work enabled by a policy, after an instruction has executed
+     *
+     * @tparam ExecutionPolicy The features to compile in
+     * @param instr The instruction which was executed
+     * @param log_stream The stream to log to, if tracing
+     */
+    template<typename ExecutionPolicy>
+    inline void after_instruction(const Instruction &instr, std::ostream *log_stream);
+
+    /*!
+     * Pushes a record for an executed instruction to the trace writer
+     *
+     * @param instr The instruction which was executed
+     */
+    void trace_instruction(const Instruction &instr);
+
+    /*!
+     * Called from compiled code to run an instruction which isn't translated
+     *
+     * @param emu The emulator
+     * @param instr The instruction to execute
+     * @return True if compiled code must stop, because code was modified or a HALT executed
+     */
+    static bool jit_execute(Emulator *emu, const Instruction *instr);
+
+    /*!
+     * As jit_execute(), but also logs the instruction
+     */
+    static bool jit_execute_logged(Emulator *emu, const Instruction *instr, std::ostream *log_stream);
+
+    /*!
+     * Called from compiled code to log a translated instruction
+     */
+    static void jit_log(Emulator *emu, const Instruction *instr, std::ostream *log_stream);
+
+    /*!
+     * Decodes the basic block starting at a given address
+     *
+     * @param pc The address of the first instruction
+     * @param end Decoding stops before this address
+     * @param instructions The vector to decode the instructions into
+     * @return The number of bytes covered by the block
+     */
+    uint16_t build_block(uint16_t pc, size_t end, std::vector<Instruction> &instructions);
+
+    /*!
+     * An entry in one of the flat opcode tables.
+     */
+    struct Opcode
+    {
+        handler_t handler;     // The function which executes the opcode
+        uint8_t operand_bytes; // The number of immediate bytes following the opcode
+        uint8_t t_states;      // T-states taken, for conditional instructions when the condition fails
+        uint8_t t_states_taken; // Extra T-states when a condition passes, or per repeat of a block instruction
+        Prefix next;           // For prefix bytes, the table the next byte is decoded from. None otherwise.
+        bool ends_block;       // If the opcode can change PC, and so ends a basic block
+    };
+    typedef std::array<Opcode, 0x100> opcode_table_t;
+
+    /*!
+     * Decodes the instruction at a given address. This walks the flat
+     * opcode tables, so costs one lookup per prefix/opcode byte.
+     *
+     * @param pc The address to decode from
+     * @param instr The instruction to decode into
+     */
+    inline void decode(uint16_t pc, Instruction &instr)
+    {
+        const Opcode *entry = &opcode_tables[Prefix::None][read_memory(pc)];
+        uint16_t addr = pc + 1;
+
+        instr.pc = pc;
+        instr.prefix = Prefix::None;
+        instr.operand = 0;
+        while(entry->next != Prefix::None)
+        {
+            instr.prefix = entry->next;
+            if(instr.prefix == Prefix::DDCB || instr.prefix == Prefix::FDCB) // Displacement comes before the opcode
+            {
+                instr.operand = read_memory(addr++);
+            }
+            entry = &opcode_tables[instr.prefix][read_memory(addr++)];
+        }
+
+        instr.handler = entry->handler;
+        instr.opcode = read_memory(addr - 1);
+        if(entry->operand_bytes == 1)
+        {
+            instr.operand = read_memory(addr);
+        }
+        else if(entry->operand_bytes == 2)
+        {
+            instr.operand = read_memory(addr) | (read_memory(addr + 1) << 8);
+        }
+        instr.length = (uint16_t)(addr - pc) + entry->operand_bytes;
+    }
+
+    /*!
+     * Decodes a DD or FD prefixed instruction, which saves decode() walking
+     * the tables when the prefix is already known. DDCB and FDCB instructions
+     * are passed on to decode().
+     *
+     * @param pc The address of the prefix
+     * @param prefix DD or FD
+     * @param instr The instruction to decode into
+     */
+    inline void decode_indexed(uint16_t pc, Prefix prefix, Instruction &instr)
+    {
+        uint8_t opcode = read_memory(pc + 1);
+        const Opcode &entry = opcode_tables[prefix][opcode];
+        if(entry.next != Prefix::None)
+        {
+            decode(pc, instr);
+            return;
+        }
+
+        instr.handler = entry.handler;
+        instr.pc = pc;
+        instr.prefix = prefix;
+        instr.opcode = opcode;
+        instr.operand = 0;
+        if(entry.operand_bytes == 1)
+        {
+            instr.operand = read_memory(pc + 2);
+        }
+        else if(entry.operand_bytes == 2)
+        {
+            instr.operand = read_memory(pc + 2) | (read_memory(pc + 3) << 8);
+        }
+        instr.length = 2 + entry.operand_bytes;
+    }
+
+    /*!
+     * Executes a single opcode. There's one instantiation per
+     * table entry, with the x/y/z/p/q fields resolved at compile time.
+     *
+     * @tparam prefix The table the opcode belongs to
+     * @tparam opcode The opcode byte
+     * @param instr The decoded instruction
+     */
+    template<Prefix prefix, uint8_t opcode>
+    void execute(const Instruction &instr);
+
+    /*!
+     * The register the HL forms of an instruction work on. The DD and FD
+     * prefixes run the same handlers as the unprefixed and CB pages, with
+     * this resolved at compile time, so (IX+d) costs no more than (HL).
+     */
+    enum class Index : uint8_t
+    {
+        HL = 0,
+        IX = 1, // DD prefix
+        IY = 2, // FD prefix
+    };
+
+    template<uint8_t opcode, Index index = Index::HL>
+    void execute_main(const Instruction &instr);
+
+    template<uint8_t opcode>
+    void execute_ed(const Instruction &instr);
+
+    template<uint8_t opcode, Index index = Index::HL>
+    void execute_cb(const Instruction &instr);
+
+    /*!
+     * Checks if an unprefixed opcode accesses (HL), which becomes (IX+d)
+     * or (IY+d) under a DD or FD prefix, and so takes a displacement byte
+     *
+     * @param opcode The opcode byte
+     * @return True if the opcode accesses (HL)
+     */
+    static constexpr bool indexed(uint8_t opcode);
+
+    /*!
+     * Gets the number of immediate bytes which follow an opcode
+     *
+     * @param prefix The table the opcode belongs to
+     * @param opcode The opcode byte
+     * @return The number of operand bytes
+     */
+    static constexpr uint8_t operand_bytes(Prefix prefix, uint8_t opcode);
+
+    /*!
+     * Gets the table that the byte after an opcode should be decoded from
+     *
+     * @param prefix The table the opcode belongs to
+     * @param opcode The opcode byte
+     * @return The next table, or None if the opcode isn't a prefix
+     */
+    static constexpr Prefix next_table(Prefix prefix, uint8_t opcode);
+
+    /*!
+     * Checks if an opcode can transfer control anywhere other than the next
+     * instruction, and so must be the last instruction in a basic block.
+     *
+     * @param prefix The table the opcode belongs to
+     * @param opcode The opcode byte
+     * @return True if the opcode ends a block
+     */
+    static constexpr bool ends_block(Prefix prefix, uint8_t opcode);
+
+    /*!
+     * Gets the number of T-states an opcode takes. For conditional
+     * instructions this is the time taken when the condition fails,
+     * and for repeating block instructions, the time for the last pass.
+     *
+     * @param prefix The table the opcode belongs to
+     * @param opcode The opcode byte
+     * @return The number of T-states
+     */
+    static constexpr uint8_t t_states(Prefix prefix, uint8_t opcode);
+
+    /*!
+     * Gets the extra T-states an opcode takes when its condition passes,
+     * or for repeating block instructions, the time for each pass but the last.
+     *
+     * @param prefix The table the opcode belongs to
+     * @param opcode The opcode byte
+     * @return The number of T-states, 0 if the opcode isn't conditional
+     */
+    static constexpr uint8_t t_states_taken(Prefix prefix, uint8_t opcode);
+
+    /*!
+     * Charges the extra T-states for a conditional instruction whose
+     * condition passed. They're added to cycles by after_instruction().
+     *
+     * @tparam prefix The table the opcode belongs to
+     * @tparam opcode The opcode byte
+     */
+    template<Prefix prefix, uint8_t opcode>
+    inline void condition_taken()
+    {
+        extra_t_states += t_states_taken(prefix, opcode);
+    }
+
+    /*!
+     * Builds the flat table for a given prefix from the decoding rules
+     */
+    template<Prefix prefix, size_t... opcodes>
+    static constexpr opcode_table_t make_opcode_table(std::index_sequence<opcodes...>);
+
+    // One 256 entry table per prefix, indexed by opcode
+    static const std::array<opcode_table_t, PrefixCount> opcode_tables;
+
+    /*!
+     * Logs a decoded instruction in textual form
+     *
+     * @param instr The instruction to log
+     * @param log_stream The stream to log to
+     */
+    void log_instruction(const Instruction &instr, std::ostream &log_stream);
+
+    /*!
+     * Logs an instruction from the unprefixed page, or the DD or FD page
+     *
+     * @tparam index The register replacing HL, as for execute_main()
+     * @param instr The instruction to log
+     * @param log_stream The stream to log to
+     */
+    template<Index index>
+    void log_main(const Instruction &instr, std::ostream &log_stream);
+
+    /*!
+     * Logs an instruction from the ED page
+     *
+     * @param instr The instruction to log
+     * @param log_stream The stream to log to
+     */
+    void log_ed(const Instruction &instr, std::ostream &log_stream);
+
+    /*!
+     * Logs an instruction from the CB page, or the DDCB or FDCB page
+     *
+     * @tparam index The register replacing HL, as for execute_cb()
+     * @param instr The instruction to log
+     * @param log_stream The stream to log to
+     */
+    template<Index index>
+    void log_cb(const Instruction &instr, std::ostream &log_stream);
+
+    /*!
+     * Gets the name of HL, IX or IY
+     *
+     * @tparam index The register to name
+     * @return The name
+     */
+    template<Index index>
+    std::string index_name() const;
+
+    /*!
+     * Gets the name of register r[reg_no], which is IXH, IXL or (IX+d) in place of H, L or (HL) under an index
+     *
+     * @tparam index The register replacing HL
+     * @param reg_no The register number in the r table
+     * @param instr The decoded instruction, which holds d
+     * @return The name
+     */
+    template<Index index>
+    std::string r_name(uint8_t reg_no, const Instruction &instr) const;
+
+    /*!
+     * Gets HL, IX or IY
+     *
+     * @tparam index The register to get
+     * @return A reference to the register
+     */
+    template<Index index>
+    inline uint16_t &get_index_reg()
+    {
+        if constexpr(index == Index::HL)
+            return reg.general.HL;
+        else if constexpr(index == Index::IX)
+            return reg.IX;
+        else
+            return reg.IY;
+    }
 
-    enum Prefix
+    /*!
+     * Gets the address accessed by (HL), or by (IX+d)/(IY+d) with the
+     * displacement taken from the low byte of the operand
+     *
+     * @tparam index The register the address is based on
+     * @param instr The decoded instruction
+     * @return The address
+     */
+    template<Index index>
+    inline uint16_t get_indexed_address(const Instruction &instr)
     {
-        None = 0,
-        CB = 1,
-        DD = 2,
-        ED = 3,
-        FD = 4,
-        PrefixCount = 5
-    };
+        if constexpr(index == Index::HL)
+            return reg.general.HL;
+        else
+            return get_index_reg<index>() + (int8_t)instr.operand;
+    }
 
     /*!
-     * Constructor
+     * Reads register r[reg_no]. (HL) is resolved at compile time
+     * to a memory access.
+     *
+     * @tparam reg_no The register number in the r table
+     * @tparam index The register replacing HL, making H and L IXH/IXL or IYH/IYL, and (HL) (IX+d) or (IY+d)
+     * @param instr The decoded instruction, which holds d
+     * @return The value of the register
      */
-    Emulator();
+    template<uint8_t reg_no, Index index = Index::HL>
+    inline uint8_t read_r(const Instruction &instr)
+    {
+        static_assert(reg_no < 8, "Register out of range");
+        if constexpr(reg_no == 6)
+            return read_memory(get_indexed_address<index>(instr));
+        else
+            return *get_r_reg<reg_no, index>();
+    }
 
     /*!
-     * Resets the state of the emulator
+     * Writes register r[reg_no]. (HL) is resolved at compile time
+     * to a memory access.
+     *
+     * @tparam reg_no The register number in the r table
+     * @tparam index The register replacing HL, as for read_r()
+     * @param instr The decoded instruction, which holds d
+     * @param val The value to write
      */
-    void reset();
+    template<uint8_t reg_no, Index index = Index::HL>
+    inline void write_r(const Instruction &instr, uint8_t val)
+    {
+        static_assert(reg_no < 8, "Register out of range");
+        if constexpr(reg_no == 6)
+            write_memory(get_indexed_address<index>(instr), val);
+        else
+            *get_r_reg<reg_no, index>() = val;
+    }
 
     /*!
-     * Emulates instruction data
+     * Gets the 8bit register associated with a given register number.
+     * (HL) isn't a register, so read_r/write_r should generally be used instead.
      *
-     * @param data The data to emulate
-     * @param log_stream The data stream to log to
+     * @tparam reg_no The register number in the r table
+     * @tparam index The register replacing HL, making H and L its high and low bytes
+     * @return A pointer to the register
      */
-    void emulate(const std::vector<uint8_t> &data, std::ostream &log_stream);
+    template<uint8_t reg_no, Index index = Index::HL>
+    inline uint8_t *get_r_reg()
+    {
+        static_assert(reg_no < 8 && reg_no != 6, "Register out of range");
+        if constexpr(reg_no == 0)
+            return &reg.general.B;
+        else if constexpr(reg_no == 1)
+            return &reg.general.C;
+        else if constexpr(reg_no == 2)
+            return &reg.general.D;
+        else if constexpr(reg_no == 3)
+            return &reg.general.E;
+        else if constexpr(reg_no == 4)
+            return index == Index::HL ? &reg.general.H : index == Index::IX ? &reg.IXH : &reg.IYH;
+        else if constexpr(reg_no == 5)
+            return index == Index::HL ? &reg.general.L : index == Index::IX ? &reg.IXL : &reg.IYL;
+        else
+            return &reg.general.A;
+    }
 
     /*!
-     * Registers a port handler, this functor
-     * will be called whenever the CPU tries to read
-     * or write to a port.
+     * Gets the 16bit register associated with a given register number
      *
-     * @param port_no The port number to install the handler into
-     * @param handler The functor to call on read/write request
+     * @tparam reg_no The register number in the rp table
+     * @tparam index The register replacing HL
+     * @return A reference to the register
      */
-    void bind_port(uint16_t port_no, port_handler_t handler);
-private:
+    template<uint8_t reg_no, Index index = Index::HL>
+    inline uint16_t &get_rp_reg()
+    {
+        static_assert(reg_no < 4, "Register out of range");
+        if constexpr(reg_no == 0)
+            return reg.general.BC;
+        else if constexpr(reg_no == 1)
+            return reg.general.DE;
+        else if constexpr(reg_no == 2)
+            return get_index_reg<index>();
+        else
+            return reg.SP;
+    }
 
     /*!
-     * Gets the 8bit memory address associated with a given register.
-     * This should be used rather than accessing the 8bit registers directly
-     * through the tables, as (HL) is a special case which this takes care of.
+     * Gets the 16bit register associated with a given register number
      *
-     * @param reg_no The register number to get in the r table
-     * @return A pointer to the register
+     * @tparam reg_no The register number in the rp2 table
+     * @tparam index The register replacing HL
+     * @return A reference to the register
      */
-    inline uint8_t *get_r_reg(uint8_t reg_no)
+    template<uint8_t reg_no, Index index = Index::HL>
+    inline uint16_t &get_rp2_reg()
     {
-        if(reg_no == 6)
+        static_assert(reg_no < 4, "Register out of range");
+        if constexpr(reg_no == 3)
+        {
+            resolve_flags();
+            return reg.general.AF;
+        }
+        else
         {
-            return &memory[reg.general.HL];
+            return get_rp_reg<reg_no, index>();
         }
+    }
+
+    enum class FlagOp : uint8_t
+    {
+        None = 0, // F is up to date
+        Add = 1,  // ADD and ADC
+        Sub = 2,  // SUB and SBC
+        Cp = 3,
+    };
 
-        return reg_table_r[reg_no];
+    // An arithmetic operation whose flags are only worked out if something reads them
+    struct PendingFlags
+    {
+        FlagOp op;
+        uint8_t a;       // The accumulator before the operation
+        uint8_t val;     // The operand, not including the carry
+        uint16_t result; // The full result, including the carry
+    };
+
+    /*!
+     * Works out F from the pending arithmetic operation, if there is one. Anything
+     * which reads F inside the emulation loop must call this first, and it's called
+     * whenever the loop returns, so F is always up to date outside of it.
+     */
+    inline void resolve_flags()
+    {
+        if(pending_flags.op == FlagOp::None)
+            return;
+
+        uint8_t a = pending_flags.a;
+        uint8_t val = pending_flags.val;
+        uint16_t result = pending_flags.result;
+        if(pending_flags.op == FlagOp::Add)
+            reg.general.F.value = FlagTables::add(a, val, result);
+        else if(pending_flags.op == FlagOp::Sub)
+            reg.general.F.value = FlagTables::sub(a, val, result);
+        else // The undocumented flags are copied from the operand rather than the result for CP
+            reg.general.F.value = (FlagTables::sub(a, val, result) & ~(FlagTables::X | FlagTables::Y))
+                                  | (val & (FlagTables::X | FlagTables::Y));
+        pending_flags.op = FlagOp::None;
     }
 
     /*!
-     * Gets the 16bit memory address associated with a given register.
-     * This should be used rather than accessing the 16bit registers directly
-     * through the tables.
+     * Gets the carry flag, without working out the rest of F
      *
-     * @param reg_no The register number to get in the rp table
-     * @return A pointer to the register
+     * @return 1 if carry is set, otherwise 0
      */
-    inline uint16_t *get_rp_reg(uint8_t reg_no)
+    inline uint8_t carry() const
     {
-        return reg_table_rp[reg_no];
+        if(pending_flags.op == FlagOp::None)
+            return reg.general.F.C;
+        return (pending_flags.result >> 8) & FlagTables::C;
     }
 
     /*!
-     * Gets the 16bit memory address associated with a given register.
-     * This should be used rather than accessing the 16bit registers directly
-     * through the tables.
+     * Records an arithmetic operation whose flags are worked out by resolve_flags(), if they're ever read
      *
-     * @param reg_no The register number to get in the rp2 table
-     * @return A pointer to the register
+     * @param op The kind of operation
+     * @param a The accumulator before the operation
+     * @param val The operand, not including the carry
+     * @param result The full result, including the carry, as a 16bit value
+     */
+    inline void set_pending_flags(FlagOp op, uint8_t a, uint8_t val, uint16_t result)
+    {
+        pending_flags = {op, a, val, result};
+    }
+
+    /*!
+     * Sets all of F at once, dropping any pending operation
+     *
+     * @param flags The new value of F
      */
-    inline uint16_t *get_rp2_reg(uint8_t reg_no)
+    inline void set_flags(uint8_t flags)
     {
-        return reg_table_rp2[reg_no];
+        reg.general.F.value = flags;
+        pending_flags.op = FlagOp::None;
     }
 
     /*!
      * Gets the value of a given condition flag value
      *
-     * @param cc_no The condition value to get
+     * @tparam cc_no The condition value to get
      * @return The value belonging to that condition
      */
-    inline bool get_cc_value(uint8_t cc_no)
+    template<uint8_t cc_no>
+    inline bool get_cc_value()
+    {
+        resolve_flags();
+        static_assert(cc_no < 8, "Condition out of range");
+        if constexpr(cc_no == 0)
+            return !reg.general.F.Z;
+        else if constexpr(cc_no == 1)
+            return reg.general.F.Z;
+        else if constexpr(cc_no == 2)
+            return !reg.general.F.C;
+        else if constexpr(cc_no == 3)
+            return reg.general.F.C;
+        else if constexpr(cc_no == 4)
+            return !reg.general.F.PV;
+        else if constexpr(cc_no == 5)
+            return reg.general.F.PV;
+        else if constexpr(cc_no == 6)
+            return !reg.general.F.S;
+        else
+            return reg.general.F.S;
+    }
+
+    /*!
+     * Writes a byte to memory. All writes made by instructions should
+     * go through here, so that cached code in the page can be dropped,
+     * and memory hooks called.
+     *
+     * @param addr The address to write to
+     * @param val The value to write
+     */
+    inline void write_memory(uint16_t addr, uint8_t val)
     {
-        switch(cc_no)
+        write_pages[addr >> 12][addr & (memory_page_size - 1)] = val;
+        if(watched_pages[addr >> 8])
         {
-            case 0:
-                return !reg.general.F.Z;
-            case 1:
-                return reg.general.F.Z;
-            case 2:
-                return !reg.general.F.C;
-            case 3:
-                return reg.general.F.C;
-            case 4:
-                return !reg.general.F.PV;
-            case 5:
-                return reg.general.F.PV;
-            case 6:
-                return !reg.general.F.S;
-            case 7:
-                return reg.general.F.S;
-            default:
-                abort();
+            watched_write(addr, val);
         }
     }
 
     /*!
-     * Checks the parity of two numbers
+     * Reads a byte of memory, through the memory map
      *
-     * @tparam T The type of thing to calculate the parity of
-     * @param num The thing to calculate the parity of
-     * @return True if the parity is even, false otherwise
+     * @param addr The address to read
+     * @return The byte read
      */
-    template<typename T>
-    inline bool parity(T num)
+    inline uint8_t read_memory(uint16_t addr)
     {
-        static_assert(((sizeof(T) * 8) % 2) == 0, "Can't check parity of an object which is not even in size");
-        size_t a = sizeof(T) * 8;
-        do
-        {
-            a /= 2;
-            num ^= num >> 16;
-        } while(a != 1);
-        return (~num) & 1;
+        return read_pages[addr >> 12][addr & (memory_page_size - 1)];
     }
 
     /*!
-     * Converts a value into its associated prefix
+     * Handles a write to a watched page. Calls the memory hook if it's
+     * active, calls the MMIO handler if the page has one, drops any cached
+     * code in the page, and marks it dirty.
+     *
+     * @param addr The address which was written to
+     * @param val The value which was written
+     */
+    void watched_write(uint16_t addr, uint8_t val);
+
+    /*!
+     * Watches every page which hasn't been written since snapshot_base was
+     * taken, so the first write to each gets marked in dirty_pages
+     */
+    void watch_clean_pages();
+
+    /*!
+     * Watches every page with an MMIO handler, which stay watched for as long as they're mapped
+     */
+    void watch_mmio_pages();
+
+    /*!
+     * Copies part of a program into RAM, bypassing write_memory(), and marks the pages it covers dirty
      *
-     * @param val The value to convert
-     * @return The prefix, or None if none.
+     * @param address Where to copy it to
+     * @param data The bytes to copy
+     * @param size The number of bytes, which mustn't run past the end of memory
      */
-    Prefix to_prefix(uint8_t val);
+    void copy_program(uint16_t address, const uint8_t *data, size_t size);
+
+    /*!
+     * Gets ready to run a program which has just been loaded, dropping any code cached from what was there before
+     *
+     * @param entry The address to start at
+     * @param end Emulation stops if PC reaches this address
+     */
+    void start_program(uint16_t entry, size_t end);
 
     // CPU Functions
 
@@ -187,7 +1432,8 @@ private:
      */
     inline void out(uint16_t port, uint8_t *n)
     {
-        ports[port](PortState::Write, n, 1);
+        const PortBinding &binding = find_port(port);
+        binding.callback(binding.context, PortState::Write, n, 1);
     }
 
     /*!
@@ -198,87 +1444,205 @@ private:
      */
     inline void in(uint16_t port, uint8_t *n)
     {
-        ports[port](PortState::Read, n, 1);
+        const PortBinding &binding = find_port(port);
+        binding.callback(binding.context, PortState::Read, n, 1);
+    }
+
+    /*!
+     * A port handler, and the context it's called with
+     */
+    struct PortBinding
+    {
+        port_callback_t callback;
+        void *context;
+    };
+
+    /*!
+     * An MMIO handler, and the context it's called with
+     */
+    struct MmioBinding
+    {
+        mmio_callback_t callback;
+        void *context;
+    };
+
+    /*!
+     * Gets the handler for the port on the address bus. Unless a port
+     * from 0x100 up is bound, it's a single lookup on the low byte,
+     * which covers every port on hardware which only decodes 8 bits.
+     *
+     * @param port The address on the bus
+     * @return The port's handler, or the default handler if nothing is bound
+     */
+    inline const PortBinding &find_port(uint16_t port) const
+    {
+        if(!high_ports.empty())
+            return find_high_port(port);
+        const PortBinding &binding = low_ports[port & 0xFF];
+        return binding.callback ? binding : default_port;
     }
 
+    /*!
+     * Gets the handler for a port when ports from 0x100 up are bound,
+     * which take priority over the ports decoded from the low byte
+     *
+     * @param port The port number
+     * @return The port's handler, or the default handler if nothing is bound
+     */
+    const PortBinding &find_high_port(uint16_t port) const;
+
+    /*!
+     * The default handler for unbound ports, reads return 0xFF and writes are ignored
+     */
+    static void open_bus(void *context, PortState state, uint8_t *data, uint16_t size);
+
+    /*!
+     * Calls a port_handler_t bound with bind_port()
+     */
+    static void call_port_function(void *context, PortState state, uint8_t *data, uint16_t size);
+
+    /*!
+     * A port bound with bind_bank_switch(), and the banks it chooses between
+     */
+    struct BankSwitch
+    {
+        Emulator *emulator;
+        uint8_t first_page;
+        uint8_t page_count;
+        std::vector<Bank> banks;
+    };
+
+    /*!
+     * Port handler for ports bound with bind_bank_switch()
+     */
+    static void switch_bank(void *context, PortState state, uint8_t *data, uint16_t size);
+
+    /*!
+     * Points pages of the memory map somewhere else. Cached code in
+     * pages whose mapping changes is dropped.
+     *
+     * @param first_page The first page to map
+     * @param page_count The number of pages to map
+     * @param read Where reads come from
+     * @param write Where writes go, write_sink to ignore them
+     * @param mmio The handler called after writes, or none
+     */
+    void map_pages(uint8_t first_page, uint8_t page_count, const uint8_t *read, uint8_t *write, const MmioBinding &mmio);
+
     // CPU State
 
     // Memory
     unsigned char memory[0x10000];
 
-    // Ports
-    port_handler_t ports[0x10000];
+    // The memory map, where each page reads from and writes to. Pages point into memory unless something else is mapped.
+    // Writes to read only pages go to write_sink. Pages with an MMIO handler are watched, so writes to them reach it.
+    std::array<const uint8_t *, memory_page_count> read_pages;
+    std::array<uint8_t *, memory_page_count> write_pages;
+    std::array<MmioBinding, memory_page_count> mmio_pages;
+    uint8_t write_sink[memory_page_size];
+
+    // Read only images mapped by load(), kept alive while a page still reads from them
+    std::array<std::shared_ptr<const ProgramImage>, memory_page_count> page_images;
+
+    // If every page maps straight to memory, so the block instructions can work on spans of it directly
+    bool flat_memory;
+
+    // Ports bound with bind_bank_switch(), which their bindings point to. Shared with snapshots, which keep the bindings.
+    std::vector<std::shared_ptr<BankSwitch>> bank_switches;
+
+    // Ports. The 8 bit ports are indexed directly, the rest are kept sorted by port number. Unbound ports have no callback.
+    std::array<PortBinding, 0x100> low_ports;
+    std::vector<std::pair<uint16_t, PortBinding>> high_ports;
+    PortBinding default_port;
+
+    // Functors bound with bind_port(), which the bindings point into
+    std::map<uint16_t, port_handler_t> port_functions;
 
     // Registers
-    struct Registers
-    {
-        struct
-        {
-            union
-            {
-                struct
-                {
-                    uint8_t B;
-                    uint8_t C;
-                };
-                uint16_t BC;
-            };
+    Registers reg;
 
-            union
-            {
-                struct
-                {
-                    uint8_t D;
-                    uint8_t E;
-                };
-                uint16_t DE;
-            };
+    // The last ADD/ADC/SUB/SBC/CP, whose flags haven't been worked out yet as nothing has read them. See resolve_flags().
+    PendingFlags pending_flags;
 
-            union
-            {
-                struct
-                {
-                    uint8_t H;
-                    uint8_t L;
-                };
-                uint16_t HL;
-            };
+    // Set by HALT to stop emulation
+    bool halted;
 
-            union
-            {
-                struct
-                {
-                    uint8_t A;
-                    struct
-                    {
-                        uint8_t C:1;  // Carry
-                        uint8_t N:1;  // Subtract
-                        uint8_t PV:1; // Parity/Overflow
-                        uint8_t H:1;  // Half Carry
-                        uint8_t Z:1;  // Zero
-                        uint8_t S:1;  // Sign
-                    } F;
-                };
-                uint16_t AF;
-            } ;
-        } general, shadow;
+    // The engine used by emulate()
+    Engine engine;
 
-        uint16_t SP;
-        uint16_t PC;
-    } reg;
+    // Decoded basic blocks, only allocated once the cached engine is used
+    std::unique_ptr<BlockCache> block_cache;
+
+    // Compiles hot blocks, only allocated once the native engine is used
+    std::unique_ptr<Jit> jit;
+
+    // Pages of memory where writes need more than storing, because they hold cached code or memory hooks are active
+    std::array<bool, 0x100> watched_pages;
+
+    // The snapshot memory was last restored from or captured to, and the pages written since. Null if there isn't one.
+    std::shared_ptr<const Snapshot> snapshot_base;
+    std::array<bool, 0x100> dirty_pages;
+
+    // Called on writes when emulating with memory hooks
+    memory_hook_t memory_hook;
+    bool memory_hook_active;
+
+    // The end of the loaded program, emulation stops if PC reaches here
+    size_t program_end;
+
+    // T-states counted when emulating with cycle counting
+    uint64_t cycles;
+
+    // The cycle count run_for_cycles() stops at
+    uint64_t cycle_deadline;
+
+    // When counting cycles, the engines stop once cycles reaches here. The deadline or the next timer tick.
+    uint64_t cycle_limit;
+
+    // Interrupt lines, and the data bus value for the maskable interrupt
+    bool irq_requested;
+    uint8_t irq_data;
+    bool nmi_requested;
+
+    // Set when an interrupt needs accepting, or an EI was just executed, before the next instruction, see update_interrupt_pending()
+    bool interrupt_pending;
+
+    // Set by EI until the instruction after it has run, which the engines stop for so that it runs before any interrupt
+    bool ei_delay;
+
+    // The interrupt timer, off if the period is 0
+    uint64_t timer_period;
+    uint8_t timer_data;
+    uint64_t next_timer;
+
+    // When stepping, the number of instructions left to run, and the address to stop at. No breakpoint if over 0xFFFF.
+    size_t instructions_left;
+    uint32_t breakpoint;
 
-    // Register lookup tables
-    std::array<uint8_t*, 8> reg_table_r;
-    std::array<uint16_t*, 4> reg_table_rp;
-    std::array<uint16_t*, 4> reg_table_rp2;
-    std::array<std::function<void(uint8_t)>, 8> alu_table;
-    std::array<std::array<std::function<void()>, 4>, 4> bli_table;
+    // T-states for taken conditions and block repeats in the current instruction, added to cycles after it
+    uint32_t extra_t_states;
 
+    // Receives records when emulating with binary traces
+    TraceWriter *trace_writer;
+
+    // Edge counters when emulating with coverage, the mask to index them with, and the previous PC >> 1
+    uint8_t *coverage_map;
+    size_t coverage_mask;
+    uint16_t coverage_prev;
+
+    // Records where time is spent when emulating with profiling
+    Profiler *profiler;
+
+    // Set when cached code is written to, so the block being executed stops
+    bool code_modified;
+
+    // Register name tables
     std::array<std::string, 8> reg_table_r_names;
     std::array<std::string, 4> reg_table_rp_names;
     std::array<std::string, 4> reg_table_rp2_names;
     std::array<std::string, 8> cc_table_names;
     std::array<std::string, 8> alu_table_names;
+    std::array<std::string, 8> rot_table_names;
     std::array<std::array<std::string, 4>, 4> bli_table_names;
 
     //ALU handlers
@@ -291,6 +1655,143 @@ private:
     void alu_or(uint8_t val);
     void alu_cp(uint8_t val);
 
+    /*!
+     * Runs alu[op] against the accumulator. The operation is resolved at
+     * compile time, so the handler is inlined into the caller.
+     *
+     * @tparam op The operation number in the alu table
+     * @param val The operand
+     */
+    template<uint8_t op>
+    inline void alu(uint8_t val)
+    {
+        static_assert(op < 8, "ALU operation out of range");
+        if constexpr(op == 0)
+            alu_add(val);
+        else if constexpr(op == 1)
+            alu_adc(val);
+        else if constexpr(op == 2)
+            alu_sub(val);
+        else if constexpr(op == 3)
+            alu_sbc(val);
+        else if constexpr(op == 4)
+            alu_and(val);
+        else if constexpr(op == 5)
+            alu_xor(val);
+        else if constexpr(op == 6)
+            alu_or(val);
+        else
+            alu_cp(val);
+    }
+
+    /*!
+     * Runs block instruction bli[a, b]. Resolved at compile time, like alu().
+     *
+     * @tparam a The row in the bli table (y - 4)
+     * @tparam b The column in the bli table (z)
+     */
+    template<uint8_t a, uint8_t b>
+    inline void bli()
+    {
+        static_assert(a < 4 && b < 4, "Block instruction out of range");
+        constexpr void (Emulator::*handlers[4][4])() = {{&Emulator::bli_ldi, &Emulator::bli_cpi, &Emulator::bli_ini, &Emulator::bli_outi},
+                                                        {&Emulator::bli_ldd, &Emulator::bli_cpd, &Emulator::bli_ind, &Emulator::bli_outd},
+                                                        {&Emulator::bli_ldir, &Emulator::bli_cpir, &Emulator::bli_inir, &Emulator::bli_otir},
+                                                        {&Emulator::bli_lddr, &Emulator::bli_cpdr, &Emulator::bli_indr, &Emulator::bli_otdr}};
+        (this->*handlers[a][b])();
+    }
+
+    /*!
+     * Copies a span of memory one byte at a time, as LDIR/LDDR would,
+     * but using bulk copies. Neither span may wrap around.
+     *
+     * @tparam step 1 to copy upwards, -1 to copy downwards
+     * @param src The first address to copy from
+     * @param dst The first address to copy to
+     * @param size The number of bytes to copy
+     */
+    template<int step>
+    void copy_span(uint16_t src, uint16_t dst, uint32_t size);
+
+    /*!
+     * Works out how many passes of a repeating block instruction to run
+     * in one go. It stops at the cycle limit, so a long LDIR can be
+     * interrupted as it could be on hardware.
+     *
+     * @param count The passes left
+     * @return The number of passes to run, at least 1
+     */
+    uint32_t repeat_passes(uint32_t count) const;
+
+    /*!
+     * Works out how many passes of a repeating block instruction which
+     * writes to memory to run in one go. As well as the cycle limit, it
+     * stops just after writing over the instruction's own opcode, so the
+     * new bytes are fetched on the next pass.
+     *
+     * @tparam step 1 if the instruction increments its destination, -1 if it decrements it
+     * @param count The passes left
+     * @param dst The next address written to
+     * @return The number of passes to run, at least 1
+     */
+    template<int step>
+    uint32_t repeat_passes(uint32_t count, uint16_t dst) const;
+
+    /*!
+     * Charges the T-states for the passes of a repeating block
+     * instruction. If it hasn't finished, PC is moved back to it,
+     * so it carries on as the next instruction.
+     *
+     * @param opcode The instruction's opcode, after the ED prefix
+     * @param passes The passes run
+     * @param finished If the instruction stopped repeating
+     */
+    void end_passes(uint8_t opcode, uint32_t passes, bool finished);
+
+    /*!
+     * Runs LDI/LDD, or LDIR/LDDR when repeating. A repeating copy
+     * is done in bulk, with the same result as copying byte by byte.
+     *
+     * @tparam step 1 to increment HL and DE, -1 to decrement them
+     * @tparam repeat If the instruction repeats until BC is 0
+     */
+    template<int step, bool repeat>
+    void block_copy();
+
+    /*!
+     * Runs CPI/CPD, or CPIR/CPDR when repeating. A repeating compare
+     * searches for A with memchr() rather than comparing byte by byte.
+     *
+     * @tparam step 1 to increment HL, -1 to decrement it
+     * @tparam repeat If the instruction repeats until BC is 0 or A is found
+     */
+    template<int step, bool repeat>
+    void block_compare();
+
+    /*!
+     * Runs INI/IND, or INIR/INDR when repeating. A repeating transfer
+     * reads every byte from the port handler in one call. The port is
+     * looked up from BC as the transfer starts, so B counting down on
+     * each pass doesn't move it to another port.
+     *
+     * @tparam step 1 to increment HL, -1 to decrement it
+     * @tparam repeat If the instruction repeats until B is 0
+     */
+    template<int step, bool repeat>
+    void block_in();
+
+    /*!
+     * Runs OUTI/OUTD, or OTIR/OTDR when repeating. A repeating transfer
+     * writes every byte to the port handler in one call. The port is
+     * looked up from BC as the transfer starts, so B counting down on
+     * each pass doesn't move it to another port.
+     *
+     * @tparam step 1 to increment HL, -1 to decrement it
+     * @tparam repeat If the instruction repeats until B is 0
+     */
+    template<int step, bool repeat>
+    void block_out();
+
     //BLI handlers
     void bli_ldi();
     void bli_cpi();
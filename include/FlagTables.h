@@ -0,0 +1,117 @@
+#ifndef Z80_DISASSEMBLER_FLAGTABLES_H
+#define Z80_DISASSEMBLER_FLAGTABLES_H
+
+
+#include <array>
+#include <cstdint>
+
+/*!
+ * Precomputed values of the F register for the ALU, INC/DEC and
+ * logical instructions, and the results and flags of the CB page's
+ * rotates, shifts and bit tests. Every table is generated at compile
+ * time and indexed by an 8bit value, so they stay resident in L1.
+ *
+ * The arithmetic instructions combine sz[] with the carry vector
+ * (A ^ operand ^ result) for H, V and C, which measured faster than
+ * full (A, operand, carry) tables as those miss the cache on real data.
+ *
+ * Entries are laid out in the same bit order as the F register.
+ */
+class FlagTables
+{
+public:
+    enum Flag : uint8_t
+    {
+        C = 0x01,  // Carry
+        N = 0x02,  // Subtract
+        PV = 0x04, // Parity/Overflow
+        X = 0x08,  // Undocumented, copy of bit 3 of the result
+        H = 0x10,  // Half Carry
+        Y = 0x20,  // Undocumented, copy of bit 5 of the result
+        Z = 0x40,  // Zero
+        S = 0x80,  // Sign
+    };
+
+    typedef std::array<uint8_t, 0x100> table_t;
+
+    // S, Z, Y and X of a result
+    static const table_t sz;
+
+    // S, Z, Y, X and parity of a result, as set by the logical instructions
+    static const table_t szp;
+
+    // Flags set by INC r, indexed by the result. C is left to the caller.
+    static const table_t inc;
+
+    // Flags set by DEC r, indexed by the result. C is left to the caller.
+    static const table_t dec;
+
+    // The result of a rotate or shift, and the flags it sets
+    struct Shifted
+    {
+        uint8_t result;
+        uint8_t flags;
+    };
+    typedef std::array<Shifted, 0x200> shift_table_t;
+
+    // RLC, RRC, RL, RR, SLA, SRA, SLL and SRL, in rot[y] order, indexed by (C << 8) | value.
+    // Only RL and RR shift the carry in, for the others both halves are the same.
+    static const std::array<shift_table_t, 8> shift;
+
+    // Flags set by BIT y, indexed by y and the value tested. C is left to the caller.
+    static const std::array<table_t, 8> bit;
+
+    /*!
+     * Gets the flags set by ADD/ADC
+     *
+     * @param a The accumulator before the operation
+     * @param val The operand, not including the carry
+     * @param sum The full 9bit result, including the carry
+     * @return The new value of F
+     */
+    static inline uint8_t add(uint8_t a, uint8_t val, uint16_t sum)
+    {
+        uint8_t result = sum & 0xFF;
+        return sz[result]
+               | ((a ^ val ^ result) & H) // If carry from bit 3
+               | (((~(a ^ val) & (a ^ result)) >> 5) & PV) // If overflow
+               | (sum >> 8); // If carry from bit 7
+    }
+
+    /*!
+     * Gets the flags set by SUB/SBC/CP
+     *
+     * @param a The accumulator before the operation
+     * @param val The operand, not including the carry
+     * @param diff The full result, including the carry, as a 16bit value
+     * @return The new value of F
+     */
+    static inline uint8_t sub(uint8_t a, uint8_t val, uint16_t diff)
+    {
+        uint8_t result = diff & 0xFF;
+        return sz[result]
+               | ((a ^ val ^ result) & H) // If borrow from bit 4
+               | ((((a ^ val) & (a ^ result)) >> 5) & PV) // If overflow
+               | ((diff >> 8) & C) // If borrow
+               | N;
+    }
+
+    /*!
+     * Gets the flags set by the block I/O instructions, INI/IND/OUTI/OUTD and their repeating forms
+     *
+     * @param b The B register, after it's been decremented
+     * @param val The last byte transferred
+     * @param k val plus C+1 or C-1 for input, or plus L for output
+     * @return The new value of F
+     */
+    static inline uint8_t block_io(uint8_t b, uint8_t val, uint16_t k)
+    {
+        return sz[b]
+               | ((val >> 6) & N) // Copy of bit 7 of the byte transferred
+               | (k > 0xFF ? H | C : 0)
+               | (szp[(k & 0x7) ^ b] & PV);
+    }
+};
+
+
+#endif //Z80_DISASSEMBLER_FLAGTABLES_H
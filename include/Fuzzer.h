@@ -0,0 +1,100 @@
+#ifndef Z80_DISASSEMBLER_FUZZER_H
+#define Z80_DISASSEMBLER_FUZZER_H
+
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Emulator.h"
+#include "Snapshot.h"
+
+/*!
+ * Runs one program over and over with different inputs, as a fuzzer
+ * does. The machine is snapshotted once, and each run restores it,
+ * which only copies back the pages the previous run wrote to. Edge
+ * coverage is recorded into a map owned by the caller, such as
+ * libFuzzer's extra counters.
+ *
+ * The input is returned by port reads in order, with reads past the
+ * end getting 0xFF. Anything written to a port is kept for the caller
+ * to check, until the next run.
+ */
+class Fuzzer
+{
+public:
+    enum Status
+    {
+        Finished = 0, // Ran past the end of the program
+        Halted = 1,   // Halted with interrupts disabled, so can't go any further
+        Stopped = 2,  // Still running when the budget ran out, or halted waiting for an interrupt
+    };
+
+    /*!
+     * Constructor, which loads the program to fuzz
+     *
+     * @param program The program to run
+     * @param instruction_budget The most instructions a run may execute
+     * @param engine The engine to run it with, the native engine runs as Cached as compiled code doesn't record coverage
+     */
+    Fuzzer(const std::vector<uint8_t> &program, size_t instruction_budget, Emulator::Engine engine = Emulator::Engine::Portable);
+
+    /*!
+     * Constructor, which starts every run from a snapshot, normally
+     * of a machine which has already booted
+     *
+     * @param start The state to start each run from
+     * @param instruction_budget The most instructions a run may execute
+     * @param engine The engine to run it with
+     */
+    Fuzzer(std::shared_ptr<const Snapshot> start, size_t instruction_budget, Emulator::Engine engine = Emulator::Engine::Portable);
+
+    /*!
+     * Sets the map edge coverage is recorded into, see Emulator::set_coverage_map()
+     *
+     * @param map The counters, or nullptr to not record coverage
+     * @param size The number of counters, a power of two
+     */
+    void set_coverage_map(uint8_t *map, size_t size);
+
+    /*!
+     * Runs the program once from the start state
+     *
+     * @param input The bytes returned by port reads
+     * @param size The size of input
+     * @return How the run ended
+     */
+    Status run(const uint8_t *input, size_t size);
+
+    /*!
+     * Gets the bytes written to ports during the last run
+     *
+     * @return The port output, in order
+     */
+    const std::vector<uint8_t> &get_output() const;
+
+    /*!
+     * Gets the emulator, to inspect the state the last run ended in
+     *
+     * @return The emulator
+     */
+    const Emulator &get_emulator() const;
+
+private:
+    /*!
+     * Port handler for every port
+     */
+    static void port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size);
+
+    Emulator emulator;
+    std::shared_ptr<const Snapshot> start;
+    size_t instruction_budget;
+
+    // The current run's input and how much of it has been read, and its output
+    const uint8_t *input;
+    size_t input_size;
+    size_t input_pos;
+    std::vector<uint8_t> output;
+};
+
+
+#endif //Z80_DISASSEMBLER_FUZZER_H
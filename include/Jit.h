@@ -0,0 +1,177 @@
+#ifndef Z80_DISASSEMBLER_JIT_H
+#define Z80_DISASSEMBLER_JIT_H
+
+
+#include <array>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "BlockCache.h"
+#include "Emulator.h"
+
+struct JitBlock;
+
+/*!
+ * A chainable exit from a compiled block. The exit jumps to a stub which
+ * returns to the dispatcher, until the block for its target has been
+ * compiled, at which point the jump is patched to go straight to it.
+ */
+struct JitExit
+{
+    uint8_t *jump;       // The rel32 of the jump to patch
+    uint8_t *stub;       // The stub which returns to the dispatcher
+    uint16_t target;     // The PC this exit is taken for
+    JitBlock *owner;     // The block the exit belongs to
+    JitBlock *linked;    // The block the exit is chained to, if any
+};
+
+/*!
+ * A basic block which has been translated to native code
+ */
+struct JitBlock
+{
+    BlockCache::Block *block; // The block this was compiled from, nullptr once discarded
+    uint8_t *entry;           // Called from the dispatcher, sets up the frame
+    uint8_t *body;            // Jumped to by chained exits, the frame is already set up
+    std::array<JitExit, 2> exits;
+    size_t exit_count;
+    std::vector<JitExit*> incoming; // Exits of other blocks which are chained to this one
+};
+
+/*!
+ * Translates hot basic blocks to x86-64 code.
+ *
+ * Register moves, 8/16bit loads, INC/DEC and the ALU instructions are
+ * translated directly, with the flags taken from the host's own flag
+ * register. Everything else, including anything which touches memory
+ * or ports, calls back into the instruction's interpreter handler.
+ *
+ * Code lives in a single mmap'd arena, which is thrown away as a whole
+ * once it fills up. The arena is executable but not writable, except
+ * for the pages being written while a block is copied in or an exit
+ * is patched.
+ */
+class Jit
+{
+public:
+    typedef void (*native_block_t)(Emulator *emu);
+
+    /*!
+     * Constructor
+     *
+     * @param emu The emulator to generate code for
+     */
+    explicit Jit(Emulator &emu);
+
+    /*!
+     * Destructor
+     */
+    ~Jit();
+
+    /*!
+     * Checks if the host supports the JIT, and the arena could be mapped
+     *
+     * @return True if blocks can be compiled
+     */
+    inline bool available() const
+    {
+        return arena != nullptr;
+    }
+
+    /*!
+     * Translates a block to native code
+     *
+     * @param block The block to compile
+     * @param end The address emulation stops at, chained exits at or past here aren't linked
+     * @param log_stream The stream to log to, or nullptr to not log
+     * @return The compiled block, or nullptr if it could not be compiled
+     */
+    JitBlock *compile(BlockCache::Block &block, size_t end, std::ostream *log_stream);
+
+    /*!
+     * Runs a compiled block, following chained exits until
+     * one isn't linked or the chain limit runs out.
+     *
+     * @param compiled The block to run
+     */
+    void run(JitBlock *compiled);
+
+    /*!
+     * Chains the exit taken by the last call to run(), if
+     * its target has been compiled since.
+     *
+     * @param target The block which PC is now at
+     */
+    void link_last_exit(JitBlock *target);
+
+    /*!
+     * Drops a compiled block, unlinking any exits chained to it.
+     * The code itself stays in the arena until the next flush().
+     *
+     * @param compiled The block to discard
+     */
+    void discard(JitBlock *compiled);
+
+    /*!
+     * Drops every compiled block and empties the arena.
+     * Must not be called while native code is running.
+     */
+    void flush();
+
+    // The number of times a block is interpreted before it's compiled
+    static constexpr uint32_t hot_threshold = 8;
+
+    // The number of chained exits which can be taken before returning to the dispatcher
+    static constexpr int32_t chain_limit = 1024;
+private:
+    /*!
+     * Emits native code for an instruction, if it's one which is translated directly
+     *
+     * @param code The buffer to emit into
+     * @param instr The instruction to translate
+     * @return True if code was emitted, false if the instruction needs its handler calling
+     */
+    bool emit_native(std::vector<uint8_t> &code, const Emulator::Instruction &instr);
+
+    /*!
+     * Patches an exit to jump to a given block
+     */
+    void patch(JitExit *exit, JitBlock *target);
+
+    /*!
+     * Patches an exit back to its dispatcher stub
+     */
+    void unpatch(JitExit *exit);
+
+    /*!
+     * Makes the pages holding part of the arena writable, or executable again
+     *
+     * @param start The first byte
+     * @param size The number of bytes
+     * @param writable True to make them writable, false to make them executable
+     */
+    void set_writable(uint8_t *start, size_t size, bool writable);
+
+    Emulator &emu;
+
+    // Offsets of the CPU registers from the start of the emulator, native code addresses them through rbx
+    std::array<int32_t, 8> r_offsets; // r[6] is (HL), which is never addressed directly
+    std::array<int32_t, 4> rp_offsets;
+    int32_t f_offset;
+    int32_t pc_offset;
+
+    // Executable memory
+    uint8_t *arena;
+    size_t arena_size;
+    size_t arena_used;
+
+    // Every block compiled since the last flush
+    std::vector<std::unique_ptr<JitBlock>> compiled_blocks;
+
+    // Written by native code
+    JitExit *last_exit;
+    int32_t chain_budget;
+};
+
+
+#endif //Z80_DISASSEMBLER_JIT_H
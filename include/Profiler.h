@@ -0,0 +1,235 @@
+#ifndef Z80_DISASSEMBLER_PROFILER_H
+#define Z80_DISASSEMBLER_PROFILER_H
+
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+#include "Emulator.h"
+
+/*!
+ * Records where a program spends its time, when emulating with a policy
+ * using profiling. Straight line code is counted a run at a time: the
+ * emulator only reports the instructions which don't carry on to the
+ * next one, or which take extra T-states, and the run of instructions
+ * up to each of them is decoded the first time it's seen and just
+ * counted after that. A shadow call stack follows CALL, RST, interrupts
+ * and the returns, charging each run to the call path it ran on.
+ *
+ * The costs of each address and opcode are worked out from the runs
+ * when a profile is written. Runs are told apart by where they start
+ * and end, so code which is rewritten as it runs has its costs listed
+ * under the instructions it had when its run was first seen.
+ *
+ * Functions are named by their entry address. Code run outside of any
+ * call is charged to the root, named 0x0000 as that's where load() starts programs.
+ * Addresses are listed under the function with the closest entry at or
+ * below them, as a profiler with a symbol table would.
+ */
+class Profiler
+{
+public:
+    /*!
+     * Constructor
+     */
+    Profiler();
+
+    /*!
+     * Clears everything recorded so far
+     */
+    void clear();
+
+    /*!
+     * Starts a run where emulation starts. Called by the emulator.
+     *
+     * @param pc The address execution starts from
+     */
+    inline void resume(uint16_t pc)
+    {
+        run_start = pc;
+    }
+
+    /*!
+     * Charges the run which was cut short by emulation stopping. Called by the emulator.
+     *
+     * @param emulator The emulator, which the run is decoded from if it's new
+     * @param pc The address execution stopped at
+     */
+    void pause(Emulator &emulator, uint16_t pc);
+
+    /*!
+     * Records an instruction which didn't carry on to the next one, or
+     * which took extra T-states, ending the run it was part of. Called by the emulator.
+     *
+     * @param emulator The emulator, which the run is decoded from if it's new
+     * @param instr The instruction which was executed
+     * @param extra_t_states The T-states it took on top of its base time, for conditions which passed and repeats
+     * @param next_pc PC after it executed, which tells if a conditional call or return was taken
+     */
+    void record(Emulator &emulator, const Emulator::Instruction &instr, uint32_t extra_t_states, uint16_t next_pc);
+
+    /*!
+     * Records an interrupt being accepted, which ends the run it
+     * interrupted and calls its handler. Called by the emulator.
+     *
+     * @param emulator The emulator, which the run is decoded from if it's new
+     * @param pc The address the interrupt was taken at
+     * @param handler The address of the handler
+     */
+    void interrupt(Emulator &emulator, uint16_t pc, uint16_t handler);
+
+    /*!
+     * Writes a callgrind profile, for KCachegrind and callgrind_annotate.
+     * Positions are instruction addresses, costs are instructions and T-states.
+     *
+     * @param stream The stream to write to
+     */
+    void write_callgrind(std::ostream &stream) const;
+
+    /*!
+     * Writes folded stacks, a line per call path with its T-states,
+     * as taken by flamegraph.pl and speedscope
+     *
+     * @param stream The stream to write to
+     */
+    void write_folded(std::ostream &stream) const;
+
+    /*!
+     * Writes a tab separated report of the hottest addresses, the
+     * opcode histogram and the T-states taken by each class of instruction
+     *
+     * @param stream The stream to write to
+     * @param hot_count The number of addresses to list
+     */
+    void write_report(std::ostream &stream, size_t hot_count = 32) const;
+
+private:
+    enum class Flow : uint8_t
+    {
+        Straight = 0, // Carries on to the next instruction, or jumps without touching the stack
+        Call = 1,     // CALL, CALL cc and RST
+        Return = 2,   // RET, RET cc, RETI and RETN
+    };
+
+    struct PcCost
+    {
+        uint64_t count;
+        uint64_t cycles;
+    };
+
+    // Instructions executed one after the other, ending with a jump, call, return or extra T-states
+    struct Run
+    {
+        uint32_t start;        // The address of the first instruction, or past the end of memory for the empty run
+        uint32_t first;        // Index of the first instruction in run_instructions
+        uint32_t size;         // The number of instructions
+        uint32_t cycles;       // The base T-states of all of them
+        uint64_t count;        // Times the run was executed
+        uint64_t extra_cycles; // T-states the last instruction took on top of its base time, over every execution
+    };
+
+    struct RunInstruction
+    {
+        uint16_t pc;
+        uint8_t prefix;
+        uint8_t opcode;
+        uint8_t t_states; // Base T-states
+    };
+
+    // A point in the call tree, one per distinct call path
+    struct Node
+    {
+        uint16_t function;  // The entry address
+        uint16_t call_site; // The address of the call which first reached this node
+        uint32_t parent;
+        uint64_t calls;
+        uint64_t instructions; // Self cost
+        uint64_t cycles;
+        uint32_t last_child;   // The child last called, which saves looking it up when a loop calls the same function over and over
+    };
+
+    // Calls deeper than this are charged to the deepest node, so runaway recursion can't grow the tree forever
+    static constexpr size_t max_depth = 256;
+
+    /*!
+     * Gets whether an opcode calls or returns, if it branches
+     */
+    static constexpr Flow flow(Emulator::Prefix prefix, uint8_t opcode)
+    {
+        if(prefix == Emulator::Prefix::ED)
+            return (opcode & 0xC7) == 0x45 ? Flow::Return : Flow::Straight; // RETN and RETI
+        if(prefix != Emulator::Prefix::None && prefix != Emulator::Prefix::DD && prefix != Emulator::Prefix::FD)
+            return Flow::Straight;
+        if((opcode & 0xC7) == 0xC0 || opcode == 0xC9) // RET cc and RET
+            return Flow::Return;
+        if((opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7 || opcode == 0xCD) // CALL cc, nn, RST and CALL nn
+            return Flow::Call;
+        return Flow::Straight;
+    }
+
+    /*!
+     * Moves down the call tree
+     *
+     * @param call_site The address of the call
+     * @param target The address called
+     */
+    void call(uint16_t call_site, uint16_t target);
+
+    /*!
+     * Moves back up the call tree
+     */
+    void ret();
+
+    /*!
+     * Counts the run from run_start up to an address, and charges it to the current node
+     *
+     * @param emulator The emulator, which the run is decoded from if it's new
+     * @param end The address after the last instruction of the run
+     * @return The run
+     */
+    Run &end_run(Emulator &emulator, uint16_t end);
+
+    /*!
+     * Looks up the run from run_start up to an address, decoding it if it hasn't been seen before
+     *
+     * @param emulator The emulator, to decode the run from
+     * @param end The address after the last instruction of the run
+     * @return The run
+     */
+    Run &find_run(Emulator &emulator, uint16_t end);
+
+    /*!
+     * Gets the costs of every address
+     */
+    void address_costs(std::vector<PcCost> &pcs) const;
+
+    /*!
+     * Gets the function every address is listed under
+     */
+    void address_functions(std::vector<uint16_t> &functions) const;
+
+    /*!
+     * Gets the inclusive costs of every node, self plus every node below it
+     */
+    void inclusive_costs(std::vector<uint64_t> &instructions, std::vector<uint64_t> &cycles) const;
+
+    // Every run seen, with the empty run first, and the instructions of each one after the other
+    std::vector<Run> runs;
+    std::vector<RunInstruction> run_instructions;
+    std::unordered_map<uint32_t, uint32_t> run_keys; // Runs keyed by (start << 16) | end
+    std::vector<uint32_t> run_ends;                  // The run last seen ending at each address, which is nearly always the only one
+    uint16_t run_start;
+
+    // The call tree, with node 0 as the root, and the children of each node keyed by (node << 16) | target
+    std::vector<Node> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;
+
+    // The shadow call stack, as nodes. current is the top.
+    std::vector<uint32_t> stack;
+    uint32_t current;
+    size_t overflow; // Calls made past max_depth which haven't returned
+};
+
+
+#endif //Z80_DISASSEMBLER_PROFILER_H
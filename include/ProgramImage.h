@@ -0,0 +1,173 @@
+#ifndef Z80_DISASSEMBLER_PROGRAMIMAGE_H
+#define Z80_DISASSEMBLER_PROGRAMIMAGE_H
+
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Emulator.h"
+
+/*!
+ * A program ready to be loaded by Emulator::load(), from a raw binary,
+ * Intel HEX, or a 48K ZX Spectrum snapshot. Files are mapped with mmap
+ * rather than read, and raw binaries and .sna snapshots are loaded
+ * straight out of the mapping, so there's no copy until the emulator's
+ * own. Images are immutable, so one can be shared by every emulator
+ * running it.
+ *
+ * A read only image is mapped into emulators as ROM, rather than copied,
+ * so every emulator reads the same pages, which the OS shares with the
+ * page cache. Emulators hold on to the image while any of it is mapped.
+ */
+class ProgramImage : public std::enable_shared_from_this<ProgramImage>
+{
+public:
+    enum class Format
+    {
+        Detect = 0,   // Chosen from the file extension, raw if it isn't one of the others
+        Raw = 1,      // Bytes loaded as they are, at the load address
+        IntelHex = 2, // Intel HEX records, .hex or .ihx, which give their own addresses
+        Sna = 3,      // A 48K ZX Spectrum snapshot, .sna
+        Z80 = 4,      // A 48K ZX Spectrum snapshot, .z80 version 1, 2 or 3
+    };
+
+    struct Options
+    {
+        Format format = Format::Detect;
+        uint16_t load_address = 0; // Where raw binaries are loaded, other formats say where they go
+        uint32_t entry = 0x10000;  // Where execution starts, 0x10000 for the image's own entry point, or the load address
+        uint32_t end = 0;          // Emulation stops if PC reaches this, 0 for just past the last byte loaded, or never for snapshots
+        bool read_only = false;    // Map the image as ROM, where its segments start on a page, rather than copying it into RAM
+    };
+
+    // A run of bytes to load. If address is on a page, data can be read
+    // up to the end of its last page, so it can be mapped as whole pages.
+    struct Segment
+    {
+        uint16_t address;
+        const uint8_t *data;
+        size_t size;
+    };
+
+    /*!
+     * Opens an image file, mapping it into memory
+     *
+     * @param path The file to open
+     * @param options How to load it
+     * @return The image, or nullptr if the file couldn't be read or isn't valid
+     */
+    static std::shared_ptr<const ProgramImage> open(const std::string &path, const Options &options);
+
+    /*!
+     * Opens an image file with the default options, choosing the format from its extension
+     *
+     * @param path The file to open
+     * @return The image, or nullptr if the file couldn't be read or isn't valid
+     */
+    static std::shared_ptr<const ProgramImage> open(const std::string &path);
+
+    /*!
+     * Parses an image which is already in memory. The data is copied, so it needn't be kept.
+     *
+     * @param data The image
+     * @param size The size of data
+     * @param options How to load it, with Detect taken as raw
+     * @return The image, or nullptr if it isn't valid
+     */
+    static std::shared_ptr<const ProgramImage> parse(const uint8_t *data, size_t size, const Options &options);
+
+    /*!
+     * Destructor, unmaps the file
+     */
+    ~ProgramImage();
+
+    ProgramImage(const ProgramImage &) = delete;
+    ProgramImage &operator=(const ProgramImage &) = delete;
+
+    /*!
+     * Gets what's loaded where, with no two segments overlapping
+     *
+     * @return The segments
+     */
+    const std::vector<Segment> &get_segments() const;
+
+    /*!
+     * Gets the address execution starts at
+     *
+     * @return The entry point
+     */
+    uint16_t get_entry() const;
+
+    /*!
+     * Gets the address emulation stops at if PC reaches it
+     *
+     * @return The end, 0x10000 if emulation never stops there
+     */
+    uint32_t get_end() const;
+
+    /*!
+     * Checks if the image is mapped as ROM rather than copied into RAM
+     *
+     * @return True if the image is read only
+     */
+    bool is_read_only() const;
+
+    /*!
+     * Checks if the image holds CPU state, as snapshots do
+     *
+     * @return True if get_registers() should be loaded
+     */
+    bool has_registers() const;
+
+    /*!
+     * Gets the CPU state a snapshot was taken in, with PC at the entry point
+     *
+     * @return The registers
+     */
+    const Emulator::Registers &get_registers() const;
+
+private:
+    ProgramImage();
+
+    /*!
+     * Fills in the image from a file's contents
+     *
+     * @param data The contents, which must stay put for the life of the image
+     * @param size The size of data
+     * @param options How to load it, with the format already chosen
+     * @return True if the contents are valid
+     */
+    bool load(const uint8_t *data, size_t size, const Options &options);
+
+    bool load_raw(const uint8_t *data, size_t size, uint16_t load_address);
+    bool load_intel_hex(const uint8_t *data, size_t size);
+    bool load_sna(const uint8_t *data, size_t size);
+    bool load_z80(const uint8_t *data, size_t size);
+
+    /*!
+     * Decompresses a block of a .z80 snapshot, where ED ED n b is b repeated n times
+     *
+     * @param data The compressed block
+     * @param size The size of data
+     * @param out Where to decompress to
+     * @param out_size The number of bytes the block must decompress to
+     * @return True if it decompressed to exactly out_size bytes
+     */
+    static bool decompress_z80(const uint8_t *data, size_t size, uint8_t *out, size_t out_size);
+
+    std::vector<Segment> segments;
+    uint16_t entry;
+    uint32_t end;
+    bool read_only;
+    bool registers_set;
+    Emulator::Registers registers;
+
+    // The file, while mapped, and either the copy made by parse() or anything which couldn't be loaded from where it was
+    uint8_t *mapping;
+    size_t mapping_size;
+    std::vector<uint8_t> buffer;
+};
+
+
+#endif //Z80_DISASSEMBLER_PROGRAMIMAGE_H
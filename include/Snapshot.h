@@ -0,0 +1,96 @@
+#ifndef Z80_DISASSEMBLER_SNAPSHOT_H
+#define Z80_DISASSEMBLER_SNAPSHOT_H
+
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "Emulator.h"
+
+/*!
+ * The full state of a machine, taken by Emulator::snapshot() and put
+ * back by Emulator::restore(). Restoring into a different Emulator
+ * forks the machine, so one booted machine can be fanned out to many.
+ *
+ * Memory is held as 256 byte pages which are never written once taken.
+ * A snapshot shares every page which hasn't been written since the
+ * snapshot the emulator was last restored from or took, and restoring
+ * the same snapshot again only copies back the pages written since.
+ *
+ * Snapshots are immutable, so they can be restored on many threads at once.
+ */
+class Snapshot
+{
+public:
+    static constexpr size_t page_size = 0x100;
+    static constexpr size_t page_count = 0x10000 / page_size;
+    typedef std::array<uint8_t, page_size> Page;
+
+    /*!
+     * Gets the CPU registers
+     *
+     * @return The registers
+     */
+    const Emulator::Registers &get_registers() const;
+
+    /*!
+     * Gets the number of T-states which had been counted
+     *
+     * @return The cycle count
+     */
+    uint64_t get_cycles() const;
+
+    /*!
+     * Reads a byte of memory
+     *
+     * @param addr The address to read
+     * @return The byte at addr
+     */
+    uint8_t read_memory(uint16_t addr) const;
+
+    /*!
+     * Counts the pages which are shared with another snapshot, rather than held separately
+     *
+     * @param other The snapshot to compare with
+     * @return The number of shared pages
+     */
+    size_t shared_pages(const Snapshot &other) const;
+
+private:
+    friend class Emulator;
+
+    // Memory, one page per 256 bytes
+    std::array<std::shared_ptr<const Page>, page_count> pages;
+
+    // Ports, as Emulator keeps them
+    std::array<Emulator::PortBinding, 0x100> low_ports;
+    std::vector<std::pair<uint16_t, Emulator::PortBinding>> high_ports;
+    Emulator::PortBinding default_port;
+    std::map<uint16_t, Emulator::port_handler_t> port_functions;
+    std::vector<std::shared_ptr<Emulator::BankSwitch>> bank_switches;
+
+    // The memory map, with no bank for pages of the emulator's own RAM. What's in the banks isn't captured.
+    std::array<Emulator::Bank, Emulator::memory_page_count> banks;
+    std::array<Emulator::MmioBinding, Emulator::memory_page_count> mmio_pages;
+    std::array<std::shared_ptr<const ProgramImage>, Emulator::memory_page_count> page_images;
+
+    // CPU and interrupt state
+    Emulator::Registers reg;
+    bool halted;
+    size_t program_end;
+    uint64_t cycles;
+    uint64_t cycle_deadline;
+    bool irq_requested;
+    uint8_t irq_data;
+    bool nmi_requested;
+    bool ei_delay;
+    uint64_t timer_period;
+    uint8_t timer_data;
+    uint64_t next_timer;
+};
+
+
+#endif //Z80_DISASSEMBLER_SNAPSHOT_H
@@ -0,0 +1,210 @@
+#ifndef Z80_DISASSEMBLER_TRACE_H
+#define Z80_DISASSEMBLER_TRACE_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+
+/*!
+ * One executed instruction in a binary trace. Records are written to
+ * trace files as is, so the layout must not change without bumping
+ * TraceHeader::current_version.
+ */
+struct TraceRecord
+{
+    uint16_t pc;        // The address the instruction was fetched from
+    uint8_t length;     // The number of valid bytes in bytes
+    uint8_t flags;      // has_registers if the registers below are valid
+    uint8_t bytes[4];   // The instruction bytes, including prefixes and operands
+
+    // Register state after the instruction executed
+    uint16_t AF;
+    uint16_t BC;
+    uint16_t DE;
+    uint16_t HL;
+    uint16_t SP;
+    uint16_t reserved;
+
+    static constexpr uint8_t has_registers = 0x01;
+};
+static_assert(sizeof(TraceRecord) == 20, "TraceRecord is written to files directly, and must stay packed");
+
+/*!
+ * The start of a trace file, followed by TraceRecords until the end of the file
+ */
+struct TraceHeader
+{
+    char magic[4];        // "Z80T"
+    uint16_t version;     // current_version
+    uint16_t record_size; // sizeof(TraceRecord)
+
+    static constexpr uint16_t current_version = 1;
+};
+static_assert(sizeof(TraceHeader) == 8, "TraceHeader is written to files directly, and must stay packed");
+
+/*!
+ * A lock free, single producer, single consumer ring of trace records.
+ * The emulator thread pushes, the writer thread pops.
+ */
+class TraceRing
+{
+public:
+    /*!
+     * Constructor
+     *
+     * @param capacity The number of records the ring can hold, must be a power of two
+     */
+    explicit TraceRing(size_t capacity);
+
+    /*!
+     * Claims the next free slot in the ring, so a record can be written
+     * straight into it rather than built elsewhere and copied. The record
+     * isn't visible to the consumer until commit() is called. Only called
+     * from the producer thread.
+     *
+     * @return The slot to write to, or nullptr if the ring is full
+     */
+    inline TraceRecord *try_claim()
+    {
+        size_t head = head_index.load(std::memory_order_relaxed);
+        if(head - cached_tail == capacity)
+        {
+            // Only go back to the shared index once the ring looks full
+            cached_tail = tail_index.load(std::memory_order_acquire);
+            if(head - cached_tail == capacity)
+                return nullptr;
+        }
+        return &records[head & mask];
+    }
+
+    /*!
+     * Publishes the record written to the slot returned by try_claim()
+     */
+    inline void commit()
+    {
+        head_index.store(head_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /*!
+     * Removes records from the ring. Only called from the consumer thread.
+     *
+     * @param out The array to copy records into
+     * @param max The maximum number of records to remove
+     * @return The number of records removed
+     */
+    size_t pop(TraceRecord *out, size_t max);
+
+    /*!
+     * Checks if the ring is empty. Only accurate from the consumer thread.
+     *
+     * @return True if there's nothing to pop
+     */
+    bool empty() const;
+private:
+    std::unique_ptr<TraceRecord[]> records;
+    size_t capacity;
+    size_t mask;
+
+    // Written by the producer, kept on separate cache lines to the consumer's index
+    alignas(64) std::atomic<size_t> head_index;
+    size_t cached_tail;
+
+    // Written by the consumer
+    alignas(64) std::atomic<size_t> tail_index;
+};
+
+/*!
+ * Writes a binary trace to a file from a background thread. The emulator
+ * only copies a record into a ring buffer per instruction, the file
+ * writes happen elsewhere.
+ */
+class TraceWriter
+{
+public:
+    /*!
+     * Constructor, opens the file and starts the writer thread
+     *
+     * @param path The file to write the trace to
+     * @param registers If register state should be recorded with every instruction
+     * @param capacity The number of records which can be buffered, must be a power of two
+     */
+    TraceWriter(const std::string &path, bool registers, size_t capacity = 0x10000);
+
+    /*!
+     * Destructor, writes any remaining records and closes the file
+     */
+    ~TraceWriter();
+
+    /*!
+     * Checks if the file was opened
+     *
+     * @return True if the trace is being written
+     */
+    bool is_open() const;
+
+    /*!
+     * Checks if register state should be recorded
+     *
+     * @return True if records should have registers filled in
+     */
+    inline bool records_registers() const
+    {
+        return registers;
+    }
+
+    /*!
+     * Gets the slot to write the next record into. Waits for the writer
+     * thread if the buffer is full, so no records are lost. The record
+     * is queued to be written by commit(). If there's no writer thread,
+     * as the file couldn't be opened or stop() was called, the record is
+     * dropped instead, as nothing would ever make room for it.
+     *
+     * @return The record to fill in
+     */
+    inline TraceRecord &claim()
+    {
+        if(!writing)
+            return discarded;
+        TraceRecord *record;
+        while(!(record = ring.try_claim()))
+            std::this_thread::yield();
+        return *record;
+    }
+
+    /*!
+     * Queues the record returned by claim() to be written
+     */
+    inline void commit()
+    {
+        if(writing)
+            ring.commit();
+    }
+
+    /*!
+     * Writes any remaining records and stops the writer thread.
+     * Nothing can be pushed afterwards.
+     */
+    void stop();
+private:
+    /*!
+     * The writer thread's main loop
+     */
+    void run();
+
+    TraceRing ring;
+    std::ofstream file;
+    bool registers;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    // If the writer thread is running, only used by the emulator thread
+    bool writing;
+    TraceRecord discarded;
+};
+
+
+#endif //Z80_DISASSEMBLER_TRACE_H
@@ -0,0 +1,392 @@
+#ifndef Z80_DISASSEMBLER_WIDEEMULATOR_H
+#define Z80_DISASSEMBLER_WIDEEMULATOR_H
+
+
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "Emulator.h"
+
+/*!
+ * Runs one program on many machines at once, for when only the inputs
+ * differ between runs. The registers of every machine ("lane") are kept
+ * as one array per register, so each instruction is decoded once and
+ * then applied to a whole group of lanes with SIMD (SSE2, or AVX2 when
+ * the compiler targets it).
+ *
+ * The lanes with the lowest PC run together, while the rest wait with
+ * their results masked out, so lanes which take different branches
+ * join back up once their paths meet. A lane is moved to its own scalar
+ * Emulator, and carries on there, if it executes an instruction which
+ * has no wide kernel (the prefixed pages, I/O, EI and the opcodes the
+ * scalar core treats as NOPs) or writes over the program. This keeps
+ * every lane's results identical to running it on an Emulator.
+ *
+ * Only instructions are counted, not T-states.
+ */
+class WideEmulator
+{
+public:
+    typedef void (*lane_port_callback_t)(void *context, size_t lane, Emulator::PortState state, uint8_t *data, uint16_t size);
+
+    /*!
+     * Constructor
+     *
+     * @param lanes The number of machines to run
+     * @param scalar_engine The engine used by lanes which are moved to a scalar Emulator
+     */
+    explicit WideEmulator(size_t lanes, Emulator::Engine scalar_engine = Emulator::Engine::Portable);
+
+    /*!
+     * Destructor
+     */
+    ~WideEmulator();
+
+    /*!
+     * Loads a program at address 0 of every lane, with the registers
+     * and the rest of memory cleared as by Emulator::reset()
+     *
+     * @param data The program to load
+     */
+    void load(const std::vector<uint8_t> &data);
+
+    /*!
+     * Continues running every lane for a number of instructions
+     *
+     * @param max_instructions The maximum number of instructions each lane executes
+     * @return The number of lanes which haven't finished
+     */
+    size_t run(size_t max_instructions = SIZE_MAX);
+
+    /*!
+     * Gets the number of lanes
+     *
+     * @return The number of lanes
+     */
+    size_t get_lane_count() const;
+
+    /*!
+     * Gets the number of lanes which have been moved to a scalar Emulator
+     *
+     * @return The number of scalar lanes
+     */
+    size_t get_scalar_lane_count() const;
+
+    /*!
+     * Checks if a lane has finished, as by Emulator::is_finished()
+     *
+     * @param lane The lane to check
+     * @return True if there's nothing left for the lane to run
+     */
+    bool is_finished(size_t lane) const;
+
+    /*!
+     * Gets the registers of a lane
+     *
+     * @param lane The lane
+     * @return The registers
+     */
+    Emulator::Registers get_registers(size_t lane) const;
+
+    /*!
+     * Sets the registers of a lane, normally to give it its inputs after load()
+     *
+     * @param lane The lane
+     * @param registers The new registers
+     */
+    void set_registers(size_t lane, const Emulator::Registers &registers);
+
+    /*!
+     * Reads a byte from the memory of a lane
+     *
+     * @param lane The lane
+     * @param addr The address to read
+     * @return The byte at addr
+     */
+    uint8_t read_memory(size_t lane, uint16_t addr) const;
+
+    /*!
+     * Writes to the memory of a lane, normally to give it its inputs after load().
+     * Writing over the program moves the lane to a scalar Emulator.
+     *
+     * @param lane The lane
+     * @param addr The address to write to
+     * @param data The bytes to write
+     * @param size The number of bytes to write
+     */
+    void write_memory(size_t lane, uint16_t addr, const uint8_t *data, size_t size);
+
+    /*!
+     * Sets the handler for port I/O. As I/O has no wide kernel, it's only
+     * ever called by lanes which have moved to a scalar Emulator. Reads
+     * give 0xFF and writes are ignored if no handler is set.
+     *
+     * @param callback The function to call, with the lane doing the I/O
+     * @param context Passed to callback
+     */
+    void set_port_handler(lane_port_callback_t callback, void *context);
+
+private:
+    enum LaneState : uint8_t
+    {
+        Running = 0,
+        Finished = 1,
+        Scalar = 2, // Moved to an Emulator
+    };
+
+    // The 8bit register arrays. B to A follow the numbering of the r table, with F in place of (HL).
+    enum Reg8
+    {
+        B = 0, C = 1, D = 2, E = 3, H = 4, L = 5, F = 6, A = 7,
+        ShadowB = 8, ShadowC = 9, ShadowD = 10, ShadowE = 11, ShadowH = 12, ShadowL = 13, ShadowF = 14, ShadowA = 15,
+        I = 16, IM = 17, IFF1 = 18, IFF2 = 19,
+        IXH = 20, IXL = 21, IYH = 22, IYL = 23, // Only carried for lanes moved to an Emulator, as the DD and FD prefixes have no kernels
+        Reg8Count = 24
+    };
+
+    // A lane which has been moved to an Emulator
+    struct ScalarLane
+    {
+        WideEmulator *owner;
+        size_t lane;
+        Emulator emulator;
+
+        ScalarLane(WideEmulator *owner, size_t lane, Emulator::Engine engine);
+    };
+
+    typedef void (WideEmulator::*handler_t)(uint16_t operand);
+
+    struct Opcode
+    {
+        handler_t handler; // Applies the opcode to every active lane
+        uint8_t length;    // Instruction length, including the opcode
+    };
+    typedef std::array<Opcode, 0x100> opcode_table_t;
+
+    /*!
+     * Picks the lanes to run the next instruction on, the running lanes
+     * with the lowest PC, and marks them in active[]
+     *
+     * @return False if no lanes are left to run
+     */
+    bool select_lanes();
+
+    /*!
+     * Stops treating every running lane as active. While they're all at
+     * the same PC, it's tracked in pc alone and the instructions they've
+     * run are counted in uniform_steps, this writes both back per lane.
+     */
+    void leave_uniform();
+
+    /*!
+     * Moves a lane to a scalar Emulator, which it carries on running on
+     *
+     * @param lane The lane to move
+     */
+    void move_to_scalar(size_t lane);
+
+    /*!
+     * Moves every active lane to a scalar Emulator, before the current
+     * instruction executes. Used for opcodes without a wide kernel.
+     */
+    void move_active_to_scalar(uint16_t operand);
+
+    /*!
+     * Executes a single opcode on every active lane. There's one
+     * instantiation per opcode, with the x/y/z/p/q fields resolved at compile time.
+     *
+     * @tparam opcode The opcode byte
+     * @param operand The immediate operand, if it has one
+     */
+    template<uint8_t opcode>
+    void execute(uint16_t operand);
+
+    /*!
+     * Gets the length of a main page opcode, including any operand
+     */
+    static constexpr uint8_t length(uint8_t opcode);
+
+    /*!
+     * Checks if an opcode has a wide kernel
+     */
+    static constexpr bool has_kernel(uint8_t opcode);
+
+    /*!
+     * Builds the opcode table
+     */
+    template<size_t... opcodes>
+    static constexpr opcode_table_t make_opcode_table(std::index_sequence<opcodes...>);
+
+    static const opcode_table_t opcode_table;
+
+    /*!
+     * Calls a kernel for each group of lanes which has an active lane in it
+     *
+     * @param kernel Called with the index of the first lane in the group, and the group's active mask
+     */
+    template<typename Kernel>
+    inline void each_group(Kernel kernel);
+
+    /*!
+     * Calls a function for each active lane
+     *
+     * @param function Called with the lane index
+     */
+    template<typename Function>
+    inline void each_active(Function function);
+
+    /*!
+     * Gets the values of r[reg_no] for every lane. (HL) is gathered
+     * from memory into scratch.
+     *
+     * @tparam reg_no The register number in the r table
+     * @return One value per lane
+     */
+    template<uint8_t reg_no>
+    const uint8_t *read_r();
+
+    /*!
+     * Gets the array a result for r[reg_no] should be written to, scratch for (HL)
+     */
+    template<uint8_t reg_no>
+    uint8_t *r_target();
+
+    /*!
+     * Finishes writing a result to r[reg_no], scattering scratch to memory for (HL)
+     */
+    template<uint8_t reg_no>
+    void commit_r();
+
+    /*!
+     * Applies alu[op] to A of every active lane
+     *
+     * @param values The operand for each lane, or nullptr to use value
+     * @param value The operand for every lane
+     */
+    template<uint8_t op>
+    void alu(const uint8_t *values, uint8_t value);
+
+    /*!
+     * Evaluates cc[cc_no] for every active lane into scratch
+     */
+    template<uint8_t cc_no>
+    void condition();
+
+    enum Taken
+    {
+        NoneTaken = 0,
+        SomeTaken = 1,
+        AllTaken = 2,
+    };
+
+    /*!
+     * Checks which of the active lanes have scratch set, after condition()
+     */
+    Taken taken_lanes();
+
+    /*!
+     * Sends the active lanes with scratch set to a target, and the rest on to the next instruction
+     *
+     * @param target The address to jump to
+     */
+    void jump_where_taken(uint16_t target);
+
+    /*!
+     * Like jump_where_taken(), but pushes the return address in the lanes which jump
+     *
+     * @param target The address to call
+     */
+    void call_where_taken(uint16_t target);
+
+    /*!
+     * Swaps two registers in every active lane
+     */
+    void swap_registers(Reg8 a, Reg8 b);
+
+    /*!
+     * Sets a register pair to the same value in every active lane
+     */
+    void set_pair(Reg8 high, Reg8 low, uint16_t value);
+
+    /*!
+     * Increments or decrements a register pair in every active lane
+     *
+     * @tparam decrement True to decrement
+     */
+    template<bool decrement>
+    void step_pair(Reg8 high, Reg8 low);
+
+    inline uint16_t pair(size_t lane, Reg8 high, Reg8 low) const
+    {
+        return (reg8(high)[lane] << 8) | reg8(low)[lane];
+    }
+
+    /*!
+     * Writes to the memory of a lane, noting if it wrote over the program
+     */
+    inline void store(size_t lane, uint16_t addr, uint8_t val)
+    {
+        memory[(lane << 16) | addr] = val;
+        if(addr < program_end)
+        {
+            code_written[lane] = 1;
+            any_code_written = true;
+        }
+    }
+
+    inline uint8_t fetch(size_t lane, uint16_t addr) const
+    {
+        return memory[(lane << 16) | addr];
+    }
+
+    void push(size_t lane, uint16_t val);
+    uint16_t pop(size_t lane);
+
+    inline uint8_t *reg8(Reg8 r)
+    {
+        return &registers8[r * padded_lanes];
+    }
+
+    inline const uint8_t *reg8(Reg8 r) const
+    {
+        return &registers8[r * padded_lanes];
+    }
+
+    /*!
+     * Port handler for lanes moved to an Emulator, forwards to the lane port handler
+     */
+    static void scalar_port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size);
+
+    size_t lanes;        // Lanes asked for
+    size_t padded_lanes; // Rounded up to a whole number of SIMD groups, the extras stay Finished
+    Emulator::Engine scalar_engine;
+
+    std::vector<uint8_t> registers8; // Reg8Count arrays of padded_lanes
+    std::vector<uint16_t> sp;
+    std::vector<uint16_t> pc_lanes;
+    std::vector<uint8_t> memory;     // 64 KB per lane
+
+    std::vector<uint8_t> state;        // LaneState per lane
+    std::vector<uint8_t> active;       // 0xFF for lanes executing the current instruction, otherwise 0
+    std::vector<uint8_t> scratch;      // Per lane operands and conditions for the current instruction
+    std::vector<uint8_t> code_written; // Lanes which wrote over the program during the current instruction
+    std::vector<uint64_t> remaining;   // Instructions each lane may still run in this call to run()
+    std::vector<std::unique_ptr<ScalarLane>> scalar_lanes;
+
+    size_t program_end;
+    uint16_t pc;             // The PC of the active lanes
+    uint16_t next_pc;        // The PC the active lanes move to, unless the instruction sets them itself
+    bool branched;           // If the instruction wrote pc_lanes itself
+    size_t leader;           // An active lane, whose memory the instruction is decoded from
+    bool uniform;            // If every running lane is active, see leave_uniform()
+    uint64_t uniform_steps;  // Instructions run since becoming uniform
+    uint64_t uniform_budget; // The most instructions which can run before a lane runs out
+    bool any_code_written;
+
+    lane_port_callback_t port_callback;
+    void *port_context;
+};
+
+
+#endif //Z80_DISASSEMBLER_WIDEEMULATOR_H
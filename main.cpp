@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstdlib>
 #include "Emulator.h"
+#include "ProgramImage.h"
+#include "Trace.h"
+#include "Profiler.h"
 
-void io_handler(Emulator::PortState state, uint8_t *data, uint16_t size)
+void io_handler(void *, Emulator::PortState state, uint8_t *data, uint16_t size)
 {
     if(state == Emulator::PortState::Write)
     {
@@ -12,26 +17,77 @@ void io_handler(Emulator::PortState state, uint8_t *data, uint16_t size)
     }
     else
     {
-        // std::cin.read((char*)data, size);
-        std::cin >> data;
+        // Block transfers ask for up to 256 bytes at once, into a buffer no bigger, and past the end of input reads as an open bus
+        std::cin.read((char*)data, size);
+        std::fill(data + std::cin.gcount(), data + size, 0xFF);
     }
 }
 
-int main()
+// Usage: [--trace <file> | --profile <prefix>] [--load <address>] [--entry <address>] [--rom] [program, out.bin by default]
+// The program's format is chosen by its extension: .hex or .ihx for Intel HEX, .sna or .z80 for snapshots, otherwise raw
+int main(int argc, char **argv)
 {
-    std::ifstream input("out.bin", std::ios::in | std::ios::binary);
-    input.seekg(0, input.end);
-    auto file_size = input.tellg();
-    input.seekg(0, input.beg);
-    std::vector<uint8_t> file_data(file_size, '\0');
-    input.read(reinterpret_cast<char *>(&file_data[0]), file_size);
-
+    std::string path = "out.bin";
+    std::string trace_path;
+    std::string profile_prefix;
+    ProgramImage::Options options;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "--trace" && i + 1 < argc) // Binary trace, which Z80_TraceDump turns back into text
+            trace_path = argv[++i];
+        else if(arg == "--profile" && i + 1 < argc) // Writes <prefix>.callgrind and <prefix>.folded, and a report to stdout
+            profile_prefix = argv[++i];
+        else if(arg == "--load" && i + 1 < argc)
+            options.load_address = (uint16_t)strtoul(argv[++i], nullptr, 0);
+        else if(arg == "--entry" && i + 1 < argc)
+            options.entry = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        else if(arg == "--rom")
+            options.read_only = true;
+        else
+            path = arg;
+    }
 
-    std::stringstream log_stream;
+    std::shared_ptr<const ProgramImage> image = ProgramImage::open(path, options);
+    if(!image)
+    {
+        std::cerr << "Couldn't load " << path << std::endl;
+        return 1;
+    }
 
     Emulator emulator;
-    emulator.bind_port(0, io_handler);
-    emulator.emulate(file_data, log_stream);
+    emulator.bind_port(0, io_handler, nullptr);
+
+    if(!trace_path.empty())
+    {
+        TraceWriter trace(trace_path, true);
+        if(!trace.is_open())
+        {
+            std::cerr << "Couldn't open " << trace_path << std::endl;
+            return 1;
+        }
+        emulator.set_trace_writer(&trace);
+        emulator.emulate<Emulator::BinaryTraced>(*image);
+        return 0;
+    }
+
+    if(!profile_prefix.empty())
+    {
+        Profiler profiler;
+        emulator.set_profiler(&profiler);
+        emulator.emulate<Emulator::Profiled>(*image);
+
+        std::ofstream callgrind(profile_prefix + ".callgrind", std::ios::out | std::ios::trunc);
+        profiler.write_callgrind(callgrind);
+        std::ofstream folded(profile_prefix + ".folded", std::ios::out | std::ios::trunc);
+        profiler.write_folded(folded);
+        std::cout << "\n--- Profile --- \n";
+        profiler.write_report(std::cout);
+        return 0;
+    }
+
+    std::stringstream log_stream;
+    emulator.emulate(*image, log_stream);
     std::cout << "\n--- Decoded Input --- \n" << log_stream.str() << std::endl;
     return 0;
-}
\ No newline at end of file
+}
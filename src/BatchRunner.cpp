@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <thread>
+#include "BatchRunner.h"
+
+BatchRunner::BatchRunner(unsigned int thread_count, Emulator::Engine engine)
+{
+    if(thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    emulators.reserve(thread_count);
+    for(unsigned int i = 0; i < thread_count; ++i)
+        emulators.emplace_back(new Emulator(engine));
+    queues.reset(new WorkQueue[thread_count]);
+}
+
+BatchRunner::~BatchRunner() = default;
+
+size_t BatchRunner::get_thread_count() const
+{
+    return emulators.size();
+}
+
+std::vector<BatchRunner::Result> BatchRunner::run(const std::vector<Job> &jobs)
+{
+    std::vector<Result> results(jobs.size());
+    size_t thread_count = emulators.size();
+
+    //Give each worker a contiguous run of jobs, the stealing evens out any imbalance
+    for(size_t i = 0; i < thread_count; ++i)
+    {
+        size_t first = jobs.size() * i / thread_count;
+        size_t last = jobs.size() * (i + 1) / thread_count;
+        for(size_t index = first; index < last; ++index)
+            queues[i].jobs.push_back(index);
+    }
+
+    //The calling thread does a share of the work too
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < thread_count; ++i)
+        threads.emplace_back(&BatchRunner::work, this, i, std::cref(jobs), std::ref(results));
+    work(0, jobs, results);
+    for(std::thread &thread : threads)
+        thread.join();
+
+    return results;
+}
+
+void BatchRunner::work(size_t worker, const std::vector<Job> &jobs, std::vector<Result> &results)
+{
+    Emulator &emulator = *emulators[worker];
+    size_t index;
+    while(take_job(worker, index))
+        run_job(emulator, jobs[index], results[index]);
+}
+
+bool BatchRunner::take_job(size_t worker, size_t &index)
+{
+    {
+        WorkQueue &own = queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if(!own.jobs.empty())
+        {
+            index = own.jobs.front();
+            own.jobs.pop_front();
+            return true;
+        }
+    }
+
+    //Nothing is ever added once the run starts, so finding every queue empty means we're done
+    size_t thread_count = emulators.size();
+    for(size_t i = 1; i < thread_count; ++i)
+    {
+        WorkQueue &victim = queues[(worker + i) % thread_count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.jobs.empty())
+        {
+            index = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void BatchRunner::run_job(Emulator &emulator, const Job &job, Result &result)
+{
+    JobIO io = {&job, 0, &result.output};
+    if(job.start)
+    {
+        emulator.restore(job.start);
+    }
+    else
+    {
+        //The previous job may have left ROM mapped
+        emulator.reset();
+        emulator.unmap_memory(0, Emulator::memory_page_count);
+        if(job.image)
+            emulator.load(*job.image);
+        else
+            emulator.load(job.program);
+    }
+    emulator.set_default_port_handler(&BatchRunner::job_port, &io);
+
+    uint64_t start_cycles = emulator.get_cycles();
+    if(job.limit == Limit::Cycles)
+        emulator.run_for_cycles<Emulator::Timed>(job.budget);
+    else
+        emulator.run<Emulator::Timed>(job.budget);
+
+    //Don't leave the emulator pointing at io once it's gone
+    emulator.set_default_port_handler(nullptr, nullptr);
+
+    result.status = emulator.is_finished() ? Status::Finished : Status::Stopped;
+    result.registers = emulator.get_registers();
+    result.cycles = emulator.get_cycles() - start_cycles;
+}
+
+void BatchRunner::job_port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size)
+{
+    JobIO &io = *static_cast<JobIO *>(context);
+    if(state == Emulator::PortState::Write)
+    {
+        io.output->insert(io.output->end(), data, data + size);
+        return;
+    }
+
+    const std::vector<uint8_t> &input = io.job->input;
+    size_t available = std::min<size_t>(size, input.size() - io.input_pos);
+    memcpy(data, input.data() + io.input_pos, available);
+    memset(data + available, 0xFF, size - available);
+    io.input_pos += available;
+}
+
+void BatchRunner::write_report(const std::vector<Job> &jobs, const std::vector<Result> &results, std::ostream &stream)
+{
+    static const char *status_names[] = {"finished", "stopped"};
+
+    stream << "name\tstatus\tcycles\tAF\tBC\tDE\tHL\tSP\tPC\toutput\n";
+    std::ios::fmtflags flags = stream.flags();
+    char fill = stream.fill();
+    for(size_t i = 0; i < jobs.size(); ++i)
+    {
+        const Result &result = results[i];
+        const Emulator::Registers &reg = result.registers;
+        stream << jobs[i].name << '\t' << status_names[result.status] << '\t' << std::dec << result.cycles
+               << std::hex << std::uppercase << std::setfill('0')
+               << '\t' << std::setw(4) << reg.general.AF << '\t' << std::setw(4) << reg.general.BC
+               << '\t' << std::setw(4) << reg.general.DE << '\t' << std::setw(4) << reg.general.HL
+               << '\t' << std::setw(4) << reg.SP << '\t' << std::setw(4) << reg.PC << '\t';
+        for(uint8_t byte : result.output)
+            stream << std::setw(2) << (unsigned int)byte;
+        stream << '\n';
+    }
+    stream.flags(flags);
+    stream.fill(fill);
+}
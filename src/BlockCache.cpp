@@ -0,0 +1,103 @@
+#include <algorithm>
+#include "BlockCache.h"
+
+BlockCache::BlockCache()
+: blocks(0x10000)
+{
+
+}
+
+BlockCache::Block *BlockCache::insert(std::unique_ptr<Block> block, std::array<bool, page_count> &watched_pages)
+{
+    uint16_t start = block->start;
+    if(blocks[start])
+    {
+        unlink(*blocks[start]);
+        retire(std::move(blocks[start]));
+    }
+
+    //Register the block against every page it covers, which may wrap around the end of memory
+    uint8_t first_page = start / page_size;
+    uint8_t last_page = (uint16_t)(start + block->size - 1) / page_size;
+    for(uint8_t page = first_page;; ++page)
+    {
+        page_blocks[page].emplace_back(start);
+        watched_pages[page] = true;
+        if(page == last_page)
+            break;
+    }
+    blocks[start] = std::move(block);
+    return blocks[start].get();
+}
+
+bool BlockCache::invalidate_page(uint8_t page)
+{
+    //Take the page's list first, as unlinking the blocks edits the lists of every page they cover
+    std::vector<uint16_t> starts;
+    starts.swap(page_blocks[page]);
+
+    bool dropped = false;
+    for(uint16_t start : starts)
+    {
+        if(blocks[start])
+        {
+            unlink(*blocks[start]);
+            retire(std::move(blocks[start]));
+            dropped = true;
+        }
+    }
+    return dropped;
+}
+
+void BlockCache::clear()
+{
+    //Every cached block is listed against the pages it covers, so only those entries need visiting.
+    //This keeps clearing a lightly used cache cheap, as happens when an emulator is reused for many short programs.
+    for(auto &starts : page_blocks)
+    {
+        for(uint16_t start : starts)
+        {
+            if(blocks[start])
+            {
+                if(retire_hook)
+                    retire_hook(*blocks[start]);
+                blocks[start] = nullptr;
+            }
+        }
+        starts.clear();
+    }
+    retired.clear();
+}
+
+void BlockCache::set_retire_hook(retire_hook_t hook)
+{
+    retire_hook = std::move(hook);
+}
+
+void BlockCache::unlink(const Block &block)
+{
+    uint8_t first_page = block.start / page_size;
+    uint8_t last_page = (uint16_t)(block.start + block.size - 1) / page_size;
+    for(uint8_t page = first_page;; ++page)
+    {
+        std::vector<uint16_t> &starts = page_blocks[page];
+        starts.erase(std::remove(starts.begin(), starts.end(), block.start), starts.end());
+        if(page == last_page)
+            break;
+    }
+}
+
+void BlockCache::retire(std::unique_ptr<Block> block)
+{
+    if(retire_hook)
+        retire_hook(*block);
+    retired.emplace_back(std::move(block));
+}
+
+size_t BlockCache::page_entries() const
+{
+    size_t entries = 0;
+    for(const auto &starts : page_blocks)
+        entries += starts.size();
+    return entries;
+}
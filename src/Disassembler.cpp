@@ -0,0 +1,498 @@
+#include <algorithm>
+#include <cstring>
+#include "Disassembler.h"
+
+namespace
+{
+    const char *const r_names[8] = {"B", "C", "D", "E", "H", "L", "(HL)", "A"};
+    const char *const rp_names[4] = {"BC", "DE", "HL", "SP"};
+    const char *const rp2_names[4] = {"BC", "DE", "HL", "AF"};
+    const char *const cc_names[8] = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
+    const char *const alu_names[8] = {"ADD", "ADC", "SUB", "SBC", "AND", "XOR", "OR", "CP"};
+    const char *const rot_names[8] = {"RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"};
+    const char *const im_names[8] = {"0", "0/1", "1", "2", "0", "0/1", "1", "2"};
+    const char *const x0_z7_names[8] = {"RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF"};
+    const char *const bli_names[4][4] = {{"LDI", "CPI", "INI", "OUTI"},
+                                         {"LDD", "CPD", "IND", "OUTD"},
+                                         {"LDIR", "CPIR", "INIR", "OTIR"},
+                                         {"LDDR", "CPDR", "INDR", "OTDR"}};
+
+    /*!
+     * Builds an operand string in place, without allocating
+     */
+    class OperandWriter
+    {
+    public:
+        explicit OperandWriter(char (&out)[20])
+        : out(out), length(0)
+        {
+            out[0] = '\0';
+        }
+
+        OperandWriter &text(const char *str)
+        {
+            while(*str && length < sizeof(out) - 1)
+                out[length++] = *str++;
+            out[length] = '\0';
+            return *this;
+        }
+
+        OperandWriter &hex(uint16_t val, int digits)
+        {
+            static const char hex_digits[] = "0123456789ABCDEF";
+            char str[7] = {'0', 'x'};
+            for(int i = 0; i < digits; ++i)
+                str[2 + i] = hex_digits[(val >> ((digits - 1 - i) * 4)) & 0xF];
+            str[2 + digits] = '\0';
+            return text(str);
+        }
+
+        OperandWriter &n(uint8_t val)
+        {
+            return hex(val, 2);
+        }
+
+        OperandWriter &nn(uint16_t val)
+        {
+            return hex(val, 4);
+        }
+
+        OperandWriter &digit(uint8_t val)
+        {
+            const char str[2] = {(char)('0' + val), '\0'};
+            return text(str);
+        }
+
+        OperandWriter &sep()
+        {
+            return text(", ");
+        }
+    private:
+        char (&out)[20];
+        size_t length;
+    };
+
+    /*!
+     * Decodes one instruction from a zero padded copy of its bytes.
+     * The DD/FD prefixes swap HL for an index register.
+     */
+    class Decoder
+    {
+    public:
+        Decoder(const uint8_t *bytes, Disassembler::Instruction &instr)
+        : bytes(bytes), instr(instr), ops(instr.operands), pos(0), index(nullptr), uses_memory(false)
+        {
+
+        }
+
+        /*!
+         * Decodes the instruction
+         *
+         * @return The length of the instruction
+         */
+        uint8_t decode()
+        {
+            uint8_t prefix = bytes[0];
+            if(prefix == 0xDD || prefix == 0xFD)
+            {
+                uint8_t next = bytes[1];
+                if(next == 0xDD || next == 0xED || next == 0xFD) // The prefix does nothing, the next one takes over
+                {
+                    instr.mnemonic = "NONI";
+                    return 1;
+                }
+                index = prefix == 0xDD ? "IX" : "IY";
+                pos = 1;
+                if(next == 0xCB)
+                {
+                    decode_index_cb();
+                    return 4;
+                }
+            }
+            else if(prefix == 0xCB)
+            {
+                pos = 1;
+                decode_cb(fetch());
+                return pos;
+            }
+            else if(prefix == 0xED)
+            {
+                pos = 1;
+                decode_ed(fetch());
+                return pos;
+            }
+
+            decode_main(fetch());
+            return pos;
+        }
+    private:
+        uint8_t fetch()
+        {
+            return bytes[pos++];
+        }
+
+        uint16_t fetch16()
+        {
+            uint16_t val = bytes[pos] | (bytes[pos + 1] << 8);
+            pos += 2;
+            return val;
+        }
+
+        // Writes (IX+d), reading the displacement
+        void indexed_operand(int8_t d)
+        {
+            ops.text("(").text(index).text(d < 0 ? "-" : "+").n(d < 0 ? -d : d).text(")");
+        }
+
+        // Writes r[reg_no], taking the index prefix into account
+        void r(uint8_t reg_no)
+        {
+            if(index && reg_no == 6)
+                indexed_operand(fetch());
+            else if(index && !uses_memory && reg_no == 4)
+                ops.text(index).text("H");
+            else if(index && !uses_memory && reg_no == 5)
+                ops.text(index).text("L");
+            else
+                ops.text(r_names[reg_no]);
+        }
+
+        // Writes rp[reg_no] or rp2[reg_no], taking the index prefix into account
+        void rp(uint8_t reg_no, const char *const *names = rp_names)
+        {
+            ops.text(index && reg_no == 2 ? index : names[reg_no]);
+        }
+
+        const char *hl()
+        {
+            return index ? index : "HL";
+        }
+
+        void relative()
+        {
+            int8_t d = fetch();
+            ops.nn(instr.address + pos + d);
+        }
+
+        void decode_main(uint8_t opcode)
+        {
+            uint8_t x = (opcode >> 6) & 0x3;
+            uint8_t y = (opcode >> 3) & 0x7;
+            uint8_t z = opcode & 0x7;
+            uint8_t p = (y >> 1) & 0x3;
+            uint8_t q = y & 0x1;
+
+            if(x == 0)
+            {
+                switch(z)
+                {
+                    case 0:
+                        if(y == 0)
+                            instr.mnemonic = "NOP";
+                        else if(y == 1)
+                            instr.mnemonic = "EX", ops.text("AF, AF'");
+                        else if(y == 2)
+                            instr.mnemonic = "DJNZ", relative();
+                        else if(y == 3)
+                            instr.mnemonic = "JR", relative();
+                        else
+                            instr.mnemonic = "JR", ops.text(cc_names[y - 4]).sep(), relative();
+                        break;
+                    case 1:
+                        if(q == 0)
+                            instr.mnemonic = "LD", rp(p), ops.sep().nn(fetch16());
+                        else
+                            instr.mnemonic = "ADD", ops.text(hl()).sep(), rp(p);
+                        break;
+                    case 2:
+                    {
+                        const char *pointers[4] = {"(BC)", "(DE)", nullptr, nullptr};
+                        instr.mnemonic = "LD";
+                        if(q == 0 && p < 2)
+                            ops.text(pointers[p]).text(", A");
+                        else if(q == 0)
+                            ops.text("(").nn(fetch16()).text("), ").text(p == 2 ? hl() : "A");
+                        else if(p < 2)
+                            ops.text("A, ").text(pointers[p]);
+                        else
+                            ops.text(p == 2 ? hl() : "A").text(", (").nn(fetch16()).text(")");
+                        break;
+                    }
+                    case 3:
+                        instr.mnemonic = q == 0 ? "INC" : "DEC", rp(p);
+                        break;
+                    case 4:
+                    case 5:
+                        uses_memory = y == 6;
+                        instr.mnemonic = z == 4 ? "INC" : "DEC", r(y);
+                        break;
+                    case 6:
+                        uses_memory = y == 6;
+                        instr.mnemonic = "LD", r(y), ops.sep().n(fetch());
+                        break;
+                    default:
+                        instr.mnemonic = x0_z7_names[y];
+                        break;
+                }
+            }
+            else if(x == 1)
+            {
+                if(y == 6 && z == 6)
+                {
+                    instr.mnemonic = "HALT";
+                }
+                else
+                {
+                    uses_memory = y == 6 || z == 6;
+                    instr.mnemonic = "LD", r(y), ops.sep(), r(z);
+                }
+            }
+            else if(x == 2)
+            {
+                uses_memory = z == 6;
+                alu(y), r(z);
+            }
+            else
+            {
+                switch(z)
+                {
+                    case 0:
+                        instr.mnemonic = "RET", ops.text(cc_names[y]);
+                        break;
+                    case 1:
+                        if(q == 0)
+                            instr.mnemonic = "POP", rp(p, rp2_names);
+                        else if(p == 0)
+                            instr.mnemonic = "RET";
+                        else if(p == 1)
+                            instr.mnemonic = "EXX";
+                        else if(p == 2)
+                            instr.mnemonic = "JP", ops.text("(").text(hl()).text(")");
+                        else
+                            instr.mnemonic = "LD", ops.text("SP, ").text(hl());
+                        break;
+                    case 2:
+                        instr.mnemonic = "JP", ops.text(cc_names[y]).sep().nn(fetch16());
+                        break;
+                    case 3:
+                        switch(y)
+                        {
+                            case 0:
+                                instr.mnemonic = "JP", ops.nn(fetch16());
+                                break;
+                            case 2:
+                                instr.mnemonic = "OUT", ops.text("(").n(fetch()).text("), A");
+                                break;
+                            case 3:
+                                instr.mnemonic = "IN", ops.text("A, (").n(fetch()).text(")");
+                                break;
+                            case 4:
+                                instr.mnemonic = "EX", ops.text("(SP), ").text(hl());
+                                break;
+                            case 5:
+                                instr.mnemonic = "EX", ops.text("DE, HL");
+                                break;
+                            case 6:
+                                instr.mnemonic = "DI";
+                                break;
+                            case 7:
+                                instr.mnemonic = "EI";
+                                break;
+                            default: // CB, handled by decode()
+                                break;
+                        }
+                        break;
+                    case 4:
+                        instr.mnemonic = "CALL", ops.text(cc_names[y]).sep().nn(fetch16());
+                        break;
+                    case 5:
+                        if(q == 0)
+                            instr.mnemonic = "PUSH", rp(p, rp2_names);
+                        else
+                            instr.mnemonic = "CALL", ops.nn(fetch16()); // The other prefixes are handled by decode()
+                        break;
+                    case 6:
+                        alu(y), ops.n(fetch());
+                        break;
+                    default:
+                        instr.mnemonic = "RST", ops.n(y * 8);
+                        break;
+                }
+            }
+        }
+
+        // Sets the mnemonic for alu[op], and the accumulator operand for the ops which name it
+        void alu(uint8_t op)
+        {
+            instr.mnemonic = alu_names[op];
+            if(op == 0 || op == 1 || op == 3)
+                ops.text("A, ");
+        }
+
+        void decode_cb(uint8_t opcode)
+        {
+            uint8_t x = (opcode >> 6) & 0x3;
+            uint8_t y = (opcode >> 3) & 0x7;
+            uint8_t z = opcode & 0x7;
+
+            if(x == 0)
+            {
+                instr.mnemonic = rot_names[y];
+            }
+            else
+            {
+                const char *bit_names[4] = {nullptr, "BIT", "RES", "SET"};
+                instr.mnemonic = bit_names[x];
+                ops.digit(y).sep();
+            }
+            r(z);
+        }
+
+        // DD CB d opcode and FD CB d opcode
+        void decode_index_cb()
+        {
+            int8_t d = bytes[2];
+            uint8_t opcode = bytes[3];
+            uint8_t x = (opcode >> 6) & 0x3;
+            uint8_t y = (opcode >> 3) & 0x7;
+            uint8_t z = opcode & 0x7;
+
+            if(x == 0)
+            {
+                instr.mnemonic = rot_names[y];
+            }
+            else
+            {
+                const char *bit_names[4] = {nullptr, "BIT", "RES", "SET"};
+                instr.mnemonic = bit_names[x];
+                ops.digit(y).sep();
+            }
+            indexed_operand(d);
+            if(x != 1 && z != 6) // Undocumented, the result is also copied to a register
+                ops.sep().text(r_names[z]);
+        }
+
+        void decode_ed(uint8_t opcode)
+        {
+            uint8_t x = (opcode >> 6) & 0x3;
+            uint8_t y = (opcode >> 3) & 0x7;
+            uint8_t z = opcode & 0x7;
+            uint8_t p = (y >> 1) & 0x3;
+            uint8_t q = y & 0x1;
+
+            instr.mnemonic = "NONI";
+            if(x == 1)
+            {
+                switch(z)
+                {
+                    case 0:
+                        instr.mnemonic = "IN";
+                        if(y != 6)
+                            ops.text(r_names[y]).sep();
+                        ops.text("(C)");
+                        break;
+                    case 1:
+                        instr.mnemonic = "OUT", ops.text("(C), ").text(y == 6 ? "0" : r_names[y]);
+                        break;
+                    case 2:
+                        instr.mnemonic = q == 0 ? "SBC" : "ADC", ops.text("HL, ").text(rp_names[p]);
+                        break;
+                    case 3:
+                        if(q == 0)
+                            instr.mnemonic = "LD", ops.text("(").nn(fetch16()).text("), ").text(rp_names[p]);
+                        else
+                            instr.mnemonic = "LD", ops.text(rp_names[p]).text(", (").nn(fetch16()).text(")");
+                        break;
+                    case 4:
+                        instr.mnemonic = "NEG";
+                        break;
+                    case 5:
+                        instr.mnemonic = y == 1 ? "RETI" : "RETN";
+                        break;
+                    case 6:
+                        instr.mnemonic = "IM", ops.text(im_names[y]);
+                        break;
+                    default:
+                    {
+                        const char *names[8] = {"LD", "LD", "LD", "LD", "RRD", "RLD", "NOP", "NOP"};
+                        const char *operands[8] = {"I, A", "R, A", "A, I", "A, R", "", "", "", ""};
+                        instr.mnemonic = names[y], ops.text(operands[y]);
+                        break;
+                    }
+                }
+            }
+            else if(x == 2 && z <= 3 && y >= 4)
+            {
+                instr.mnemonic = bli_names[y - 4][z];
+            }
+        }
+
+        const uint8_t *bytes;
+        Disassembler::Instruction &instr;
+        OperandWriter ops;
+        uint8_t pos;
+        const char *index;  // "IX" or "IY" when prefixed, otherwise nullptr
+        bool uses_memory;   // When (IX+d) is used, H and L aren't replaced
+    };
+}
+
+Disassembler::Instruction Disassembler::decode(const uint8_t *data, size_t size, uint16_t address)
+{
+    // Decode from a padded copy, so the decoder doesn't need to check for running off the end
+    uint8_t bytes[4] = {};
+    memcpy(bytes, data, std::min(size, sizeof(bytes)));
+
+    Instruction instr;
+    instr.address = address;
+    instr.length = Decoder(bytes, instr).decode();
+
+    if(instr.length > size) // Truncated, just show the first byte
+    {
+        instr.length = 1;
+        instr.mnemonic = "DB";
+        OperandWriter(instr.operands).n(bytes[0]);
+    }
+    memcpy(instr.bytes, bytes, sizeof(bytes));
+    return instr;
+}
+
+void Disassembler::disassemble(const uint8_t *data, size_t size, uint16_t origin, std::vector<Instruction> &instructions)
+{
+    size_t offset = 0;
+    while(offset < size)
+    {
+        instructions.emplace_back(decode(data + offset, size - offset, (uint16_t)(origin + offset)));
+        offset += instructions.back().length;
+    }
+}
+
+void Disassembler::format(const Instruction &instr, std::string &out)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+    char line[64];
+    size_t length = 0;
+
+    // Address
+    for(int shift = 12; shift >= 0; shift -= 4)
+        line[length++] = hex_digits[(instr.address >> shift) & 0xF];
+    line[length++] = ' ';
+    line[length++] = ' ';
+
+    // Bytes, padded to the longest instruction
+    for(uint8_t i = 0; i < 4; ++i)
+    {
+        line[length++] = i < instr.length ? hex_digits[instr.bytes[i] >> 4] : ' ';
+        line[length++] = i < instr.length ? hex_digits[instr.bytes[i] & 0xF] : ' ';
+        line[length++] = ' ';
+    }
+    line[length++] = ' ';
+
+    out.append(line, length);
+    out.append(instr.mnemonic);
+    if(instr.operands[0])
+    {
+        out.push_back(' ');
+        out.append(instr.operands);
+    }
+    out.push_back('\n');
+}
@@ -2,6 +2,7 @@
 // Created by fred on 11/05/18.
 //
 
+#include <algorithm>
 #include <iostream>
 #include <array>
 #include <memory>
@@ -11,734 +12,2381 @@
 #include <Emulator.h>
 
 #include "Emulator.h"
-
-Emulator::Emulator()
+#include "BlockCache.h"
+#include "Jit.h"
+#include "Profiler.h"
+#include "ProgramImage.h"
+#include "Snapshot.h"
+#include "Trace.h"
+
+Emulator::Emulator(Engine engine)
+: read_pages(), write_pages(), mmio_pages(), low_ports(), default_port{&Emulator::open_bus, nullptr}, engine(engine), watched_pages(), timer_period(0), timer_data(0xFF), trace_writer(nullptr),
+  coverage_map(nullptr), coverage_mask(0), coverage_prev(0), profiler(nullptr)
 {
+    //Setup name tables, these never change so they're kept out of reset()
+    reg_table_r_names = {"B", "C", "D", "E", "H", "L", "(HL)", "A"};
+    reg_table_rp_names = {"BC", "DE", "HL", "SP"};
+    reg_table_rp2_names = {"BC", "DE", "HL", "AF"};
+    cc_table_names = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
+    alu_table_names = {"ADD A,", "ADC A,", "SUB", "SBC A,", "AND", "XOR", "OR", "CP"};
+    rot_table_names = {"RLC", "RRC", "RL", "RR", "SLA", "SRA", "SLL", "SRL"};
+    bli_table_names = {{{"LDI", "CPI", "INI", "OUTI"},
+                        {"LDD", "CPD", "IND", "OUTD"},
+                        {"LDIR", "CPIR", "INIR", "OTIR"},
+                        {"LDDR", "CPDR", "INDR", "OTDR"}}};
+
+    unmap_memory(0, memory_page_count);
     reset();
 }
 
+Emulator::~Emulator() = default;
+
+void Emulator::bind_port(uint16_t port_no, port_callback_t callback, void *context)
+{
+    if(port_no < low_ports.size())
+    {
+        low_ports[port_no] = {callback, context};
+        return;
+    }
+
+    auto it = std::lower_bound(high_ports.begin(), high_ports.end(), port_no,
+                               [](const std::pair<uint16_t, PortBinding> &entry, uint16_t port) { return entry.first < port; });
+    if(it != high_ports.end() && it->first == port_no)
+    {
+        if(callback)
+            it->second = {callback, context};
+        else
+            high_ports.erase(it);
+    }
+    else if(callback)
+    {
+        high_ports.insert(it, {port_no, {callback, context}});
+    }
+}
+
 void Emulator::bind_port(uint16_t port_no, Emulator::port_handler_t handler)
 {
-    ports[port_no] = std::move(handler);
+    if(!handler)
+    {
+        bind_port(port_no, nullptr, nullptr);
+        port_functions.erase(port_no);
+        return;
+    }
+
+    port_handler_t &function = port_functions[port_no];
+    function = std::move(handler);
+    bind_port(port_no, &Emulator::call_port_function, &function);
+}
+
+void Emulator::set_default_port_handler(port_callback_t callback, void *context)
+{
+    default_port = callback ? PortBinding{callback, context} : PortBinding{&Emulator::open_bus, nullptr};
+}
+
+const Emulator::PortBinding &Emulator::find_high_port(uint16_t port) const
+{
+    auto it = std::lower_bound(high_ports.begin(), high_ports.end(), port,
+                               [](const std::pair<uint16_t, PortBinding> &entry, uint16_t port) { return entry.first < port; });
+    if(it != high_ports.end() && it->first == port)
+        return it->second;
+    const PortBinding &binding = low_ports[port & 0xFF];
+    return binding.callback ? binding : default_port;
+}
+
+void Emulator::open_bus(void *, PortState state, uint8_t *data, uint16_t size)
+{
+    if(state == PortState::Read)
+        memset(data, 0xFF, size);
+}
+
+void Emulator::call_port_function(void *context, PortState state, uint8_t *data, uint16_t size)
+{
+    (*static_cast<port_handler_t *>(context))(state, data, size);
 }
 
-Emulator::Prefix Emulator::to_prefix(uint8_t val)
+void Emulator::switch_bank(void *context, PortState state, uint8_t *data, uint16_t size)
 {
-    switch(val)
+    if(state == PortState::Read)
     {
-        case 0xCB:
-            return CB;
-        case 0xDD:
-            return DD;
-        case 0xED:
-            return ED;
-        case 0xFD:
-            return FD;
-        default:
-            return None;
+        memset(data, 0xFF, size);
+        return;
     }
-    abort();
+
+    //Only the last write of a block transfer matters
+    BankSwitch *bank_switch = static_cast<BankSwitch *>(context);
+    const Bank &bank = bank_switch->banks[data[size - 1] % bank_switch->banks.size()];
+    bank_switch->emulator->map_memory(bank_switch->first_page, bank_switch->page_count, bank);
 }
 
+void Emulator::map_memory(uint8_t first_page, uint8_t page_count, const Bank &bank)
+{
+    map_pages(first_page, page_count, bank.read, bank.write ? bank.write : write_sink, {nullptr, nullptr});
+}
 
-void Emulator::alu_add(uint8_t val)
+void Emulator::map_mmio(uint8_t first_page, uint8_t page_count, const Bank &bank, mmio_callback_t callback, void *context)
 {
-    uint8_t result = reg.general.A + val;
+    map_pages(first_page, page_count, bank.read, bank.write ? bank.write : write_sink, {callback, context});
+}
 
-    reg.general.F.S = result >> 7; // If result is negative, set S
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.PV = ((reg.general.A >> 7) == (val >> 7) && (val >> 7) != reg.general.F.S); // If overflow
-    reg.general.F.H = (((reg.general.A & 0xF) + val) & 0x10) == 0x10; // If carry from bit 3
-    reg.general.F.C = (((uint16_t)reg.general.A) + ((uint16_t)val)) > 0xFF; // If carry from bit 7
-    reg.general.F.N = 0;
+void Emulator::unmap_memory(uint8_t first_page, uint8_t page_count)
+{
+    map_pages(first_page, page_count, memory + first_page * memory_page_size, memory + first_page * memory_page_size, {nullptr, nullptr});
+}
 
-    reg.general.A = result;
+void Emulator::bind_bank_switch(uint16_t port_no, uint8_t first_page, uint8_t page_count, std::vector<Bank> banks)
+{
+    bank_switches.push_back(std::make_shared<BankSwitch>(BankSwitch{this, first_page, page_count, std::move(banks)}));
+    bind_port(port_no, &Emulator::switch_bank, bank_switches.back().get());
 }
 
-void Emulator::alu_adc(uint8_t val)
+void Emulator::map_pages(uint8_t first_page, uint8_t page_count, const uint8_t *read, uint8_t *write, const MmioBinding &mmio)
 {
-    uint8_t result = reg.general.A + val + reg.general.F.C;
+    for(size_t i = 0; i < page_count && first_page + i < memory_page_count; ++i)
+    {
+        size_t page = first_page + i;
+        const uint8_t *page_read = read + i * memory_page_size;
+        uint8_t *page_write = write == write_sink ? write_sink : write + i * memory_page_size;
+        if(read_pages[page] == page_read && write_pages[page] == page_write && mmio_pages[page].callback == mmio.callback
+           && mmio_pages[page].context == mmio.context)
+            continue; // Switching to the bank which is already mapped is common, and shouldn't throw away cached code
+
+        read_pages[page] = page_read;
+        write_pages[page] = page_write;
+        mmio_pages[page] = mmio;
+        page_images[page].reset();
+
+        //Code decoded from the page is no longer what's there
+        for(size_t block_page = page * (memory_page_size >> 8); block_page < (page + 1) * (memory_page_size >> 8); ++block_page)
+        {
+            if(block_cache && block_cache->invalidate_page(block_page))
+                code_modified = true;
+        }
+    }
+    watch_mmio_pages();
 
-    reg.general.F.S = result >> 7; // If result is negative, set S
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.PV = ((reg.general.A >> 7) == (val >> 7) && (val >> 7) != reg.general.F.S); // If overflow
-    reg.general.F.H = (((reg.general.A & 0xF) + val) & 0x10) == 0x10; // If carry from bit 3
-    reg.general.F.C = (((uint16_t)reg.general.A) + ((uint16_t)val) + (uint16_t)reg.general.F.C) > 0xFF; // If carry from bit 7
-    reg.general.F.N = 0;
+    flat_memory = true;
+    for(size_t page = 0; page < memory_page_count; ++page)
+        flat_memory &= read_pages[page] == memory + page * memory_page_size && write_pages[page] == memory + page * memory_page_size;
+}
 
-    reg.general.A = result;
+void Emulator::set_engine(Engine engine_)
+{
+    engine = engine_;
 }
 
-void Emulator::alu_sub(uint8_t val)
+void Emulator::set_memory_hook(memory_hook_t hook)
 {
-    uint8_t result = reg.general.A - val;
+    memory_hook = std::move(hook);
+}
 
-    reg.general.F.S = result >> 7; // If result is negative
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = ((reg.general.A & 0xF) < (val & 0xF)); // If borrow from bit 4
-    reg.general.F.PV = ((reg.general.A >> 7) == (val >> 7) && (val >> 7) != reg.general.F.S); // If overflow
-    reg.general.F.N = 1;
-    reg.general.F.C = std::abs(reg.general.A) + std::abs(val) > 0xFF; // If borrow
+uint64_t Emulator::get_cycles() const
+{
+    return cycles;
+}
 
-    reg.general.A = result;
+bool Emulator::is_finished() const
+{
+    return halted ? !reg.IFF1 && !nmi_requested : reg.PC >= program_end;
 }
 
-void Emulator::alu_sbc(uint8_t val)
+bool Emulator::is_halted() const
 {
-    uint8_t result = reg.general.A - val - reg.general.C;
+    return halted;
+}
 
-    reg.general.F.S = result >> 7; // If result is negative
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = (reg.general.A & 0xF) < (val & 0xF) + reg.general.C; // If borrow from bit 4
-    reg.general.F.PV = ((reg.general.A >> 7) == (val >> 7) && (val >> 7) != reg.general.F.S); // If overflow
-    reg.general.F.N = 1;
-    reg.general.F.C = std::abs(reg.general.A) + std::abs(val) + reg.general.C > 0xFF; // If borrow
+void Emulator::interrupt(uint8_t data)
+{
+    irq_requested = true;
+    irq_data = data;
+    update_interrupt_pending();
+}
 
-    reg.general.A = result;
+void Emulator::clear_interrupt()
+{
+    irq_requested = false;
+    update_interrupt_pending();
 }
-void Emulator::alu_and(uint8_t val)
+
+void Emulator::nmi()
 {
-    uint8_t result = reg.general.A & val;
+    nmi_requested = true;
+    update_interrupt_pending();
+}
 
-    reg.general.F.S = result >> 7; // If result is negative, set S
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = 1;
-    reg.general.F.PV = parity(result); // If parity
-    reg.general.F.N = 0;
-    reg.general.F.C = 0;
+void Emulator::set_interrupt_timer(uint64_t period, uint8_t data)
+{
+    timer_period = period;
+    timer_data = data;
+    next_timer = cycles + period;
+}
 
-    reg.general.A = result;
+void Emulator::update_timer()
+{
+    if(timer_period && cycles >= next_timer)
+    {
+        // Ticks which were missed, for instance while interrupts were disabled, are dropped
+        next_timer += timer_period * ((cycles - next_timer) / timer_period + 1);
+        interrupt(timer_data);
+    }
+    cycle_limit = timer_period ? std::min(cycle_deadline, next_timer) : cycle_deadline;
 }
 
-void Emulator::alu_xor(uint8_t val)
+bool Emulator::skip_halt()
 {
-    uint8_t result = reg.general.A ^ val;
+    // Only the timer can end a HALT while emulation is running, anything else comes from the host between calls
+    if(!reg.IFF1 || !timer_period || cycles >= cycle_deadline)
+        return false;
+
+    // HALT runs NOPs, so time moves on in 4 T-state steps
+    uint64_t target = std::min(next_timer, cycle_deadline);
+    cycles += (target - cycles + 3) / 4 * 4;
+    return true;
+}
+
+template<typename ExecutionPolicy>
+void Emulator::accept_interrupt(std::ostream *log_stream)
+{
+    if(nmi_requested)
+    {
+        nmi_requested = false;
+        reg.IFF2 = reg.IFF1;
+        reg.IFF1 = false;
+        halted = false;
+        if constexpr(ExecutionPolicy::profile)
+        {
+            if(profiler)
+                profiler->interrupt(*this, reg.PC, 0x66);
+        }
+        push(reg.PC);
+        reg.PC = 0x66;
+        if constexpr(ExecutionPolicy::count_cycles)
+            cycles += 11;
+        update_interrupt_pending();
+        return;
+    }
+
+    // Interrupts are enabled once the instruction after EI has finished, so it runs first if it's part of the program.
+    // Any interrupt is taken on the next call, once the loop has checked its limits.
+    if(ei_delay)
+    {
+        ei_delay = false;
+        if(reg.PC < program_end)
+        {
+            Instruction instr;
+            decode(reg.PC, instr);
+            reg.PC += instr.length;
+            (this->*instr.handler)(instr);
+            after_instruction<ExecutionPolicy>(instr, log_stream);
+        }
+        update_interrupt_pending();
+        return;
+    }
 
-    reg.general.F.S = result >> 7; // If result is negative, set S
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = 0;
-    reg.general.F.PV = parity(result); // If parity
-    reg.general.F.N = 0;
-    reg.general.F.C = 0;
+    irq_requested = false;
+    reg.IFF1 = reg.IFF2 = false;
+    halted = false;
+    uint16_t return_pc = reg.PC;
+    push(reg.PC);
+    uint8_t t_states;
+    if(reg.IM == 2)
+    {
+        uint16_t vector = (reg.I << 8) | irq_data;
+        reg.PC = read_memory(vector) | (read_memory(vector + 1) << 8);
+        t_states = 19;
+    }
+    else if(reg.IM == 1)
+    {
+        reg.PC = 0x38;
+        t_states = 13;
+    }
+    else // Only RST instructions are supported on the data bus in IM 0, which is what hardware puts there
+    {
+        reg.PC = irq_data & 0x38;
+        t_states = 13;
+    }
+    if constexpr(ExecutionPolicy::count_cycles)
+        cycles += t_states;
+    if constexpr(ExecutionPolicy::profile)
+    {
+        if(profiler)
+            profiler->interrupt(*this, return_pc, reg.PC);
+    }
+    update_interrupt_pending();
+}
 
-    reg.general.A = result;
+const Emulator::Registers &Emulator::get_registers() const
+{
+    return reg;
 }
 
-void Emulator::alu_or(uint8_t val)
+void Emulator::set_registers(const Registers &registers)
 {
-    uint8_t result = reg.general.A | val;
+    reg = registers;
+    pending_flags.op = FlagOp::None;
+    update_interrupt_pending();
+}
 
-    reg.general.F.S = result >> 7; // If result is negative, set S
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = 0;
-    reg.general.F.PV = parity(result); // If parity
-    reg.general.F.N = 0;
-    reg.general.F.C = 0;
+const uint8_t *Emulator::get_memory() const
+{
+    return memory;
+}
 
-    reg.general.A = result;
+void Emulator::set_trace_writer(TraceWriter *writer)
+{
+    trace_writer = writer;
 }
 
-void Emulator::alu_cp(uint8_t val)
+void Emulator::set_coverage_map(uint8_t *map, size_t size)
 {
-    uint8_t result = reg.general.A - val;
+    coverage_map = map;
+    coverage_mask = map ? size - 1 : 0;
+    coverage_prev = 0;
+}
 
-    reg.general.F.S = result >> 7; // If result is negative
-    reg.general.F.Z = result == 0; // If result is 0
-    reg.general.F.H = ((reg.general.A & 0xF) < (val & 0xF)); // If borrow from bit 4
-    reg.general.F.PV = ((reg.general.A >> 7) == (val >> 7) && (val >> 7) != reg.general.F.S); // If overflow
-    reg.general.F.N = 1;
-    reg.general.F.C = std::abs(reg.general.A) + std::abs(val) > 0xFF; // If borrow
+void Emulator::set_profiler(Profiler *profiler_)
+{
+    profiler = profiler_;
 }
 
-void Emulator::bli_ldi()
+void Emulator::log_trace_record(const TraceRecord &record, std::ostream &log_stream)
 {
+    for(uint8_t i = 0; i < record.length; ++i)
+    {
+        memory[(uint16_t)(record.pc + i)] = record.bytes[i];
+        dirty_pages[(uint16_t)(record.pc + i) >> 8] = true;
+    }
 
+    Instruction instr;
+    decode(record.pc, instr);
+    log_instruction(instr, log_stream);
 }
 
-void Emulator::bli_cpi()
+void Emulator::alu_add(uint8_t val)
 {
+    uint16_t sum = reg.general.A + val;
+    set_pending_flags(FlagOp::Add, reg.general.A, val, sum);
+    reg.general.A = sum;
+}
 
+void Emulator::alu_adc(uint8_t val)
+{
+    uint16_t sum = reg.general.A + val + carry();
+    set_pending_flags(FlagOp::Add, reg.general.A, val, sum);
+    reg.general.A = sum;
 }
 
-void Emulator::bli_ini()
+void Emulator::alu_sub(uint8_t val)
 {
+    uint16_t diff = reg.general.A - val;
+    set_pending_flags(FlagOp::Sub, reg.general.A, val, diff);
+    reg.general.A = diff;
+}
 
+void Emulator::alu_sbc(uint8_t val)
+{
+    uint16_t diff = reg.general.A - val - carry();
+    set_pending_flags(FlagOp::Sub, reg.general.A, val, diff);
+    reg.general.A = diff;
 }
 
-void Emulator::bli_outi()
+void Emulator::alu_and(uint8_t val)
 {
+    reg.general.A &= val;
+    set_flags(FlagTables::szp[reg.general.A] | FlagTables::H);
+}
 
+void Emulator::alu_xor(uint8_t val)
+{
+    reg.general.A ^= val;
+    set_flags(FlagTables::szp[reg.general.A]);
 }
 
-void Emulator::bli_ldd()
+void Emulator::alu_or(uint8_t val)
 {
+    reg.general.A |= val;
+    set_flags(FlagTables::szp[reg.general.A]);
+}
 
+void Emulator::alu_cp(uint8_t val)
+{
+    set_pending_flags(FlagOp::Cp, reg.general.A, val, (uint16_t)(reg.general.A - val));
 }
 
-void Emulator::bli_cpd()
+namespace
+{
+    /*!
+     * Finds the last occurrence of a byte, the reverse of memchr()
+     */
+    inline const uint8_t *find_last(const uint8_t *data, uint8_t val, size_t size)
+    {
+#if defined(__GLIBC__)
+        return static_cast<const uint8_t *>(memrchr(data, val, size));
+#else
+        while(size--)
+        {
+            if(data[size] == val)
+                return data + size;
+        }
+        return nullptr;
+#endif
+    }
+}
+
+template<int step>
+void Emulator::copy_span(uint16_t src, uint16_t dst, uint32_t size)
 {
+    // The lowest addresses of each span, neither wraps
+    uint16_t src_low = step > 0 ? src : src - size + 1;
+    uint16_t dst_low = step > 0 ? dst : dst - size + 1;
+
+    // Anything written to a watched page, or anywhere when other memory is mapped in, needs write_memory(), so go byte by byte
+    for(uint32_t page = dst_low >> 8; page <= (uint32_t)(dst_low + size - 1) >> 8; ++page)
+    {
+        if(watched_pages[page] || !flat_memory)
+        {
+            for(uint32_t i = 0; i < size; ++i)
+            {
+                write_memory(dst + step * (int)i, read_memory(src + step * (int)i));
+            }
+            return;
+        }
+    }
+
+    // Copying one byte at a time towards a destination which overlaps the source repeats
+    // the first distance bytes over and over. Copy them once, then double up what's done.
+    uint32_t distance = step > 0 ? (uint16_t)(dst - src) : (uint16_t)(src - dst);
+    if(distance == 0 || distance >= size)
+    {
+        memmove(memory + dst_low, memory + src_low, size);
+    }
+    else if(step > 0)
+    {
+        memcpy(memory + dst, memory + src, distance);
+        for(uint32_t done = distance; done < size; done += std::min(done, size - done))
+        {
+            memcpy(memory + dst + done, memory + dst, std::min(done, size - done));
+        }
+    }
+    else
+    {
+        memcpy(memory + dst - distance + 1, memory + src - distance + 1, distance);
+        for(uint32_t done = distance; done < size; done += std::min(done, size - done))
+        {
+            uint32_t chunk = std::min(done, size - done);
+            memcpy(memory + dst - done - chunk + 1, memory + dst - chunk + 1, chunk);
+        }
+    }
+}
 
+uint32_t Emulator::repeat_passes(uint32_t count) const
+{
+    // Run as many passes as fit in the cycles left, each of which takes as long as a repeat
+    if(cycles >= cycle_limit)
+        return 1;
+    return (uint32_t)std::min<uint64_t>(count, std::max<uint64_t>(1, (cycle_limit - cycles) / t_states_taken(Prefix::ED, 0xB0)));
 }
 
-void Emulator::bli_ind()
+template<int step>
+uint32_t Emulator::repeat_passes(uint32_t count, uint16_t dst) const
 {
+    count = repeat_passes(count);
 
+    // PC has moved past the two bytes of the instruction, stop on the first pass that writes to either
+    uint16_t pc = reg.PC - 2;
+    uint16_t to_pc = step > 0 ? std::min<uint16_t>(pc - dst, pc + 1 - dst) : std::min<uint16_t>(dst - pc, dst - pc - 1);
+    return std::min(count, to_pc + 1u);
 }
 
-void Emulator::bli_outd()
+void Emulator::end_passes(uint8_t opcode, uint32_t passes, bool finished)
+{
+    extra_t_states += t_states_taken(Prefix::ED, opcode) * (passes - 1);
+    if(!finished)
+    {
+        // The last pass repeats too, and the instruction runs again from where it left off
+        extra_t_states += t_states_taken(Prefix::ED, opcode) - t_states(Prefix::ED, opcode);
+        reg.PC -= 2;
+    }
+}
+
+template<int step, bool repeat>
+void Emulator::block_copy()
 {
+    uint32_t count = repeat && reg.general.BC == 0 ? 0x10000 : repeat ? reg.general.BC : 1;
+    if constexpr(repeat)
+        count = repeat_passes<step>(count, reg.general.DE);
+    for(uint32_t left = count; left;)
+    {
+        // Split the copy wherever HL or DE wraps around
+        uint32_t size = step > 0 ? std::min({left, 0x10000u - reg.general.HL, 0x10000u - reg.general.DE})
+                                 : std::min({left, reg.general.HL + 1u, reg.general.DE + 1u});
+        copy_span<step>(reg.general.HL, reg.general.DE, size);
+        reg.general.HL += step * (int)size;
+        reg.general.DE += step * (int)size;
+        left -= size;
+    }
+    reg.general.BC -= count;
+
+    // The undocumented flags come from the last byte copied plus A
+    uint8_t n = read_memory(reg.general.DE - step) + reg.general.A;
+    resolve_flags();
+    reg.general.F.value = (reg.general.F.value & (FlagTables::S | FlagTables::Z | FlagTables::C))
+                          | (reg.general.BC ? FlagTables::PV : 0)
+                          | (n & FlagTables::X) | ((n << 4) & FlagTables::Y);
+    if constexpr(repeat)
+        end_passes(0xB0, count, reg.general.BC == 0);
+}
 
+template<int step, bool repeat>
+void Emulator::block_compare()
+{
+    uint32_t count = repeat && reg.general.BC == 0 ? 0x10000 : repeat ? reg.general.BC : 1;
+    if constexpr(repeat)
+        count = repeat_passes(count);
+    uint32_t passes = 0;
+    bool found = false;
+    while(!flat_memory && passes < count && !found) // Other memory is mapped in, so the search can't be a span of ours
+    {
+        found = read_memory(reg.general.HL) == reg.general.A;
+        reg.general.HL += step;
+        ++passes;
+    }
+    while(passes < count && !found)
+    {
+        // Search up to wherever HL wraps around
+        uint32_t size = step > 0 ? std::min(count - passes, 0x10000u - reg.general.HL) : std::min(count - passes, reg.general.HL + 1u);
+        const uint8_t *match = step > 0 ? static_cast<const uint8_t *>(memchr(memory + reg.general.HL, reg.general.A, size))
+                                        : find_last(memory + reg.general.HL - size + 1, reg.general.A, size);
+        found = match != nullptr;
+        uint32_t searched = !found ? size : step > 0 ? match - (memory + reg.general.HL) + 1 : (memory + reg.general.HL) - match + 1;
+        reg.general.HL += step * (int)searched;
+        passes += searched;
+    }
+    reg.general.BC -= passes;
+
+    // Flags are as CP against the last byte compared, but the undocumented flags come from A - (HL) - H
+    uint8_t val = read_memory(reg.general.HL - step);
+    uint16_t diff = reg.general.A - val;
+    uint8_t flags = FlagTables::sub(reg.general.A, val, diff);
+    uint8_t n = diff - ((flags & FlagTables::H) ? 1 : 0);
+    set_flags((flags & (FlagTables::S | FlagTables::Z | FlagTables::H | FlagTables::N))
+              | carry()
+              | (reg.general.BC ? FlagTables::PV : 0)
+              | (n & FlagTables::X) | ((n << 4) & FlagTables::Y));
+    if constexpr(repeat)
+        end_passes(0xB1, passes, found || reg.general.BC == 0);
 }
 
-void Emulator::bli_ldir() //note: This wont behave realistically if the instruction overwrites itself
+template<int step, bool repeat>
+void Emulator::block_in()
 {
-    do
+    uint16_t count = repeat && reg.general.B == 0 ? 0x100 : repeat ? reg.general.B : 1;
+    if constexpr(repeat)
+        count = repeat_passes<step>(count, reg.general.HL);
+    uint8_t data[0x100];
+    const PortBinding &binding = find_port(reg.general.BC);
+    binding.callback(binding.context, PortState::Read, data, count);
+
+    for(uint16_t i = 0; i < count; ++i)
     {
-        memory[reg.general.DE++] = memory[reg.general.HL++];
-    } while(--reg.general.BC != 0);
-    reg.general.F.H = 0;
-    reg.general.F.N = 0;
-    reg.general.F.PV = reg.general.BC - 1 != 0;
+        write_memory(reg.general.HL + step * i, data[i]);
+    }
+    reg.general.HL += step * count;
+    reg.general.B -= count;
+    set_flags(FlagTables::block_io(reg.general.B, data[count - 1], data[count - 1] + (uint8_t)(reg.general.C + step)));
+    if constexpr(repeat)
+        end_passes(0xB2, count, reg.general.B == 0);
 }
 
-void Emulator::bli_cpir()
+template<int step, bool repeat>
+void Emulator::block_out()
 {
+    uint16_t count = repeat && reg.general.B == 0 ? 0x100 : repeat ? reg.general.B : 1;
+    if constexpr(repeat)
+        count = repeat_passes(count);
+    uint8_t data[0x100];
+    const PortBinding &binding = find_port(reg.general.BC);
+    for(uint16_t i = 0; i < count; ++i)
+    {
+        data[i] = read_memory(reg.general.HL + step * i);
+    }
+    reg.general.HL += step * count;
+    reg.general.B -= count;
 
+    binding.callback(binding.context, PortState::Write, data, count);
+    set_flags(FlagTables::block_io(reg.general.B, data[count - 1], data[count - 1] + reg.general.L));
+    if constexpr(repeat)
+        end_passes(0xB3, count, reg.general.B == 0);
 }
 
-void Emulator::bli_inir()
+void Emulator::bli_ldi()
 {
+    block_copy<1, false>();
+}
 
+void Emulator::bli_cpi()
+{
+    block_compare<1, false>();
 }
 
-void Emulator::bli_otir()
+void Emulator::bli_ini()
 {
+    block_in<1, false>();
+}
 
+void Emulator::bli_outi()
+{
+    block_out<1, false>();
 }
 
-void Emulator::bli_lddr()
+void Emulator::bli_ldd()
 {
+    block_copy<-1, false>();
+}
 
+void Emulator::bli_cpd()
+{
+    block_compare<-1, false>();
 }
 
-void Emulator::bli_cpdr()
+void Emulator::bli_ind()
+{
+    block_in<-1, false>();
+}
+
+void Emulator::bli_outd()
 {
+    block_out<-1, false>();
+}
 
+void Emulator::bli_ldir()
+{
+    block_copy<1, true>();
 }
 
-void Emulator::bli_indr()
+void Emulator::bli_cpir()
 {
+    block_compare<1, true>();
+}
 
+void Emulator::bli_inir()
+{
+    block_in<1, true>();
 }
 
-void Emulator::bli_otdr()
+void Emulator::bli_otir()
 {
+    block_out<1, true>();
+}
 
+void Emulator::bli_lddr()
+{
+    block_copy<-1, true>();
 }
 
+void Emulator::bli_cpdr()
+{
+    block_compare<-1, true>();
+}
 
-void Emulator::reset()
+void Emulator::bli_indr()
 {
-    //Reset registers, and set stack pointer to top (it grows downwards)
-    reg = {0};
-    reg.SP = sizeof(memory) - 1;
+    block_in<-1, true>();
+}
 
-    //Setup register lookup tables
-    reg_table_r = {&reg.general.B, &reg.general.C, &reg.general.D, &reg.general.E, &reg.general.H, &reg.general.L, (uint8_t*)&reg.general.HL, &reg.general.A};
-    reg_table_rp = {&reg.general.BC, &reg.general.DE, &reg.general.HL, &reg.SP};
-    reg_table_rp2 = {&reg.general.BC, &reg.general.DE, &reg.general.HL, &reg.general.AF};
-    alu_table = {std::bind(&Emulator::alu_add, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_adc, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_sub, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_sbc, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_and, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_xor, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_or, this, std::placeholders::_1),
-                 std::bind(&Emulator::alu_cp, this, std::placeholders::_1)};
-
-    bli_table =  std::array<std::array<std::function<void()>, 4>, 4>
-                 {{{std::bind(&Emulator::bli_ldi, this), std::bind(&Emulator::bli_cpi, this), std::bind(&Emulator::bli_ini, this), std::bind(&Emulator::bli_outi, this)},
-                 {std::bind(&Emulator::bli_ldd, this), std::bind(&Emulator::bli_cpd, this), std::bind(&Emulator::bli_ind, this), std::bind(&Emulator::bli_outd, this)},
-                 {std::bind(&Emulator::bli_ldir, this), std::bind(&Emulator::bli_cpir, this), std::bind(&Emulator::bli_inir, this), std::bind(&Emulator::bli_otir, this)},
-                 {std::bind(&Emulator::bli_lddr, this), std::bind(&Emulator::bli_cpdr, this), std::bind(&Emulator::bli_indr, this), std::bind(&Emulator::bli_otdr, this)}}};
+void Emulator::bli_otdr()
+{
+    block_out<-1, true>();
+}
 
 
-    reg_table_r_names = {"B", "C", "D", "E", "H", "L", "(HL)", "A"};
-    reg_table_rp_names = {"BC", "DE", "HL", "SP"};
-    reg_table_rp2_names = {"BC", "DE", "HL", "AF"};
-    cc_table_names = {"NZ", "Z", "NC", "C", "PO", "PE", "P", "M"};
-    alu_table_names = {"ADD A,", "ADC A,", "SUB", "SBC A,", "AND", "XOR", "OR", "CP"};
-    bli_table_names = {{{"LDI", "CPI", "INI", "OUTI"},
-                        {"LDD", "CPD", "IND", "OUTD"},
-                        {"LDIR", "CPIR", "INIR", "OTIR"},
-                        {"LDDR", "CPDR", "INDR", "OTDR"}}};
+void Emulator::reset()
+{
+    //Reset registers and memory, and set stack pointer to top (it grows downwards)
+    reg = {0};
+    pending_flags = {FlagOp::None, 0, 0, 0};
+    memset(memory, 0, sizeof(memory));
+    reg.SP = sizeof(memory) - 1;
+    halted = false;
+    program_end = 0;
+    cycles = 0;
+    cycle_deadline = 0;
+    instructions_left = 0;
+    breakpoint = 0x10000;
+    cycle_limit = 0;
+    irq_requested = false;
+    irq_data = 0xFF;
+    nmi_requested = false;
+    interrupt_pending = false;
+    ei_delay = false;
+    next_timer = timer_period;
+    extra_t_states = 0;
+
+    //Drop any cached code, and the snapshot memory was based on
+    watched_pages.fill(false);
+    watch_mmio_pages();
+    memory_hook_active = false;
+    snapshot_base.reset();
+    dirty_pages.fill(false);
+    code_modified = false;
+    if(jit)
+        jit->flush();
+    if(block_cache)
+        block_cache->clear();
+    coverage_prev = 0;
 }
 
 void Emulator::push(uint16_t val)
 {
-    memory[reg.SP--] = (val >> 8) & 0xFF; // Stop top 8 bits first
-    memory[reg.SP--] = val & 0xFF; // Stop bottom 8 bits last
+    write_memory(--reg.SP, (val >> 8) & 0xFF); // Store top 8 bits first
+    write_memory(--reg.SP, val & 0xFF); // Store bottom 8 bits last
 }
 
 uint16_t Emulator::pop()
 {
-    uint16_t data = (memory[reg.SP] << 8) | memory[reg.SP + 1];
-    reg.SP += 2;
+    uint16_t data = read_memory(reg.SP++);
+    data |= read_memory(reg.SP++) << 8;
 
     return data;
 }
 
-void Emulator::emulate(const std::vector<uint8_t> &data, std::ostream &log_stream)
+constexpr bool Emulator::indexed(uint8_t opcode)
 {
-    //Copy the program data into memory first
-    memcpy(memory, data.data(), data.size());
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
 
-    for(reg.PC = 0; reg.PC < data.size(); ++reg.PC)
-    {
-        //Get instruction prefix
-        process_instruction:
-        Prefix prefix = to_prefix(memory[reg.PC]);
-        if(prefix != Prefix::None)
-            ++reg.PC;
+    return (x == 0 && z >= 4 && z <= 6 && y == 6) // INC/DEC (HL) and LD (HL), n
+           || (x == 1 && (y == 6) != (z == 6)) // LD r, (HL) and LD (HL), r, but not HALT
+           || (x == 2 && z == 6); // alu (HL)
+}
 
-        uint8_t x, y, z, p, q;
-        x = (memory[reg.PC] >> 6) & 0x3;
-        y = (memory[reg.PC] >> 3) & 0x7;
-        z = memory[reg.PC] & 0x7;
-        p = (y >> 1) & 0x3;
-        q = y & 0x1;
+constexpr uint8_t Emulator::operand_bytes(Prefix prefix, uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
 
-        switch(prefix)
+    switch(prefix)
+    {
+        case Prefix::DD: // As unprefixed, with d coming before any immediate for (IX+d)
+        case Prefix::FD:
+            return next_table(prefix, opcode) != Prefix::None ? 0 : operand_bytes(Prefix::None, opcode) + (indexed(opcode) ? 1 : 0);
+        case Prefix::None:
         {
-            case Prefix::None:
+            if(x == 0)
             {
-                switch(x)
-                {
-                    case 0: // X = 0
-                    {
-                        switch(z)
-                        {
-                            case 0: // z = 0
-                            {
-                                switch(y)
-                                {
-                                    case 0: // NOP
-                                    {
-                                        break;
-                                    }
-                                    case 1: // EX AF, AF'
-                                    {
-                                        std::swap(reg.general.AF, reg.shadow.AF);
-                                        log_stream << "EX AF, AF'" << std::endl;
-                                        break;
-                                    }
-                                    case 2:
-                                        break;
-                                    case 3: // JR d
-                                    {
-                                        int8_t jmp_offset = data[++reg.PC] + 2;
-                                        reg.PC += jmp_offset - 1;
-
-                                        log_stream << "JR " << (int16_t)jmp_offset << std::endl;
-                                        goto process_instruction;
-                                        break;
-                                    }
-                                    case 4: case 5: case 6: case 7:
-                                        break;
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            }
-                            case 1: // z = 1
-                            {
-                                switch(q)
-                                {
-                                    case 0: // LD rp[p], nn
-                                    {
-                                        *get_rp_reg(p) = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                        reg.PC += 2;
-
-                                        log_stream << "LD " << reg_table_rp_names[p].c_str() << ", " << *get_rp_reg(p) << std::endl;
-                                        break;
-                                    }
-                                    case 1:
-                                        break;
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            }
-                            case 2: // z = 2
-                            {
-                                switch(q)
-                                {
-                                    case 0: // q = 0
-                                    {
-                                        switch(p)
-                                        {
-                                            case 0: // LD (BC), A
-                                            {
-                                                memory[reg.general.BC] = reg.general.A;
-                                                log_stream << "LD (BC), A" << std::endl;
-                                                break;
-                                            }
-                                            case 1: // LD (DE), A
-                                            {
-                                                memory[reg.general.DE] = reg.general.A;
-                                                log_stream << "LD (DE), A" << std::endl;
-                                                break;
-                                            }
-                                            case 2: // LD (nn), HL
-                                            {
-                                                uint16_t addr = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                                reg.PC += 2;
-
-                                                memory[addr] = reg.general.L;
-                                                memory[addr + 1] = reg.general.H;
-
-                                                log_stream << "LD (" << addr << "), HL" << std::endl;
-                                                break;
-                                            }
-                                            case 3: // LD (nn), A
-                                            {
-                                                uint16_t addr = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                                reg.PC += 2;
-
-                                                memory[addr] = reg.general.A;
-
-                                                log_stream << "LD (" << addr << "), A" << std::endl;
-                                                break;
-                                            }
-                                            default:
-                                                abort();
-                                        }
-                                        break;
-                                    }
-                                    case 1: // Q = 1
-                                    {
-                                        switch(p)
-                                        {
-                                            case 0: // LD A, (BC)
-                                            {
-                                                reg.general.A = memory[reg.general.BC];
-                                                log_stream << "LD A, (BC)" << std::endl;
-                                                break;
-                                            }
-                                            case 1: // LD A, (DE)
-                                            {
-                                                reg.general.A = memory[reg.general.DE];
-                                                log_stream << "LD A, (DE)" << std::endl;
-                                                break;
-                                            }
-                                            case 2: // LD HL, (nn)
-                                            {
-                                                uint16_t addr = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                                reg.PC += 2;
-
-                                                reg.general.L = memory[addr];
-                                                reg.general.H = memory[addr + 1];
-
-                                                log_stream << "LD HL, (" << addr << ")" << std::endl;
-                                                break;
-                                            }
-                                            case 3: // LD A, (nn)
-                                            {
-                                                uint16_t addr = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                                reg.PC += 2;
-
-                                                reg.general.A = memory[addr];
-
-                                                log_stream << "LD A, (" << addr << ")" << std::endl;
-                                                break;
-                                            }
-                                            default:
-                                                abort();
-                                        }
-                                        break;
-                                    }
-                                    default:
-                                        abort();
-                                }
-
-                                break;
-                            }
-                            case 3: // z = 3
-                            {
-                                switch(q)
-                                {
-                                    case 0: // INC rp[p]
-                                    {
-                                        ++(*get_rp_reg(p));
-
-
-                                        log_stream << "INC " << reg_table_rp_names[p] << std::endl;
-                                        break;
-                                    }
-                                    case 1: // DEC rp[p]
-                                    {
-                                        --(*get_rp_reg(p));
-                                        log_stream << "DEC " << reg_table_rp_names[p] << std::endl;
-                                        break;
-                                    }
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            }
-                            case 4: // INC r[y]
-                            {
-                                uint8_t *y_reg = get_r_reg(y);
-
-                                reg.general.F.PV = *y_reg == 0x7F; // If overflow
-                                reg.general.F.H = (((*y_reg & 0xF) + 1) & 0x10) == 0x10; // If half carry
-
-                                ++(*y_reg); // Do the increment
-
-                                reg.general.F.S = *y_reg >> 7; // If result is negative, set S
-                                reg.general.F.Z = *y_reg == 0; // If result is 0
-                                reg.general.F.N = 0;
-
-                                log_stream << "INC " << reg_table_r_names[y] << std::endl;
-                                break;
-                            }
-                            case 5: // DEC r[y]
-                            {
-                                uint8_t *y_reg = get_r_reg(y);
-
-                                reg.general.F.PV = *y_reg == 0x80; // If underflow
-                                reg.general.F.H = ((int8_t)(((*y_reg & 0xF) - 1)) < 0);
-
-                                --(*y_reg); // Do the decrement
-
-                                reg.general.F.S = *y_reg >> 7; // If result is negative, set S
-                                reg.general.F.Z = *y_reg == 0; // If result is 0
-                                reg.general.F.N = 1;
-
-                                log_stream << "DEC " << reg_table_r_names[y] << std::endl;
-                                break;
-                            }
-                            case 6: // LD r[y], n
-                            {
-                                uint8_t *y_reg = get_r_reg(y);
-                                *y_reg = memory[++reg.PC];
-
-                                log_stream << "LD " << reg_table_r_names[y].c_str() << ", " << (uint16_t)*y_reg << std::endl;
-                                break;
-                            }
-                            case 7:
-                                break;
-                            default:
-                                abort();
-                        }
-                        break;
-                    }
-                    case 1: // X = 1
-                    {
-                        if(z == 6 && y == 6) // HALT
-                        {
-                            // todo: implement, currently just exits
-                            reg.PC = data.size();
-                            log_stream << "HALT" << std::endl;
-                            break;
-                        }
-                        else // LD r[y], r[z]
-                        {
-
-                            *get_r_reg(y) = *get_r_reg(z);
-                            log_stream << "LD " << reg_table_r_names[y] << ", " << reg_table_r_names[z] << std::endl;
-                        }
-                        break;
-                    }
-                    case 2: // X = 2, alu[y] r[z]
-                    {
-                        alu_table[y](*reg_table_r[z]);
-                        log_stream << alu_table_names[y] << " " << reg_table_r_names[z] << std::endl;
-                        break;
-                    }
-                    case 3: // X = 3
-                        switch(z)
-                        {
-                            case 0: // Z = 0, RET cc[y]
-                            {
-                                log_stream << "RET " << cc_table_names[y] << std::endl;
-                                if(get_cc_value(y))
-                                {
-                                    reg.PC = pop();
-                                    goto process_instruction;
-                                }
-                                break;
-                            }
-                            case 1: // Z = 1
-                            {
-                                switch(q)
-                                {
-                                    case 0: // POP rp2[p]
-                                    {
-                                        *get_rp2_reg(p) = pop();
-                                        log_stream << "POP " << reg_table_rp2_names[p] << std::endl;
-                                        break;
-                                    }
-                                    case 1: // Q = 1
-                                    {
-                                        switch(p)
-                                        {
-                                            case 0: // RET
-                                            {
-                                                reg.PC = pop();
-
-                                                log_stream << "RET" <<std::endl;
-                                                goto process_instruction;
-                                                break;
-                                            }
-                                            case 1: // EXX
-                                            {
-                                                std::swap(reg.general.BC, reg.shadow.BC);
-                                                std::swap(reg.general.DE, reg.shadow.DE);
-                                                std::swap(reg.general.HL, reg.shadow.HL);
-
-                                                log_stream << "EXX" << std::endl;
-                                                break;
-                                            }
-                                            case 2:
-                                                break;
-                                            case 3:
-                                                break;
-                                            default:
-                                                abort();
-                                        }
-                                        break;
-                                    }
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            }
-                            case 2:
-                                break;
-                            case 3: // Z = 3
-                            {
-                                switch(y)
-                                {
-                                    case 0:
-                                        break;
-                                    case 1:
-                                        break;
-                                    case 2: // OUT (n), A
-                                    {
-                                        out(memory[++reg.PC], &reg.general.A);
-                                        log_stream << "OUT (" << (uint16_t)memory[reg.PC] << "), A" << std::endl;
-                                        break;
-                                    }
-                                    case 3: // IN A, (n)
-                                    {
-                                        in(memory[++reg.PC], &reg.general.A);
-                                        log_stream << "IN A, (" << (uint16_t)memory[reg.PC] << ")" << std::endl;
-                                        break;
-                                    }
-                                    case 4:
-                                        break;
-                                    case 5:
-                                        break;
-                                    case 6:
-                                        break;
-                                    case 7:
-                                        break;
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            }
-                            case 4: // Z = 4
-                            {
-                                break;
-                            }
-                            case 5: // Z = 5
-                                switch(q)
-                                {
-                                    case 0: // PUSH rp2[p]
-                                    {
-                                        push(*get_rp2_reg(p));
-
-                                        log_stream << "PUSH " << reg_table_rp2_names[p] << std::endl;
-                                        break;
-                                    }
-                                    case 1:
-                                    {
-                                        switch(p)
-                                        {
-                                            case 0: // CALL nn
-                                            {
-                                                uint16_t call_dest = memory[reg.PC + 1] | (memory[reg.PC + 2] << 8);
-                                                push(reg.PC + 3);
-
-                                                reg.PC = call_dest;
-
-                                                log_stream << "CALL " << call_dest << std::endl;
-                                                goto process_instruction;
-                                                break;
-                                            }
-                                            default:
-                                                abort();
-                                        }
-                                        break;
-                                    }
-                                    default:
-                                        abort();
-                                }
-                                break;
-                            case 6: // 	alu[y] n
-                            {
-                                alu_table[y](memory[++reg.PC]);
-                                log_stream << alu_table_names[y] << " " << (uint16_t)memory[reg.PC] << std::endl;
-                                break;
-                            }
-                            case 7:
-                                break;
-                            default:
-                                abort();
-                        }
-                        break;
-                    default:
-                        abort();
-                }
-                break;
+                if(z == 0 && y >= 2) // DJNZ d, JR d, JR cc[y-4], d
+                    return 1;
+                if(z == 1 && q == 0) // LD rp[p], nn
+                    return 2;
+                if(z == 2 && p >= 2) // LD (nn), HL/A and LD HL/A, (nn)
+                    return 2;
+                if(z == 6) // LD r[y], n
+                    return 1;
             }
-            case Prefix::CB:
+            else if(x == 3)
             {
-                break;
+                if(z == 2 || z == 4) // JP cc[y], nn and CALL cc[y], nn
+                    return 2;
+                if(z == 3 && y == 0) // JP nn
+                    return 2;
+                if(z == 3 && (y == 2 || y == 3)) // OUT (n), A and IN A, (n)
+                    return 1;
+                if(z == 5 && q == 1 && p == 0) // CALL nn
+                    return 2;
+                if(z == 6) // alu[y] n
+                    return 1;
             }
-            case Prefix::ED:
+            return 0;
+        }
+        case Prefix::ED:
+            return (x == 1 && z == 3) ? 2 : 0; // LD (nn), rp[p] and LD rp[p], (nn)
+        default:
+            return 0;
+    }
+}
+
+constexpr Emulator::Prefix Emulator::next_table(Prefix prefix, uint8_t opcode)
+{
+    switch(prefix)
+    {
+        case Prefix::None:
+        {
+            switch(opcode)
             {
-                switch(x)
-                {
-                    case 0: // NONI
-                    {
-                        break;
-                    }
-                    case 1:
-                    {
-                        break;
-                    }
-                    case 2: // x = 2
-                    {
-                        if(z <= 3 && y >= 4) // BLI[y, z]
-                        {
-                            bli_table[y - 4][z]();
-                            log_stream << bli_table_names[y - 4][z] << std::endl;
-                            break;
-                        }
-                        break; // NONI
-                    }
-                    case 3: // NONI
-                    {
-                        break;
-                    }
-                }
-                break;
+                case 0xCB:
+                    return Prefix::CB;
+                case 0xDD:
+                    return Prefix::DD;
+                case 0xED:
+                    return Prefix::ED;
+                case 0xFD:
+                    return Prefix::FD;
+                default:
+                    return Prefix::None;
             }
-            default:
-                abort();
         }
+        case Prefix::DD:
+            return opcode == 0xCB ? Prefix::DDCB : Prefix::None;
+        case Prefix::FD:
+            return opcode == 0xCB ? Prefix::FDCB : Prefix::None;
+        default:
+            return Prefix::None;
     }
-}
\ No newline at end of file
+}
+
+constexpr bool Emulator::ends_block(Prefix prefix, uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
+
+    switch(prefix)
+    {
+        case Prefix::DD:
+        case Prefix::FD:
+            if(opcode == 0xDD || opcode == 0xED || opcode == 0xFD) // NONI, goes back to decode the second prefix
+                return true;
+            return ends_block(Prefix::None, opcode);
+        case Prefix::None:
+        {
+            if(x == 0)
+                return z == 0 && y >= 2; // DJNZ d, JR d, JR cc[y-4], d
+            if(x == 1)
+                return z == 6 && y == 6; // HALT
+            if(x == 3)
+            {
+                return z == 0 // RET cc[y]
+                       || (z == 1 && q == 1 && (p == 0 || p == 2)) // RET and JP (HL)
+                       || z == 2 // JP cc[y], nn
+                       || (z == 3 && y == 0) // JP nn
+                       || z == 4 // CALL cc[y], nn
+                       || (z == 5 && q == 1 && p == 0) // CALL nn
+                       || z == 7; // RST y*8
+            }
+            return false;
+        }
+        case Prefix::ED:
+            return (x == 1 && z == 5) // RETN and RETI
+                   || (x == 2 && z <= 3 && y >= 6); // Repeating block instructions, which go back to themselves until done
+        default:
+            return false;
+    }
+}
+
+constexpr uint8_t Emulator::t_states(Prefix prefix, uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
+
+    switch(prefix)
+    {
+        case Prefix::None:
+        {
+            if(x == 0)
+            {
+                switch(z)
+                {
+                    case 0: // NOP, EX AF, AF', DJNZ d, JR d, JR cc[y-4], d
+                        return y == 2 ? 8 : y == 3 ? 12 : y >= 4 ? 7 : 4;
+                    case 1: // LD rp[p], nn and ADD HL, rp[p]
+                        return q == 0 ? 10 : 11;
+                    case 2: // LD (nn), HL/HL, (nn), LD (nn), A/A, (nn), and the (BC)/(DE) loads
+                        return p == 2 ? 16 : p == 3 ? 13 : 7;
+                    case 3: // INC/DEC rp[p]
+                        return 6;
+                    case 4: // INC/DEC r[y]
+                    case 5:
+                        return y == 6 ? 11 : 4;
+                    case 6: // LD r[y], n
+                        return y == 6 ? 10 : 7;
+                    default:
+                        return 4;
+                }
+            }
+            if(x == 1) // LD r[y], r[z] and HALT
+                return (y == 6) != (z == 6) ? 7 : 4;
+            if(x == 2) // alu[y] r[z]
+                return z == 6 ? 7 : 4;
+
+            switch(z)
+            {
+                case 0: // RET cc[y]
+                    return 5;
+                case 1: // POP rp2[p], RET, EXX, JP (HL), LD SP, HL
+                    return q == 0 || p == 0 ? 10 : p == 3 ? 6 : 4;
+                case 2: // JP cc[y], nn
+                    return 10;
+                case 3: // JP nn, CB, OUT (n), A, IN A, (n), EX (SP), HL, EX DE, HL, DI, EI
+                    return y == 0 ? 10 : y == 1 ? 0 : y <= 3 ? 11 : y == 4 ? 19 : 4;
+                case 4: // CALL cc[y], nn
+                    return 10;
+                case 5: // PUSH rp2[p], CALL nn and the DD, ED and FD prefixes
+                    return q == 0 ? 11 : p == 0 ? 17 : 0;
+                case 6: // alu[y] n
+                    return 7;
+                default: // RST y*8
+                    return 11;
+            }
+        }
+        case Prefix::CB: // rot[y], BIT, RES and SET on r[z]
+            return z != 6 ? 8 : x == 1 ? 12 : 15;
+        case Prefix::ED:
+        {
+            if(x == 1)
+            {
+                const uint8_t times[8] = {12, 12, 15, 20, 8, 14, 8, 0};
+                if(z == 7) // LD I/R, A and LD A, I/R, RRD, RLD and two NOPs
+                    return y < 4 ? 9 : y < 6 ? 18 : 8;
+                return times[z];
+            }
+            if(x == 2 && z <= 3 && y >= 4) // BLI[y, z]
+                return 16;
+            return 8; // NONI
+        }
+        case Prefix::DD:
+        case Prefix::FD:
+        {
+            if(next_table(prefix, opcode) != Prefix::None) // DDCB/FDCB, timed as a whole
+                return 0;
+            if(opcode == 0xDD || opcode == 0xED || opcode == 0xFD) // NONI
+                return 4;
+            if(opcode == 0x36) // LD (IX+d), n
+                return 19;
+
+            // The prefix adds 4, and working out IX+d another 8
+            return t_states(Prefix::None, opcode) + (indexed(opcode) ? 12 : 4);
+        }
+        case Prefix::DDCB:
+        case Prefix::FDCB:
+            return x == 1 ? 20 : 23;
+        default:
+            return 0;
+    }
+}
+
+constexpr uint8_t Emulator::t_states_taken(Prefix prefix, uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+
+    switch(prefix)
+    {
+        case Prefix::None:
+        case Prefix::DD:
+        case Prefix::FD:
+        {
+            if(x == 0 && z == 0 && (y == 2 || y >= 4)) // DJNZ d and JR cc[y-4], d
+                return 5;
+            if(x == 3 && z == 0) // RET cc[y]
+                return 6;
+            if(x == 3 && z == 4) // CALL cc[y], nn
+                return 7;
+            return 0;
+        }
+        case Prefix::ED:
+            return (x == 2 && z <= 3 && y >= 6) ? 21 : 0; // LDIR, CPIR, INIR, OTIR, LDDR, CPDR, INDR, OTDR
+        default:
+            return 0;
+    }
+}
+
+template<Emulator::Prefix prefix, size_t... opcodes>
+constexpr Emulator::opcode_table_t Emulator::make_opcode_table(std::index_sequence<opcodes...>)
+{
+    return {{Opcode{&Emulator::execute<prefix, opcodes>, operand_bytes(prefix, opcodes), t_states(prefix, opcodes),
+                    t_states_taken(prefix, opcodes), next_table(prefix, opcodes), ends_block(prefix, opcodes)}...}};
+}
+
+const std::array<Emulator::opcode_table_t, Emulator::PrefixCount> Emulator::opcode_tables = {
+        make_opcode_table<Prefix::None>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::CB>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::DD>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::ED>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::FD>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::DDCB>(std::make_index_sequence<0x100>()),
+        make_opcode_table<Prefix::FDCB>(std::make_index_sequence<0x100>())
+};
+
+template<Emulator::Prefix prefix, uint8_t opcode>
+void Emulator::execute(const Instruction &instr)
+{
+    if constexpr(prefix == Prefix::None)
+        execute_main<opcode>(instr);
+    else if constexpr(prefix == Prefix::ED)
+        execute_ed<opcode>(instr);
+    else if constexpr(prefix == Prefix::CB)
+        execute_cb<opcode>(instr);
+    else if constexpr(prefix == Prefix::DDCB || prefix == Prefix::FDCB)
+        execute_cb<opcode, prefix == Prefix::DDCB ? Index::IX : Index::IY>(instr);
+    else if constexpr(opcode == 0xDD || opcode == 0xED || opcode == 0xFD) // NONI, the first prefix is a NOP and the second starts a new instruction
+        reg.PC = instr.pc + 1;
+    else
+        execute_main<opcode, prefix == Prefix::DD ? Index::IX : Index::IY>(instr);
+}
+
+template<uint8_t opcode, Emulator::Index index>
+void Emulator::execute_main(const Instruction &instr)
+{
+    constexpr uint8_t x = (opcode >> 6) & 0x3;
+    constexpr uint8_t y = (opcode >> 3) & 0x7;
+    constexpr uint8_t z = opcode & 0x7;
+    constexpr uint8_t p = (y >> 1) & 0x3;
+    constexpr uint8_t q = y & 0x1;
+
+    if constexpr(x == 0) // X = 0
+    {
+        if constexpr(z == 0) // z = 0
+        {
+            if constexpr(y == 1) // EX AF, AF'
+            {
+                resolve_flags();
+                std::swap(reg.general.AF, reg.shadow.AF);
+            }
+            else if constexpr(y == 2) // DJNZ d
+            {
+                if(--reg.general.B != 0)
+                {
+                    reg.PC += (int8_t)instr.operand;
+                    condition_taken<Prefix::None, opcode>();
+                }
+            }
+            else if constexpr(y == 3) // JR d
+            {
+                reg.PC += (int8_t)instr.operand;
+            }
+            else if constexpr(y >= 4) // JR cc[y-4], d
+            {
+                if(get_cc_value<y - 4>())
+                {
+                    reg.PC += (int8_t)instr.operand;
+                    condition_taken<Prefix::None, opcode>();
+                }
+            }
+        }
+        else if constexpr(z == 1) // z = 1
+        {
+            if constexpr(q == 0) // LD rp[p], nn
+            {
+                get_rp_reg<p, index>() = instr.operand;
+            }
+            else // ADD HL, rp[p]
+            {
+                uint16_t &hl = get_rp_reg<2, index>();
+                uint16_t val = get_rp_reg<p, index>();
+                uint32_t sum = hl + val;
+                resolve_flags();
+                set_flags((reg.general.F.value & (FlagTables::S | FlagTables::Z | FlagTables::PV))
+                          | (((hl ^ val ^ sum) >> 8) & FlagTables::H) // If carry from bit 11
+                          | ((sum >> 8) & (FlagTables::X | FlagTables::Y))
+                          | (sum >> 16)); // If carry from bit 15
+                hl = sum;
+            }
+        }
+        else if constexpr(z == 2) // z = 2
+        {
+            if constexpr(q == 0) // q = 0
+            {
+                if constexpr(p == 0) // LD (BC), A
+                {
+                    write_memory(reg.general.BC, reg.general.A);
+                }
+                else if constexpr(p == 1) // LD (DE), A
+                {
+                    write_memory(reg.general.DE, reg.general.A);
+                }
+                else if constexpr(p == 2) // LD (nn), HL
+                {
+                    write_memory(instr.operand, *get_r_reg<5, index>());
+                    write_memory(instr.operand + 1, *get_r_reg<4, index>());
+                }
+                else // LD (nn), A
+                {
+                    write_memory(instr.operand, reg.general.A);
+                }
+            }
+            else // Q = 1
+            {
+                if constexpr(p == 0) // LD A, (BC)
+                {
+                    reg.general.A = read_memory(reg.general.BC);
+                }
+                else if constexpr(p == 1) // LD A, (DE)
+                {
+                    reg.general.A = read_memory(reg.general.DE);
+                }
+                else if constexpr(p == 2) // LD HL, (nn)
+                {
+                    *get_r_reg<5, index>() = read_memory(instr.operand);
+                    *get_r_reg<4, index>() = read_memory(instr.operand + 1);
+                }
+                else // LD A, (nn)
+                {
+                    reg.general.A = read_memory(instr.operand);
+                }
+            }
+        }
+        else if constexpr(z == 3) // z = 3
+        {
+            if constexpr(q == 0) // INC rp[p]
+            {
+                ++get_rp_reg<p, index>();
+            }
+            else // DEC rp[p]
+            {
+                --get_rp_reg<p, index>();
+            }
+        }
+        else if constexpr(z == 4) // INC r[y]
+        {
+            uint8_t result = read_r<y, index>(instr) + 1; // Do the increment
+            write_r<y, index>(instr, result);
+            set_flags(FlagTables::inc[result] | carry());
+        }
+        else if constexpr(z == 5) // DEC r[y]
+        {
+            uint8_t result = read_r<y, index>(instr) - 1; // Do the decrement
+            write_r<y, index>(instr, result);
+            set_flags(FlagTables::dec[result] | carry());
+        }
+        else if constexpr(z == 6) // LD r[y], n
+        {
+            if constexpr(index != Index::HL && y == 6) // LD (IX+d), n has n after d
+                write_r<y, index>(instr, instr.operand >> 8);
+            else
+                write_r<y, index>(instr, instr.operand);
+        }
+    }
+    else if constexpr(x == 1) // X = 1
+    {
+        if constexpr(z == 6 && y == 6) // HALT, sleeps until an interrupt
+        {
+            halted = true;
+        }
+        else // LD r[y], r[z]
+        {
+            //H and L aren't replaced when the other operand is (IX+d)
+            constexpr Index hl = y == 6 || z == 6 ? Index::HL : index;
+            write_r<y, y == 6 ? index : hl>(instr, read_r<z, z == 6 ? index : hl>(instr));
+        }
+    }
+    else if constexpr(x == 2) // X = 2, alu[y] r[z]
+    {
+        alu<y>(read_r<z, index>(instr));
+    }
+    else // X = 3
+    {
+        if constexpr(z == 0) // Z = 0, RET cc[y]
+        {
+            if(get_cc_value<y>())
+            {
+                reg.PC = pop();
+                condition_taken<Prefix::None, opcode>();
+            }
+        }
+        else if constexpr(z == 1) // Z = 1
+        {
+            if constexpr(q == 0) // POP rp2[p]
+            {
+                get_rp2_reg<p, index>() = pop();
+            }
+            else if constexpr(p == 0) // RET
+            {
+                reg.PC = pop();
+            }
+            else if constexpr(p == 1) // EXX
+            {
+                std::swap(reg.general.BC, reg.shadow.BC);
+                std::swap(reg.general.DE, reg.shadow.DE);
+                std::swap(reg.general.HL, reg.shadow.HL);
+            }
+            else if constexpr(p == 2) // JP (HL)
+            {
+                reg.PC = get_index_reg<index>();
+            }
+            else // LD SP, HL
+            {
+                reg.SP = get_index_reg<index>();
+            }
+        }
+        else if constexpr(z == 2) // Z = 2, JP cc[y], nn
+        {
+            if(get_cc_value<y>())
+            {
+                reg.PC = instr.operand;
+            }
+        }
+        else if constexpr(z == 3) // Z = 3
+        {
+            if constexpr(y == 0) // JP nn
+            {
+                reg.PC = instr.operand;
+            }
+            else if constexpr(y == 2) // OUT (n), A
+            {
+                out((reg.general.A << 8) | instr.operand, &reg.general.A);
+            }
+            else if constexpr(y == 3) // IN A, (n)
+            {
+                in((reg.general.A << 8) | instr.operand, &reg.general.A);
+            }
+            else if constexpr(y == 4) // EX (SP), HL
+            {
+                uint16_t &hl = get_index_reg<index>();
+                uint16_t val = read_memory(reg.SP) | (read_memory(reg.SP + 1) << 8);
+                write_memory(reg.SP, hl & 0xFF);
+                write_memory(reg.SP + 1, hl >> 8);
+                hl = val;
+            }
+            else if constexpr(y == 6) // DI
+            {
+                reg.IFF1 = reg.IFF2 = false;
+                update_interrupt_pending();
+            }
+            else if constexpr(y == 7) // EI
+            {
+                reg.IFF1 = reg.IFF2 = true;
+                ei_delay = true; // Stops the engines, so the loop runs the next instruction before any interrupt
+                update_interrupt_pending();
+            }
+        }
+        else if constexpr(z == 4) // Z = 4, CALL cc[y], nn
+        {
+            if(get_cc_value<y>())
+            {
+                push(reg.PC);
+                reg.PC = instr.operand;
+                condition_taken<Prefix::None, opcode>();
+            }
+        }
+        else if constexpr(z == 5) // Z = 5
+        {
+            if constexpr(q == 0) // PUSH rp2[p]
+            {
+                push(get_rp2_reg<p, index>());
+            }
+            else if constexpr(p == 0) // CALL nn
+            {
+                push(reg.PC);
+                reg.PC = instr.operand;
+            }
+            else // Prefixes, never dispatched here
+            {
+                abort();
+            }
+        }
+        else if constexpr(z == 6) // alu[y] n
+        {
+            alu<y>(instr.operand);
+        }
+        else // Z = 7, RST y*8
+        {
+            push(reg.PC);
+            reg.PC = y * 8;
+        }
+    }
+}
+
+template<uint8_t opcode>
+void Emulator::execute_ed(const Instruction &instr)
+{
+    constexpr uint8_t x = (opcode >> 6) & 0x3;
+    constexpr uint8_t y = (opcode >> 3) & 0x7;
+    constexpr uint8_t z = opcode & 0x7;
+
+    if constexpr(x == 1 && z == 5) // RETN and RETI
+    {
+        reg.PC = pop();
+        reg.IFF1 = reg.IFF2;
+        update_interrupt_pending();
+    }
+    else if constexpr(x == 1 && z == 6) // IM im[y]
+    {
+        constexpr uint8_t modes[8] = {0, 0, 1, 2, 0, 0, 1, 2};
+        reg.IM = modes[y];
+    }
+    else if constexpr(x == 1 && z == 7 && y == 0) // LD I, A
+    {
+        reg.I = reg.general.A;
+    }
+    else if constexpr(x == 1 && z == 7 && y == 2) // LD A, I
+    {
+        reg.general.A = reg.I;
+        set_flags(FlagTables::sz[reg.I] | (reg.IFF2 ? FlagTables::PV : 0) | carry());
+    }
+    else if constexpr(x == 2 && z <= 3 && y >= 4) // BLI[y, z]
+    {
+        bli<y - 4, z>();
+    }
+    // Otherwise NONI
+}
+
+template<uint8_t opcode, Emulator::Index index>
+void Emulator::execute_cb(const Instruction &instr)
+{
+    constexpr uint8_t x = (opcode >> 6) & 0x3;
+    constexpr uint8_t y = (opcode >> 3) & 0x7;
+    constexpr uint8_t z = opcode & 0x7;
+
+    //DDCB and FDCB always work on (IX+d), and other than BIT, also copy the result to r[z]
+    constexpr uint8_t target = index == Index::HL ? z : 6;
+    constexpr bool copy = index != Index::HL && z != 6 && x != 1;
+
+    if constexpr(x == 0) // rot[y] r[z]
+    {
+        uint16_t shift_index = read_r<target, index>(instr);
+        if constexpr(y == 2 || y == 3) // RL and RR shift the carry in
+            shift_index |= carry() << 8;
+        const FlagTables::Shifted &shifted = FlagTables::shift[y][shift_index];
+        write_r<target, index>(instr, shifted.result);
+        if constexpr(copy)
+            write_r<z>(instr, shifted.result);
+        set_flags(shifted.flags);
+    }
+    else if constexpr(x == 1) // BIT y, r[z]
+    {
+        set_flags(FlagTables::bit[y][read_r<target, index>(instr)] | carry());
+    }
+    else // RES and SET y, r[z]
+    {
+        uint8_t val = read_r<target, index>(instr);
+        uint8_t result = x == 2 ? val & ~(1 << y) : val | (1 << y);
+        write_r<target, index>(instr, result);
+        if constexpr(copy)
+            write_r<z>(instr, result);
+    }
+}
+
+void Emulator::log_instruction(const Instruction &instr, std::ostream &log_stream)
+{
+    switch(instr.prefix)
+    {
+        case Prefix::None:
+            log_main<Index::HL>(instr, log_stream);
+            break;
+        case Prefix::DD:
+            log_main<Index::IX>(instr, log_stream);
+            break;
+        case Prefix::FD:
+            log_main<Index::IY>(instr, log_stream);
+            break;
+        case Prefix::CB:
+            log_cb<Index::HL>(instr, log_stream);
+            break;
+        case Prefix::DDCB:
+            log_cb<Index::IX>(instr, log_stream);
+            break;
+        case Prefix::FDCB:
+            log_cb<Index::IY>(instr, log_stream);
+            break;
+        case Prefix::ED:
+            log_ed(instr, log_stream);
+            break;
+        default:
+            break;
+    }
+}
+
+template<Emulator::Index index>
+std::string Emulator::index_name() const
+{
+    if constexpr(index == Index::HL)
+        return "HL";
+    else if constexpr(index == Index::IX)
+        return "IX";
+    else
+        return "IY";
+}
+
+template<Emulator::Index index>
+std::string Emulator::r_name(uint8_t reg_no, const Instruction &instr) const
+{
+    if constexpr(index == Index::HL)
+    {
+        return reg_table_r_names[reg_no];
+    }
+    else
+    {
+        if(reg_no == 6) // (IX+d), with d in the low byte of the operand
+        {
+            int8_t d = instr.operand & 0xFF;
+            return "(" + index_name<index>() + (d < 0 ? "" : "+") + std::to_string(d) + ")";
+        }
+        if(reg_no == 4 || reg_no == 5) // IXH and IXL
+            return index_name<index>() + (reg_no == 4 ? "H" : "L");
+        return reg_table_r_names[reg_no];
+    }
+}
+
+template<Emulator::Index index>
+void Emulator::log_main(const Instruction &instr, std::ostream &log_stream)
+{
+    uint8_t x, y, z, p, q;
+    x = (instr.opcode >> 6) & 0x3;
+    y = (instr.opcode >> 3) & 0x7;
+    z = instr.opcode & 0x7;
+    p = (y >> 1) & 0x3;
+    q = y & 0x1;
+
+    //HL in the rp tables is replaced by IX or IY too
+    std::string rp_name = p == 2 ? index_name<index>() : reg_table_rp_names[p];
+    std::string rp2_name = p == 2 ? index_name<index>() : reg_table_rp2_names[p];
+
+    if(index != Index::HL && (instr.opcode == 0xDD || instr.opcode == 0xED || instr.opcode == 0xFD))
+    {
+        log_stream << "NONI" << std::endl;
+        return;
+    }
+
+    switch(x)
+    {
+        case 0: // X = 0
+        {
+            switch(z)
+            {
+                case 0:
+                {
+                    if(y == 1) // EX AF, AF'
+                        log_stream << "EX AF, AF'" << std::endl;
+                    else if(y == 2) // DJNZ d
+                        log_stream << "DJNZ " << (int16_t)(int8_t)(instr.operand + 2) << std::endl;
+                    else if(y == 3) // JR d
+                        log_stream << "JR " << (int16_t)(int8_t)(instr.operand + 2) << std::endl;
+                    else if(y >= 4) // JR cc[y-4], d
+                        log_stream << "JR " << cc_table_names[y - 4] << ", " << (int16_t)(int8_t)(instr.operand + 2) << std::endl;
+                    break;
+                }
+                case 1:
+                {
+                    if(q == 0) // LD rp[p], nn
+                        log_stream << "LD " << rp_name << ", " << instr.operand << std::endl;
+                    else // ADD HL, rp[p]
+                        log_stream << "ADD " << index_name<index>() << ", " << rp_name << std::endl;
+                    break;
+                }
+                case 2:
+                {
+                    const std::string rp_names[4] = {"BC", "DE", index_name<index>(), "A"};
+                    if(q == 0 && p < 2) // LD (BC), A and LD (DE), A
+                        log_stream << "LD (" << rp_names[p] << "), A" << std::endl;
+                    else if(q == 0) // LD (nn), HL and LD (nn), A
+                        log_stream << "LD (" << instr.operand << "), " << rp_names[p] << std::endl;
+                    else if(p < 2) // LD A, (BC) and LD A, (DE)
+                        log_stream << "LD A, (" << rp_names[p] << ")" << std::endl;
+                    else // LD HL, (nn) and LD A, (nn)
+                        log_stream << "LD " << rp_names[p] << ", (" << instr.operand << ")" << std::endl;
+                    break;
+                }
+                case 3: // INC/DEC rp[p]
+                {
+                    log_stream << (q == 0 ? "INC " : "DEC ") << rp_name << std::endl;
+                    break;
+                }
+                case 4: // INC r[y]
+                {
+                    log_stream << "INC " << r_name<index>(y, instr) << std::endl;
+                    break;
+                }
+                case 5: // DEC r[y]
+                {
+                    log_stream << "DEC " << r_name<index>(y, instr) << std::endl;
+                    break;
+                }
+                case 6: // LD r[y], n, where n follows d for LD (IX+d), n
+                {
+                    uint8_t n = index != Index::HL && y == 6 ? instr.operand >> 8 : instr.operand;
+                    log_stream << "LD " << r_name<index>(y, instr) << ", " << (uint16_t)n << std::endl;
+                    break;
+                }
+                default:
+                    break;
+            }
+            break;
+        }
+        case 1: // X = 1
+        {
+            if(z == 6 && y == 6) // HALT
+                log_stream << "HALT" << std::endl;
+            else if(y == 6 || z == 6) // LD r[y], r[z], where H and L aren't replaced when the other operand is (IX+d)
+                log_stream << "LD " << (y == 6 ? r_name<index>(y, instr) : reg_table_r_names[y]) << ", "
+                           << (z == 6 ? r_name<index>(z, instr) : reg_table_r_names[z]) << std::endl;
+            else
+                log_stream << "LD " << r_name<index>(y, instr) << ", " << r_name<index>(z, instr) << std::endl;
+            break;
+        }
+        case 2: // X = 2, alu[y] r[z]
+        {
+            log_stream << alu_table_names[y] << " " << r_name<index>(z, instr) << std::endl;
+            break;
+        }
+        case 3: // X = 3
+        {
+            if(z == 0) // RET cc[y]
+                log_stream << "RET " << cc_table_names[y] << std::endl;
+            else if(z == 1 && q == 0) // POP rp2[p]
+                log_stream << "POP " << rp2_name << std::endl;
+            else if(z == 1 && p == 0) // RET
+                log_stream << "RET" << std::endl;
+            else if(z == 1 && p == 1) // EXX
+                log_stream << "EXX" << std::endl;
+            else if(z == 1 && p == 2) // JP (HL)
+                log_stream << "JP (" << index_name<index>() << ")" << std::endl;
+            else if(z == 1) // LD SP, HL
+                log_stream << "LD SP, " << index_name<index>() << std::endl;
+            else if(z == 2) // JP cc[y], nn
+                log_stream << "JP " << cc_table_names[y] << ", " << instr.operand << std::endl;
+            else if(z == 3 && y == 0) // JP nn
+                log_stream << "JP " << instr.operand << std::endl;
+            else if(z == 3 && y == 2) // OUT (n), A
+                log_stream << "OUT (" << instr.operand << "), A" << std::endl;
+            else if(z == 3 && y == 3) // IN A, (n)
+                log_stream << "IN A, (" << instr.operand << ")" << std::endl;
+            else if(z == 3 && y == 4) // EX (SP), HL
+                log_stream << "EX (SP), " << index_name<index>() << std::endl;
+            else if(z == 3 && y == 6) // DI
+                log_stream << "DI" << std::endl;
+            else if(z == 3 && y == 7) // EI
+                log_stream << "EI" << std::endl;
+            else if(z == 4) // CALL cc[y], nn
+                log_stream << "CALL " << cc_table_names[y] << ", " << instr.operand << std::endl;
+            else if(z == 5 && q == 0) // PUSH rp2[p]
+                log_stream << "PUSH " << rp2_name << std::endl;
+            else if(z == 5 && p == 0) // CALL nn
+                log_stream << "CALL " << instr.operand << std::endl;
+            else if(z == 6) // alu[y] n
+                log_stream << alu_table_names[y] << " " << instr.operand << std::endl;
+            else if(z == 7) // RST y*8
+                log_stream << "RST " << y * 8 << std::endl;
+            break;
+        }
+        default:
+            abort();
+    }
+}
+
+void Emulator::log_ed(const Instruction &instr, std::ostream &log_stream)
+{
+    uint8_t x, y, z;
+    x = (instr.opcode >> 6) & 0x3;
+    y = (instr.opcode >> 3) & 0x7;
+    z = instr.opcode & 0x7;
+
+    if(x == 1 && z == 5) // RETN and RETI
+        log_stream << (y == 1 ? "RETI" : "RETN") << std::endl;
+    else if(x == 1 && z == 6) // IM im[y]
+    {
+        const int modes[8] = {0, 0, 1, 2, 0, 0, 1, 2};
+        log_stream << "IM " << modes[y] << std::endl;
+    }
+    else if(x == 1 && z == 7 && y == 0) // LD I, A
+        log_stream << "LD I, A" << std::endl;
+    else if(x == 1 && z == 7 && y == 2) // LD A, I
+        log_stream << "LD A, I" << std::endl;
+    else if(x == 2 && z <= 3 && y >= 4) // BLI[y, z]
+        log_stream << bli_table_names[y - 4][z] << std::endl;
+}
+
+template<Emulator::Index index>
+void Emulator::log_cb(const Instruction &instr, std::ostream &log_stream)
+{
+    uint8_t x, y, z;
+    x = (instr.opcode >> 6) & 0x3;
+    y = (instr.opcode >> 3) & 0x7;
+    z = instr.opcode & 0x7;
+
+    //DDCB and FDCB always work on (IX+d), and other than BIT, also copy the result to r[z]
+    std::string target = r_name<index>(index == Index::HL ? z : 6, instr);
+    std::string copy = index != Index::HL && z != 6 && x != 1 ? ", " + reg_table_r_names[z] : "";
+
+    const char *bit_names[4] = {"", "BIT", "RES", "SET"};
+    if(x == 0) // rot[y] r[z]
+        log_stream << rot_table_names[y] << " " << target << copy << std::endl;
+    else // BIT, RES and SET y, r[z]
+        log_stream << bit_names[x] << " " << (int)y << ", " << target << copy << std::endl;
+}
+
+void Emulator::load(const std::vector<uint8_t> &data)
+{
+    copy_program(0, data.data(), data.size());
+    start_program(0, data.size());
+}
+
+void Emulator::load(const ProgramImage &image)
+{
+    for(const ProgramImage::Segment &segment : image.get_segments())
+    {
+        //ROM is mapped straight from the image, so it's shared rather than copied, but only whole pages can be mapped
+        if(image.is_read_only() && segment.address % memory_page_size == 0)
+        {
+            uint8_t first_page = segment.address / memory_page_size;
+            uint8_t page_count = (segment.size + memory_page_size - 1) / memory_page_size;
+            map_memory(first_page, page_count, {segment.data, nullptr});
+            std::fill_n(page_images.begin() + first_page, std::min<size_t>(page_count, memory_page_count - first_page), image.shared_from_this());
+        }
+        else
+            copy_program(segment.address, segment.data, segment.size);
+    }
+
+    if(image.has_registers())
+    {
+        reg = image.get_registers();
+        pending_flags.op = FlagOp::None;
+    }
+    start_program(image.get_entry(), image.get_end());
+}
+
+void Emulator::copy_program(uint16_t address, const uint8_t *data, size_t size)
+{
+    memcpy(memory + address, data, size);
+    for(size_t page = address >> 8; page < (address + size + 0xFF) >> 8; ++page)
+        dirty_pages[page] = true;
+}
+
+void Emulator::start_program(uint16_t entry, size_t end)
+{
+    //The program was copied in bypassing write_memory(), so drop any cached code
+    if(jit)
+        jit->flush();
+    if(block_cache)
+        block_cache->clear();
+    watched_pages.fill(memory_hook_active);
+    watch_mmio_pages();
+    watch_clean_pages();
+
+    reg.PC = entry;
+    halted = false;
+    program_end = end;
+    cycle_deadline = cycles;
+}
+
+void Emulator::load_memory(const uint8_t *image, size_t end)
+{
+    memcpy(memory, image, sizeof(memory));
+    if(jit)
+        jit->flush();
+    if(block_cache)
+        block_cache->clear();
+    watched_pages.fill(memory_hook_active);
+    watch_mmio_pages();
+    snapshot_base.reset();
+
+    halted = false;
+    program_end = end;
+    cycle_deadline = cycles;
+}
+
+std::shared_ptr<const Snapshot> Emulator::snapshot()
+{
+    std::shared_ptr<Snapshot> snapshot(new Snapshot());
+
+    //Pages which are clean still match the base snapshot, so share them rather than copying
+    for(size_t page = 0; page < Snapshot::page_count; ++page)
+    {
+        if(snapshot_base && !dirty_pages[page])
+        {
+            snapshot->pages[page] = snapshot_base->pages[page];
+        }
+        else
+        {
+            std::shared_ptr<Snapshot::Page> copy(new Snapshot::Page);
+            memcpy(copy->data(), memory + page * Snapshot::page_size, Snapshot::page_size);
+            snapshot->pages[page] = std::move(copy);
+        }
+    }
+
+    snapshot->low_ports = low_ports;
+    snapshot->high_ports = high_ports;
+    snapshot->default_port = default_port;
+    snapshot->port_functions = port_functions;
+    snapshot->bank_switches = bank_switches;
+
+    for(size_t page = 0; page < memory_page_count; ++page)
+    {
+        snapshot->mmio_pages[page] = mmio_pages[page];
+        snapshot->page_images[page] = page_images[page];
+        if(read_pages[page] == memory + page * memory_page_size)
+            snapshot->banks[page] = {nullptr, nullptr};
+        else
+            snapshot->banks[page] = {read_pages[page], write_pages[page] == write_sink ? nullptr : write_pages[page]};
+    }
+
+    resolve_flags();
+    snapshot->reg = reg;
+    snapshot->halted = halted;
+    snapshot->program_end = program_end;
+    snapshot->cycles = cycles;
+    snapshot->cycle_deadline = cycle_deadline;
+    snapshot->irq_requested = irq_requested;
+    snapshot->irq_data = irq_data;
+    snapshot->nmi_requested = nmi_requested;
+    snapshot->ei_delay = ei_delay;
+    snapshot->timer_period = timer_period;
+    snapshot->timer_data = timer_data;
+    snapshot->next_timer = next_timer;
+
+    //Further snapshots and restores only need the pages written from here on
+    snapshot_base = snapshot;
+    dirty_pages.fill(false);
+    watch_clean_pages();
+    return snapshot;
+}
+
+void Emulator::restore(const std::shared_ptr<const Snapshot> &snapshot)
+{
+    //Memory matches the base snapshot except for dirty pages, so only those and the pages the two snapshots don't share need copying
+    for(size_t page = 0; page < Snapshot::page_count; ++page)
+    {
+        const std::shared_ptr<const Snapshot::Page> &source = snapshot->pages[page];
+        if(snapshot_base && !dirty_pages[page] && snapshot_base->pages[page] == source)
+            continue;
+
+        memcpy(memory + page * Snapshot::page_size, source->data(), Snapshot::page_size);
+        if(block_cache)
+            block_cache->invalidate_page(page);
+    }
+    snapshot_base = snapshot;
+    dirty_pages.fill(false);
+    watch_clean_pages();
+
+    //Bound functors are copied, so point their bindings at our copies
+    port_functions = snapshot->port_functions;
+    low_ports = snapshot->low_ports;
+    high_ports = snapshot->high_ports;
+    default_port = snapshot->default_port;
+    for(auto &function : port_functions)
+        bind_port(function.first, &Emulator::call_port_function, &function.second);
+
+    //Bank switches belonging to another emulator would switch its banks, so bind copies of them
+    bank_switches = snapshot->bank_switches;
+    for(auto &bank_switch : bank_switches)
+    {
+        if(bank_switch->emulator == this)
+            continue;
+
+        std::shared_ptr<BankSwitch> copy = std::make_shared<BankSwitch>(*bank_switch);
+        copy->emulator = this;
+        for(PortBinding &binding : low_ports)
+            if(binding.context == bank_switch.get())
+                binding.context = copy.get();
+        for(auto &port : high_ports)
+            if(port.second.context == bank_switch.get())
+                port.second.context = copy.get();
+        if(default_port.context == bank_switch.get())
+            default_port.context = copy.get();
+        bank_switch = std::move(copy);
+    }
+
+    for(uint8_t page = 0; page < memory_page_count; ++page)
+    {
+        const Bank &bank = snapshot->banks[page];
+        if(bank.read)
+            map_mmio(page, 1, bank, snapshot->mmio_pages[page].callback, snapshot->mmio_pages[page].context);
+        else
+            unmap_memory(page, 1);
+        page_images[page] = snapshot->page_images[page];
+    }
+
+    reg = snapshot->reg;
+    pending_flags.op = FlagOp::None;
+    halted = snapshot->halted;
+    program_end = snapshot->program_end;
+    cycles = snapshot->cycles;
+    cycle_deadline = snapshot->cycle_deadline;
+    irq_requested = snapshot->irq_requested;
+    irq_data = snapshot->irq_data;
+    nmi_requested = snapshot->nmi_requested;
+    ei_delay = snapshot->ei_delay;
+    timer_period = snapshot->timer_period;
+    timer_data = snapshot->timer_data;
+    next_timer = snapshot->next_timer;
+    update_interrupt_pending();
+
+    //Coverage starts afresh, rather than recording an edge from wherever we were to where the snapshot was
+    coverage_prev = 0;
+}
+
+template<typename ExecutionPolicy>
+void Emulator::emulate(const std::vector<uint8_t> &data, std::ostream *log_stream)
+{
+    load(data);
+    cycle_deadline = UINT64_MAX;
+    run_engine<ExecutionPolicy>(log_stream);
+    cycle_deadline = cycles;
+}
+
+template<typename ExecutionPolicy>
+void Emulator::emulate(const ProgramImage &image, std::ostream *log_stream)
+{
+    load(image);
+    cycle_deadline = UINT64_MAX;
+    run_engine<ExecutionPolicy>(log_stream);
+    cycle_deadline = cycles;
+}
+
+template<typename ExecutionPolicy>
+uint64_t Emulator::run_for_cycles(uint64_t budget, std::ostream *log_stream)
+{
+    static_assert(ExecutionPolicy::count_cycles, "run_for_cycles() needs a policy which counts cycles");
+
+    // The deadline carries on from the last one rather than from now, so overruns are paid back
+    uint64_t start = cycles;
+    cycle_deadline += budget;
+    run_engine<ExecutionPolicy>(log_stream);
+    return cycles - start;
+}
+
+template<typename ExecutionPolicy>
+size_t Emulator::run(size_t instructions, std::ostream *log_stream)
+{
+    // Only run_for_cycles() stops at the cycle deadline, anything run here is counted towards the next one
+    uint64_t deadline = cycle_deadline;
+    cycle_deadline = UINT64_MAX;
+    instructions_left = instructions;
+    run_engine<Stepped<ExecutionPolicy>>(log_stream);
+    cycle_deadline = std::max(deadline, cycles);
+    return instructions - instructions_left;
+}
+
+template<typename ExecutionPolicy>
+bool Emulator::run_until(uint16_t address, size_t max_instructions, std::ostream *log_stream)
+{
+    // Step off the breakpoint first, in case we're stopped on it
+    if(max_instructions == 0 || run<ExecutionPolicy>(1, log_stream) == 0)
+        return false;
+
+    breakpoint = address;
+    run<ExecutionPolicy>(max_instructions - 1, log_stream);
+    breakpoint = 0x10000;
+    return reg.PC == address;
+}
+
+template<typename ExecutionPolicy>
+bool Emulator::run_until(const std::function<bool(const Emulator &)> &predicate, size_t max_instructions, std::ostream *log_stream)
+{
+    for(size_t i = 0; i < max_instructions; ++i)
+    {
+        if(predicate(*this))
+            return true;
+        if(run<ExecutionPolicy>(1, log_stream) == 0)
+            return false;
+    }
+    return predicate(*this);
+}
+
+template<typename ExecutionPolicy>
+void Emulator::run_engine(std::ostream *log_stream)
+{
+    //With memory hooks every page is watched, otherwise only pages holding cached code are
+    bool hooks_active = ExecutionPolicy::memory_hooks && memory_hook;
+    if(hooks_active != memory_hook_active)
+    {
+        if(jit)
+            jit->flush();
+        if(block_cache)
+            block_cache->clear();
+        memory_hook_active = hooks_active;
+        watched_pages.fill(memory_hook_active);
+        watch_mmio_pages();
+        watch_clean_pages();
+    }
+
+    extra_t_states = 0;
+    if constexpr(ExecutionPolicy::profile)
+    {
+        if(profiler)
+            profiler->resume(reg.PC);
+    }
+    while(true)
+    {
+        update_timer();
+        if(limit_reached<ExecutionPolicy>())
+            break;
+        if(interrupt_pending)
+            accept_interrupt<ExecutionPolicy>(log_stream);
+        if(halted)
+        {
+            if(!skip_halt())
+                break;
+            continue;
+        }
+        if(reg.PC >= program_end)
+            break;
+
+        // The engines return when a limit is reached, or the CPU halts or has an interrupt to accept
+        switch(engine)
+        {
+            case Engine::Portable:
+                run_portable<ExecutionPolicy>(program_end, log_stream);
+                break;
+            case Engine::Threaded:
+                run_threaded<ExecutionPolicy>(program_end, log_stream);
+                break;
+            case Engine::Cached:
+                run_cached<ExecutionPolicy>(program_end, log_stream);
+                break;
+            case Engine::Native:
+                run_native<ExecutionPolicy>(program_end, log_stream);
+                break;
+            default:
+                abort();
+        }
+    }
+
+    if constexpr(ExecutionPolicy::profile)
+    {
+        if(profiler)
+            profiler->pause(*this, reg.PC);
+    }
+
+    //F is only left pending inside the loop, so callers always see it up to date
+    resolve_flags();
+}
+
+// after_instruction() is expanded into every handler of every loop. In a file this size GCC gives up inlining
+// it part way through the policies which add anything to it, which leaves a call per instruction.
+#if defined(__GNUC__)
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+template<typename ExecutionPolicy>
+ALWAYS_INLINE void Emulator::after_instruction(const Instruction &instr, std::ostream *log_stream)
+{
+    if constexpr(ExecutionPolicy::trace == TextTrace)
+        log_instruction(instr, *log_stream);
+    else if constexpr(ExecutionPolicy::trace == BinaryTrace)
+        trace_instruction(instr);
+    if constexpr(ExecutionPolicy::profile)
+    {
+        //Straight line code is counted a run at a time, so the profiler only needs to see where runs end
+        if(profiler && (reg.PC != (uint16_t)(instr.pc + instr.length) || extra_t_states))
+            profiler->record(*this, instr, extra_t_states, reg.PC);
+        if constexpr(!ExecutionPolicy::count_cycles)
+            extra_t_states = 0;
+    }
+    if constexpr(ExecutionPolicy::count_cycles)
+    {
+        cycles += opcode_tables[instr.prefix][instr.opcode].t_states + extra_t_states;
+        extra_t_states = 0;
+    }
+    if constexpr(ExecutionPolicy::coverage)
+    {
+        if(coverage_map)
+        {
+            ++coverage_map[(coverage_prev ^ instr.pc) & coverage_mask];
+            coverage_prev = instr.pc >> 1;
+        }
+    }
+    if constexpr(ExecutionPolicy::stepped)
+        --instructions_left;
+}
+
+template<typename ExecutionPolicy>
+void Emulator::run_portable(size_t end, std::ostream *log_stream)
+{
+    Instruction instr;
+    while(running<ExecutionPolicy>(end))
+    {
+        decode(reg.PC, instr);
+        reg.PC += instr.length;
+        (this->*instr.handler)(instr);
+        after_instruction<ExecutionPolicy>(instr, log_stream);
+    }
+}
+
+void Emulator::trace_instruction(const Instruction &instr)
+{
+    if(!trace_writer)
+        return;
+
+    // Rebuilt from the decoded instruction rather than read back from memory, in case the instruction overwrote itself
+    TraceRecord &record = trace_writer->claim();
+    uint8_t i = 0;
+    switch(instr.prefix)
+    {
+        case Prefix::CB:
+            record.bytes[i++] = 0xCB;
+            break;
+        case Prefix::DD:
+        case Prefix::DDCB:
+            record.bytes[i++] = 0xDD;
+            break;
+        case Prefix::ED:
+            record.bytes[i++] = 0xED;
+            break;
+        case Prefix::FD:
+        case Prefix::FDCB:
+            record.bytes[i++] = 0xFD;
+            break;
+        default:
+            break;
+    }
+    if(instr.prefix == Prefix::DDCB || instr.prefix == Prefix::FDCB) // Displacement comes before the opcode
+    {
+        record.bytes[i++] = 0xCB;
+        record.bytes[i++] = instr.operand;
+    }
+    record.bytes[i++] = instr.opcode;
+    for(uint16_t operand = instr.operand; i < instr.length; ++i, operand >>= 8)
+    {
+        record.bytes[i] = operand;
+    }
+    for(; i < sizeof(record.bytes); ++i)
+    {
+        record.bytes[i] = 0;
+    }
+
+    record.pc = instr.pc;
+    record.length = instr.length;
+    if(trace_writer->records_registers())
+    {
+        record.flags = TraceRecord::has_registers;
+        resolve_flags();
+        record.AF = reg.general.AF;
+        record.BC = reg.general.BC;
+        record.DE = reg.general.DE;
+        record.HL = reg.general.HL;
+        record.SP = reg.SP;
+    }
+    else
+    {
+        record.flags = 0;
+        record.AF = record.BC = record.DE = record.HL = record.SP = 0;
+    }
+    record.reserved = 0;
+    trace_writer->commit();
+}
+
+void Emulator::watched_write(uint16_t addr, uint8_t val)
+{
+    if(memory_hook_active)
+        memory_hook(addr, val);
+    const MmioBinding &mmio = mmio_pages[addr >> 12];
+    if(mmio.callback)
+        mmio.callback(mmio.context, addr, val);
+
+    if(block_cache && block_cache->invalidate_page(addr >> 8))
+        code_modified = true;
+    if(!memory_hook_active && !mmio.callback)
+        watched_pages[addr >> 8] = false;
+    dirty_pages[addr >> 8] = true;
+}
+
+void Emulator::watch_clean_pages()
+{
+    if(!snapshot_base)
+        return;
+    for(size_t page = 0; page < watched_pages.size(); ++page)
+        watched_pages[page] |= !dirty_pages[page];
+}
+
+void Emulator::watch_mmio_pages()
+{
+    for(size_t page = 0; page < watched_pages.size(); ++page)
+        watched_pages[page] |= mmio_pages[page / (memory_page_size >> 8)].callback != nullptr;
+}
+
+uint16_t Emulator::build_block(uint16_t pc, size_t end, std::vector<Instruction> &instructions)
+{
+    uint16_t addr = pc;
+    size_t size = 0;
+    Instruction instr;
+    do
+    {
+        decode(addr, instr);
+        instructions.emplace_back(instr);
+        addr += instr.length;
+        size += instr.length;
+    } while(addr < end && size < BlockCache::page_size && !opcode_tables[instr.prefix][instr.opcode].ends_block);
+
+    return size;
+}
+
+template<typename ExecutionPolicy>
+void Emulator::run_cached(size_t end, std::ostream *log_stream)
+{
+    if(!block_cache)
+        block_cache = std::make_unique<BlockCache>();
+
+    while(running<ExecutionPolicy>(end))
+    {
+        BlockCache::Block *block = block_cache->find(reg.PC);
+        if(!block)
+        {
+            auto new_block = std::make_unique<BlockCache::Block>();
+            new_block->start = reg.PC;
+            new_block->size = build_block(reg.PC, end, new_block->instructions);
+            block = block_cache->insert(std::move(new_block), watched_pages);
+        }
+
+        execute_block<ExecutionPolicy>(block->instructions, log_stream);
+        block_cache->release();
+    }
+}
+
+template<typename ExecutionPolicy>
+void Emulator::execute_block(const std::vector<Instruction> &instructions, std::ostream *log_stream)
+{
+    code_modified = false;
+    for(const Instruction &instr : instructions)
+    {
+        reg.PC += instr.length;
+        (this->*instr.handler)(instr);
+        after_instruction<ExecutionPolicy>(instr, log_stream);
+        if(code_modified || halted || interrupt_pending || limit_reached<ExecutionPolicy>())
+            break;
+    }
+}
+
+template<typename ExecutionPolicy>
+void Emulator::run_native(size_t end, std::ostream *log_stream)
+{
+    if(!block_cache)
+        block_cache = std::make_unique<BlockCache>();
+    if(!jit)
+    {
+        jit = std::make_unique<Jit>(*this);
+        block_cache->set_retire_hook([this](BlockCache::Block &block) {
+            if(block.compiled)
+                jit->discard(block.compiled);
+        });
+    }
+    if(!jit->available() || ExecutionPolicy::count_cycles || ExecutionPolicy::stepped || ExecutionPolicy::coverage || ExecutionPolicy::profile
+       || ExecutionPolicy::trace == BinaryTrace) // Compiled code doesn't count cycles or instructions, record coverage, profile or write binary traces
+    {
+        run_cached<ExecutionPolicy>(end, log_stream);
+        return;
+    }
+
+    while(running<ExecutionPolicy>(end))
+    {
+        BlockCache::Block *block = block_cache->find(reg.PC);
+        if(!block)
+        {
+            auto new_block = std::make_unique<BlockCache::Block>();
+            new_block->start = reg.PC;
+            new_block->size = build_block(reg.PC, end, new_block->instructions);
+            block = block_cache->insert(std::move(new_block), watched_pages);
+        }
+
+        if(!block->compiled && ++block->executions >= Jit::hot_threshold)
+            jit->compile(*block, end, ExecutionPolicy::trace == TextTrace ? log_stream : nullptr);
+
+        jit->link_last_exit(block->compiled);
+        if(block->compiled)
+        {
+            code_modified = false;
+            resolve_flags();
+            jit->run(block->compiled);
+        }
+        else
+        {
+            execute_block<ExecutionPolicy>(block->instructions, log_stream);
+        }
+        block_cache->release();
+    }
+}
+
+bool Emulator::jit_execute(Emulator *emu, const Instruction *instr)
+{
+    emu->reg.PC = instr->pc + instr->length;
+    (emu->*instr->handler)(*instr);
+    emu->resolve_flags(); // Compiled code reads F directly
+    return emu->code_modified || emu->halted || emu->interrupt_pending;
+}
+
+bool Emulator::jit_execute_logged(Emulator *emu, const Instruction *instr, std::ostream *log_stream)
+{
+    emu->reg.PC = instr->pc + instr->length;
+    (emu->*instr->handler)(*instr);
+    emu->resolve_flags();
+    emu->log_instruction(*instr, *log_stream);
+    return emu->code_modified || emu->halted || emu->interrupt_pending;
+}
+
+void Emulator::jit_log(Emulator *emu, const Instruction *instr, std::ostream *log_stream)
+{
+    emu->log_instruction(*instr, *log_stream);
+}
+
+#if defined(__GNUC__)
+
+// Expands X(0x00) to X(0xFF)
+#define THREADED_ROW(X, row) X(row##0) X(row##1) X(row##2) X(row##3) X(row##4) X(row##5) X(row##6) X(row##7) \
+                             X(row##8) X(row##9) X(row##A) X(row##B) X(row##C) X(row##D) X(row##E) X(row##F)
+#define THREADED_ALL(X) THREADED_ROW(X, 0x0) THREADED_ROW(X, 0x1) THREADED_ROW(X, 0x2) THREADED_ROW(X, 0x3) \
+                        THREADED_ROW(X, 0x4) THREADED_ROW(X, 0x5) THREADED_ROW(X, 0x6) THREADED_ROW(X, 0x7) \
+                        THREADED_ROW(X, 0x8) THREADED_ROW(X, 0x9) THREADED_ROW(X, 0xA) THREADED_ROW(X, 0xB) \
+                        THREADED_ROW(X, 0xC) THREADED_ROW(X, 0xD) THREADED_ROW(X, 0xE) THREADED_ROW(X, 0xF)
+
+#define THREADED_LABEL(op) &&op_##op,
+#define THREADED_DD_LABEL(op) &&dd_##op,
+#define THREADED_FD_LABEL(op) &&fd_##op,
+
+#define THREADED_DISPATCH() \
+    do \
+    { \
+        if(!running<ExecutionPolicy>(end)) \
+            return; \
+        goto *labels[read_memory(reg.PC)]; \
+    } while(0)
+
+// The DD and FD prefixes jump on through their own label tables, other prefix bytes go through decode().
+// Everything else has its operands fetched and handler inlined here.
+#define THREADED_HANDLER(op) \
+    op_##op: \
+    { \
+        if constexpr(op == 0xDD) \
+        { \
+            goto *dd_labels[read_memory(reg.PC + 1)]; \
+        } \
+        else if constexpr(op == 0xFD) \
+        { \
+            goto *fd_labels[read_memory(reg.PC + 1)]; \
+        } \
+        else if constexpr(next_table(Prefix::None, op) != Prefix::None) \
+        { \
+            decode(reg.PC, instr); \
+            reg.PC += instr.length; \
+            (this->*instr.handler)(instr); \
+        } \
+        else \
+        { \
+            constexpr uint8_t bytes = operand_bytes(Prefix::None, op); \
+            instr.pc = reg.PC; \
+            instr.prefix = Prefix::None; \
+            instr.opcode = op; \
+            instr.length = 1 + bytes; \
+            if constexpr(bytes == 1) \
+                instr.operand = read_memory(reg.PC + 1); \
+            else if constexpr(bytes == 2) \
+                instr.operand = read_memory(reg.PC + 1) | (read_memory(reg.PC + 2) << 8); \
+            reg.PC += 1 + bytes; \
+            execute_main<op>(instr); \
+        } \
+        after_instruction<ExecutionPolicy>(instr, log_stream); \
+        THREADED_DISPATCH(); \
+    }
+
+// (IX+d) and (IY+d) accesses are inlined as unprefixed opcodes are, the rest of the DD and FD pages share one call through the tables
+#define THREADED_INDEXED_HANDLER(label, table, op) \
+    label: \
+    { \
+        if constexpr(!indexed(op)) \
+        { \
+            goto indexed_call; \
+        } \
+        else \
+        { \
+            constexpr uint8_t bytes = operand_bytes(table, op); \
+            instr.pc = reg.PC; \
+            instr.prefix = table; \
+            instr.opcode = op; \
+            instr.length = 2 + bytes; \
+            if constexpr(bytes == 1) \
+                instr.operand = read_memory(reg.PC + 2); \
+            else \
+                instr.operand = read_memory(reg.PC + 2) | (read_memory(reg.PC + 3) << 8); \
+            reg.PC += 2 + bytes; \
+            execute_main<op, table == Prefix::DD ? Index::IX : Index::IY>(instr); \
+            after_instruction<ExecutionPolicy>(instr, log_stream); \
+            THREADED_DISPATCH(); \
+        } \
+    }
+
+#define THREADED_DD_HANDLER(op) THREADED_INDEXED_HANDLER(dd_##op, Prefix::DD, op)
+#define THREADED_FD_HANDLER(op) THREADED_INDEXED_HANDLER(fd_##op, Prefix::FD, op)
+
+template<typename ExecutionPolicy>
+void Emulator::run_threaded(size_t end, std::ostream *log_stream)
+{
+    static const void *const labels[0x100] = {THREADED_ALL(THREADED_LABEL)};
+    static const void *const dd_labels[0x100] = {THREADED_ALL(THREADED_DD_LABEL)};
+    static const void *const fd_labels[0x100] = {THREADED_ALL(THREADED_FD_LABEL)};
+
+    Instruction instr;
+    THREADED_DISPATCH();
+    THREADED_ALL(THREADED_HANDLER)
+    THREADED_ALL(THREADED_DD_HANDLER)
+    THREADED_ALL(THREADED_FD_HANDLER)
+
+indexed_call:
+    decode_indexed(reg.PC, read_memory(reg.PC) == 0xDD ? Prefix::DD : Prefix::FD, instr);
+    reg.PC += instr.length;
+    (this->*instr.handler)(instr);
+    after_instruction<ExecutionPolicy>(instr, log_stream);
+    THREADED_DISPATCH();
+}
+
+#undef THREADED_FD_HANDLER
+#undef THREADED_DD_HANDLER
+#undef THREADED_INDEXED_HANDLER
+#undef THREADED_HANDLER
+#undef THREADED_DISPATCH
+#undef THREADED_FD_LABEL
+#undef THREADED_DD_LABEL
+#undef THREADED_LABEL
+#undef THREADED_ALL
+#undef THREADED_ROW
+
+#else
+
+template<typename ExecutionPolicy>
+void Emulator::run_threaded(size_t end, std::ostream *log_stream)
+{
+    run_portable<ExecutionPolicy>(end, log_stream);
+}
+
+#endif
+
+// Every combination of policy features is available to users of the library, except coverage and profiling which are only needed without tracing
+#define INSTANTIATE_POLICY(trace, count_cycles, memory_hooks, coverage, profile) \
+    template void Emulator::emulate<Emulator::Policy<trace, count_cycles, memory_hooks, coverage, profile>>(const std::vector<uint8_t> &, std::ostream *); \
+    template void Emulator::emulate<Emulator::Policy<trace, count_cycles, memory_hooks, coverage, profile>>(const ProgramImage &, std::ostream *); \
+    template size_t Emulator::run<Emulator::Policy<trace, count_cycles, memory_hooks, coverage, profile>>(size_t, std::ostream *); \
+    template bool Emulator::run_until<Emulator::Policy<trace, count_cycles, memory_hooks, coverage, profile>>(uint16_t, size_t, std::ostream *); \
+    template bool Emulator::run_until<Emulator::Policy<trace, count_cycles, memory_hooks, coverage, profile>>(const std::function<bool(const Emulator &)> &, size_t, std::ostream *);
+
+INSTANTIATE_POLICY(Emulator::NoTrace, false, false, false, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, false, true, false, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, false, false, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, true, false, false)
+INSTANTIATE_POLICY(Emulator::TextTrace, false, false, false, false)
+INSTANTIATE_POLICY(Emulator::TextTrace, false, true, false, false)
+INSTANTIATE_POLICY(Emulator::TextTrace, true, false, false, false)
+INSTANTIATE_POLICY(Emulator::TextTrace, true, true, false, false)
+INSTANTIATE_POLICY(Emulator::BinaryTrace, false, false, false, false)
+INSTANTIATE_POLICY(Emulator::BinaryTrace, false, true, false, false)
+INSTANTIATE_POLICY(Emulator::BinaryTrace, true, false, false, false)
+INSTANTIATE_POLICY(Emulator::BinaryTrace, true, true, false, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, false, false, true, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, false, true, true, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, false, true, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, true, true, false)
+INSTANTIATE_POLICY(Emulator::NoTrace, false, false, false, true)
+INSTANTIATE_POLICY(Emulator::NoTrace, false, true, false, true)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, false, false, true)
+INSTANTIATE_POLICY(Emulator::NoTrace, true, true, false, true)
+
+#undef INSTANTIATE_POLICY
+
+// run_for_cycles() is available with every policy which counts cycles
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, false>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::TextTrace, true, false>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::TextTrace, true, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::BinaryTrace, true, false>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::BinaryTrace, true, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, false, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, true, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, false, false, true>>(uint64_t, std::ostream *);
+template uint64_t Emulator::run_for_cycles<Emulator::Policy<Emulator::NoTrace, true, true, false, true>>(uint64_t, std::ostream *);
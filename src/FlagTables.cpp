@@ -0,0 +1,155 @@
+#include "FlagTables.h"
+
+namespace
+{
+    constexpr uint8_t sz53(uint8_t result)
+    {
+        uint8_t flags = result & (FlagTables::S | FlagTables::Y | FlagTables::X);
+        if(result == 0)
+            flags |= FlagTables::Z;
+        return flags;
+    }
+
+    constexpr bool even_parity(uint8_t val)
+    {
+        val ^= val >> 4;
+        val ^= val >> 2;
+        val ^= val >> 1;
+        return (val & 1) == 0;
+    }
+
+    constexpr FlagTables::table_t make_sz_table()
+    {
+        FlagTables::table_t table{};
+        for(unsigned int a = 0; a < 0x100; ++a)
+        {
+            table[a] = sz53(a);
+        }
+        return table;
+    }
+
+    constexpr FlagTables::table_t make_szp_table()
+    {
+        FlagTables::table_t table{};
+        for(unsigned int a = 0; a < 0x100; ++a)
+        {
+            table[a] = sz53(a) | (even_parity(a) ? FlagTables::PV : 0);
+        }
+        return table;
+    }
+
+    constexpr FlagTables::table_t make_inc_table()
+    {
+        FlagTables::table_t table{};
+        for(unsigned int result = 0; result < 0x100; ++result)
+        {
+            table[result] = sz53(result);
+            if(result == 0x80) // If overflow
+                table[result] |= FlagTables::PV;
+            if((result & 0xF) == 0) // If carry from bit 3
+                table[result] |= FlagTables::H;
+        }
+        return table;
+    }
+
+    constexpr FlagTables::table_t make_dec_table()
+    {
+        FlagTables::table_t table{};
+        for(unsigned int result = 0; result < 0x100; ++result)
+        {
+            table[result] = sz53(result) | FlagTables::N;
+            if(result == 0x7F) // If underflow
+                table[result] |= FlagTables::PV;
+            if((result & 0xF) == 0xF) // If borrow from bit 4
+                table[result] |= FlagTables::H;
+        }
+        return table;
+    }
+
+    constexpr std::array<FlagTables::shift_table_t, 8> make_shift_tables()
+    {
+        std::array<FlagTables::shift_table_t, 8> tables{};
+        for(unsigned int op = 0; op < 8; ++op)
+        {
+            for(unsigned int index = 0; index < 0x200; ++index)
+            {
+                uint8_t val = index & 0xFF;
+                uint8_t carry_in = index >> 8;
+                uint8_t result = 0;
+                uint8_t carry_out = 0;
+                switch(op)
+                {
+                    case 0: // RLC
+                        result = (val << 1) | (val >> 7);
+                        carry_out = val >> 7;
+                        break;
+                    case 1: // RRC
+                        result = (val >> 1) | (val << 7);
+                        carry_out = val & 1;
+                        break;
+                    case 2: // RL
+                        result = (val << 1) | carry_in;
+                        carry_out = val >> 7;
+                        break;
+                    case 3: // RR
+                        result = (val >> 1) | (carry_in << 7);
+                        carry_out = val & 1;
+                        break;
+                    case 4: // SLA
+                        result = val << 1;
+                        carry_out = val >> 7;
+                        break;
+                    case 5: // SRA
+                        result = (val >> 1) | (val & 0x80);
+                        carry_out = val & 1;
+                        break;
+                    case 6: // SLL, undocumented, shifts a 1 in
+                        result = (val << 1) | 1;
+                        carry_out = val >> 7;
+                        break;
+                    default: // SRL
+                        result = val >> 1;
+                        carry_out = val & 1;
+                        break;
+                }
+                tables[op][index].result = result;
+                tables[op][index].flags = sz53(result) | (even_parity(result) ? FlagTables::PV : 0) | carry_out;
+            }
+        }
+        return tables;
+    }
+
+    constexpr std::array<FlagTables::table_t, 8> make_bit_tables()
+    {
+        std::array<FlagTables::table_t, 8> tables{};
+        for(unsigned int bit = 0; bit < 8; ++bit)
+        {
+            for(unsigned int val = 0; val < 0x100; ++val)
+            {
+                //X and Y come from the value tested. For BIT y, (HL) real hardware copies them from an internal address register, which isn't emulated.
+                uint8_t flags = FlagTables::H | (val & (FlagTables::X | FlagTables::Y));
+                if(val & (1 << bit))
+                    flags |= bit == 7 ? FlagTables::S : 0;
+                else
+                    flags |= FlagTables::Z | FlagTables::PV;
+                tables[bit][val] = flags;
+            }
+        }
+        return tables;
+    }
+
+    // Forces generation at compile time, the definitions below are then constant initialised from these
+    constexpr FlagTables::table_t sz_table = make_sz_table();
+    constexpr FlagTables::table_t szp_table = make_szp_table();
+    constexpr FlagTables::table_t inc_table = make_inc_table();
+    constexpr FlagTables::table_t dec_table = make_dec_table();
+    constexpr std::array<FlagTables::shift_table_t, 8> shift_tables = make_shift_tables();
+    constexpr std::array<FlagTables::table_t, 8> bit_tables = make_bit_tables();
+}
+
+const FlagTables::table_t FlagTables::sz = sz_table;
+const FlagTables::table_t FlagTables::szp = szp_table;
+const FlagTables::table_t FlagTables::inc = inc_table;
+const FlagTables::table_t FlagTables::dec = dec_table;
+const std::array<FlagTables::shift_table_t, 8> FlagTables::shift = shift_tables;
+const std::array<FlagTables::table_t, 8> FlagTables::bit = bit_tables;
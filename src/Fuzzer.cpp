@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstring>
+#include "Fuzzer.h"
+
+Fuzzer::Fuzzer(const std::vector<uint8_t> &program, size_t instruction_budget, Emulator::Engine engine)
+: emulator(engine), instruction_budget(instruction_budget), input(nullptr), input_size(0), input_pos(0)
+{
+    emulator.load(program);
+    start = emulator.snapshot();
+}
+
+Fuzzer::Fuzzer(std::shared_ptr<const Snapshot> start, size_t instruction_budget, Emulator::Engine engine)
+: emulator(engine), start(std::move(start)), instruction_budget(instruction_budget), input(nullptr), input_size(0), input_pos(0)
+{
+
+}
+
+void Fuzzer::set_coverage_map(uint8_t *map, size_t size)
+{
+    emulator.set_coverage_map(map, size);
+}
+
+Fuzzer::Status Fuzzer::run(const uint8_t *input_, size_t size)
+{
+    //Only the registers and the pages the last run wrote to need putting back
+    emulator.restore(start);
+    emulator.set_default_port_handler(&Fuzzer::port, this);
+    input = input_;
+    input_size = size;
+    input_pos = 0;
+    output.clear();
+
+    emulator.run<Emulator::Covered>(instruction_budget);
+    if(!emulator.is_finished())
+        return Status::Stopped;
+    return emulator.is_halted() ? Status::Halted : Status::Finished;
+}
+
+const std::vector<uint8_t> &Fuzzer::get_output() const
+{
+    return output;
+}
+
+const Emulator &Fuzzer::get_emulator() const
+{
+    return emulator;
+}
+
+void Fuzzer::port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size)
+{
+    Fuzzer &fuzzer = *static_cast<Fuzzer *>(context);
+    if(state == Emulator::PortState::Write)
+    {
+        fuzzer.output.insert(fuzzer.output.end(), data, data + size);
+        return;
+    }
+
+    size_t available = std::min<size_t>(size, fuzzer.input_size - fuzzer.input_pos);
+    memcpy(data, fuzzer.input + fuzzer.input_pos, available);
+    memset(data + available, 0xFF, size - available);
+    fuzzer.input_pos += available;
+}
@@ -0,0 +1,508 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include "Jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define JIT_SUPPORTED 1
+#endif
+
+namespace
+{
+    // Host registers, numbered as they're encoded in ModRM
+    enum HostReg : uint8_t
+    {
+        AL = 0,
+        CL = 1,
+        DL = 2,
+        AH = 4, // Only without a REX prefix
+    };
+
+    constexpr size_t arena_bytes = 4 * 1024 * 1024;
+
+    inline void emit(std::vector<uint8_t> &code, std::initializer_list<uint8_t> bytes)
+    {
+        code.insert(code.end(), bytes);
+    }
+
+    template<typename T>
+    inline void emit_imm(std::vector<uint8_t> &code, T val)
+    {
+        uint8_t bytes[sizeof(T)];
+        memcpy(bytes, &val, sizeof(T));
+        code.insert(code.end(), bytes, bytes + sizeof(T));
+    }
+
+    /*!
+     * Emits an instruction whose memory operand is [rbx + disp32]
+     *
+     * @param code The buffer to emit into
+     * @param opcode The opcode bytes, including any operand size prefix
+     * @param reg The register, or opcode extension, for the ModRM reg field
+     * @param disp The displacement from rbx
+     */
+    inline void emit_rbx(std::vector<uint8_t> &code, std::initializer_list<uint8_t> opcode, uint8_t reg, int32_t disp)
+    {
+        emit(code, opcode);
+        code.emplace_back(0x80 | (reg << 3) | 3);
+        emit_imm<int32_t>(code, disp);
+    }
+
+    /*!
+     * Emits a jump with a rel32 that's filled in later by bind()
+     *
+     * @return The offset of the rel32
+     */
+    inline size_t emit_jump(std::vector<uint8_t> &code, std::initializer_list<uint8_t> opcode)
+    {
+        emit(code, opcode);
+        emit_imm<int32_t>(code, 0);
+        return code.size() - 4;
+    }
+
+    /*!
+     * Points a jump emitted by emit_jump() at an offset in the same buffer
+     */
+    inline void bind(std::vector<uint8_t> &code, size_t at, size_t target)
+    {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(&code[at], &rel, 4);
+    }
+
+    /*!
+     * Gets the address a block ending instruction jumps to, when it's known at compile time
+     *
+     * @param instr The instruction
+     * @param target Set to the address
+     * @return True if the instruction has a fixed target
+     */
+    bool static_target(const Emulator::Instruction &instr, uint16_t &target)
+    {
+        if(instr.prefix != Emulator::Prefix::None)
+            return false;
+
+        uint8_t x = (instr.opcode >> 6) & 0x3;
+        uint8_t y = (instr.opcode >> 3) & 0x7;
+        uint8_t z = instr.opcode & 0x7;
+
+        if(x == 0 && z == 0 && y >= 2) // DJNZ d, JR d, JR cc[y-4], d
+        {
+            target = instr.pc + instr.length + (int8_t)instr.operand;
+            return true;
+        }
+        if(x == 3 && (z == 2 || z == 4 || instr.opcode == 0xC3 || instr.opcode == 0xCD)) // JP/CALL (cc), nn
+        {
+            target = instr.operand;
+            return true;
+        }
+        if(x == 3 && z == 7) // RST y*8
+        {
+            target = y * 8;
+            return true;
+        }
+        return false;
+    }
+}
+
+Jit::Jit(Emulator &emu)
+: emu(emu), arena(nullptr), arena_size(0), arena_used(0), last_exit(nullptr), chain_budget(0)
+{
+    auto offset = [&emu](const void *field) {
+        return (int32_t)((const uint8_t *)field - (const uint8_t *)&emu);
+    };
+    r_offsets = {offset(&emu.reg.general.B), offset(&emu.reg.general.C), offset(&emu.reg.general.D),
+                 offset(&emu.reg.general.E), offset(&emu.reg.general.H), offset(&emu.reg.general.L),
+                 0, offset(&emu.reg.general.A)};
+    rp_offsets = {offset(&emu.reg.general.BC), offset(&emu.reg.general.DE),
+                  offset(&emu.reg.general.HL), offset(&emu.reg.SP)};
+    f_offset = offset(&emu.reg.general.F);
+    pc_offset = offset(&emu.reg.PC);
+
+#ifdef JIT_SUPPORTED
+    // The arena is never writable and executable at once. Hosts which won't make it executable at all don't get the JIT.
+    void *mem = mmap(nullptr, arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem != MAP_FAILED)
+    {
+        if(mprotect(mem, arena_bytes, PROT_READ | PROT_EXEC) == 0)
+        {
+            arena = (uint8_t *)mem;
+            arena_size = arena_bytes;
+        }
+        else
+        {
+            munmap(mem, arena_bytes);
+        }
+    }
+#endif
+}
+
+Jit::~Jit()
+{
+    flush();
+#ifdef JIT_SUPPORTED
+    if(arena)
+        munmap(arena, arena_size);
+#endif
+}
+
+bool Jit::emit_native(std::vector<uint8_t> &code, const Emulator::Instruction &instr)
+{
+    if(instr.prefix != Emulator::Prefix::None)
+        return false;
+
+    uint8_t x = (instr.opcode >> 6) & 0x3;
+    uint8_t y = (instr.opcode >> 3) & 0x7;
+    uint8_t z = instr.opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
+
+    if(instr.opcode == 0x00) // NOP
+    {
+        return true;
+    }
+    if(instr.opcode == 0x18) // JR d
+    {
+        emit_rbx(code, {0x66, 0xC7}, 0, pc_offset); // mov word [PC], target
+        emit_imm<uint16_t>(code, instr.pc + instr.length + (int8_t)instr.operand);
+        return true;
+    }
+    if(x == 0 && z == 1 && q == 0) // LD rp[p], nn
+    {
+        emit_rbx(code, {0x66, 0xC7}, 0, rp_offsets[p]); // mov word [rp], nn
+        emit_imm<uint16_t>(code, instr.operand);
+        return true;
+    }
+    if(x == 0 && z == 3) // INC/DEC rp[p]
+    {
+        emit_rbx(code, {0x66, 0xFF}, q, rp_offsets[p]); // inc/dec word [rp]
+        return true;
+    }
+    if(x == 0 && (z == 4 || z == 5) && y != 6) // INC/DEC r[y]
+    {
+        // The host's INC/DEC set S, Z, H and overflow the same way, and leave carry alone
+        uint8_t val = y == 7 ? DL : CL;
+        emit(code, {0x31, 0xC0}); // xor eax, eax, so the flags don't depend on the previous instruction
+        if(y != 7)
+            emit_rbx(code, {0x8A}, CL, r_offsets[y]); // mov cl, [r]
+        emit(code, {0xFE, (uint8_t)((z == 4 ? 0xC0 : 0xC8) | val)}); // inc/dec r
+        emit(code, {0x9F}); // lahf
+        emit(code, {0x0F, 0x90, 0xC0}); // seto al
+        if(y != 7)
+            emit_rbx(code, {0x88}, CL, r_offsets[y]); // mov [r], cl
+        emit(code, {0xC0, 0xE0, 0x02}); // shl al, 2
+        emit(code, {0x80, 0xE4, 0xD0}); // and ah, S | Z | H
+        emit(code, {0x08, 0xC4}); // or ah, al
+        emit(code, {0x88, (uint8_t)(0xC0 | (val << 3))}); // mov al, r
+        emit(code, {0x24, 0x28}); // and al, X | Y
+        emit(code, {0x08, 0xC4}); // or ah, al
+        emit_rbx(code, {0x8A}, AL, f_offset); // mov al, [F]
+        emit(code, {0x24, 0x01}); // and al, C
+        emit(code, {0x08, 0xC4}); // or ah, al
+        if(z == 5)
+            emit(code, {0x80, 0xCC, 0x02}); // or ah, N
+        emit_rbx(code, {0x88}, AH, f_offset); // mov [F], ah
+        return true;
+    }
+    if(x == 0 && z == 6 && y != 6) // LD r[y], n
+    {
+        if(y == 7)
+            emit(code, {0xB2}); // mov dl, n
+        else
+            emit_rbx(code, {0xC6}, 0, r_offsets[y]); // mov byte [r], n
+        code.emplace_back(instr.operand);
+        return true;
+    }
+    if(x == 1 && y != 6 && z != 6) // LD r[y], r[z]
+    {
+        if(y == 7 && z == 7)
+            return true;
+        if(y == 7)
+        {
+            emit_rbx(code, {0x8A}, DL, r_offsets[z]); // mov dl, [r[z]]
+        }
+        else if(z == 7)
+        {
+            emit_rbx(code, {0x88}, DL, r_offsets[y]); // mov [r[y]], dl
+        }
+        else
+        {
+            emit_rbx(code, {0x8A}, CL, r_offsets[z]); // mov cl, [r[z]]
+            emit_rbx(code, {0x88}, CL, r_offsets[y]); // mov [r[y]], cl
+        }
+        return true;
+    }
+    if((x == 2 && z != 6) || (x == 3 && z == 6)) // alu[y] r[z] and alu[y] n
+    {
+        // ADD, ADC, SUB, SBC, AND, XOR, OR, CP, as the matching host op dl, cl
+        static constexpr uint8_t host_ops[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38};
+        bool arithmetic = y <= 3 || y == 7;
+
+        emit(code, {0x31, 0xC0}); // xor eax, eax, so the flags don't depend on the previous instruction
+        if(x == 3)
+            emit(code, {0xB1, (uint8_t)instr.operand}); // mov cl, n
+        else if(z == 7)
+            emit(code, {0x88, 0xD1}); // mov cl, dl
+        else
+            emit_rbx(code, {0x8A}, CL, r_offsets[z]); // mov cl, [r]
+        if(y == 1 || y == 3)
+        {
+            emit_rbx(code, {0x8A}, AL, f_offset); // mov al, [F]
+            emit(code, {0xD0, 0xE8}); // shr al, 1, moving the carry flag into the host's
+        }
+        emit(code, {host_ops[y], 0xCA}); // op dl, cl
+        emit(code, {0x9F}); // lahf, S Z - H - P - C line up with the Z80's flags
+        if(arithmetic)
+        {
+            emit(code, {0x0F, 0x90, 0xC0}); // seto al
+            emit(code, {0xC0, 0xE0, 0x02}); // shl al, 2
+            emit(code, {0x80, 0xE4, 0xD1}); // and ah, S | Z | H | C
+            emit(code, {0x08, 0xC4}); // or ah, al
+        }
+        else
+        {
+            // The host leaves H undefined for logical ops, the Z80 sets it for AND only
+            emit(code, {0x80, 0xE4, 0xC4}); // and ah, S | Z | P
+            if(y == 4)
+                emit(code, {0x80, 0xCC, 0x10}); // or ah, H
+        }
+        emit(code, {0x88, (uint8_t)(y == 7 ? 0xC8 : 0xD0)}); // mov al, dl (or cl for CP, which takes X/Y from the operand)
+        emit(code, {0x24, 0x28}); // and al, X | Y
+        emit(code, {0x08, 0xC4}); // or ah, al
+        if(y == 2 || y == 3 || y == 7)
+            emit(code, {0x80, 0xCC, 0x02}); // or ah, N
+        emit_rbx(code, {0x88}, AH, f_offset); // mov [F], ah
+        return true;
+    }
+    return false;
+}
+
+JitBlock *Jit::compile(BlockCache::Block &block, size_t end, std::ostream *log_stream)
+{
+    if(!available())
+        return nullptr;
+
+    auto compiled = std::make_unique<JitBlock>();
+    compiled->block = &block;
+    compiled->exit_count = 0;
+
+    std::vector<uint8_t> code;
+    std::vector<size_t> exit_jumps; // Jumps to the common exit
+
+    emit(code, {0x53}); // push rbx
+    emit(code, {0x48, 0x89, 0xFB}); // mov rbx, rdi
+    size_t body = code.size();
+    emit_rbx(code, {0x0F, 0xB6}, DL, r_offsets[7]); // movzx edx, byte [A], A is kept in dl while in native code
+
+    for(const Emulator::Instruction &instr : block.instructions)
+    {
+        bool last = &instr == &block.instructions.back();
+        if(last) // PC only needs to be right at the end of the block, or when calling a handler
+        {
+            emit_rbx(code, {0x66, 0xC7}, 0, pc_offset); // mov word [PC], next
+            emit_imm<uint16_t>(code, instr.pc + instr.length);
+        }
+
+        if(emit_native(code, instr))
+        {
+            if(log_stream)
+            {
+                emit_rbx(code, {0x88}, DL, r_offsets[7]); // mov [A], dl
+                emit(code, {0x48, 0x89, 0xDF}); // mov rdi, rbx
+                emit(code, {0x48, 0xBE}); // mov rsi, &instr
+                emit_imm<uint64_t>(code, (uintptr_t)&instr);
+                emit(code, {0x48, 0xBA}); // mov rdx, log_stream
+                emit_imm<uint64_t>(code, (uintptr_t)log_stream);
+                emit(code, {0x48, 0xB8}); // mov rax, &jit_log
+                emit_imm<uint64_t>(code, (uintptr_t)&Emulator::jit_log);
+                emit(code, {0xFF, 0xD0}); // call rax
+                emit_rbx(code, {0x0F, 0xB6}, DL, r_offsets[7]); // movzx edx, byte [A]
+            }
+        }
+        else
+        {
+            emit_rbx(code, {0x88}, DL, r_offsets[7]); // mov [A], dl
+            emit(code, {0x48, 0x89, 0xDF}); // mov rdi, rbx
+            emit(code, {0x48, 0xBE}); // mov rsi, &instr
+            emit_imm<uint64_t>(code, (uintptr_t)&instr);
+            if(log_stream)
+            {
+                emit(code, {0x48, 0xBA}); // mov rdx, log_stream
+                emit_imm<uint64_t>(code, (uintptr_t)log_stream);
+            }
+            emit(code, {0x48, 0xB8}); // mov rax, &jit_execute
+            emit_imm<uint64_t>(code, log_stream ? (uintptr_t)&Emulator::jit_execute_logged : (uintptr_t)&Emulator::jit_execute);
+            emit(code, {0xFF, 0xD0}); // call rax
+            emit(code, {0x84, 0xC0}); // test al, al
+            exit_jumps.emplace_back(emit_jump(code, {0x0F, 0x85})); // jnz exit, code was modified or HALT executed
+            emit_rbx(code, {0x0F, 0xB6}, DL, r_offsets[7]); // movzx edx, byte [A]
+        }
+    }
+
+    // Exits which can be chained: the fall through address, and the branch target if it's fixed
+    const Emulator::Instruction &last = block.instructions.back();
+    uint16_t targets[2];
+    size_t target_count = 0;
+    targets[target_count++] = block.start + block.size;
+    if(static_target(last, targets[target_count]) && targets[target_count] != targets[0])
+        ++target_count;
+
+    std::array<size_t, 2> chain_jumps{};
+    std::array<size_t, 2> stub_jumps{};
+    emit_rbx(code, {0x88}, DL, r_offsets[7]); // mov [A], dl
+    emit_rbx(code, {0x0F, 0xB7}, CL, pc_offset); // movzx ecx, word [PC]
+    for(size_t i = 0; i < target_count; ++i)
+    {
+        if(targets[i] >= end) // Emulation stops there, so there's nothing to chain to
+            continue;
+
+        JitExit &exit = compiled->exits[compiled->exit_count];
+        exit.target = targets[i];
+        exit.owner = compiled.get();
+        exit.linked = nullptr;
+
+        emit(code, {0x81, 0xF9}); // cmp ecx, target
+        emit_imm<uint32_t>(code, targets[i]);
+        size_t next = emit_jump(code, {0x0F, 0x85}); // jne next
+        emit(code, {0x48, 0xBA}); // mov rdx, &chain_budget
+        emit_imm<uint64_t>(code, (uintptr_t)&chain_budget);
+        emit(code, {0xFF, 0x0A}); // dec dword [rdx]
+        exit_jumps.emplace_back(emit_jump(code, {0x0F, 0x84})); // jz exit
+        chain_jumps[compiled->exit_count] = emit_jump(code, {0xE9}); // jmp stub, patched once the target is compiled
+        bind(code, next, code.size());
+        ++compiled->exit_count;
+    }
+
+    size_t exit_label = code.size();
+    emit(code, {0x5B}); // pop rbx
+    emit(code, {0xC3}); // ret
+    for(size_t at : exit_jumps)
+        bind(code, at, exit_label);
+
+    // Stubs record which exit was taken, so the dispatcher can chain it
+    for(size_t i = 0; i < compiled->exit_count; ++i)
+    {
+        bind(code, chain_jumps[i], code.size());
+        stub_jumps[i] = code.size();
+        emit(code, {0x48, 0xB8}); // mov rax, &last_exit
+        emit_imm<uint64_t>(code, (uintptr_t)&last_exit);
+        emit(code, {0x48, 0xB9}); // mov rcx, &exit
+        emit_imm<uint64_t>(code, (uintptr_t)&compiled->exits[i]);
+        emit(code, {0x48, 0x89, 0x08}); // mov [rax], rcx
+        bind(code, emit_jump(code, {0xE9}), exit_label); // jmp exit
+    }
+
+    // Copy into the arena, making room if needed
+    size_t start = (arena_used + 15) & ~(size_t)15;
+    if(start + code.size() > arena_size)
+    {
+        if(code.size() > arena_size)
+            return nullptr;
+        flush();
+        start = 0;
+    }
+    uint8_t *native = arena + start;
+    set_writable(native, code.size(), true);
+    memcpy(native, code.data(), code.size());
+    set_writable(native, code.size(), false);
+    arena_used = start + code.size();
+
+    compiled->entry = native;
+    compiled->body = native + body;
+    for(size_t i = 0; i < compiled->exit_count; ++i)
+    {
+        compiled->exits[i].jump = native + chain_jumps[i];
+        compiled->exits[i].stub = native + stub_jumps[i];
+    }
+
+    block.compiled = compiled.get();
+    compiled_blocks.emplace_back(std::move(compiled));
+    return block.compiled;
+}
+
+void Jit::run(JitBlock *compiled)
+{
+    last_exit = nullptr;
+    chain_budget = chain_limit;
+    ((native_block_t)compiled->entry)(&emu);
+}
+
+void Jit::link_last_exit(JitBlock *target)
+{
+    JitExit *exit = last_exit;
+    last_exit = nullptr;
+    if(!exit || !target || !exit->owner->block || exit->linked)
+        return;
+    if(exit->target == target->block->start)
+        patch(exit, target);
+}
+
+void Jit::discard(JitBlock *compiled)
+{
+    for(JitExit *exit : compiled->incoming)
+        unpatch(exit);
+    compiled->incoming.clear();
+
+    for(size_t i = 0; i < compiled->exit_count; ++i)
+    {
+        JitExit *exit = &compiled->exits[i];
+        if(exit->linked)
+        {
+            auto &incoming = exit->linked->incoming;
+            incoming.erase(std::remove(incoming.begin(), incoming.end(), exit), incoming.end());
+            unpatch(exit);
+        }
+    }
+
+    if(last_exit && last_exit->owner == compiled)
+        last_exit = nullptr;
+    compiled->block->compiled = nullptr;
+    compiled->block = nullptr;
+}
+
+void Jit::flush()
+{
+    for(auto &compiled : compiled_blocks)
+    {
+        if(compiled->block)
+            compiled->block->compiled = nullptr;
+    }
+    compiled_blocks.clear();
+    arena_used = 0;
+    last_exit = nullptr;
+}
+
+void Jit::patch(JitExit *exit, JitBlock *target)
+{
+    int32_t rel = (int32_t)(target->body - (exit->jump + 4));
+    set_writable(exit->jump, 4, true);
+    memcpy(exit->jump, &rel, 4);
+    set_writable(exit->jump, 4, false);
+    exit->linked = target;
+    target->incoming.emplace_back(exit);
+}
+
+void Jit::unpatch(JitExit *exit)
+{
+    int32_t rel = (int32_t)(exit->stub - (exit->jump + 4));
+    set_writable(exit->jump, 4, true);
+    memcpy(exit->jump, &rel, 4);
+    set_writable(exit->jump, 4, false);
+    exit->linked = nullptr;
+}
+
+void Jit::set_writable(uint8_t *start, size_t size, bool writable)
+{
+#ifdef JIT_SUPPORTED
+    //Protection is set a page at a time, so this covers the pages either side too
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)start & ~(page_size - 1);
+    uintptr_t last = ((uintptr_t)start + size + page_size - 1) & ~(page_size - 1);
+
+    //The constructor checked the arena could be made executable, so there's no going on if this fails
+    if(mprotect((void *)first, last - first, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+        abort();
+#endif
+}
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <tuple>
+#include "Profiler.h"
+
+namespace
+{
+    enum InstructionClass
+    {
+        Load = 0,
+        Arithmetic = 1, // The alu table, INC/DEC and the 16bit arithmetic
+        BitOps = 2,     // Rotates, shifts, BIT, SET and RES
+        Jump = 3,       // JP, JR and DJNZ
+        CallReturn = 4,
+        Stack = 5,      // PUSH, POP and the exchanges with (SP)
+        Block = 6,      // LDI/CPI/INI/OUTI and their repeats
+        IO = 7,
+        Control = 8,    // NOP, HALT, DI/EI, IM, prefixes and anything else
+        ClassCount = 9
+    };
+
+    const char *class_names[ClassCount] = {"load", "arithmetic", "bit", "jump", "call/return", "stack", "block", "io", "control"};
+
+    const char *prefix_names[Emulator::PrefixCount] = {"", "CB", "DD", "ED", "FD", "DDCB", "FDCB"};
+
+    InstructionClass classify(Emulator::Prefix prefix, uint8_t opcode)
+    {
+        uint8_t x = (opcode >> 6) & 0x3;
+        uint8_t y = (opcode >> 3) & 0x7;
+        uint8_t z = opcode & 0x7;
+        uint8_t q = y & 0x1;
+
+        if(prefix == Emulator::Prefix::CB || prefix == Emulator::Prefix::DDCB || prefix == Emulator::Prefix::FDCB)
+            return BitOps;
+
+        if(prefix == Emulator::Prefix::ED)
+        {
+            if(x == 2)
+                return y >= 4 && z <= 3 ? (z >= 2 ? IO : Block) : Control;
+            if(x != 1)
+                return Control;
+            if(z == 0 || z == 1)
+                return IO;
+            if(z == 2 || z == 4)
+                return Arithmetic; // SBC/ADC HL, rp and NEG
+            if(z == 3 || (z == 7 && y < 4))
+                return Load; // LD (nn), rp, LD rp, (nn) and LD I/R
+            if(z == 5)
+                return CallReturn; // RETN and RETI
+            if(z == 7)
+                return BitOps; // RRD and RLD
+            return Control;
+        }
+
+        // The main page, which DD and FD also decode through
+        if(x == 0)
+        {
+            if(z == 0)
+                return y >= 2 ? Jump : (y == 1 ? Load : Control);
+            if(z == 1)
+                return q == 0 ? Load : Arithmetic;
+            if(z == 2 || z == 6)
+                return Load;
+            if(z == 7)
+                return y < 4 ? BitOps : Arithmetic; // RLCA..RRA, then DAA, CPL, SCF, CCF
+            return Arithmetic;
+        }
+        if(x == 1)
+            return z == 6 && y == 6 ? Control : Load;
+        if(x == 2)
+            return Arithmetic;
+        if(z == 0 || z == 4 || z == 7)
+            return CallReturn;
+        if(z == 1)
+        {
+            if(q == 0)
+                return Stack;
+            if(y == 1)
+                return CallReturn;
+            return y == 5 ? Jump : (y == 3 ? Control : Load); // JP (HL), EXX and LD SP, HL
+        }
+        if(z == 2)
+            return Jump;
+        if(z == 3)
+        {
+            if(y == 0)
+                return Jump;
+            if(y == 2 || y == 3)
+                return IO;
+            if(y == 4)
+                return Stack; // EX (SP), HL
+            return y == 5 ? Load : Control;
+        }
+        if(z == 5)
+            return q == 0 ? Stack : (y == 1 ? CallReturn : Control);
+        return Arithmetic;
+    }
+
+    void write_function(std::ostream &stream, uint16_t function)
+    {
+        stream << "0x" << std::setw(4) << function;
+    }
+}
+
+Profiler::Profiler()
+: run_ends(0x10000)
+{
+    clear();
+}
+
+void Profiler::clear()
+{
+    runs.assign(1, Run{0x10000, 0, 0, 0, 0, 0});
+    run_instructions.clear();
+    run_keys.clear();
+    std::fill(run_ends.begin(), run_ends.end(), 0);
+    run_start = 0;
+    nodes.assign(1, Node{0, 0, 0, 1, 0, 0, 0});
+    children.clear();
+    stack.clear();
+    current = 0;
+    overflow = 0;
+}
+
+inline Profiler::Run &Profiler::end_run(Emulator &emulator, uint16_t end)
+{
+    Run *run = &runs[run_ends[end]];
+    if(run->start != run_start)
+        run = &find_run(emulator, end);
+    ++run->count;
+    Node &node = nodes[current];
+    node.instructions += run->size;
+    node.cycles += run->cycles;
+    return *run;
+}
+
+void Profiler::pause(Emulator &emulator, uint16_t pc)
+{
+    end_run(emulator, pc);
+    run_start = pc;
+}
+
+void Profiler::record(Emulator &emulator, const Emulator::Instruction &instr, uint32_t extra_t_states, uint16_t next_pc)
+{
+    uint16_t end = instr.pc + instr.length;
+    Run &run = end_run(emulator, end);
+    if(extra_t_states)
+    {
+        //The instruction is always the last in its run, so its extra time is kept with the run
+        run.extra_cycles += extra_t_states;
+        nodes[current].cycles += extra_t_states;
+    }
+
+    Flow instr_flow = flow(instr.prefix, instr.opcode);
+    if(instr_flow == Flow::Call && next_pc != end)
+        call(instr.pc, next_pc);
+    else if(instr_flow == Flow::Return && next_pc != end)
+        ret();
+    run_start = next_pc;
+}
+
+void Profiler::interrupt(Emulator &emulator, uint16_t pc, uint16_t handler)
+{
+    end_run(emulator, pc);
+    call(pc, handler);
+    run_start = handler;
+}
+
+void Profiler::call(uint16_t call_site, uint16_t target)
+{
+    if(stack.size() >= max_depth)
+    {
+        ++overflow;
+        return;
+    }
+
+    uint32_t child = nodes[current].last_child;
+    if(child == 0 || nodes[child].function != target)
+    {
+        uint64_t key = ((uint64_t)current << 16) | target;
+        auto it = children.find(key);
+        if(it == children.end())
+        {
+            child = (uint32_t)nodes.size();
+            nodes.push_back(Node{target, call_site, current, 0, 0, 0, 0});
+            children.emplace(key, child);
+        }
+        else
+        {
+            child = it->second;
+        }
+        nodes[current].last_child = child;
+    }
+
+    ++nodes[child].calls;
+    stack.push_back(current);
+    current = child;
+}
+
+void Profiler::ret()
+{
+    if(overflow)
+    {
+        --overflow;
+        return;
+    }
+
+    //Returning with nothing on the shadow stack, such as when the program manipulates SP itself, stays at the root
+    if(stack.empty())
+        return;
+    current = stack.back();
+    stack.pop_back();
+}
+
+Profiler::Run &Profiler::find_run(Emulator &emulator, uint16_t end)
+{
+    uint32_t key = ((uint32_t)run_start << 16) | end;
+    auto it = run_keys.find(key);
+    if(it == run_keys.end())
+    {
+        Run run = {run_start, (uint32_t)run_instructions.size(), 0, 0, 0, 0};
+        uint16_t length = end - run_start;
+        for(uint32_t offset = 0; offset < length;)
+        {
+            //Decoded from memory as it is now, which is how it ran unless it overwrote itself
+            Emulator::Instruction instr;
+            emulator.decode(run_start + offset, instr);
+            uint8_t t_states = Emulator::opcode_tables[instr.prefix][instr.opcode].t_states;
+            run_instructions.push_back(RunInstruction{instr.pc, (uint8_t)instr.prefix, instr.opcode, t_states});
+            ++run.size;
+            run.cycles += t_states;
+            offset += instr.length;
+        }
+        it = run_keys.emplace(key, (uint32_t)runs.size()).first;
+        runs.push_back(run);
+    }
+    run_ends[end] = it->second;
+    return runs[it->second];
+}
+
+void Profiler::address_costs(std::vector<PcCost> &pcs) const
+{
+    pcs.assign(0x10000, PcCost{0, 0});
+    for(const Run &run : runs)
+    {
+        for(uint32_t i = run.first; i < run.first + run.size; ++i)
+        {
+            const RunInstruction &instr = run_instructions[i];
+            pcs[instr.pc].count += run.count;
+            pcs[instr.pc].cycles += run.count * instr.t_states;
+        }
+        if(run.size)
+            pcs[run_instructions[run.first + run.size - 1].pc].cycles += run.extra_cycles;
+    }
+}
+
+void Profiler::address_functions(std::vector<uint16_t> &functions) const
+{
+    std::vector<bool> entries(0x10000);
+    for(const Node &node : nodes)
+        entries[node.function] = true;
+
+    functions.resize(0x10000);
+    uint16_t function = 0;
+    for(uint32_t pc = 0; pc < 0x10000; ++pc)
+    {
+        if(entries[pc])
+            function = (uint16_t)pc;
+        functions[pc] = function;
+    }
+}
+
+void Profiler::inclusive_costs(std::vector<uint64_t> &instructions, std::vector<uint64_t> &cycles) const
+{
+    instructions.resize(nodes.size());
+    cycles.resize(nodes.size());
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        instructions[i] = nodes[i].instructions;
+        cycles[i] = nodes[i].cycles;
+    }
+
+    //Children are always created after their parents, so walking backwards sums each subtree before it's added to its parent
+    for(size_t i = nodes.size() - 1; i > 0; --i)
+    {
+        instructions[nodes[i].parent] += instructions[i];
+        cycles[nodes[i].parent] += cycles[i];
+    }
+}
+
+void Profiler::write_callgrind(std::ostream &stream) const
+{
+    std::vector<uint64_t> inclusive_instructions, inclusive_cycles;
+    inclusive_costs(inclusive_instructions, inclusive_cycles);
+
+    //Calls are merged across call paths, by caller, call site and callee
+    struct CallCost
+    {
+        uint64_t calls = 0;
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+    };
+    std::map<std::tuple<uint16_t, uint16_t, uint16_t>, CallCost> calls;
+    for(size_t i = 1; i < nodes.size(); ++i)
+    {
+        const Node &node = nodes[i];
+        CallCost &cost = calls[std::make_tuple(nodes[node.parent].function, node.call_site, node.function)];
+        cost.calls += node.calls;
+        cost.instructions += inclusive_instructions[i];
+        cost.cycles += inclusive_cycles[i];
+    }
+
+    std::vector<PcCost> pcs;
+    address_costs(pcs);
+    std::vector<uint16_t> functions;
+    address_functions(functions);
+    std::map<uint16_t, std::vector<uint16_t>> function_pcs;
+    for(uint32_t pc = 0; pc < pcs.size(); ++pc)
+    {
+        if(pcs[pc].count)
+            function_pcs[functions[pc]].push_back(pc);
+    }
+    for(const auto &call : calls)
+        function_pcs[std::get<0>(call.first)];
+
+    std::ios::fmtflags flags = stream.flags();
+    char fill = stream.fill();
+    stream << "# callgrind format\nversion: 1\ncreator: frZ80\npositions: instr\nevents: Instructions Cycles\n\nfl=program\n"
+           << std::hex << std::uppercase << std::setfill('0');
+    for(const auto &function : function_pcs)
+    {
+        stream << "\nfn=";
+        write_function(stream, function.first);
+        stream << '\n';
+        for(uint16_t pc : function.second)
+            stream << "0x" << std::setw(4) << pc << std::dec << ' ' << pcs[pc].count << ' ' << pcs[pc].cycles << std::hex << '\n';
+
+        auto first = calls.lower_bound(std::make_tuple(function.first, 0, 0));
+        for(auto it = first; it != calls.end() && std::get<0>(it->first) == function.first; ++it)
+        {
+            stream << "cfn=";
+            write_function(stream, std::get<2>(it->first));
+            stream << "\ncalls=" << std::dec << it->second.calls << std::hex << " 0x" << std::setw(4) << std::get<2>(it->first)
+                   << "\n0x" << std::setw(4) << std::get<1>(it->first) << std::dec << ' ' << it->second.instructions
+                   << ' ' << it->second.cycles << std::hex << '\n';
+        }
+    }
+    stream.flags(flags);
+    stream.fill(fill);
+}
+
+void Profiler::write_folded(std::ostream &stream) const
+{
+    std::ios::fmtflags flags = stream.flags();
+    char fill = stream.fill();
+    stream << std::hex << std::uppercase << std::setfill('0');
+
+    std::vector<uint32_t> path;
+    for(uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        if(nodes[i].cycles == 0)
+            continue;
+
+        path.clear();
+        for(uint32_t node = i; node != 0; node = nodes[node].parent)
+            path.push_back(node);
+        path.push_back(0);
+
+        for(auto it = path.rbegin(); it != path.rend(); ++it)
+        {
+            if(it != path.rbegin())
+                stream << ';';
+            write_function(stream, nodes[*it].function);
+        }
+        stream << ' ' << std::dec << nodes[i].cycles << std::hex << '\n';
+    }
+    stream.flags(flags);
+    stream.fill(fill);
+}
+
+void Profiler::write_report(std::ostream &stream, size_t hot_count) const
+{
+    std::ios::fmtflags flags = stream.flags();
+    char fill = stream.fill();
+
+    std::vector<PcCost> pcs;
+    address_costs(pcs);
+    std::vector<uint16_t> hot;
+    for(uint32_t pc = 0; pc < pcs.size(); ++pc)
+    {
+        if(pcs[pc].count)
+            hot.push_back(pc);
+    }
+    hot_count = std::min(hot_count, hot.size());
+    std::partial_sort(hot.begin(), hot.begin() + hot_count, hot.end(),
+                      [&pcs](uint16_t a, uint16_t b) { return pcs[a].cycles > pcs[b].cycles; });
+
+    std::vector<uint16_t> functions;
+    address_functions(functions);
+    stream << "address\tfunction\tcount\tcycles\n";
+    for(size_t i = 0; i < hot_count; ++i)
+    {
+        const PcCost &cost = pcs[hot[i]];
+        stream << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << hot[i] << '\t' << std::setw(4) << functions[hot[i]]
+               << std::dec << '\t' << cost.count << '\t' << cost.cycles << '\n';
+    }
+
+    struct OpcodeCost
+    {
+        uint64_t count = 0;
+        uint64_t cycles = 0;
+    };
+    std::vector<std::array<OpcodeCost, 0x100>> opcodes(Emulator::PrefixCount);
+    for(const Run &run : runs)
+    {
+        for(uint32_t i = run.first; i < run.first + run.size; ++i)
+        {
+            const RunInstruction &instr = run_instructions[i];
+            OpcodeCost &cost = opcodes[instr.prefix][instr.opcode];
+            cost.count += run.count;
+            cost.cycles += run.count * instr.t_states;
+        }
+        if(run.size)
+        {
+            const RunInstruction &last = run_instructions[run.first + run.size - 1];
+            opcodes[last.prefix][last.opcode].cycles += run.extra_cycles;
+        }
+    }
+
+    uint64_t class_counts[ClassCount] = {};
+    uint64_t class_cycles[ClassCount] = {};
+    stream << "\nprefix\topcode\tcount\tcycles\n";
+    for(size_t prefix = 0; prefix < opcodes.size(); ++prefix)
+    {
+        for(size_t opcode = 0; opcode < 0x100; ++opcode)
+        {
+            const OpcodeCost &cost = opcodes[prefix][opcode];
+            if(cost.count == 0)
+                continue;
+            stream << prefix_names[prefix] << '\t' << std::hex << std::setw(2) << opcode << std::dec << '\t' << cost.count
+                   << '\t' << cost.cycles << '\n';
+
+            InstructionClass type = classify((Emulator::Prefix)prefix, (uint8_t)opcode);
+            class_counts[type] += cost.count;
+            class_cycles[type] += cost.cycles;
+        }
+    }
+
+    stream << "\nclass\tcount\tcycles\tcycles per instruction\n";
+    for(size_t type = 0; type < ClassCount; ++type)
+    {
+        if(class_counts[type] == 0)
+            continue;
+        stream << class_names[type] << '\t' << class_counts[type] << '\t' << class_cycles[type] << '\t'
+               << std::fixed << std::setprecision(2) << (double)class_cycles[type] / class_counts[type] << '\n';
+    }
+    stream.flags(flags);
+    stream.fill(fill);
+}
@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include "ProgramImage.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MMAP_SUPPORTED 1
+#endif
+
+namespace
+{
+    // Where the 48K of RAM in a Spectrum snapshot goes
+    constexpr uint16_t spectrum_ram = 0x4000;
+    constexpr size_t spectrum_ram_size = 0xC000;
+
+    constexpr size_t sna_header_size = 27;
+    constexpr size_t z80_header_size = 30;
+
+    /*!
+     * Rounds a size up to whole pages of the emulator's memory map
+     */
+    inline size_t page_align(size_t size)
+    {
+        return (size + Emulator::memory_page_size - 1) & ~(Emulator::memory_page_size - 1);
+    }
+
+    inline uint16_t read_word(const uint8_t *data)
+    {
+        return data[0] | (data[1] << 8);
+    }
+
+    /*!
+     * Reads a byte written as two hex digits
+     */
+    bool read_hex_byte(const uint8_t *data, size_t size, size_t &pos, uint8_t &val)
+    {
+        val = 0;
+        for(size_t end = pos + 2; pos < end; ++pos)
+        {
+            if(pos >= size || !isxdigit(data[pos]))
+                return false;
+            val = (val << 4) | (isdigit(data[pos]) ? data[pos] - '0' : (tolower(data[pos]) - 'a' + 10));
+        }
+        return true;
+    }
+
+    /*!
+     * Chooses a format from a path's extension
+     */
+    ProgramImage::Format detect_format(const std::string &path)
+    {
+        size_t dot = path.rfind('.');
+        std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return tolower(c); });
+        if(extension == "hex" || extension == "ihx")
+            return ProgramImage::Format::IntelHex;
+        if(extension == "sna")
+            return ProgramImage::Format::Sna;
+        if(extension == "z80")
+            return ProgramImage::Format::Z80;
+        return ProgramImage::Format::Raw;
+    }
+}
+
+ProgramImage::ProgramImage()
+: entry(0), end(0), read_only(false), registers_set(false), registers(), mapping(nullptr), mapping_size(0)
+{
+
+}
+
+ProgramImage::~ProgramImage()
+{
+#ifdef MMAP_SUPPORTED
+    if(mapping)
+        munmap(mapping, mapping_size);
+#endif
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::open(const std::string &path, const Options &options)
+{
+    Options chosen = options;
+    if(chosen.format == Format::Detect)
+        chosen.format = detect_format(path);
+
+    std::shared_ptr<ProgramImage> image(new ProgramImage());
+#ifdef MMAP_SUPPORTED
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return nullptr;
+
+    struct stat info;
+    if(fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    //Whole pages are mapped, so the end of the last one reads as zeros rather than faulting
+    size_t size = (size_t)info.st_size;
+    if(size)
+    {
+        void *mem = mmap(nullptr, page_align(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mem == MAP_FAILED)
+        {
+            close(fd);
+            return nullptr;
+        }
+        image->mapping = static_cast<uint8_t *>(mem);
+        image->mapping_size = page_align(size);
+    }
+    close(fd);
+
+    if(!image->load(image->mapping, size, chosen))
+        return nullptr;
+    return image;
+#else
+    std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if(!input.is_open())
+        return nullptr;
+    std::vector<uint8_t> data((size_t)input.tellg());
+    input.seekg(0);
+    input.read(reinterpret_cast<char *>(data.data()), data.size());
+    if(!input)
+        return nullptr;
+    return parse(data.data(), data.size(), chosen);
+#endif
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::open(const std::string &path)
+{
+    return open(path, Options());
+}
+
+std::shared_ptr<const ProgramImage> ProgramImage::parse(const uint8_t *data, size_t size, const Options &options)
+{
+    //Keep a copy, padded to whole pages, which the segments of raw images and .sna snapshots can point into
+    std::vector<uint8_t> source(page_align(size), 0);
+    std::copy(data, data + size, source.begin());
+
+    std::shared_ptr<ProgramImage> image(new ProgramImage());
+    Options chosen = options;
+    if(chosen.format == Format::Detect)
+        chosen.format = Format::Raw;
+    if(!image->load(source.data(), size, chosen))
+        return nullptr;
+
+    //Formats which had to be parsed left what they loaded in buffer, otherwise the segments point into the copy
+    if(image->buffer.empty())
+        image->buffer.swap(source);
+    return image;
+}
+
+const std::vector<ProgramImage::Segment> &ProgramImage::get_segments() const
+{
+    return segments;
+}
+
+uint16_t ProgramImage::get_entry() const
+{
+    return entry;
+}
+
+uint32_t ProgramImage::get_end() const
+{
+    return end;
+}
+
+bool ProgramImage::is_read_only() const
+{
+    return read_only;
+}
+
+bool ProgramImage::has_registers() const
+{
+    return registers_set;
+}
+
+const Emulator::Registers &ProgramImage::get_registers() const
+{
+    return registers;
+}
+
+bool ProgramImage::load(const uint8_t *data, size_t size, const Options &options)
+{
+    bool valid = false;
+    switch(options.format)
+    {
+        case Format::Detect:
+        case Format::Raw:
+            valid = load_raw(data, size, options.load_address);
+            break;
+        case Format::IntelHex:
+            valid = load_intel_hex(data, size);
+            break;
+        case Format::Sna:
+            valid = load_sna(data, size);
+            break;
+        case Format::Z80:
+            valid = load_z80(data, size);
+            break;
+    }
+    if(!valid)
+        return false;
+
+    if(options.entry < 0x10000)
+        entry = (uint16_t)options.entry;
+    if(options.end)
+        end = options.end;
+    registers.PC = entry;
+    read_only = options.read_only;
+    return true;
+}
+
+bool ProgramImage::load_raw(const uint8_t *data, size_t size, uint16_t load_address)
+{
+    if(load_address + size > 0x10000)
+        return false;
+
+    if(size)
+        segments.push_back({load_address, data, size});
+    entry = load_address;
+    end = load_address + size;
+    return true;
+}
+
+bool ProgramImage::load_intel_hex(const uint8_t *data, size_t size)
+{
+    std::vector<uint8_t> image(0x10000, 0);
+    std::vector<bool> loaded(0x10000, false);
+    uint32_t base = 0;
+    bool has_entry = false;
+
+    size_t pos = 0;
+    bool finished = false;
+    while(pos < size && !finished)
+    {
+        //Anything between records must be whitespace, such as line endings
+        if(data[pos] != ':')
+        {
+            if(!isspace(data[pos]))
+                return false;
+            ++pos;
+            continue;
+        }
+        ++pos;
+
+        // Byte count, address, type, data and checksum
+        uint8_t record[5 + 0xFF];
+        if(!read_hex_byte(data, size, pos, record[0]))
+            return false;
+        uint8_t checksum = record[0];
+        for(size_t i = 1; i < record[0] + 5u; ++i)
+        {
+            if(!read_hex_byte(data, size, pos, record[i]))
+                return false;
+            checksum += record[i];
+        }
+        if(checksum)
+            return false;
+
+        uint8_t count = record[0];
+        uint16_t offset = (record[1] << 8) | record[2];
+        const uint8_t *bytes = record + 4;
+        switch(record[3])
+        {
+            case 0: // Data
+            {
+                uint32_t address = base + offset;
+                if(address + count > 0x10000)
+                    return false;
+                std::copy(bytes, bytes + count, image.begin() + address);
+                std::fill(loaded.begin() + address, loaded.begin() + address + count, true);
+                break;
+            }
+            case 1: // End of file
+                finished = true;
+                break;
+            case 2: // Extended segment address, the segment times 16 is added to addresses
+                if(count != 2)
+                    return false;
+                base = ((bytes[0] << 8) | bytes[1]) << 4;
+                break;
+            case 3: // Start segment address, CS:IP
+            {
+                uint32_t start = (((bytes[0] << 8) | bytes[1]) << 4) + ((bytes[2] << 8) | bytes[3]);
+                if(count != 4 || start > 0xFFFF)
+                    return false;
+                entry = (uint16_t)start;
+                has_entry = true;
+                break;
+            }
+            case 4: // Extended linear address, the upper 16 bits of addresses
+                if(count != 2)
+                    return false;
+                base = ((bytes[0] << 8) | bytes[1]) << 16;
+                break;
+            case 5: // Start linear address
+            {
+                uint32_t start = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+                if(count != 4 || start > 0xFFFF)
+                    return false;
+                entry = (uint16_t)start;
+                has_entry = true;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    //Each run of loaded bytes is a segment, pointing into the image once it's been moved into buffer
+    buffer.swap(image);
+    for(uint32_t address = 0; address < 0x10000;)
+    {
+        if(!loaded[address])
+        {
+            ++address;
+            continue;
+        }
+
+        uint32_t start = address;
+        while(address < 0x10000 && loaded[address])
+            ++address;
+        segments.push_back({(uint16_t)start, buffer.data() + start, address - start});
+    }
+
+    if(!has_entry)
+        entry = segments.empty() ? 0 : segments.front().address;
+    end = segments.empty() ? 0 : segments.back().address + segments.back().size;
+    return true;
+}
+
+bool ProgramImage::load_sna(const uint8_t *data, size_t size)
+{
+    if(size != sna_header_size + spectrum_ram_size)
+        return false;
+
+    registers.I = data[0];
+    registers.shadow.HL = read_word(data + 1);
+    registers.shadow.DE = read_word(data + 3);
+    registers.shadow.BC = read_word(data + 5);
+    registers.shadow.AF = read_word(data + 7);
+    registers.general.HL = read_word(data + 9);
+    registers.general.DE = read_word(data + 11);
+    registers.general.BC = read_word(data + 13);
+    registers.IY = read_word(data + 15);
+    registers.IX = read_word(data + 17);
+    registers.IFF2 = (data[19] & 0x04) != 0;
+    registers.IFF1 = registers.IFF2;
+    registers.general.AF = read_word(data + 21);
+    registers.SP = read_word(data + 23);
+    registers.IM = data[25] & 0x3;
+    registers_set = true;
+
+    //PC was pushed onto the stack when the snapshot was taken, so pop it. The stack's in the image.
+    const uint8_t *ram = data + sna_header_size;
+    if(registers.SP < spectrum_ram || registers.SP == 0xFFFF)
+        return false;
+    entry = read_word(ram + registers.SP - spectrum_ram);
+    registers.SP += 2;
+
+    segments.push_back({spectrum_ram, ram, spectrum_ram_size});
+    end = 0x10000;
+    return true;
+}
+
+bool ProgramImage::load_z80(const uint8_t *data, size_t size)
+{
+    if(size < z80_header_size)
+        return false;
+
+    registers.general.A = data[0];
+    registers.general.F.value = data[1];
+    registers.general.BC = read_word(data + 2);
+    registers.general.HL = read_word(data + 4);
+    registers.SP = read_word(data + 8);
+    registers.I = data[10];
+    registers.general.DE = read_word(data + 13);
+    registers.shadow.BC = read_word(data + 15);
+    registers.shadow.DE = read_word(data + 17);
+    registers.shadow.HL = read_word(data + 19);
+    registers.shadow.A = data[21];
+    registers.shadow.F.value = data[22];
+    registers.IY = read_word(data + 23);
+    registers.IX = read_word(data + 25);
+    registers.IFF1 = data[27] != 0;
+    registers.IFF2 = data[28] != 0;
+    registers.IM = data[29] & 0x3;
+    registers_set = true;
+
+    // Version 1 has 48K of RAM straight after the header, compressed if bit 5 of byte 12 is set (255 means 1)
+    std::vector<uint8_t> ram(page_align(spectrum_ram_size), 0);
+    uint8_t flags = data[12] == 0xFF ? 1 : data[12];
+    entry = read_word(data + 6);
+    if(entry != 0)
+    {
+        const uint8_t *block = data + z80_header_size;
+        size_t block_size = size - z80_header_size;
+        if(!(flags & 0x20))
+        {
+            if(block_size < spectrum_ram_size)
+                return false;
+            std::copy(block, block + spectrum_ram_size, ram.begin());
+        }
+        else if(!decompress_z80(block, block_size, ram.data(), spectrum_ram_size))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // Versions 2 and 3 have a longer header with PC in it, then 16K pages each with their own header
+        if(size < z80_header_size + 5)
+            return false;
+        size_t extra_size = read_word(data + 30);
+        size_t pos = z80_header_size + 2 + extra_size;
+        if(pos > size)
+            return false;
+        entry = read_word(data + 32);
+
+        //Only the 48K machines, whose modes are below 3 in version 2 and below 4 in version 3
+        uint8_t mode = data[34];
+        if(mode >= (extra_size == 23 ? 3 : 4))
+            return false;
+
+        while(pos + 3 <= size)
+        {
+            uint16_t block_size = read_word(data + pos);
+            uint8_t page = data[pos + 2];
+            pos += 3;
+            size_t stored_size = block_size == 0xFFFF ? 0x4000 : block_size;
+            if(pos + stored_size > size)
+                return false;
+
+            // Pages 8, 4 and 5 are at 0x4000, 0x8000 and 0xC000, the others are ROM and interfaces
+            uint8_t *out = page == 8 ? &ram[0x0000] : page == 4 ? &ram[0x4000] : page == 5 ? &ram[0x8000] : nullptr;
+            if(out)
+            {
+                if(block_size == 0xFFFF)
+                    std::copy(data + pos, data + pos + 0x4000, out);
+                else if(!decompress_z80(data + pos, stored_size, out, 0x4000))
+                    return false;
+            }
+            pos += stored_size;
+        }
+    }
+
+    buffer.swap(ram);
+    segments.push_back({spectrum_ram, buffer.data(), spectrum_ram_size});
+    end = 0x10000;
+    return true;
+}
+
+bool ProgramImage::decompress_z80(const uint8_t *data, size_t size, uint8_t *out, size_t out_size)
+{
+    size_t in = 0;
+    size_t written = 0;
+    while(in < size && written < out_size)
+    {
+        if(in + 3 < size && data[in] == 0xED && data[in + 1] == 0xED)
+        {
+            size_t count = std::min<size_t>(data[in + 2], out_size - written);
+            memset(out + written, data[in + 3], count);
+            written += count;
+            in += 4;
+        }
+        else
+        {
+            out[written++] = data[in++];
+        }
+    }
+    return written == out_size;
+}
@@ -0,0 +1,24 @@
+#include "Snapshot.h"
+
+const Emulator::Registers &Snapshot::get_registers() const
+{
+    return reg;
+}
+
+uint64_t Snapshot::get_cycles() const
+{
+    return cycles;
+}
+
+uint8_t Snapshot::read_memory(uint16_t addr) const
+{
+    return (*pages[addr / page_size])[addr % page_size];
+}
+
+size_t Snapshot::shared_pages(const Snapshot &other) const
+{
+    size_t shared = 0;
+    for(size_t page = 0; page < page_count; ++page)
+        shared += pages[page] == other.pages[page];
+    return shared;
+}
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "Trace.h"
+
+TraceRing::TraceRing(size_t capacity)
+: records(new TraceRecord[capacity]), capacity(capacity), mask(capacity - 1), head_index(0), cached_tail(0), tail_index(0)
+{
+
+}
+
+size_t TraceRing::pop(TraceRecord *out, size_t max)
+{
+    size_t tail = tail_index.load(std::memory_order_relaxed);
+    size_t head = head_index.load(std::memory_order_acquire);
+    size_t count = std::min(head - tail, max);
+    for(size_t i = 0; i < count; ++i)
+    {
+        out[i] = records[(tail + i) & mask];
+    }
+    tail_index.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+bool TraceRing::empty() const
+{
+    return tail_index.load(std::memory_order_relaxed) == head_index.load(std::memory_order_acquire);
+}
+
+TraceWriter::TraceWriter(const std::string &path, bool registers, size_t capacity)
+: ring(capacity), file(path, std::ios::out | std::ios::binary | std::ios::trunc), registers(registers), stopping(false), writing(false), discarded()
+{
+    if(!file.is_open())
+        return;
+
+    TraceHeader header = {{'Z', '8', '0', 'T'}, TraceHeader::current_version, sizeof(TraceRecord)};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    thread = std::thread(&TraceWriter::run, this);
+    writing = true;
+}
+
+TraceWriter::~TraceWriter()
+{
+    stop();
+}
+
+bool TraceWriter::is_open() const
+{
+    return file.is_open();
+}
+
+void TraceWriter::stop()
+{
+    stopping = true;
+    if(thread.joinable())
+        thread.join();
+    writing = false;
+    if(file.is_open())
+        file.close();
+}
+
+void TraceWriter::run()
+{
+    std::vector<TraceRecord> batch(0x1000);
+    while(true)
+    {
+        size_t count = ring.pop(batch.data(), batch.size());
+        if(count)
+        {
+            file.write(reinterpret_cast<const char *>(batch.data()), count * sizeof(TraceRecord));
+        }
+        else if(stopping && ring.empty()) // Only stop once everything pushed before stop() is written
+        {
+            break;
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    file.flush();
+}
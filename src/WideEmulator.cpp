@@ -0,0 +1,1080 @@
+#include <algorithm>
+#include <cstring>
+#include "WideEmulator.h"
+#include "FlagTables.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+#if defined(__AVX2__)
+    // 32 lanes of 8bit values, one AVX2 register
+    struct Vec
+    {
+        static constexpr size_t width = 32;
+        __m256i v;
+
+        static inline Vec load(const uint8_t *p)
+        {
+            return {_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))};
+        }
+
+        inline void store(uint8_t *p) const
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+        }
+
+        static inline Vec set1(uint8_t x)
+        {
+            return {_mm256_set1_epi8((char)x)};
+        }
+
+        inline bool any() const
+        {
+            return _mm256_movemask_epi8(v) != 0;
+        }
+    };
+
+    inline Vec operator+(Vec a, Vec b) { return {_mm256_add_epi8(a.v, b.v)}; }
+    inline Vec operator-(Vec a, Vec b) { return {_mm256_sub_epi8(a.v, b.v)}; }
+    inline Vec operator&(Vec a, Vec b) { return {_mm256_and_si256(a.v, b.v)}; }
+    inline Vec operator|(Vec a, Vec b) { return {_mm256_or_si256(a.v, b.v)}; }
+    inline Vec operator^(Vec a, Vec b) { return {_mm256_xor_si256(a.v, b.v)}; }
+    inline Vec andnot(Vec a, Vec b) { return {_mm256_andnot_si256(a.v, b.v)}; } // ~a & b
+    inline Vec equal(Vec a, Vec b) { return {_mm256_cmpeq_epi8(a.v, b.v)}; }
+    inline Vec max_u(Vec a, Vec b) { return {_mm256_max_epu8(a.v, b.v)}; }
+
+    template<int n>
+    inline Vec shift_right(Vec a)
+    {
+        return {_mm256_and_si256(_mm256_srli_epi16(a.v, n), _mm256_set1_epi8((char)(0xFF >> n)))};
+    }
+
+    template<int n>
+    inline Vec shift_left(Vec a)
+    {
+        return {_mm256_and_si256(_mm256_slli_epi16(a.v, n), _mm256_set1_epi8((char)(0xFF << n)))};
+    }
+#elif defined(__SSE2__)
+    // 16 lanes of 8bit values, one SSE2 register
+    struct Vec
+    {
+        static constexpr size_t width = 16;
+        __m128i v;
+
+        static inline Vec load(const uint8_t *p)
+        {
+            return {_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))};
+        }
+
+        inline void store(uint8_t *p) const
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+        }
+
+        static inline Vec set1(uint8_t x)
+        {
+            return {_mm_set1_epi8((char)x)};
+        }
+
+        inline bool any() const
+        {
+            return _mm_movemask_epi8(v) != 0;
+        }
+    };
+
+    inline Vec operator+(Vec a, Vec b) { return {_mm_add_epi8(a.v, b.v)}; }
+    inline Vec operator-(Vec a, Vec b) { return {_mm_sub_epi8(a.v, b.v)}; }
+    inline Vec operator&(Vec a, Vec b) { return {_mm_and_si128(a.v, b.v)}; }
+    inline Vec operator|(Vec a, Vec b) { return {_mm_or_si128(a.v, b.v)}; }
+    inline Vec operator^(Vec a, Vec b) { return {_mm_xor_si128(a.v, b.v)}; }
+    inline Vec andnot(Vec a, Vec b) { return {_mm_andnot_si128(a.v, b.v)}; } // ~a & b
+    inline Vec equal(Vec a, Vec b) { return {_mm_cmpeq_epi8(a.v, b.v)}; }
+    inline Vec max_u(Vec a, Vec b) { return {_mm_max_epu8(a.v, b.v)}; }
+
+    template<int n>
+    inline Vec shift_right(Vec a)
+    {
+        return {_mm_and_si128(_mm_srli_epi16(a.v, n), _mm_set1_epi8((char)(0xFF >> n)))};
+    }
+
+    template<int n>
+    inline Vec shift_left(Vec a)
+    {
+        return {_mm_and_si128(_mm_slli_epi16(a.v, n), _mm_set1_epi8((char)(0xFF << n)))};
+    }
+#else
+    // 16 lanes of 8bit values in plain arrays, for hosts without SSE2. The compiler may still vectorise the loops.
+    struct Vec
+    {
+        static constexpr size_t width = 16;
+        uint8_t v[width];
+
+        static inline Vec load(const uint8_t *p)
+        {
+            Vec result;
+            memcpy(result.v, p, width);
+            return result;
+        }
+
+        inline void store(uint8_t *p) const
+        {
+            memcpy(p, v, width);
+        }
+
+        static inline Vec set1(uint8_t x)
+        {
+            Vec result;
+            memset(result.v, x, width);
+            return result;
+        }
+
+        inline bool any() const
+        {
+            uint8_t bits = 0;
+            for(size_t i = 0; i < width; ++i)
+                bits |= v[i];
+            return (bits & 0x80) != 0;
+        }
+    };
+
+    template<typename Op>
+    inline Vec map(Vec a, Vec b, Op op)
+    {
+        Vec result;
+        for(size_t i = 0; i < Vec::width; ++i)
+            result.v[i] = op(a.v[i], b.v[i]);
+        return result;
+    }
+
+    inline Vec operator+(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x + y); }); }
+    inline Vec operator-(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x - y); }); }
+    inline Vec operator&(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x & y); }); }
+    inline Vec operator|(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x | y); }); }
+    inline Vec operator^(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x ^ y); }); }
+    inline Vec andnot(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(~x & y); }); }
+    inline Vec equal(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return (uint8_t)(x == y ? 0xFF : 0); }); }
+    inline Vec max_u(Vec a, Vec b) { return map(a, b, [](uint8_t x, uint8_t y) { return std::max(x, y); }); }
+
+    template<int n>
+    inline Vec shift_right(Vec a)
+    {
+        return map(a, a, [](uint8_t x, uint8_t) { return (uint8_t)(x >> n); });
+    }
+
+    template<int n>
+    inline Vec shift_left(Vec a)
+    {
+        return map(a, a, [](uint8_t x, uint8_t) { return (uint8_t)(x << n); });
+    }
+#endif
+
+    inline Vec constant(uint8_t x)
+    {
+        return Vec::set1(x);
+    }
+
+    // Unsigned a < b, as a mask
+    inline Vec less(Vec a, Vec b)
+    {
+        return andnot(equal(max_u(a, b), a), constant(0xFF));
+    }
+
+    // a where mask is set, otherwise b
+    inline Vec select(Vec mask, Vec a, Vec b)
+    {
+        return (mask & a) | andnot(mask, b);
+    }
+
+    // S, Z, Y and X of a result, as FlagTables::sz
+    inline Vec flags_sz(Vec result)
+    {
+        return (result & constant(FlagTables::S | FlagTables::Y | FlagTables::X))
+               | (equal(result, constant(0)) & constant(FlagTables::Z));
+    }
+
+    // PV set for even parity, as FlagTables::szp
+    inline Vec flags_parity(Vec result)
+    {
+        Vec parity = result ^ shift_right<4>(result);
+        parity = parity ^ shift_right<2>(parity);
+        parity = parity ^ shift_right<1>(parity);
+        return shift_left<2>(andnot(parity, constant(1)));
+    }
+
+    /*!
+     * Applies alu[op] to a group of lanes, matching Emulator::alu()
+     *
+     * @tparam op The operation, alu[op]
+     * @param a The accumulator
+     * @param val The operand
+     * @param f The flags before the operation
+     * @param result Set to the new accumulator
+     * @param flags Set to the new flags
+     */
+    template<uint8_t op>
+    inline void alu_op(Vec a, Vec val, Vec f, Vec &result, Vec &flags)
+    {
+        if constexpr(op == 0 || op == 1) // ADD A, and ADC A,
+        {
+            Vec carry_in = op == 1 ? f & constant(FlagTables::C) : constant(0);
+            Vec partial = a + val;
+            result = partial + carry_in;
+            Vec carry = less(partial, a) | less(result, partial);
+            flags = flags_sz(result)
+                    | ((a ^ val ^ result) & constant(FlagTables::H))
+                    | (shift_right<5>(andnot(a ^ val, a ^ result)) & constant(FlagTables::PV))
+                    | (carry & constant(FlagTables::C));
+        }
+        else if constexpr(op == 2 || op == 3 || op == 7) // SUB, SBC A, and CP
+        {
+            Vec carry_in = op == 3 ? f & constant(FlagTables::C) : constant(0);
+            Vec partial = a - val;
+            Vec diff = partial - carry_in;
+            Vec borrow = less(a, val) | less(partial, carry_in);
+            flags = flags_sz(diff)
+                    | ((a ^ val ^ diff) & constant(FlagTables::H))
+                    | (shift_right<5>((a ^ val) & (a ^ diff)) & constant(FlagTables::PV))
+                    | (borrow & constant(FlagTables::C))
+                    | constant(FlagTables::N);
+            if constexpr(op == 7) // The undocumented flags are copied from the operand for CP
+            {
+                Vec xy = constant(FlagTables::X | FlagTables::Y);
+                flags = andnot(xy, flags) | (val & xy);
+                result = a;
+            }
+            else
+            {
+                result = diff;
+            }
+        }
+        else if constexpr(op == 4) // AND
+        {
+            result = a & val;
+            flags = flags_sz(result) | flags_parity(result) | constant(FlagTables::H);
+        }
+        else // XOR and OR
+        {
+            result = op == 5 ? a ^ val : a | val;
+            flags = flags_sz(result) | flags_parity(result);
+        }
+    }
+}
+
+WideEmulator::ScalarLane::ScalarLane(WideEmulator *owner, size_t lane, Emulator::Engine engine)
+: owner(owner), lane(lane), emulator(engine)
+{
+    emulator.set_default_port_handler(&WideEmulator::scalar_port, this);
+}
+
+WideEmulator::WideEmulator(size_t lanes, Emulator::Engine scalar_engine)
+: lanes(lanes), padded_lanes((lanes + Vec::width - 1) / Vec::width * Vec::width), scalar_engine(scalar_engine),
+  registers8(Reg8Count * padded_lanes), sp(padded_lanes), pc_lanes(padded_lanes), memory(lanes << 16),
+  state(padded_lanes, Finished), active(padded_lanes), scratch(padded_lanes), code_written(padded_lanes),
+  remaining(padded_lanes), scalar_lanes(lanes), program_end(0), pc(0), next_pc(0), branched(false), leader(0),
+  uniform(false), uniform_steps(0), uniform_budget(0), any_code_written(false), port_callback(nullptr), port_context(nullptr)
+{
+
+}
+
+WideEmulator::~WideEmulator() = default;
+
+void WideEmulator::load(const std::vector<uint8_t> &data)
+{
+    //Every lane starts as Emulator::reset() and load() would leave it
+    std::fill(registers8.begin(), registers8.end(), 0);
+    std::fill(sp.begin(), sp.end(), 0xFFFF);
+    std::fill(pc_lanes.begin(), pc_lanes.end(), 0);
+    for(size_t lane = 0; lane < lanes; ++lane)
+    {
+        uint8_t *lane_memory = &memory[lane << 16];
+        memcpy(lane_memory, data.data(), data.size());
+        memset(lane_memory + data.size(), 0, 0x10000 - data.size());
+        state[lane] = Running;
+        scalar_lanes[lane].reset();
+    }
+    program_end = data.size();
+    uniform = false;
+    uniform_steps = 0;
+}
+
+size_t WideEmulator::run(size_t max_instructions)
+{
+    std::fill(remaining.begin(), remaining.end(), max_instructions);
+
+    while(select_lanes())
+    {
+        //The program is the same in every running lane, so it can be decoded from any of them
+        const uint8_t *code = &memory[leader << 16];
+        const Opcode &entry = opcode_table[code[pc]];
+        if(pc + entry.length > program_end) // The operand would be read from past the program, which can differ between lanes
+        {
+            move_active_to_scalar(0);
+            continue;
+        }
+
+        uint16_t operand = 0;
+        if(entry.length == 2)
+            operand = code[pc + 1];
+        else if(entry.length == 3)
+            operand = code[pc + 1] | (code[pc + 2] << 8);
+
+        next_pc = pc + entry.length;
+        branched = false;
+        (this->*entry.handler)(operand);
+
+        if(uniform)
+        {
+            pc = next_pc;
+            ++uniform_steps;
+        }
+        else
+        {
+            each_active([this](size_t lane) {
+                if(!branched)
+                    pc_lanes[lane] = next_pc;
+                --remaining[lane];
+            });
+        }
+
+        //Lanes which wrote over the program no longer share it, so they carry on alone
+        if(any_code_written)
+        {
+            leave_uniform();
+            for(size_t lane = 0; lane < lanes; ++lane)
+            {
+                if(code_written[lane])
+                {
+                    code_written[lane] = 0;
+                    if(state[lane] == Running)
+                        move_to_scalar(lane);
+                }
+            }
+            any_code_written = false;
+        }
+    }
+
+    //Lanes which were moved to an Emulator run there for the rest of their budget
+    size_t unfinished = 0;
+    for(size_t lane = 0; lane < lanes; ++lane)
+    {
+        ScalarLane *scalar = scalar_lanes[lane].get();
+        if(scalar && remaining[lane] > 0 && !scalar->emulator.is_finished())
+            remaining[lane] -= scalar->emulator.run(remaining[lane]);
+        unfinished += !is_finished(lane);
+    }
+    return unfinished;
+}
+
+bool WideEmulator::select_lanes()
+{
+    if(uniform)
+    {
+        if(pc < program_end && uniform_steps < uniform_budget)
+            return true;
+        leave_uniform();
+    }
+
+    size_t running = 0;
+    uint32_t lowest = 0x10000;
+    for(size_t lane = 0; lane < padded_lanes; ++lane)
+    {
+        if(state[lane] != Running)
+            continue;
+        if(pc_lanes[lane] >= program_end)
+        {
+            state[lane] = Finished;
+            continue;
+        }
+        if(remaining[lane] == 0)
+            continue;
+        ++running;
+        lowest = std::min<uint32_t>(lowest, pc_lanes[lane]);
+    }
+    if(running == 0)
+        return false;
+
+    //Running the lowest PC first lets lanes which branched forwards wait for the rest to catch up
+    pc = lowest;
+    size_t count = 0;
+    uniform_budget = UINT64_MAX;
+    for(size_t lane = 0; lane < padded_lanes; ++lane)
+    {
+        bool selected = state[lane] == Running && remaining[lane] > 0 && pc_lanes[lane] == pc;
+        active[lane] = selected ? 0xFF : 0;
+        if(selected)
+        {
+            if(count++ == 0)
+                leader = lane;
+            uniform_budget = std::min(uniform_budget, remaining[lane]);
+        }
+    }
+    uniform = count == running;
+    uniform_steps = 0;
+    return true;
+}
+
+void WideEmulator::leave_uniform()
+{
+    if(!uniform)
+        return;
+
+    each_active([this](size_t lane) {
+        pc_lanes[lane] = pc;
+        remaining[lane] -= uniform_steps;
+    });
+    uniform_steps = 0;
+    uniform = false;
+}
+
+void WideEmulator::move_to_scalar(size_t lane)
+{
+    std::unique_ptr<ScalarLane> scalar(new ScalarLane(this, lane, scalar_engine));
+    scalar->emulator.load_memory(&memory[lane << 16], program_end);
+    scalar->emulator.set_registers(get_registers(lane));
+    scalar_lanes[lane] = std::move(scalar);
+    state[lane] = Scalar;
+    active[lane] = 0;
+}
+
+void WideEmulator::move_active_to_scalar(uint16_t)
+{
+    leave_uniform();
+    each_active([this](size_t lane) { move_to_scalar(lane); });
+}
+
+template<typename Kernel>
+inline void WideEmulator::each_group(Kernel kernel)
+{
+    for(size_t i = 0; i < padded_lanes; i += Vec::width)
+    {
+        Vec mask = Vec::load(&active[i]);
+        if(mask.any())
+            kernel(i, mask);
+    }
+}
+
+template<typename Function>
+inline void WideEmulator::each_active(Function function)
+{
+    for(size_t lane = 0; lane < padded_lanes; ++lane)
+    {
+        if(active[lane])
+            function(lane);
+    }
+}
+
+template<uint8_t reg_no>
+const uint8_t *WideEmulator::read_r()
+{
+    if constexpr(reg_no == 6) // (HL)
+    {
+        each_active([this](size_t lane) { scratch[lane] = fetch(lane, pair(lane, H, L)); });
+        return scratch.data();
+    }
+    else
+    {
+        return reg8((Reg8)reg_no);
+    }
+}
+
+template<uint8_t reg_no>
+uint8_t *WideEmulator::r_target()
+{
+    if constexpr(reg_no == 6) // (HL)
+        return scratch.data();
+    else
+        return reg8((Reg8)reg_no);
+}
+
+template<uint8_t reg_no>
+void WideEmulator::commit_r()
+{
+    if constexpr(reg_no == 6) // (HL)
+        each_active([this](size_t lane) { store(lane, pair(lane, H, L), scratch[lane]); });
+}
+
+template<uint8_t op>
+void WideEmulator::alu(const uint8_t *values, uint8_t value)
+{
+    uint8_t *a = reg8(A);
+    uint8_t *f = reg8(F);
+    each_group([&](size_t i, Vec mask) {
+        Vec old_a = Vec::load(a + i);
+        Vec old_f = Vec::load(f + i);
+        Vec result, flags;
+        alu_op<op>(old_a, values ? Vec::load(values + i) : constant(value), old_f, result, flags);
+        select(mask, result, old_a).store(a + i);
+        select(mask, flags, old_f).store(f + i);
+    });
+}
+
+template<uint8_t cc_no>
+void WideEmulator::condition()
+{
+    // NZ, Z, NC, C, PO, PE, P, M test these flags in pairs, clear then set
+    constexpr uint8_t flags[4] = {FlagTables::Z, FlagTables::C, FlagTables::PV, FlagTables::S};
+    const uint8_t *f = reg8(F);
+    each_group([&](size_t i, Vec mask) {
+        Vec clear = equal(Vec::load(f + i) & constant(flags[cc_no >> 1]), constant(0));
+        Vec taken = (cc_no & 1) ? andnot(clear, mask) : clear & mask;
+        taken.store(&scratch[i]);
+    });
+}
+
+WideEmulator::Taken WideEmulator::taken_lanes()
+{
+    bool any_taken = false;
+    bool any_not_taken = false;
+    each_group([&](size_t i, Vec mask) {
+        Vec taken = Vec::load(&scratch[i]);
+        any_taken |= (taken & mask).any();
+        any_not_taken |= andnot(taken, mask).any();
+    });
+    if(!any_taken)
+        return NoneTaken;
+    return any_not_taken ? SomeTaken : AllTaken;
+}
+
+void WideEmulator::jump_where_taken(uint16_t target)
+{
+    //If every lane goes the same way they stay together
+    Taken taken = taken_lanes();
+    if(taken == AllTaken)
+        next_pc = target;
+    if(taken != SomeTaken)
+        return;
+
+    leave_uniform();
+    each_active([&](size_t lane) { pc_lanes[lane] = scratch[lane] ? target : next_pc; });
+    branched = true;
+}
+
+void WideEmulator::call_where_taken(uint16_t target)
+{
+    Taken taken = taken_lanes();
+    if(taken == NoneTaken)
+        return;
+
+    if(taken == AllTaken)
+    {
+        each_active([&](size_t lane) { push(lane, next_pc); });
+        next_pc = target;
+        return;
+    }
+
+    leave_uniform();
+    each_active([&](size_t lane) {
+        if(scratch[lane])
+        {
+            push(lane, next_pc);
+            pc_lanes[lane] = target;
+        }
+        else
+        {
+            pc_lanes[lane] = next_pc;
+        }
+    });
+    branched = true;
+}
+
+void WideEmulator::swap_registers(Reg8 a, Reg8 b)
+{
+    uint8_t *first = reg8(a);
+    uint8_t *second = reg8(b);
+    each_group([&](size_t i, Vec mask) {
+        Vec x = Vec::load(first + i);
+        Vec y = Vec::load(second + i);
+        select(mask, y, x).store(first + i);
+        select(mask, x, y).store(second + i);
+    });
+}
+
+void WideEmulator::set_pair(Reg8 high, Reg8 low, uint16_t value)
+{
+    uint8_t *hi = reg8(high);
+    uint8_t *lo = reg8(low);
+    each_group([&](size_t i, Vec mask) {
+        select(mask, constant(value >> 8), Vec::load(hi + i)).store(hi + i);
+        select(mask, constant(value & 0xFF), Vec::load(lo + i)).store(lo + i);
+    });
+}
+
+template<bool decrement>
+void WideEmulator::step_pair(Reg8 high, Reg8 low)
+{
+    uint8_t *hi = reg8(high);
+    uint8_t *lo = reg8(low);
+    each_group([&](size_t i, Vec mask) {
+        Vec old_hi = Vec::load(hi + i);
+        Vec old_lo = Vec::load(lo + i);
+        Vec new_lo, new_hi;
+        if(decrement)
+        {
+            new_lo = old_lo - constant(1);
+            new_hi = old_hi + equal(old_lo, constant(0)); // Adding the all ones mask takes one off
+        }
+        else
+        {
+            new_lo = old_lo + constant(1);
+            new_hi = old_hi - equal(new_lo, constant(0));
+        }
+        select(mask, new_hi, old_hi).store(hi + i);
+        select(mask, new_lo, old_lo).store(lo + i);
+    });
+}
+
+void WideEmulator::push(size_t lane, uint16_t val)
+{
+    store(lane, --sp[lane], (val >> 8) & 0xFF); // Store top 8 bits first
+    store(lane, --sp[lane], val & 0xFF); // Store bottom 8 bits last
+}
+
+uint16_t WideEmulator::pop(size_t lane)
+{
+    uint16_t data = fetch(lane, sp[lane]++);
+    data |= fetch(lane, sp[lane]++) << 8;
+    return data;
+}
+
+template<uint8_t opcode>
+void WideEmulator::execute(uint16_t operand)
+{
+    constexpr uint8_t x = (opcode >> 6) & 0x3;
+    constexpr uint8_t y = (opcode >> 3) & 0x7;
+    constexpr uint8_t z = opcode & 0x7;
+    constexpr uint8_t p = (y >> 1) & 0x3;
+    constexpr uint8_t q = y & 0x1;
+
+    // rp[p] and rp2[p] as register array pairs, SP is handled separately
+    constexpr Reg8 rp_high[4] = {B, D, H, A};
+    constexpr Reg8 rp_low[4] = {C, E, L, F};
+
+    if constexpr(x == 0) // X = 0
+    {
+        if constexpr(z == 0) // z = 0
+        {
+            if constexpr(y == 1) // EX AF, AF'
+            {
+                swap_registers(A, ShadowA);
+                swap_registers(F, ShadowF);
+            }
+            else if constexpr(y == 2) // DJNZ d
+            {
+                uint8_t *b = reg8(B);
+                each_group([&](size_t i, Vec mask) {
+                    Vec old = Vec::load(b + i);
+                    Vec result = old - constant(1);
+                    select(mask, result, old).store(b + i);
+                    andnot(equal(result, constant(0)), mask).store(&scratch[i]);
+                });
+                jump_where_taken(next_pc + (int8_t)operand);
+            }
+            else if constexpr(y == 3) // JR d
+            {
+                next_pc += (int8_t)operand;
+            }
+            else if constexpr(y >= 4) // JR cc[y-4], d
+            {
+                condition<y - 4>();
+                jump_where_taken(next_pc + (int8_t)operand);
+            }
+            // Otherwise NOP
+        }
+        else if constexpr(z == 1 && q == 0) // LD rp[p], nn
+        {
+            if constexpr(p == 3)
+                each_active([&](size_t lane) { sp[lane] = operand; });
+            else
+                set_pair(rp_high[p], rp_low[p], operand);
+        }
+        else if constexpr(z == 2) // z = 2
+        {
+            if constexpr(q == 0) // q = 0
+            {
+                if constexpr(p == 0) // LD (BC), A
+                    each_active([&](size_t lane) { store(lane, pair(lane, B, C), reg8(A)[lane]); });
+                else if constexpr(p == 1) // LD (DE), A
+                    each_active([&](size_t lane) { store(lane, pair(lane, D, E), reg8(A)[lane]); });
+                else if constexpr(p == 2) // LD (nn), HL
+                    each_active([&](size_t lane) {
+                        store(lane, operand, reg8(L)[lane]);
+                        store(lane, operand + 1, reg8(H)[lane]);
+                    });
+                else // LD (nn), A
+                    each_active([&](size_t lane) { store(lane, operand, reg8(A)[lane]); });
+            }
+            else // Q = 1
+            {
+                if constexpr(p == 0) // LD A, (BC)
+                    each_active([&](size_t lane) { reg8(A)[lane] = fetch(lane, pair(lane, B, C)); });
+                else if constexpr(p == 1) // LD A, (DE)
+                    each_active([&](size_t lane) { reg8(A)[lane] = fetch(lane, pair(lane, D, E)); });
+                else if constexpr(p == 2) // LD HL, (nn)
+                    each_active([&](size_t lane) {
+                        reg8(L)[lane] = fetch(lane, operand);
+                        reg8(H)[lane] = fetch(lane, operand + 1);
+                    });
+                else // LD A, (nn)
+                    each_active([&](size_t lane) { reg8(A)[lane] = fetch(lane, operand); });
+            }
+        }
+        else if constexpr(z == 3) // INC rp[p] and DEC rp[p]
+        {
+            if constexpr(p == 3)
+                each_active([&](size_t lane) { sp[lane] += q == 0 ? 1 : -1; });
+            else
+                step_pair<q == 1>(rp_high[p], rp_low[p]);
+        }
+        else if constexpr(z == 4 || z == 5) // INC r[y] and DEC r[y]
+        {
+            const uint8_t *values = read_r<y>();
+            uint8_t *target = r_target<y>();
+            uint8_t *f = reg8(F);
+            each_group([&](size_t i, Vec mask) {
+                Vec old = Vec::load(values + i);
+                Vec old_f = Vec::load(f + i);
+                Vec result, flags;
+                if(z == 4)
+                {
+                    result = old + constant(1);
+                    flags = flags_sz(result)
+                            | (equal(result, constant(0x80)) & constant(FlagTables::PV))
+                            | (equal(result & constant(0xF), constant(0)) & constant(FlagTables::H));
+                }
+                else
+                {
+                    result = old - constant(1);
+                    flags = flags_sz(result) | constant(FlagTables::N)
+                            | (equal(result, constant(0x7F)) & constant(FlagTables::PV))
+                            | (equal(result & constant(0xF), constant(0xF)) & constant(FlagTables::H));
+                }
+                flags = flags | (old_f & constant(FlagTables::C));
+                select(mask, result, Vec::load(target + i)).store(target + i);
+                select(mask, flags, old_f).store(f + i);
+            });
+            commit_r<y>();
+        }
+        else if constexpr(z == 6) // LD r[y], n
+        {
+            uint8_t *target = r_target<y>();
+            each_group([&](size_t i, Vec mask) {
+                select(mask, constant(operand), Vec::load(target + i)).store(target + i);
+            });
+            commit_r<y>();
+        }
+    }
+    else if constexpr(x == 1) // X = 1
+    {
+        if constexpr(z == 6 && y == 6) // HALT, which only finishes a lane if it can't be woken by an interrupt
+        {
+            leave_uniform();
+            each_active([this](size_t lane) {
+                if(reg8(IFF1)[lane])
+                    move_to_scalar(lane);
+                else
+                    state[lane] = Finished;
+            });
+        }
+        else // LD r[y], r[z]
+        {
+            const uint8_t *values = read_r<z>();
+            uint8_t *target = r_target<y>();
+            each_group([&](size_t i, Vec mask) {
+                select(mask, Vec::load(values + i), Vec::load(target + i)).store(target + i);
+            });
+            commit_r<y>();
+        }
+    }
+    else if constexpr(x == 2) // X = 2, alu[y] r[z]
+    {
+        alu<y>(read_r<z>(), 0);
+    }
+    else // X = 3
+    {
+        if constexpr(z == 0) // Z = 0, RET cc[y]
+        {
+            condition<y>();
+            if(taken_lanes() == NoneTaken)
+                return;
+            leave_uniform();
+            each_active([this](size_t lane) { pc_lanes[lane] = scratch[lane] ? pop(lane) : next_pc; });
+            branched = true;
+        }
+        else if constexpr(z == 1) // Z = 1
+        {
+            if constexpr(q == 0) // POP rp2[p]
+            {
+                each_active([&](size_t lane) {
+                    uint16_t val = pop(lane);
+                    reg8(rp_high[p])[lane] = val >> 8;
+                    reg8(rp_low[p])[lane] = val & 0xFF;
+                });
+            }
+            else if constexpr(p == 0) // RET
+            {
+                leave_uniform();
+                each_active([this](size_t lane) { pc_lanes[lane] = pop(lane); });
+                branched = true;
+            }
+            else if constexpr(p == 1) // EXX
+            {
+                swap_registers(B, ShadowB);
+                swap_registers(C, ShadowC);
+                swap_registers(D, ShadowD);
+                swap_registers(E, ShadowE);
+                swap_registers(H, ShadowH);
+                swap_registers(L, ShadowL);
+            }
+            else if constexpr(p == 2) // JP (HL)
+            {
+                leave_uniform();
+                each_active([this](size_t lane) { pc_lanes[lane] = pair(lane, H, L); });
+                branched = true;
+            }
+        }
+        else if constexpr(z == 2) // Z = 2, JP cc[y], nn
+        {
+            condition<y>();
+            jump_where_taken(operand);
+        }
+        else if constexpr(z == 3) // Z = 3
+        {
+            if constexpr(y == 0) // JP nn
+            {
+                next_pc = operand;
+            }
+            else if constexpr(y == 6) // DI
+            {
+                uint8_t *iff1 = reg8(IFF1);
+                uint8_t *iff2 = reg8(IFF2);
+                each_group([&](size_t i, Vec mask) {
+                    andnot(mask, Vec::load(iff1 + i)).store(iff1 + i);
+                    andnot(mask, Vec::load(iff2 + i)).store(iff2 + i);
+                });
+            }
+        }
+        else if constexpr(z == 4) // Z = 4, CALL cc[y], nn
+        {
+            condition<y>();
+            call_where_taken(operand);
+        }
+        else if constexpr(z == 5) // Z = 5
+        {
+            if constexpr(q == 0) // PUSH rp2[p]
+            {
+                each_active([&](size_t lane) { push(lane, pair(lane, rp_high[p], rp_low[p])); });
+            }
+            else if constexpr(p == 0) // CALL nn
+            {
+                each_active([&](size_t lane) { push(lane, next_pc); });
+                next_pc = operand;
+            }
+        }
+        else if constexpr(z == 6) // alu[y] n
+        {
+            alu<y>(nullptr, operand);
+        }
+        else // Z = 7, RST y*8
+        {
+            each_active([&](size_t lane) { push(lane, next_pc); });
+            next_pc = y * 8;
+        }
+    }
+}
+
+constexpr uint8_t WideEmulator::length(uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
+
+    if(x == 0)
+    {
+        if(z == 0)
+            return y >= 2 ? 2 : 1; // DJNZ d, JR d and JR cc, d
+        if(z == 1)
+            return q == 0 ? 3 : 1; // LD rp, nn
+        if(z == 2)
+            return p >= 2 ? 3 : 1; // LD (nn), HL/A and LD HL/A, (nn)
+        if(z == 6)
+            return 2; // LD r, n
+        return 1;
+    }
+    if(x == 3)
+    {
+        if(z == 2 || z == 4 || (z == 3 && y == 0) || (z == 5 && q == 1 && p == 0))
+            return 3; // JP cc, nn, CALL cc, nn, JP nn and CALL nn
+        if(z == 6 || (z == 3 && (y == 2 || y == 3)))
+            return 2; // alu n, OUT (n), A and IN A, (n)
+    }
+    return 1;
+}
+
+constexpr bool WideEmulator::has_kernel(uint8_t opcode)
+{
+    uint8_t x = (opcode >> 6) & 0x3;
+    uint8_t y = (opcode >> 3) & 0x7;
+    uint8_t z = opcode & 0x7;
+    uint8_t p = (y >> 1) & 0x3;
+    uint8_t q = y & 0x1;
+
+    if(x == 0)
+        return !(z == 1 && q == 1) && z != 7; // ADD HL, rp, and the accumulator ops which are NOPs in the scalar core
+    if(x == 3)
+    {
+        if(z == 1)
+            return !(q == 1 && p == 3); // LD SP, HL
+        if(z == 3)
+            return y == 0 || y == 6; // JP nn and DI, but not the CB prefix, I/O, EI or the exchanges
+        if(z == 5)
+            return q == 0 || p == 0; // PUSH and CALL nn, but not the DD, ED and FD prefixes
+    }
+    return true;
+}
+
+template<size_t... opcodes>
+constexpr WideEmulator::opcode_table_t WideEmulator::make_opcode_table(std::index_sequence<opcodes...>)
+{
+    return {{{has_kernel(opcodes) ? &WideEmulator::execute<opcodes> : &WideEmulator::move_active_to_scalar, length(opcodes)}...}};
+}
+
+const WideEmulator::opcode_table_t WideEmulator::opcode_table = make_opcode_table(std::make_index_sequence<0x100>());
+
+size_t WideEmulator::get_lane_count() const
+{
+    return lanes;
+}
+
+size_t WideEmulator::get_scalar_lane_count() const
+{
+    return std::count_if(scalar_lanes.begin(), scalar_lanes.end(), [](const std::unique_ptr<ScalarLane> &scalar) { return scalar != nullptr; });
+}
+
+bool WideEmulator::is_finished(size_t lane) const
+{
+    if(scalar_lanes[lane])
+        return scalar_lanes[lane]->emulator.is_finished();
+    return state[lane] == Finished;
+}
+
+Emulator::Registers WideEmulator::get_registers(size_t lane) const
+{
+    if(scalar_lanes[lane])
+        return scalar_lanes[lane]->emulator.get_registers();
+
+    Emulator::Registers registers = {};
+    registers.general.B = reg8(B)[lane];
+    registers.general.C = reg8(C)[lane];
+    registers.general.D = reg8(D)[lane];
+    registers.general.E = reg8(E)[lane];
+    registers.general.H = reg8(H)[lane];
+    registers.general.L = reg8(L)[lane];
+    registers.general.F.value = reg8(F)[lane];
+    registers.general.A = reg8(A)[lane];
+    registers.shadow.B = reg8(ShadowB)[lane];
+    registers.shadow.C = reg8(ShadowC)[lane];
+    registers.shadow.D = reg8(ShadowD)[lane];
+    registers.shadow.E = reg8(ShadowE)[lane];
+    registers.shadow.H = reg8(ShadowH)[lane];
+    registers.shadow.L = reg8(ShadowL)[lane];
+    registers.shadow.F.value = reg8(ShadowF)[lane];
+    registers.shadow.A = reg8(ShadowA)[lane];
+    registers.IXH = reg8(IXH)[lane];
+    registers.IXL = reg8(IXL)[lane];
+    registers.IYH = reg8(IYH)[lane];
+    registers.IYL = reg8(IYL)[lane];
+    registers.SP = sp[lane];
+    registers.PC = pc_lanes[lane];
+    registers.I = reg8(I)[lane];
+    registers.IM = reg8(IM)[lane];
+    registers.IFF1 = reg8(IFF1)[lane] != 0;
+    registers.IFF2 = reg8(IFF2)[lane] != 0;
+    return registers;
+}
+
+void WideEmulator::set_registers(size_t lane, const Emulator::Registers &registers)
+{
+    if(scalar_lanes[lane])
+    {
+        scalar_lanes[lane]->emulator.set_registers(registers);
+        return;
+    }
+
+    reg8(B)[lane] = registers.general.B;
+    reg8(C)[lane] = registers.general.C;
+    reg8(D)[lane] = registers.general.D;
+    reg8(E)[lane] = registers.general.E;
+    reg8(H)[lane] = registers.general.H;
+    reg8(L)[lane] = registers.general.L;
+    reg8(F)[lane] = registers.general.F.value;
+    reg8(A)[lane] = registers.general.A;
+    reg8(ShadowB)[lane] = registers.shadow.B;
+    reg8(ShadowC)[lane] = registers.shadow.C;
+    reg8(ShadowD)[lane] = registers.shadow.D;
+    reg8(ShadowE)[lane] = registers.shadow.E;
+    reg8(ShadowH)[lane] = registers.shadow.H;
+    reg8(ShadowL)[lane] = registers.shadow.L;
+    reg8(ShadowF)[lane] = registers.shadow.F.value;
+    reg8(ShadowA)[lane] = registers.shadow.A;
+    reg8(IXH)[lane] = registers.IXH;
+    reg8(IXL)[lane] = registers.IXL;
+    reg8(IYH)[lane] = registers.IYH;
+    reg8(IYL)[lane] = registers.IYL;
+    sp[lane] = registers.SP;
+    pc_lanes[lane] = registers.PC;
+    reg8(I)[lane] = registers.I;
+    reg8(IM)[lane] = registers.IM;
+    reg8(IFF1)[lane] = registers.IFF1 ? 0xFF : 0;
+    reg8(IFF2)[lane] = registers.IFF2 ? 0xFF : 0;
+}
+
+uint8_t WideEmulator::read_memory(size_t lane, uint16_t addr) const
+{
+    if(scalar_lanes[lane])
+        return scalar_lanes[lane]->emulator.get_memory()[addr];
+    return fetch(lane, addr);
+}
+
+void WideEmulator::write_memory(size_t lane, uint16_t addr, const uint8_t *data, size_t size)
+{
+    if(scalar_lanes[lane])
+    {
+        Emulator &emulator = scalar_lanes[lane]->emulator;
+        std::vector<uint8_t> image(emulator.get_memory(), emulator.get_memory() + 0x10000);
+        for(size_t i = 0; i < size; ++i)
+            image[(uint16_t)(addr + i)] = data[i];
+        emulator.load_memory(image.data(), program_end);
+        return;
+    }
+
+    bool over_program = false;
+    for(size_t i = 0; i < size; ++i)
+    {
+        uint16_t target = addr + i;
+        memory[(lane << 16) | target] = data[i];
+        over_program |= target < program_end;
+    }
+    if(over_program && state[lane] == Running)
+        move_to_scalar(lane);
+}
+
+void WideEmulator::set_port_handler(lane_port_callback_t callback, void *context)
+{
+    port_callback = callback;
+    port_context = context;
+}
+
+void WideEmulator::scalar_port(void *context, Emulator::PortState state, uint8_t *data, uint16_t size)
+{
+    ScalarLane &scalar = *static_cast<ScalarLane *>(context);
+    WideEmulator &owner = *scalar.owner;
+    if(owner.port_callback)
+        owner.port_callback(owner.port_context, scalar.lane, state, data, size);
+    else if(state == Emulator::PortState::Read)
+        memset(data, 0xFF, size);
+}
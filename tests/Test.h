@@ -0,0 +1,76 @@
+#ifndef Z80_DISASSEMBLER_TEST_H
+#define Z80_DISASSEMBLER_TEST_H
+
+
+#include <iostream>
+#include <vector>
+
+/*!
+ * The harness shared by the test programs. Each test is declared with
+ * TEST(name) and run in the order declared, checks which fail are
+ * reported as they happen, and the program exits with 1 if any did.
+ * Include it from one source file per test program, as it defines main().
+ */
+namespace test
+{
+    struct Case
+    {
+        const char *name;
+        void (*run)();
+    };
+
+    inline std::vector<Case> &cases()
+    {
+        static std::vector<Case> registered;
+        return registered;
+    }
+
+    inline int &failures()
+    {
+        static int count = 0;
+        return count;
+    }
+
+    struct Registration
+    {
+        Registration(const char *name, void (*run)())
+        {
+            cases().push_back({name, run});
+        }
+    };
+}
+
+/*!
+ * Reports a check which failed
+ *
+ * @param condition True if the check passed
+ * @param what What was checked
+ */
+inline void check(bool condition, const char *what)
+{
+    if(!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++test::failures();
+    }
+}
+
+#define TEST(name) \
+    static void name(); \
+    static test::Registration name##_registration(#name, &name); \
+    static void name()
+
+int main()
+{
+    for(const test::Case &test_case : test::cases())
+    {
+        int before = test::failures();
+        test_case.run();
+        if(test::failures() != before)
+            std::cerr << "in " << test_case.name << std::endl;
+    }
+    return test::failures() ? 1 : 0;
+}
+
+
+#endif //Z80_DISASSEMBLER_TEST_H
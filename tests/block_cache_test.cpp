@@ -0,0 +1,67 @@
+#include <memory>
+#include <vector>
+#include "BlockCache.h"
+#include "Emulator.h"
+#include "Test.h"
+
+// Checks blocks which straddle a page boundary, and write to a page they cover, are cached and dropped without leaking
+
+static std::unique_ptr<BlockCache::Block> make_block(uint16_t start, uint16_t size)
+{
+    std::unique_ptr<BlockCache::Block> block(new BlockCache::Block());
+    block->start = start;
+    block->size = size;
+    return block;
+}
+
+// The page lists only hold the blocks which are cached, however often they're dropped and rebuilt
+TEST(page_lists)
+{
+    BlockCache cache;
+    std::array<bool, BlockCache::page_count> watched_pages{};
+
+    for(int pass = 0; pass < 1000; ++pass)
+    {
+        cache.insert(make_block(0x00F8, 10), watched_pages);
+        cache.invalidate_page(0x01);
+        cache.release();
+    }
+    check(cache.page_entries() == 0, "dropping a block removes it from every page it covers");
+
+    cache.insert(make_block(0x00F8, 10), watched_pages);
+    for(int pass = 0; pass < 1000; ++pass)
+        cache.insert(make_block(0x00F8, 10), watched_pages);
+    check(cache.page_entries() == 2, "replacing a block doesn't leave its old entries behind");
+
+    cache.insert(make_block(0xFFFE, 4), watched_pages);
+    cache.invalidate_page(0x00);
+    check(cache.find(0xFFFE) == nullptr && cache.find(0x00F8) == nullptr, "blocks which wrap around memory are dropped");
+    check(cache.page_entries() == 0, "blocks which wrap around memory are removed from every page");
+}
+
+// A loop straddling 0x0100 which stores into the page it ends in, run by every engine
+TEST(straddling_loop)
+{
+    std::vector<uint8_t> program(0x105, 0);
+    const uint8_t setup[] = {0x06, 0x00,        // LD B,0
+                             0x0E, 0x40,        // LD C,0x40
+                             0xC3, 0xFC, 0x00}; // JP 0x00FC
+    const uint8_t loop[] = {0x32, 0x80, 0x01,   // 0x00FC: LD (0x0180),A
+                            0x3C,               // 0x00FF: INC A
+                            0x10, 0xFA,         // 0x0100: DJNZ 0x00FC
+                            0x0D,               // 0x0102: DEC C
+                            0x20, 0xF7};        // 0x0103: JR NZ,0x00FC
+    std::copy(std::begin(setup), std::end(setup), program.begin());
+    std::copy(std::begin(loop), std::end(loop), program.begin() + 0xFC);
+
+    Emulator reference(Emulator::Engine::Portable);
+    reference.emulate(program);
+    for(Emulator::Engine engine : {Emulator::Engine::Threaded, Emulator::Engine::Cached, Emulator::Engine::Native})
+    {
+        Emulator emulator(engine);
+        emulator.emulate(program);
+        check(emulator.get_registers().general.AF == reference.get_registers().general.AF
+              && emulator.get_registers().PC == reference.get_registers().PC, "every engine ends in the same state");
+        check(emulator.get_memory()[0x0180] == reference.get_memory()[0x0180], "every engine stores the same value");
+    }
+}
@@ -0,0 +1,48 @@
+#include <vector>
+#include "Emulator.h"
+#include "Test.h"
+
+// Checks repeating block instructions stop at the cycle budget, and when they write over themselves
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+// A long LDIR is interrupted at the budget, and picks up where it left off
+TEST(budget)
+{
+    const std::vector<uint8_t> program = {0x21, 0x00, 0x10, // LD HL,0x1000
+                                          0x11, 0x00, 0x80, // LD DE,0x8000
+                                          0x01, 0x00, 0x70, // LD BC,0x7000
+                                          0xED, 0xB0};      // LDIR
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.load(program);
+        uint64_t taken = emulator.run_for_cycles(200);
+        check(taken >= 200 && taken < 200 + 21, "LDIR stops at the budget");
+        check(emulator.get_registers().PC == 0x0009 && emulator.get_registers().general.BC != 0, "LDIR resumes from itself");
+
+        uint64_t total = taken;
+        while(emulator.get_registers().PC != program.size())
+            total += emulator.run_for_cycles(1000);
+        check(emulator.get_registers().general.BC == 0 && emulator.get_registers().general.DE == 0xF000, "LDIR finishes the copy");
+        check(total == 30 + 21 * (0x7000 - 1) + 16, "LDIR takes 21 T-states for every pass but the last");
+    }
+}
+
+// Copying zeros over the LDIR turns it into NOP, OR B part way through
+TEST(overwrite)
+{
+    const std::vector<uint8_t> program = {0x21, 0x00, 0x10, // LD HL,0x1000
+                                          0x11, 0x00, 0x00, // LD DE,0x0000
+                                          0x01, 0x00, 0x01, // LD BC,0x0100
+                                          0xED, 0xB0};      // LDIR
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.emulate(program);
+        check(emulator.get_registers().general.DE == 0x000A && emulator.get_registers().general.BC == 0x00F6,
+              "LDIR stops once it writes over itself");
+        check(emulator.get_memory()[0x0009] == 0x00 && emulator.get_memory()[0x000A] == 0xB0, "LDIR only writes the bytes it got to");
+    }
+}
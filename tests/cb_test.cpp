@@ -0,0 +1,70 @@
+#include <vector>
+#include "Emulator.h"
+#include "Test.h"
+
+// Checks CB prefixed rotates, shifts and bit operations against results and flags worked out by hand
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+/*!
+ * Runs code on every engine, checking a register and F afterwards
+ *
+ * @param code The code to run
+ * @param result Gets the register to check
+ * @param expected The value the register should have
+ * @param flags The value F should have
+ * @param what What's being checked
+ */
+template<typename Result>
+static void check_result(const std::vector<uint8_t> &code, Result result, uint8_t expected, uint8_t flags, const char *what)
+{
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.emulate(code);
+        const Emulator::Registers &reg = emulator.get_registers();
+        check(result(emulator, reg) == expected && reg.general.F.value == flags, what);
+    }
+}
+
+TEST(rotates_and_shifts)
+{
+    check_result({0x06, 0x81, 0xCB, 0x00}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.B; },
+                 0x03, 0x05, "RLC B carries bit 7 round");
+    check_result({0x3E, 0x01, 0xCB, 0x0F}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.A; },
+                 0x80, 0x81, "RRC A carries bit 0 round");
+    check_result({0x37, 0x0E, 0x80, 0xCB, 0x11}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.C; },
+                 0x01, 0x01, "RL C rotates through the carry");
+    check_result({0x16, 0x80, 0xCB, 0x22}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.D; },
+                 0x00, 0x45, "SLA D shifts out to zero");
+    check_result({0x1E, 0x81, 0xCB, 0x2B}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.E; },
+                 0xC0, 0x85, "SRA E keeps the sign");
+    check_result({0x26, 0x80, 0xCB, 0x34}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.H; },
+                 0x01, 0x01, "SLL H shifts a one in");
+    check_result({0x2E, 0x01, 0xCB, 0x3D}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.L; },
+                 0x00, 0x45, "SRL L shifts out to zero");
+    check_result({0x3E, 0x14, 0xCB, 0x07}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.A; },
+                 0x28, 0x2C, "RLC A copies bits 3 and 5 of the result to F");
+}
+
+TEST(bits)
+{
+    check_result({0x3E, 0x80, 0xB7, 0xCB, 0x7F}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.A; },
+                 0x80, 0x90, "BIT 7, A of a set bit");
+    check_result({0x3E, 0x80, 0x37, 0xCB, 0x47}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.A; },
+                 0x80, 0x55, "BIT 0, A of a clear bit, keeping the carry");
+    check_result({0x3E, 0x0F, 0xB7, 0xCB, 0xBF, 0xCB, 0xC7}, [](const Emulator &, const Emulator::Registers &reg) { return reg.general.A; },
+                 0x0F, 0x0C, "SET and RES leave F alone");
+}
+
+TEST(memory)
+{
+    const std::vector<uint8_t> code = {0x21, 0x00, 0x80, // LD HL,0x8000
+                                       0x36, 0x0F,       // LD (HL),0x0F
+                                       0xCB, 0xFE,       // SET 7,(HL)
+                                       0xCB, 0x86,       // RES 0,(HL)
+                                       0xCB, 0x06};      // RLC (HL)
+    check_result(code, [](const Emulator &emulator, const Emulator::Registers &) { return emulator.get_memory()[0x8000]; },
+                 0x1D, 0x0D, "SET, RES and RLC of (HL)");
+}
@@ -0,0 +1,57 @@
+#include <string>
+#include <vector>
+#include "Disassembler.h"
+#include "Test.h"
+
+// Checks a listing covering the prefixed and undocumented forms against one checked by hand
+
+TEST(listing)
+{
+    const uint8_t code[] = {0x00,                   // NOP
+                            0x3E, 0x12,             // LD A,0x12
+                            0x21, 0x34, 0x12,       // LD HL,0x1234
+                            0xDD, 0x21, 0x00, 0x80, // LD IX,0x8000
+                            0xDD, 0x7E, 0x05,       // LD A,(IX+5)
+                            0xFD, 0x77, 0xFE,       // LD (IY-2),A
+                            0xDD, 0x36, 0x03, 0x2A, // LD (IX+3),0x2A
+                            0xDD, 0x26, 0x12,       // LD IXH,0x12
+                            0xDD, 0x7D,             // LD A,IXL
+                            0xFD, 0x84,             // ADD A,IYH
+                            0xDD, 0xCB, 0x02, 0x06, // RLC (IX+2)
+                            0xDD, 0xCB, 0x02, 0x00, // RLC (IX+2),B
+                            0xFD, 0xCB, 0xFF, 0x7E, // BIT 7,(IY-1)
+                            0xFD, 0xCB, 0x04, 0xFF, // SET 7,(IY+4),A
+                            0xCB, 0x37,             // SLL A
+                            0xED, 0xB0,             // LDIR
+                            0x10, 0xFE,             // DJNZ to itself
+                            0xC3, 0x00, 0x80,       // JP 0x8000
+                            0xED, 0x5E,             // IM 2
+                            0xDD};                  // A prefix cut off by the end of the data
+    const char *expected = "8000  00           NOP\n"
+                           "8001  3E 12        LD A, 0x12\n"
+                           "8003  21 34 12     LD HL, 0x1234\n"
+                           "8006  DD 21 00 80  LD IX, 0x8000\n"
+                           "800A  DD 7E 05     LD A, (IX+0x05)\n"
+                           "800D  FD 77 FE     LD (IY-0x02), A\n"
+                           "8010  DD 36 03 2A  LD (IX+0x03), 0x2A\n"
+                           "8014  DD 26 12     LD IXH, 0x12\n"
+                           "8017  DD 7D        LD A, IXL\n"
+                           "8019  FD 84        ADD A, IYH\n"
+                           "801B  DD CB 02 06  RLC (IX+0x02)\n"
+                           "801F  DD CB 02 00  RLC (IX+0x02), B\n"
+                           "8023  FD CB FF 7E  BIT 7, (IY-0x01)\n"
+                           "8027  FD CB 04 FF  SET 7, (IY+0x04), A\n"
+                           "802B  CB 37        SLL A\n"
+                           "802D  ED B0        LDIR\n"
+                           "802F  10 FE        DJNZ 0x802F\n"
+                           "8031  C3 00 80     JP 0x8000\n"
+                           "8034  ED 5E        IM 2\n"
+                           "8036  DD           DB 0xDD\n";
+
+    std::vector<Disassembler::Instruction> instructions;
+    Disassembler::disassemble(code, sizeof(code), 0x8000, instructions);
+    std::string listing;
+    for(const Disassembler::Instruction &instr : instructions)
+        Disassembler::format(instr, listing);
+    check(listing == expected, "the listing matches");
+}
@@ -0,0 +1,47 @@
+#include <vector>
+#include "Fuzzer.h"
+#include "Test.h"
+
+// Checks each fuzzer run starts from the same state, whatever the run before it did
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+// Stores the input at 0x8000 until a read past its end, then writes out the first and fourth bytes stored and how many there were
+static const std::vector<uint8_t> program = {0x21, 0x00, 0x80, // LD HL,0x8000
+                                             0xDB, 0x10,       // loop: IN A,(0x10)
+                                             0xFE, 0xFF,       // CP 0xFF
+                                             0x28, 0x04,       // JR Z,done
+                                             0x77,             // LD (HL),A
+                                             0x23,             // INC HL
+                                             0x18, 0xF6,       // JR loop
+                                             0x3A, 0x00, 0x80, // done: LD A,(0x8000)
+                                             0xD3, 0x20,       // OUT (0x20),A
+                                             0x3A, 0x03, 0x80, // LD A,(0x8003)
+                                             0xD3, 0x20,       // OUT (0x20),A
+                                             0x7D,             // LD A,L
+                                             0xD3, 0x20};      // OUT (0x20),A
+
+TEST(runs_are_independent)
+{
+    const uint8_t long_input[] = {1, 2, 3, 4, 5};
+    const uint8_t short_input[] = {9};
+    for(Emulator::Engine engine : engines)
+    {
+        Fuzzer fuzzer(program, 1000, engine);
+        check(fuzzer.run(long_input, sizeof(long_input)) == Fuzzer::Finished, "the program runs to the end");
+        check(fuzzer.get_output() == std::vector<uint8_t>({1, 4, 5}), "the first run sees its own input");
+
+        check(fuzzer.run(short_input, sizeof(short_input)) == Fuzzer::Finished, "the program runs to the end again");
+        check(fuzzer.get_output() == std::vector<uint8_t>({9, 0, 1}), "memory the first run wrote is back as it started");
+        check(fuzzer.get_emulator().get_memory()[0x8001] == 0, "no input from the first run is left");
+
+        fuzzer.run(long_input, sizeof(long_input));
+        check(fuzzer.get_output() == std::vector<uint8_t>({1, 4, 5}), "running the first input again gives the same output");
+
+        Fuzzer fresh(program, 1000, engine);
+        fresh.run(short_input, sizeof(short_input));
+        check(fresh.get_output() == std::vector<uint8_t>({9, 0, 1}), "a fresh fuzzer gives the same output");
+        check(fresh.get_emulator().get_registers().general.HL == 0x8001, "input ends where it should");
+    }
+}
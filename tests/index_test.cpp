@@ -0,0 +1,122 @@
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "Emulator.h"
+#include "ProgramImage.h"
+#include "Test.h"
+
+// Checks every DD, FD, DDCB and FDCB opcode runs the same on every engine, and a few against known results
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+// Sets every register, and the bytes (HL), (IX+0x40) and (IY+0x40) point at
+static const std::vector<uint8_t> setup = {0x31, 0x00, 0xC0,       // LD SP,0xC000
+                                           0xDD, 0x21, 0x10, 0x80, // LD IX,0x8010
+                                           0xFD, 0x21, 0x20, 0x90, // LD IY,0x9020
+                                           0x21, 0x30, 0x70,       // LD HL,0x7030
+                                           0x01, 0x34, 0x12,       // LD BC,0x1234
+                                           0x11, 0x78, 0x56,       // LD DE,0x5678
+                                           0x3E, 0x5A,             // LD A,0x5A
+                                           0x32, 0x50, 0x80,       // LD (0x8050),A
+                                           0x32, 0x60, 0x90,       // LD (0x9060),A
+                                           0x32, 0x30, 0x70,       // LD (0x7030),A
+                                           0xC6, 0xC3};            // ADD A,0xC3
+
+// Runs code from 0x0100, with HALT at every address below so calls, restarts and returns to 0 stop.
+// Operands are all 0x40, so jumps land past the end of the program, which stops it too.
+static void run(Emulator &emulator, const std::vector<uint8_t> &code)
+{
+    std::vector<uint8_t> data(0x100, 0x76);
+    data.insert(data.end(), code.begin(), code.end());
+    ProgramImage::Options options;
+    options.entry = 0x0100;
+    std::shared_ptr<const ProgramImage> image = ProgramImage::parse(data.data(), data.size(), options);
+
+    emulator.reset();
+    emulator.emulate<Emulator::Fast>(*image);
+}
+
+static bool same_state(const Emulator &a, const Emulator &b)
+{
+    const Emulator::Registers &x = a.get_registers();
+    const Emulator::Registers &y = b.get_registers();
+    return x.general.AF == y.general.AF && x.general.BC == y.general.BC && x.general.DE == y.general.DE && x.general.HL == y.general.HL
+           && x.shadow.AF == y.shadow.AF && x.shadow.BC == y.shadow.BC && x.shadow.DE == y.shadow.DE && x.shadow.HL == y.shadow.HL
+           && x.IX == y.IX && x.IY == y.IY && x.SP == y.SP && x.PC == y.PC && x.IFF1 == y.IFF1
+           && memcmp(a.get_memory(), b.get_memory(), 0x10000) == 0;
+}
+
+// Each opcode once, and in a loop run often enough for the cached and native engines to compile it
+static void check_engines(const std::vector<uint8_t> &instruction, const char *what)
+{
+    std::vector<uint8_t> once = setup;
+    once.insert(once.end(), instruction.begin(), instruction.end());
+
+    std::vector<uint8_t> looped = setup;
+    const uint8_t counter[] = {0x3E, 0x10,        // LD A,16
+                               0x32, 0x00, 0x7F}; // LD (0x7F00),A
+    const uint8_t loop[] = {0x3A, 0x00, 0x7F,     // LD A,(0x7F00)
+                            0x3D,                 // DEC A
+                            0x32, 0x00, 0x7F,     // LD (0x7F00),A
+                            0x20, 0x00};          // JR NZ,loop
+    looped.insert(looped.end(), std::begin(counter), std::end(counter));
+    looped.insert(looped.end(), instruction.begin(), instruction.end());
+    looped.insert(looped.end(), std::begin(loop), std::end(loop));
+    looped.back() = (uint8_t)-(int)(instruction.size() + sizeof(loop));
+
+    for(const std::vector<uint8_t> *code : {&once, &looped})
+    {
+        Emulator reference(Emulator::Engine::Portable);
+        run(reference, *code);
+        for(Emulator::Engine engine : engines)
+        {
+            Emulator emulator(engine);
+            run(emulator, *code);
+            check(same_state(emulator, reference), what);
+        }
+    }
+}
+
+TEST(every_opcode)
+{
+    for(uint8_t prefix : {0xDD, 0xFD})
+    {
+        for(int opcode = 0; opcode < 0x100; ++opcode)
+        {
+            if(opcode != 0xCB)
+                check_engines({prefix, (uint8_t)opcode, 0x40, 0x40}, prefix == 0xDD ? "DD opcodes match on every engine" : "FD opcodes match on every engine");
+            check_engines({prefix, 0xCB, 0x40, (uint8_t)opcode}, prefix == 0xDD ? "DDCB opcodes match on every engine" : "FDCB opcodes match on every engine");
+        }
+    }
+}
+
+// Loads, stores and arithmetic through IX and IY, and the undocumented halves and DDCB copies
+TEST(known_results)
+{
+    const std::vector<uint8_t> code = {0xDD, 0x21, 0x00, 0x80,       // LD IX,0x8000
+                                       0xDD, 0x36, 0x01, 0x2A,       // LD (IX+1),42
+                                       0xDD, 0x7E, 0x01,             // LD A,(IX+1)
+                                       0xFD, 0x21, 0x05, 0x80,       // LD IY,0x8005
+                                       0xFD, 0x77, 0xFC,             // LD (IY-4),A, the same byte
+                                       0xFD, 0x34, 0xFC,             // INC (IY-4)
+                                       0xDD, 0x46, 0x01,             // LD B,(IX+1)
+                                       0xDD, 0x26, 0x12,             // LD IXH,0x12
+                                       0xDD, 0x2E, 0x34,             // LD IXL,0x34
+                                       0xDD, 0x7C,                   // LD A,IXH
+                                       0xDD, 0x85,                   // ADD A,IXL
+                                       0xFD, 0x21, 0x00, 0x90,       // LD IY,0x9000
+                                       0xFD, 0x36, 0x00, 0x81,       // LD (IY+0),0x81
+                                       0xFD, 0xCB, 0x00, 0x01,       // RLC (IY+0),C
+                                       0xDD, 0x09};                  // ADD IX,BC
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.emulate<Emulator::Fast>(code);
+        const Emulator::Registers &reg = emulator.get_registers();
+        check(reg.general.B == 43, "LD B,(IX+1) reads what INC (IY-4) wrote");
+        check(reg.general.A == 0x46, "IXH and IXL are the halves of IX");
+        check(reg.general.C == 0x03 && emulator.get_memory()[0x9000] == 0x03, "RLC (IY+0),C rotates memory and copies it to C");
+        check(reg.IX == 0x1234 + 0x2B03, "ADD IX,BC adds to IX");
+    }
+}
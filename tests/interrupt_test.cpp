@@ -0,0 +1,66 @@
+#include <vector>
+#include "Emulator.h"
+#include "Test.h"
+
+// Checks interrupts wait for the instruction after EI, and only that one
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+// An interrupt raised long after an EI is taken straight away, even when PC is back at the instruction after it
+TEST(stale_ei)
+{
+    std::vector<uint8_t> program(0x3B, 0);
+    const uint8_t main[] = {0xED, 0x56,  // IM 1
+                            0xFB,        // EI
+                            0x3C,        // loop: INC A
+                            0x18, 0xFD}; // JR loop
+    const uint8_t handler[] = {0x47,     // 0x0038: LD B,A
+                               0xF3,     // DI
+                               0x76};    // HALT
+    std::copy(std::begin(main), std::end(main), program.begin());
+    std::copy(std::begin(handler), std::end(handler), program.begin() + 0x38);
+
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.load(program);
+        emulator.run(4);
+        check(emulator.get_registers().PC == 0x0003 && emulator.get_registers().general.A == 1, "the loop runs once");
+        emulator.interrupt(0xFF);
+        emulator.run(10);
+        check(emulator.get_registers().general.B == 1, "the interrupt is taken before another INC A");
+    }
+}
+
+// The instruction after EI is held back for an interrupt which is already raised
+TEST(ei_delay)
+{
+    const std::vector<uint8_t> program = {0xED, 0x56, // IM 1
+                                          0xFB,       // EI
+                                          0x3C,       // INC A
+                                          0x3C};      // INC A
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.load(program);
+        emulator.interrupt(0xFF);
+        emulator.run(10);
+        check(emulator.get_registers().PC == 0x0038 && emulator.get_registers().general.A == 1, "one instruction runs after EI");
+    }
+}
+
+// An EI which ends the program doesn't run the byte after it, and leaves the interrupt for the next run
+TEST(ei_at_end)
+{
+    const std::vector<uint8_t> program = {0xED, 0x56, // IM 1
+                                          0xFB};      // EI
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.load(program);
+        emulator.interrupt(0xFF);
+        check(emulator.run(10) == 2, "nothing runs after the EI");
+        check(emulator.get_registers().PC == 0x0003 && emulator.get_registers().SP == 0xFFFF, "the interrupt isn't taken past the end");
+    }
+}
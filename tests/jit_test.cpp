@@ -0,0 +1,75 @@
+#include <random>
+#include <vector>
+#include "Emulator.h"
+#include "Jit.h"
+#include "Test.h"
+
+// Checks compiled code against the portable engine, on loops of random register and ALU instructions run often enough to compile
+
+/*!
+ * Appends a random instruction which works on registers, never writing B as that counts the loop
+ */
+static void random_instruction(std::mt19937 &random, std::vector<uint8_t> &code)
+{
+    static const uint8_t others[] = {0x07, 0x0F, 0x17, 0x1F, 0x27, 0x2F, 0x37, 0x3F}; // RLCA, RRCA, RLA, RRA, DAA, CPL, SCF, CCF
+    static const uint8_t writable[] = {1, 2, 3, 4, 5, 7}; // r[] without B and (HL)
+    static const uint8_t readable[] = {0, 1, 2, 3, 4, 5, 7};
+
+    uint8_t dest = writable[random() % sizeof(writable)];
+    uint8_t source = readable[random() % sizeof(readable)];
+    uint8_t n = (uint8_t)random();
+    switch(random() % 8)
+    {
+        case 0: // LD r, r
+            code.push_back(0x40 | (dest << 3) | source);
+            break;
+        case 1: // LD r, n
+            code.insert(code.end(), {(uint8_t)(0x06 | (dest << 3)), n});
+            break;
+        case 2: // INC r and DEC r
+            code.push_back((0x04 | (dest << 3)) + random() % 2);
+            break;
+        case 3: // alu[y] r
+        case 4:
+            code.push_back(0x80 | (random() % 8 << 3) | source);
+            break;
+        case 5: // alu[y] n
+            code.insert(code.end(), {(uint8_t)(0xC6 | (random() % 8 << 3)), n});
+            break;
+        case 6: // INC rp and DEC rp, other than BC
+            code.push_back((random() % 2 ? 0x03 : 0x0B) | ((1 + random() % 3) << 4));
+            break;
+        default:
+            code.push_back(others[random() % sizeof(others)]);
+            break;
+    }
+}
+
+TEST(random_loops)
+{
+    std::mt19937 random(0x280);
+    for(int loop = 0; loop < 2000; ++loop)
+    {
+        std::vector<uint8_t> code;
+        for(uint8_t r : {1, 2, 3, 4, 5, 7}) // LD r, n
+            code.insert(code.end(), {(uint8_t)(0x06 | (r << 3)), (uint8_t)random()});
+        code.insert(code.end(), {0xC6, (uint8_t)random()});              // ADD A, n, for random flags
+        code.insert(code.end(), {0x06, (uint8_t)(Jit::hot_threshold * 4)}); // LD B, n
+
+        size_t body = code.size();
+        size_t length = 1 + random() % 24;
+        for(size_t i = 0; i < length; ++i)
+            random_instruction(random, code);
+        code.insert(code.end(), {0x10, (uint8_t)(body - code.size() - 2)}); // DJNZ body
+
+        Emulator portable(Emulator::Engine::Portable);
+        Emulator native(Emulator::Engine::Native);
+        portable.emulate(code);
+        native.emulate(code);
+        const Emulator::Registers &expected = portable.get_registers();
+        const Emulator::Registers &reg = native.get_registers();
+        check(reg.general.AF == expected.general.AF && reg.general.BC == expected.general.BC && reg.general.DE == expected.general.DE
+              && reg.general.HL == expected.general.HL && reg.SP == expected.SP && reg.PC == expected.PC,
+              "compiled code ends in the same state as the portable engine");
+    }
+}
@@ -0,0 +1,41 @@
+#include <algorithm>
+#include <vector>
+#include "Emulator.h"
+#include "Test.h"
+
+// Checks ports are addressed by all 16 bits of the bus, as the hardware puts them there
+
+struct Written
+{
+    std::vector<uint8_t> data;
+};
+
+static void record_writes(void *context, Emulator::PortState state, uint8_t *data, uint16_t size)
+{
+    if(state == Emulator::PortState::Write)
+        static_cast<Written *>(context)->data.insert(static_cast<Written *>(context)->data.end(), data, data + size);
+}
+
+// OUT (n), A reaches a 16 bit bank switch port with A on the top of the bus, and 8 bit ports still see every write
+TEST(port_addresses)
+{
+    static uint8_t banks[2][Emulator::memory_page_size];
+    std::fill(std::begin(banks[0]), std::end(banks[0]), 0x11);
+    std::fill(std::begin(banks[1]), std::end(banks[1]), 0x22);
+
+    const std::vector<uint8_t> program = {0x3E, 0x7F,       // LD A,0x7F
+                                          0xD3, 0xFD,       // OUT (0xFD),A, port 0x7FFD
+                                          0x3A, 0x00, 0x80, // LD A,(0x8000)
+                                          0xD3, 0x10,       // OUT (0x10),A, port 0x2210
+                                          0x21, 0x00, 0x00, // LD HL,0x0000
+                                          0x01, 0x10, 0x02, // LD BC,0x0210
+                                          0xED, 0xB3};      // OTIR
+    Emulator emulator;
+    Written written;
+    emulator.bind_bank_switch(0x7FFD, 0x8, 1, {{banks[0], nullptr}, {banks[1], nullptr}});
+    emulator.bind_port(0x10, record_writes, &written);
+    emulator.emulate(program);
+
+    check(emulator.get_registers().general.A == 0x22, "OUT (n), A switches the bank bound to 0x7FFD");
+    check(written.data == std::vector<uint8_t>({0x22, 0x3E, 0x7F}), "8 bit ports are decoded from the low byte of the bus");
+}
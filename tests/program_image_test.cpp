@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include "Emulator.h"
+#include "ProgramImage.h"
+#include "Test.h"
+
+// Checks ROM mapped from an image stays readable after the caller drops the image
+
+// The emulator keeps the image's pages mapped through reset() and a later load(), so it has to keep the image too
+TEST(rom_lifetime)
+{
+    const char *path = "program_image_test.bin";
+    {
+        std::vector<char> rom(Emulator::memory_page_size, 0);
+        rom[0] = 0x3E; // LD A,0x2A
+        rom[1] = 0x2A;
+        rom[2] = 0x76; // HALT
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write(rom.data(), rom.size());
+    }
+
+    ProgramImage::Options options;
+    options.read_only = true;
+    std::shared_ptr<const ProgramImage> image = ProgramImage::open(path, options);
+    check(image != nullptr, "the ROM opens");
+    if(!image)
+        return;
+
+    Emulator emulator;
+    emulator.load(*image);
+    image.reset();
+    std::remove(path);
+
+    emulator.reset();
+    emulator.load(std::vector<uint8_t>{0x00, 0x00, 0x00});
+    emulator.run(10);
+    check(emulator.get_registers().general.A == 0x2A, "the ROM is still read once the image is dropped");
+
+    std::shared_ptr<const Snapshot> snapshot = emulator.snapshot();
+    emulator.unmap_memory(0, 1);
+    emulator.restore(snapshot);
+    snapshot.reset();
+    emulator.reset();
+    emulator.load(std::vector<uint8_t>{0x00, 0x00, 0x00});
+    emulator.run(10);
+    check(emulator.get_registers().general.A == 0x2A, "a snapshot keeps the ROM it had mapped");
+}
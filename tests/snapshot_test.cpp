@@ -0,0 +1,50 @@
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "Emulator.h"
+#include "Snapshot.h"
+#include "Test.h"
+
+// Checks restoring a snapshot puts back memory a block copy wrote over, in pages untouched since it was taken
+
+static const Emulator::Engine engines[] = {Emulator::Engine::Portable, Emulator::Engine::Threaded,
+                                           Emulator::Engine::Cached, Emulator::Engine::Native};
+
+TEST(restore_after_ldir)
+{
+    // Copies 0x300 bytes over four pages from 0xA0F0, which nothing has written since the snapshot
+    std::vector<uint8_t> data = {0x21, 0x00, 0x90, // LD HL,0x9000
+                                 0x11, 0xF0, 0xA0, // LD DE,0xA0F0
+                                 0x01, 0x00, 0x03, // LD BC,0x0300
+                                 0xED, 0xB0,       // LDIR
+                                 0x76};            // HALT
+    data.resize(0x9300);
+    for(size_t i = 0x9000; i < data.size(); ++i)
+        data[i] = (uint8_t)(i * 7 + 1);
+
+    for(Emulator::Engine engine : engines)
+    {
+        Emulator emulator(engine);
+        emulator.load(data);
+        std::vector<uint8_t> memory(emulator.get_memory(), emulator.get_memory() + 0x10000);
+        Emulator::Registers reg = emulator.get_registers();
+        std::shared_ptr<const Snapshot> snapshot = emulator.snapshot();
+
+        // Twice, as the second restore only copies back the pages written since the first
+        for(int pass = 0; pass < 2; ++pass)
+        {
+            emulator.run(1000);
+            check(emulator.get_registers().general.BC == 0 && emulator.get_memory()[0xA3EF] == data[0x92FF], "LDIR copies the block");
+
+            emulator.restore(snapshot);
+            check(memcmp(emulator.get_memory(), memory.data(), memory.size()) == 0, "restoring puts back the memory LDIR wrote");
+            const Emulator::Registers &restored = emulator.get_registers();
+            check(restored.PC == reg.PC && restored.general.BC == reg.general.BC && restored.general.DE == reg.general.DE
+                  && restored.general.HL == reg.general.HL, "restoring puts back the registers");
+        }
+
+        Emulator fork(engine);
+        fork.restore(snapshot);
+        check(memcmp(fork.get_memory(), memory.data(), memory.size()) == 0, "restoring into another emulator gives the same memory");
+    }
+}
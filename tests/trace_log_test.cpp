@@ -0,0 +1,96 @@
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Emulator.h"
+#include "Trace.h"
+#include "Test.h"
+
+// Checks every instruction the emulator executes has a line in the text trace
+
+struct Logged
+{
+    std::vector<uint8_t> bytes;
+    const char *text;
+};
+
+static void check_logged(const std::vector<Logged> &expected)
+{
+    Emulator emulator;
+    for(const Logged &logged : expected)
+    {
+        TraceRecord record = {};
+        record.pc = 0x1000;
+        record.length = logged.bytes.size();
+        std::copy(logged.bytes.begin(), logged.bytes.end(), record.bytes);
+
+        std::stringstream log_stream;
+        emulator.log_trace_record(record, log_stream);
+        check(log_stream.str() == std::string(logged.text) + "\n", logged.text);
+    }
+}
+
+// Jumps, calls and restarts, with relative jumps logged as their offset from the instruction
+TEST(branches)
+{
+    check_logged({{{0x10, 0xFB}, "DJNZ -3"},
+                  {{0x18, 0x05}, "JR 7"},
+                  {{0x28, 0x02}, "JR Z, 4"},
+                  {{0x38, 0xFE}, "JR C, 0"},
+                  {{0xC3, 0x34, 0x12}, "JP 4660"},
+                  {{0xFA, 0x00, 0x80}, "JP M, 32768"},
+                  {{0xE9}, "JP (HL)"},
+                  {{0xCD, 0x00, 0x01}, "CALL 256"},
+                  {{0xCC, 0x00, 0x01}, "CALL Z, 256"},
+                  {{0xC8}, "RET Z"},
+                  {{0xC9}, "RET"},
+                  {{0xFF}, "RST 56"}});
+}
+
+// Interrupt control
+TEST(interrupts)
+{
+    check_logged({{{0xF3}, "DI"},
+                  {{0xFB}, "EI"},
+                  {{0xED, 0x46}, "IM 0"},
+                  {{0xED, 0x56}, "IM 1"},
+                  {{0xED, 0x5E}, "IM 2"},
+                  {{0xED, 0x45}, "RETN"},
+                  {{0xED, 0x4D}, "RETI"},
+                  {{0xED, 0x47}, "LD I, A"},
+                  {{0xED, 0x57}, "LD A, I"}});
+}
+
+// The CB page, and the DD and FD pages with IX and IY, IXH and IXL, and (IX+d) in place of HL, H and L, and (HL)
+TEST(indexed)
+{
+    check_logged({{{0xCB, 0x00}, "RLC B"},
+                  {{0xCB, 0x7E}, "BIT 7, (HL)"},
+                  {{0xCB, 0xC7}, "SET 0, A"},
+                  {{0xDD, 0x21, 0x34, 0x12}, "LD IX, 4660"},
+                  {{0xFD, 0x21, 0x34, 0x12}, "LD IY, 4660"},
+                  {{0xDD, 0x7E, 0x01}, "LD A, (IX+1)"},
+                  {{0xFD, 0x77, 0xFE}, "LD (IY-2), A"},
+                  {{0xDD, 0x66, 0x03}, "LD H, (IX+3)"},
+                  {{0xDD, 0x36, 0x05, 0x2A}, "LD (IX+5), 42"},
+                  {{0xDD, 0x7C}, "LD A, IXH"},
+                  {{0xFD, 0x65}, "LD IYH, IYL"},
+                  {{0xDD, 0x2C}, "INC IXL"},
+                  {{0xDD, 0x86, 0x07}, "ADD A, (IX+7)"},
+                  {{0xDD, 0x09}, "ADD IX, BC"},
+                  {{0xDD, 0x29}, "ADD IX, IX"},
+                  {{0xDD, 0x23}, "INC IX"},
+                  {{0xDD, 0x22, 0x00, 0x80}, "LD (32768), IX"},
+                  {{0xDD, 0xE5}, "PUSH IX"},
+                  {{0xFD, 0xE1}, "POP IY"},
+                  {{0xDD, 0xE3}, "EX (SP), IX"},
+                  {{0xDD, 0xE9}, "JP (IX)"},
+                  {{0xFD, 0xF9}, "LD SP, IY"},
+                  {{0x29}, "ADD HL, HL"},
+                  {{0xE3}, "EX (SP), HL"},
+                  {{0xF9}, "LD SP, HL"},
+                  {{0xDD, 0xDD}, "NONI"},
+                  {{0xDD, 0xCB, 0x02, 0x06}, "RLC (IX+2)"},
+                  {{0xDD, 0xCB, 0x02, 0x00}, "RLC (IX+2), B"},
+                  {{0xFD, 0xCB, 0xFF, 0x46}, "BIT 0, (IY-1)"},
+                  {{0xFD, 0xCB, 0x04, 0xFF}, "SET 7, (IY+4), A"}});
+}
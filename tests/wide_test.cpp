@@ -0,0 +1,121 @@
+#include <cstring>
+#include <random>
+#include <vector>
+#include "Emulator.h"
+#include "WideEmulator.h"
+#include "Test.h"
+
+// Checks random programs with random inputs leave every lane as running it alone on an Emulator would
+
+static const size_t lane_count = 19;    // Not a whole number of vectors, so the last one is part filled
+static const size_t program_count = 150;
+static const size_t instruction_budget = 2000;
+static const uint16_t input_address = 0x8000;
+static const size_t input_size = 0x100;
+
+// Mostly unprefixed instructions, which have wide kernels, with the odd prefixed one to move a lane
+// to its Emulator. Operands are random too, so lanes branch apart on their flags and jump out of the program.
+static std::vector<uint8_t> random_program(std::mt19937 &random)
+{
+    std::vector<uint8_t> program;
+    size_t size = 16 + random() % 96;
+    while(program.size() < size)
+    {
+        uint8_t opcode = random();
+        if((opcode == 0xCB || opcode == 0xDD || opcode == 0xED || opcode == 0xFD) && random() % 8 != 0)
+            continue;
+        program.push_back(opcode);
+    }
+    return program;
+}
+
+static Emulator::Registers random_registers(std::mt19937 &random)
+{
+    Emulator::Registers registers = {};
+    registers.general.AF = random();
+    registers.general.BC = random();
+    registers.general.DE = random();
+    //Point HL somewhere in the inputs half the time, so (HL) reads something other than 0
+    registers.general.HL = random() % 2 ? input_address + random() % input_size : random();
+    registers.shadow.AF = random();
+    registers.shadow.BC = random();
+    registers.shadow.DE = random();
+    registers.shadow.HL = random();
+    registers.IX = random();
+    registers.IY = random();
+    registers.SP = random();
+    registers.I = random();
+    registers.IM = random() % 3;
+    return registers;
+}
+
+static void port_handler(void *, Emulator::PortState state, uint8_t *data, uint16_t size)
+{
+    if(state == Emulator::PortState::Read)
+        memset(data, 0xFF, size);
+}
+
+static bool same_registers(const Emulator::Registers &x, const Emulator::Registers &y)
+{
+    return x.general.AF == y.general.AF && x.general.BC == y.general.BC && x.general.DE == y.general.DE && x.general.HL == y.general.HL
+           && x.shadow.AF == y.shadow.AF && x.shadow.BC == y.shadow.BC && x.shadow.DE == y.shadow.DE && x.shadow.HL == y.shadow.HL
+           && x.IX == y.IX && x.IY == y.IY && x.SP == y.SP && x.PC == y.PC && x.I == y.I && x.IM == y.IM
+           && x.IFF1 == y.IFF1 && x.IFF2 == y.IFF2;
+}
+
+TEST(random_programs)
+{
+#ifdef __AVX2__
+    if(!__builtin_cpu_supports("avx2"))
+    {
+        std::cout << "Skipped, as this CPU has no AVX2" << std::endl;
+        return;
+    }
+#endif
+
+    std::mt19937 random(0x170);
+    size_t scalar_lanes = 0;
+    for(size_t program_index = 0; program_index < program_count; ++program_index)
+    {
+        std::vector<uint8_t> program = random_program(random);
+
+        WideEmulator wide(lane_count);
+        wide.load(program);
+        std::vector<Emulator::Registers> registers(lane_count);
+        std::vector<std::vector<uint8_t>> inputs(lane_count, std::vector<uint8_t>(input_size));
+        for(size_t lane = 0; lane < lane_count; ++lane)
+        {
+            registers[lane] = random_registers(random);
+            for(uint8_t &byte : inputs[lane])
+                byte = random();
+            wide.set_registers(lane, registers[lane]);
+            wide.write_memory(lane, input_address, inputs[lane].data(), input_size);
+        }
+        wide.run(instruction_budget);
+        scalar_lanes += wide.get_scalar_lane_count();
+
+        for(size_t lane = 0; lane < lane_count; ++lane)
+        {
+            std::vector<uint8_t> memory(0x10000, 0);
+            std::copy(program.begin(), program.end(), memory.begin());
+            std::copy(inputs[lane].begin(), inputs[lane].end(), memory.begin() + input_address);
+
+            Emulator emulator;
+            emulator.set_default_port_handler(&port_handler, nullptr);
+            emulator.load_memory(memory.data(), program.size());
+            emulator.set_registers(registers[lane]);
+            emulator.run(instruction_budget);
+
+            check(same_registers(wide.get_registers(lane), emulator.get_registers()), "lane registers match the emulator");
+            check(wide.is_finished(lane) == emulator.is_finished(), "lane finishes with the emulator");
+            const uint8_t *expected = emulator.get_memory();
+            bool same_memory = true;
+            for(size_t addr = 0; addr < 0x10000 && same_memory; ++addr)
+                same_memory = wide.read_memory(lane, addr) == expected[addr];
+            check(same_memory, "lane memory matches the emulator");
+        }
+    }
+
+    //Some lanes have to have left the wide kernels, or the fallback wasn't tested
+    check(scalar_lanes > 0, "some lanes moved to an emulator");
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <iomanip>
+#include <vector>
+#include "Emulator.h"
+#include "Trace.h"
+
+// Converts a binary trace back to the text log format
+int main(int argc, char **argv)
+{
+    bool show_registers = argc > 2 && strcmp(argv[2], "-r") == 0;
+    if(argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <trace file> [-r]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+    TraceHeader header = {};
+    input.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if(!input || memcmp(header.magic, "Z80T", 4) != 0 || header.version != TraceHeader::current_version
+       || header.record_size != sizeof(TraceRecord))
+    {
+        std::cerr << argv[1] << " is not a trace file, or is from a different version" << std::endl;
+        return 1;
+    }
+
+    Emulator emulator;
+    std::vector<TraceRecord> records(0x1000);
+    while(input)
+    {
+        input.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(TraceRecord));
+        size_t count = input.gcount() / sizeof(TraceRecord);
+        for(size_t i = 0; i < count; ++i)
+        {
+            const TraceRecord &record = records[i];
+            if(show_registers && (record.flags & TraceRecord::has_registers))
+            {
+                std::cout << std::hex << std::setfill('0')
+                          << std::setw(4) << record.pc << " AF=" << std::setw(4) << record.AF
+                          << " BC=" << std::setw(4) << record.BC << " DE=" << std::setw(4) << record.DE
+                          << " HL=" << std::setw(4) << record.HL << " SP=" << std::setw(4) << record.SP
+                          << std::dec << std::setfill(' ') << "  ";
+            }
+            emulator.log_trace_record(record, std::cout);
+        }
+    }
+    return 0;
+}